@@ -0,0 +1,153 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/* Size of the blocks items and strings are carved from. Bigger requests get a
+ * block of their own. */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+
+typedef struct _BmArenaBlock BmArenaBlock;
+struct _BmArenaBlock
+{
+  BmArenaBlock *next;
+  gsize size;
+  gsize used;
+  gsize pad;
+};
+
+struct _BmArena
+{
+  BmArenaBlock *blocks;
+};
+
+BmArena *
+bm_arena_new(void)
+{
+  return g_new0(BmArena, 1);
+}
+
+void
+bm_arena_free(BmArena *arena)
+{
+  BmArenaBlock *block;
+
+  if (!arena)
+    return;
+
+  while ((block = arena->blocks))
+  {
+    arena->blocks = block->next;
+    g_free(block);
+  }
+
+  g_free(arena);
+}
+
+static BmArenaBlock *
+arena_block_new(gsize size)
+{
+  BmArenaBlock *block = g_malloc(sizeof(BmArenaBlock) + size);
+
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+
+  return block;
+}
+
+gpointer
+bm_arena_alloc(BmArena *arena, gsize size)
+{
+  BmArenaBlock *block = arena->blocks;
+  gpointer rv;
+
+  size = (size + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1);
+
+  if (size > ARENA_BLOCK_SIZE / 4)
+  {
+    /* keep filling the current block, put the big one behind it */
+    BmArenaBlock *big = arena_block_new(size);
+
+    if (block)
+    {
+      big->next = block->next;
+      block->next = big;
+    }
+    else
+      arena->blocks = big;
+
+    big->used = size;
+
+    return big + 1;
+  }
+
+  if (!block || block->size - block->used < size)
+  {
+    block = arena_block_new(ARENA_BLOCK_SIZE);
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  rv = (gchar *)(block + 1) + block->used;
+  block->used += size;
+
+  return rv;
+}
+
+gpointer
+bm_arena_alloc0(BmArena *arena, gsize size)
+{
+  return memset(bm_arena_alloc(arena, size), 0, size);
+}
+
+gchar *
+bm_arena_strndup(BmArena *arena, const gchar *s, gsize len)
+{
+  gchar *rv;
+
+  if (!s)
+    return NULL;
+
+  rv = bm_arena_alloc(arena, len + 1);
+  memcpy(rv, s, len);
+  rv[len] = 0;
+
+  return rv;
+}
+
+gchar *
+bm_arena_strconcat(BmArena *arena, const gchar *s1, const gchar *s2)
+{
+  gsize len1 = strlen(s1);
+  gsize len2 = strlen(s2);
+  gchar *rv = bm_arena_alloc(arena, len1 + len2 + 1);
+
+  memcpy(rv, s1, len1);
+  memcpy(rv + len1, s2, len2 + 1);
+
+  return rv;
+}
+
+void
+bm_arena_steal(BmArena *arena, BmArena *from)
+{
+  BmArenaBlock *last;
+
+  if (!from->blocks)
+    return;
+
+  for (last = from->blocks; last->next; last = last->next)
+    ;
+
+  /* behind the head block, which stays the one being filled */
+  if (arena->blocks)
+  {
+    last->next = arena->blocks->next;
+    arena->blocks->next = from->blocks;
+  }
+  else
+    arena->blocks = from->blocks;
+
+  from->blocks = NULL;
+}
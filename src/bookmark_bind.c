@@ -0,0 +1,256 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Items bound to an open document remember their element and the children of
+ * it the setters change, found the same way the setters would find them. The
+ * setters then start from there instead of searching the document. Each bound
+ * element points back to the reference in its _private, so that removing an
+ * element can empty every reference into it. Nothing here is kept up to date
+ * with changes made to the document behind the back of the bookmark functions.
+ */
+
+struct _BookmarkNodeRef
+{
+  xmlDoc *doc;
+  xmlNode *parts[BM_NODE_N_PARTS];
+};
+
+static inline gboolean
+is_item_element(xmlNode *node)
+{
+  return node->type == XML_ELEMENT_NODE &&
+      (!xmlStrcmp(node->name, BAD_CAST "folder") ||
+       !xmlStrcmp(node->name, BAD_CAST "bookmark"));
+}
+
+static xmlNode *
+next_item_element(xmlNode *node)
+{
+  while (node && !is_item_element(node))
+    node = node->next;
+
+  return node;
+}
+
+static xmlNode *
+first_title(xmlNode *node)
+{
+  for (node = node->children; node; node = node->next)
+  {
+    if (!xmlStrcmp(node->name, BAD_CAST "title"))
+      return node;
+  }
+
+  return NULL;
+}
+
+static void
+bind_item(BookmarkItem *bm_item, xmlDoc *doc, xmlNode *node)
+{
+  BookmarkNodeRef *ref = bm_item->xml;
+
+  if (!ref)
+  {
+    if (bm_item->tree && bm_item->tree->arena)
+    {
+      ref = bm_arena_alloc(bm_item->tree->arena, sizeof(*ref));
+      bm_item->tree->bound = TRUE;
+    }
+    else
+      ref = g_new(BookmarkNodeRef, 1);
+
+    bm_item->xml = ref;
+  }
+
+  ref->doc = doc;
+  ref->parts[BM_NODE_ELEMENT] = node;
+  node->_private = ref;
+  ref->parts[BM_NODE_TITLE] = first_title(node);
+  ref->parts[BM_NODE_METADATA] = get_node_by_tag(node->children, "metadata");
+  ref->parts[BM_NODE_VISIT_COUNT] =
+      get_node_by_tag(node->children, "visit_count");
+  ref->parts[BM_NODE_TIME_VISITED] =
+      get_node_by_tag(node->children, "time_visited");
+  ref->parts[BM_NODE_DELETED] = get_node_by_tag(node->children, "deleted");
+}
+
+/* Whether bm_item was loaded from node: the file may have been reordered
+ * since the tree was loaded, so the shape alone says nothing. Items are told
+ * apart by their id, or by their title if they were loaded without one. */
+static gboolean
+item_matches(const BookmarkItem *bm_item, xmlNode *node)
+{
+  xmlChar *xs;
+  gboolean same;
+
+  if (bm_item->id)
+  {
+    xs = xmlGetProp(node, BAD_CAST "id");
+    same = xs && !strcmp(bm_item->id, (const char *)xs);
+  }
+  else if (bm_item->name)
+  {
+    xmlNode *title = first_title(node);
+    gchar *name;
+
+    xs = title ? xmlNodeGetContent(title) : NULL;
+
+    /* the loader names bookmarks after their title with a suffix */
+    if (bm_item->isFolder)
+      name = g_strdup(xs ? (const char *)xs : "");
+    else
+      name = g_strconcat(xs ? (const char *)xs : "(null)", ".bm", NULL);
+
+    same = !strcmp(bm_item->name, name);
+    g_free(name);
+  }
+  else
+    return TRUE;
+
+  xmlFree(xs);
+
+  return same;
+}
+
+/* Pairs the children of bm_item with the item elements below node, the way
+ * the loader made one from the other */
+static gboolean
+bind_children(BookmarkItem *bm_item, xmlDoc *doc, xmlNode *node)
+{
+  BookmarkItem *child;
+  xmlNode *n = next_item_element(node->children);
+
+  bm_loader_expand(bm_item);
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+  {
+    gboolean is_folder;
+
+    if (!n)
+      return FALSE;
+
+    is_folder = !xmlStrcmp(n->name, BAD_CAST "folder");
+
+    if (!child->isFolder != !is_folder || !item_matches(child, n))
+      return FALSE;
+
+    bind_item(child, doc, n);
+
+    if (!bind_children(child, doc, n))
+      return FALSE;
+
+    n = next_item_element(n->next);
+  }
+
+  return n == NULL;
+}
+
+void
+bm_bind_release(BookmarkItem *bm_item)
+{
+  if (bm_item->xml)
+  {
+    xmlNode *node = bm_item->xml->parts[BM_NODE_ELEMENT];
+
+    if (node && node->_private == bm_item->xml)
+      node->_private = NULL;
+
+    if (!bm_item->tree || !bm_item->tree->arena)
+      g_free(bm_item->xml);
+
+    bm_item->xml = NULL;
+  }
+}
+
+/* Unbinds bm_item and everything below it */
+static void
+clear_bindings(BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  bm_bind_release(bm_item);
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    clear_bindings(child);
+}
+
+void
+bm_bind_forget(xmlNode *node)
+{
+  for (; node; node = node->next)
+  {
+    BookmarkNodeRef *ref;
+
+    if (!is_item_element(node))
+      continue;
+
+    ref = node->_private;
+
+    /* still bound to the document, but to nothing in it */
+    if (ref && ref->parts[BM_NODE_ELEMENT] == node)
+    {
+      memset(ref->parts, 0, sizeof(ref->parts));
+      node->_private = NULL;
+    }
+
+    bm_bind_forget(node->children);
+  }
+}
+
+gboolean
+bm_bind_is_bound(const BookmarkItem *bm_item, const xmlNode *root_element)
+{
+  return bm_item->xml && root_element &&
+      bm_item->xml->doc == root_element->doc;
+}
+
+xmlNode *
+bm_bind_lookup(const BookmarkItem *bm_item, const xmlNode *root_element,
+               BmNodePart part)
+{
+  if (!bm_bind_is_bound(bm_item, root_element))
+    return NULL;
+
+  return bm_item->xml->parts[part];
+}
+
+void
+bm_bind_update(BookmarkItem *bm_item, const xmlNode *root_element,
+               BmNodePart part, xmlNode *node)
+{
+  if (bm_bind_is_bound(bm_item, root_element))
+    bm_item->xml->parts[part] = node;
+}
+
+gboolean
+bookmark_item_bind_document(BookmarkItem *bookmark_root, xmlDocPtr doc)
+{
+  xmlNode *root_element;
+
+  CHECK_PARAM(!bookmark_root || !doc, "\nInvalid Input Parameter",
+              return FALSE);
+
+  root_element = xmlDocGetRootElement(doc);
+
+  if (!root_element)
+    return FALSE;
+
+  /* the root item keeps being found through the <title> of the document */
+  if (!bind_children(bookmark_root, doc, root_element))
+  {
+    clear_bindings(bookmark_root);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+bookmark_item_unbind_document(BookmarkItem *bookmark_root)
+{
+  CHECK_PARAM(!bookmark_root, "\nInvalid Input Parameter", return);
+
+  clear_bindings(bookmark_root);
+}
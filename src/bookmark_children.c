@@ -0,0 +1,122 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * The children of a folder by position, for folders too large to walk to the
+ * nth child. Built the first time a folder is asked for a child by position.
+ * Linking and unlinking a child change it in place, appending in O(1) and the
+ * rest moving the children after it; bookmark_item_relink_children() drops
+ * it. The arrays of arena trees are freed together with the tree.
+ */
+
+static GPtrArray *
+child_array(BookmarkItem *folder)
+{
+  BookmarkItem *child;
+
+  if (folder->child_array)
+    return folder->child_array;
+
+  bm_loader_expand(folder);
+
+  folder->child_array = g_ptr_array_new();
+
+  for (child = folder->first_child; child; child = child->next_sibling)
+    g_ptr_array_add(folder->child_array, child);
+
+  if (folder->tree && folder->tree->arena)
+  {
+    folder->tree->child_arrays =
+        g_slist_prepend(folder->tree->child_arrays, folder->child_array);
+  }
+
+  return folder->child_array;
+}
+
+void
+bm_child_array_build(BookmarkItem *folder)
+{
+  child_array(folder);
+}
+
+void
+bm_child_array_free(BookmarkItem *folder)
+{
+  if (folder->child_array)
+  {
+    g_ptr_array_free(folder->child_array, TRUE);
+    folder->child_array = NULL;
+  }
+}
+
+void
+bm_child_array_insert(BookmarkItem *parent, BookmarkItem *child,
+                      BookmarkItem *before)
+{
+  GPtrArray *array = parent->child_array;
+  guint i;
+
+  if (!array)
+    return;
+
+  for (i = 0; before && i < array->len; i++)
+  {
+    if (g_ptr_array_index(array, i) == before)
+      break;
+  }
+
+  if (before && i < array->len)
+    g_ptr_array_insert(array, i, child);
+  else
+    g_ptr_array_add(array, child);
+}
+
+void
+bm_child_array_remove(BookmarkItem *parent, BookmarkItem *child)
+{
+  if (parent->child_array)
+    g_ptr_array_remove(parent->child_array, child);
+}
+
+guint
+bookmark_item_get_n_children(BookmarkItem *folder)
+{
+  CHECK_PARAM(!folder, "\nInvalid Input Parameter", return 0);
+
+  return child_array(folder)->len;
+}
+
+BookmarkItem *
+bookmark_item_get_nth_child(BookmarkItem *folder, guint n)
+{
+  GPtrArray *children;
+
+  CHECK_PARAM(!folder, "\nInvalid Input Parameter", return NULL);
+
+  children = child_array(folder);
+
+  return n < children->len ? g_ptr_array_index(children, n) : NULL;
+}
+
+guint
+bookmark_item_get_children(BookmarkItem *folder, guint offset, guint limit,
+                           BookmarkItem **children)
+{
+  GPtrArray *array;
+
+  CHECK_PARAM(!folder || (limit && !children), "\nInvalid Input Parameter",
+              return 0);
+
+  array = child_array(folder);
+
+  if (offset >= array->len)
+    return 0;
+
+  limit = MIN(limit, array->len - offset);
+
+  if (limit)
+    memcpy(children, array->pdata + offset, limit * sizeof(BookmarkItem *));
+
+  return limit;
+}
@@ -0,0 +1,544 @@
+#include "bookmark_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Remembers that doc has the journaled changes up to pos */
+static void
+doc_set_journal_pos(xmlDoc *doc, const BmJournalPos *pos)
+{
+  if (!doc->_private)
+    doc->_private = g_new(BmJournalPos, 1);
+
+  *(BmJournalPos *)doc->_private = *pos;
+}
+
+xmlDoc *
+bm_doc_open_dict(const gchar *file_name, int options, xmlDictPtr dict)
+{
+  xmlParserCtxtPtr ctxt;
+  BookmarkLock *lock;
+  GMappedFile *mf;
+  xmlDoc *doc = NULL;
+  gchar *journal;
+  gsize journal_len;
+  BmJournalPos pos;
+
+  if (!bm_lock_files(BM_LOCK_SHARED, &lock))
+    return NULL;
+
+  mf = g_mapped_file_new(file_name, FALSE, NULL);
+  journal = mf ? bm_journal_read(file_name, &journal_len, &pos) : NULL;
+
+  /* the mapping stays what it is when the file is replaced */
+  bookmark_lock_release(lock);
+
+  if (!mf)
+    return NULL;
+
+  if (g_mapped_file_get_length(mf) && (ctxt = xmlNewParserCtxt()))
+  {
+    if (dict)
+    {
+      xmlDictFree(ctxt->dict);
+      ctxt->dict = dict;
+      xmlDictReference(dict);
+    }
+
+    doc = xmlCtxtReadMemory(ctxt, g_mapped_file_get_contents(mf),
+                            g_mapped_file_get_length(mf), file_name, NULL,
+                            options | XML_PARSE_COMPACT | XML_PARSE_NOBLANKS);
+    xmlFreeParserCtxt(ctxt);
+  }
+
+  g_mapped_file_unref(mf);
+
+  if (doc)
+  {
+    bm_doc_index_ids(doc);
+
+    if (journal)
+    {
+      pos.offset = bm_journal_apply(doc, journal, journal_len, pos.offset);
+      doc_set_journal_pos(doc, &pos);
+    }
+  }
+
+  g_free(journal);
+
+  return doc;
+}
+
+xmlDoc *
+bm_doc_open(const gchar *file_name, int options)
+{
+  return bm_doc_open_dict(file_name, options, NULL);
+}
+
+void
+bm_doc_forget_journal(xmlDoc *doc)
+{
+  g_free(doc->_private);
+  doc->_private = NULL;
+}
+
+void
+bm_doc_free(xmlDoc *doc)
+{
+  bm_doc_forget_journal(doc);
+  xmlFreeDoc(doc);
+}
+
+/* Random, so that ids given to elements not yet in a document are unique
+ * too. XBEL ids have to be XML names, hence the prefix. */
+static gchar *
+new_id(void)
+{
+  return g_strdup_printf("bm%08x%08x", g_random_int(), g_random_int());
+}
+
+/* Sets the id attribute of node and registers it as an ID of doc */
+static void
+set_id(xmlDoc *doc, xmlNode *node, const gchar *id)
+{
+  xmlAttr *attr;
+
+  /* an attribute that already is an ID is registered again by xmlSetProp() */
+  attr = xmlSetProp(node, BAD_CAST "id", BAD_CAST id);
+
+  if (doc && attr && attr->atype != XML_ATTRIBUTE_ID)
+    xmlAddID(NULL, doc, BAD_CAST id, attr);
+}
+
+static gchar *
+set_new_id(xmlDoc *doc, xmlNode *node)
+{
+  gchar *id = new_id();
+
+  while (xmlGetID(doc, BAD_CAST id))
+  {
+    g_free(id);
+    id = new_id();
+  }
+
+  set_id(doc, node, id);
+
+  return id;
+}
+
+static inline gboolean
+is_item_element(xmlNode *node)
+{
+  return node->type == XML_ELEMENT_NODE &&
+      (!xmlStrcmp(node->name, BAD_CAST "folder") ||
+       !xmlStrcmp(node->name, BAD_CAST "bookmark"));
+}
+
+static void
+index_ids(xmlDoc *doc, xmlNode *node, GPtrArray *renew, GHashTable *shared)
+{
+  for (node = node->children; node; node = node->next)
+  {
+    xmlAttr *attr;
+    xmlAttr *first;
+    xmlChar *id;
+
+    if (!is_item_element(node))
+      continue;
+
+    attr = xmlHasProp(node, BAD_CAST "id");
+    id = attr ? xmlGetProp(node, BAD_CAST "id") : NULL;
+
+    if (!id || !*id)
+      g_ptr_array_add(renew, node);
+    else if ((first = xmlGetID(doc, id)))
+    {
+      /* nobody can tell which element such an id means, give all a new
+       * one */
+      if (first != attr)
+      {
+        g_ptr_array_add(renew, node);
+        g_hash_table_add(shared, first->parent);
+      }
+    }
+    else
+      xmlAddID(NULL, doc, id, attr);
+
+    xmlFree(id);
+    index_ids(doc, node, renew, shared);
+  }
+}
+
+void
+bm_doc_index_ids(xmlDoc *doc)
+{
+  GPtrArray *renew = g_ptr_array_new();
+  GHashTable *shared = g_hash_table_new(g_direct_hash, g_direct_equal);
+  xmlNode *root = xmlDocGetRootElement(doc);
+  GHashTableIter iter;
+  gpointer node;
+  guint i;
+
+  if (root)
+    index_ids(doc, root, renew, shared);
+
+  g_hash_table_iter_init(&iter, shared);
+
+  while (g_hash_table_iter_next(&iter, &node, NULL))
+    g_free(set_new_id(doc, node));
+
+  for (i = 0; i < renew->len; i++)
+    g_free(set_new_id(doc, g_ptr_array_index(renew, i)));
+
+  g_hash_table_destroy(shared);
+  g_ptr_array_free(renew, TRUE);
+}
+
+/* Whether the id attribute of node is id. The value is compared where it
+ * is, only values made of several nodes are put together. */
+static gboolean
+has_id(xmlNode *node, const gchar *id)
+{
+  xmlAttr *attr = xmlHasProp(node, BAD_CAST "id");
+  xmlChar *s;
+  gboolean rv;
+
+  if (!attr)
+    return FALSE;
+
+  if (!attr->children)
+    return !*id;
+
+  if (attr->children->type == XML_TEXT_NODE && !attr->children->next)
+    return !xmlStrcmp(attr->children->content, BAD_CAST id);
+
+  s = xmlNodeGetContent((xmlNode *)attr);
+  rv = s && !xmlStrcmp(s, BAD_CAST id);
+  xmlFree(s);
+
+  return rv;
+}
+
+static xmlNode *
+find_id(xmlNode *node, const gchar *id)
+{
+  for (node = node->children; node; node = node->next)
+  {
+    xmlNode *found;
+
+    if (!is_item_element(node))
+      continue;
+
+    found = has_id(node, id) ? node : find_id(node, id);
+
+    if (found)
+      return found;
+  }
+
+  return NULL;
+}
+
+xmlNode *
+bm_doc_find_id(xmlDoc *doc, const gchar *id)
+{
+  xmlNode *root;
+  xmlAttr *attr;
+
+  if (!doc || !id)
+    return NULL;
+
+  attr = xmlGetID(doc, BAD_CAST id);
+
+  if (attr)
+    return attr->parent && is_item_element(attr->parent) ? attr->parent : NULL;
+
+  /* documents of the caller are searched, registering their ids would
+   * change them behind its back */
+  root = xmlDocGetRootElement(doc);
+
+  return root ? find_id(root, id) : NULL;
+}
+
+void
+bm_doc_set_new_id(xmlNode *node, BookmarkItem *bm_item)
+{
+  gchar *id;
+
+  /* the item keeps its id, unless another element of the document has it */
+  if (bm_item->id && *bm_item->id && !bm_doc_find_id(node->doc, bm_item->id))
+  {
+    set_id(node->doc, node, bm_item->id);
+    return;
+  }
+
+  id = set_new_id(node->doc, node);
+  bm_tree_strfree(bm_item->tree, bm_item->id);
+  bm_item->id = bm_tree_strdup(bm_item->tree, id);
+  g_free(id);
+}
+
+gboolean
+bm_files_key_get(const gchar *file_name, BmFilesKey *key)
+{
+  gchar *journal_name = g_strconcat(file_name, ".journal", NULL);
+  struct stat st;
+
+  if (!stat(journal_name, &st))
+  {
+    key->journal_size = st.st_size;
+    key->journal_mtime = st.st_mtim.tv_sec;
+    key->journal_mtime_nsec = st.st_mtim.tv_nsec;
+  }
+  else
+  {
+    key->journal_size = 0;
+    key->journal_mtime = 0;
+    key->journal_mtime_nsec = 0;
+  }
+
+  g_free(journal_name);
+
+  return bm_snapshot_key_for_file(file_name, &key->file);
+}
+
+gboolean
+bm_files_key_changed(const gchar *file_name, BmFilesKey *key)
+{
+  BmSnapshotKey file_key;
+  gchar *journal_name;
+  struct stat st;
+  gboolean racy;
+  gboolean rv;
+
+  if (!bm_snapshot_key_for_file(file_name, &file_key))
+    return TRUE;
+
+  racy = file_key.hashed;
+
+  if (!bm_snapshot_key_matches(file_name, &file_key, &key->file))
+    return TRUE;
+
+  /* the same contents, that stat() alone tells apart from now on */
+  if (key->file.hashed && !racy)
+  {
+    key->file = file_key;
+    key->file.hash = 0;
+    key->file.hashed = FALSE;
+  }
+
+  journal_name = g_strconcat(file_name, ".journal", NULL);
+
+  if (stat(journal_name, &st))
+    rv = key->journal_size || key->journal_mtime || key->journal_mtime_nsec;
+  else
+  {
+    rv = (guint64)st.st_size != key->journal_size ||
+        st.st_mtim.tv_sec != key->journal_mtime ||
+        st.st_mtim.tv_nsec != key->journal_mtime_nsec;
+  }
+
+  g_free(journal_name);
+
+  return rv;
+}
+
+/* Writes doc, or data if doc is NULL, with the lines of landed and then the
+ * changes journaled after journal_pos, all of them if NULL. The lines taken
+ * from the journal are appended to folded once the file is written. With a
+ * key nothing is written over a file other than the one key was taken of,
+ * and key is taken of the new file. */
+static gboolean
+save_file(const gchar *file_name, xmlDoc *doc, const xmlChar *data, gsize len,
+          const BmJournalPos *journal_pos, GString *landed, GString *folded,
+          BmFilesKey *key, gboolean *changed)
+{
+  BookmarkLock *lock;
+  BmSnapshotKey file_key;
+  struct stat st;
+  gchar *tmp_name;
+  gchar *journal;
+  gsize journal_len;
+  BmJournalPos now;
+  gsize journal_offset;
+  gsize journal_end;
+  gchar *taken = NULL;
+  xmlDoc *data_doc = NULL;
+  gboolean rv = FALSE;
+  FILE *fp;
+  int fd;
+
+  if (changed)
+    *changed = FALSE;
+
+  if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &lock))
+    return FALSE;
+
+  /* saved by someone else since, writing would undo that */
+  if (key && (!bm_snapshot_key_for_file(file_name, &file_key) ||
+              !bm_snapshot_key_matches(file_name, &file_key, &key->file)))
+  {
+    bookmark_lock_release(lock);
+
+    if (changed)
+      *changed = TRUE;
+
+    return FALSE;
+  }
+
+  /* journaled while the document was open, the journal is emptied below */
+  journal = bm_journal_read(file_name, &journal_len, &now);
+
+  /* emptied or replaced since, everything in it is newer then. Its length
+   * says nothing, it may have grown past the offset again. */
+  if (journal && journal_pos && bm_journal_pos_same(journal_pos, &now))
+    journal_offset = journal_pos->offset;
+  else
+    journal_offset = now.offset;
+
+  journal_end = journal_offset;
+
+  if ((journal && journal_offset != journal_len) || (landed && landed->len))
+  {
+    if (!doc)
+    {
+      doc = data_doc = xmlReadMemory((const char *)data, len, file_name, NULL,
+                                     XML_PARSE_SAX1 | XML_PARSE_RECOVER |
+                                     XML_PARSE_COMPACT | XML_PARSE_NOBLANKS);
+    }
+
+    if (!doc)
+    {
+      bookmark_lock_release(lock);
+      g_free(journal);
+      return FALSE;
+    }
+
+    /* the journal finds its elements by id */
+    if (data_doc)
+      bm_doc_index_ids(data_doc);
+
+    /* applying cuts the lines up, they are copied first */
+    if (landed && landed->len)
+    {
+      gchar *lines = g_strndup(landed->str, landed->len);
+
+      bm_journal_apply(doc, lines, landed->len, 0);
+      g_free(lines);
+    }
+
+    if (journal)
+    {
+      if (folded)
+      {
+        taken = g_strndup(journal + journal_offset,
+                          journal_len - journal_offset);
+      }
+
+      journal_end = bm_journal_apply(doc, journal, journal_len,
+                                     journal_offset);
+    }
+
+    now.offset = journal_end;
+    doc_set_journal_pos(doc, &now);
+  }
+
+  tmp_name = g_strconcat(file_name, ".XXXXXX", NULL);
+  fd = g_mkstemp(tmp_name);
+
+  if (fd == -1)
+  {
+    bookmark_lock_release(lock);
+
+    if (data_doc)
+      bm_doc_free(data_doc);
+
+    g_free(journal);
+    g_free(taken);
+    g_free(tmp_name);
+
+    return FALSE;
+  }
+
+  /* the file is replaced, not rewritten, keep its permissions */
+  if (!stat(file_name, &st))
+    fchmod(fd, st.st_mode & 07777);
+  else
+    fchmod(fd, 0644);
+
+  fp = fdopen(fd, "w");
+
+  if (!fp)
+    close(fd);
+  else
+  {
+    if (doc)
+      rv = xmlDocFormatDump(fp, doc, 1) != -1;
+    else
+      rv = fwrite(data, 1, len, fp) == len;
+
+    rv = rv && !fflush(fp) && !fsync(fileno(fp));
+
+    if (fclose(fp))
+      rv = FALSE;
+  }
+
+  if (rv)
+    rv = !rename(tmp_name, file_name);
+
+  if (!rv)
+    unlink(tmp_name);
+  else if (journal)
+  {
+    /* replaying the journal on the new file would undo later changes in it */
+    bm_journal_truncate(file_name);
+
+    if (doc)
+      bm_doc_forget_journal(doc);
+
+    if (taken)
+      g_string_append_len(folded, taken, journal_end - journal_offset);
+  }
+
+  /* still under the lock, nobody else wrote in between */
+  if (rv && key)
+    bm_files_key_get(file_name, key);
+
+  bookmark_lock_release(lock);
+
+  if (data_doc)
+    bm_doc_free(data_doc);
+
+  g_free(journal);
+  g_free(taken);
+  g_free(tmp_name);
+
+  return rv;
+}
+
+gboolean
+bm_doc_save(xmlDoc *doc, const gchar *file_name)
+{
+  return save_file(file_name, doc, NULL, 0, bm_doc_journal_pos(doc), NULL,
+                   NULL, NULL, NULL);
+}
+
+gboolean
+bm_doc_save_key(xmlDoc *doc, const gchar *file_name, BmFilesKey *key,
+                gboolean *changed)
+{
+  return save_file(file_name, doc, NULL, 0, bm_doc_journal_pos(doc), NULL,
+                   NULL, key, changed);
+}
+
+gboolean
+bm_doc_save_data(const xmlChar *data, gsize len,
+                 const BmJournalPos *journal_pos, GString *landed,
+                 GString *folded, const gchar *file_name, BmFilesKey *key,
+                 gboolean *changed)
+{
+  return save_file(file_name, NULL, data, len, journal_pos, landed, folded,
+                   key, changed);
+}
@@ -0,0 +1,1563 @@
+#include "bookmark_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Everything the bookmark functions keep between calls, for one file: the
+ * tree, the document the changes go to, the names in it and the order the
+ * last sorted insert used. Readers of the tree hold the read lock, every
+ * function that changes the document and the tree holds the write lock. The
+ * tree is bound to the document, so the changes do not search for their
+ * elements. Nothing is shared with other engines, so they do not wait for
+ * each other.
+ *
+ * Every change goes to the tree as well, under the write lock, together
+ * with its indexes and the caches of its folders. Those are all built with
+ * the tree and kept up to date, the search index is rebuilt by the writer
+ * once it holds too many removed items, so readers only ever read. That
+ * rules out lazy trees and trees without child lists. While no document is
+ * open the tree is read again, and patched in place the way a BookmarkWatch
+ * does, once the file or its journal are no longer those it was read from.
+ * The document is opened under the shared lock of the files right after
+ * that, so it is the file the tree has. Writes check that the file is still
+ * that one under the exclusive lock: if others saved it in between nothing
+ * is written, the document and what it had that was not written are
+ * dropped, and the tree is read again.
+ *
+ * Items taken out of the tree, by a change or a reload, are kept until the
+ * engine is freed: a caller may still hold them from before, and passing
+ * them to an engine function then only makes it fail.
+ *
+ * Visit counts and times can be buffered instead, see
+ * bookmark_engine_set_visit_buffer(). The buffer holds the latest values per
+ * item under its own lock, so recording a visit neither waits for readers nor
+ * touches the document. The items are those of the tree of the engine, their
+ * visits are forgotten when they are taken out of it. A full buffer and the
+ * max_delay timeout only wake the save thread below, which takes the write
+ * lock, puts the visits into the document and writes it, so neither the main
+ * loop nor the caller recording a visit waits for readers or for the disk.
+ * bookmark_engine_free() cancels the timeout under the same lock. The timeout
+ * holds a reference to the engine, so a callback already being dispatched
+ * meanwhile still finds the lock and the cancellation after the engine was
+ * freed. Flushed visits of items with an id are appended to the journal of
+ * the file, one line each and one sync for all, instead of writing the
+ * document; only the others go into it. Visits only count as written once
+ * the journal append or a write of a document holding them succeeded.
+ * Buffered visits get into the tree once they are flushed.
+ *
+ * bookmark_engine_save_async() serializes the document on the caller's
+ * thread and leaves writing and syncing it to a save thread. Saves asked
+ * for while one is being written replace each other's data, so only the
+ * newest is written next and all of them complete with that write. The
+ * document stays open meanwhile. Every write folds the journal into the file
+ * and empties it, so the journal lines it took are handed back: the next
+ * write of older data applies them first, and so does the document before it
+ * is serialized or saved again. Once a write landed and the document was not
+ * changed since it was handed over, the save thread closes it, so that the
+ * next change starts from the file with what others saved in between.
+ */
+
+struct _BookmarkEngine
+{
+  /* one for the caller, one for the visits timeout */
+  gint ref_count;
+  gchar *file_name;
+  BookmarkLoadFlags flags;
+  GRWLock lock;
+  /* loaded on first use */
+  BookmarkItem *root;
+  /* the file and journal the tree was read from or written to, bumped
+   * whenever they change, and whether others changed the tree through them
+   * since, under save_lock */
+  BmFilesKey key;
+  guint key_serial;
+  gboolean tree_stale;
+  /* a write found the file saved by others, the document has to go */
+  gboolean conflict;
+  /* items taken out of the tree, kept until the engine is freed so that the
+   * pointers callers still hold are only refused, see engine_has_item() */
+  GPtrArray *removed;
+  /* opened on the first change, dropped by a save */
+  xmlDoc *doc;
+  /* bumped on every change of doc, with the write lock held */
+  guint doc_serial;
+  /* names of every doc of this engine, not shared with other engines */
+  xmlDictPtr dict;
+  SortOrder sort_order;
+  /* EngineVisit by item, not yet in doc or the journal */
+  GHashTable *visits;
+  /* opened on the first flush of visits */
+  BookmarkJournal *journal;
+  GMutex visits_lock;
+  guint visits_max_pending;
+  guint visits_max_delay;
+  guint visits_source;
+  /* set by bookmark_engine_free(), the timeout must not flush any more */
+  gboolean visits_cancelled;
+  /* bumped whenever visits go into doc, which has visits that were not
+   * written yet while it differs from visits_saved */
+  guint visits_serial;
+  /* newest serialized doc for the save thread, the journal lines folded into
+   * the file since it was serialized, and the tasks waiting for it to be
+   * written */
+  xmlChar *save_data;
+  int save_len;
+  BmJournalPos save_journal_pos;
+  GString *save_landed;
+  guint save_visits_serial;
+  guint save_doc_serial;
+  GSList *save_tasks;
+  /* visits_serial of the last document written */
+  guint visits_saved;
+  /* journal lines the save thread folded into the file that doc lacks. Once
+   * set the journal was emptied, doc has none of what is in it now. */
+  GString *doc_landed;
+  gboolean doc_journal_emptied;
+  /* the timeout left the visits to the save thread */
+  gboolean visits_due;
+  /* the save thread runs, and is writing data taken from save_data */
+  gboolean saving;
+  gboolean writing;
+  GMutex save_lock;
+  GCond save_cond;
+};
+
+typedef struct
+{
+  gchar *visit_count;
+  gchar *time_visited;
+} EngineVisit;
+
+static void
+engine_visit_free(gpointer data)
+{
+  EngineVisit *visit = data;
+
+  g_free(visit->visit_count);
+  g_free(visit->time_visited);
+  g_free(visit);
+}
+
+BookmarkEngine *
+bookmark_engine_new(const gchar *file_name, BookmarkLoadFlags flags)
+{
+  BookmarkEngine *engine;
+
+  CHECK_PARAM(!file_name, "\nInvalid Input Parameter", return NULL);
+
+  /* the document is changed through the tree, it has to be a plain one,
+   * and readers must not build parts of it */
+  CHECK_PARAM(flags & (BM_LOAD_ARENA | BM_LOAD_LAZY | BM_LOAD_NO_CHILD_LISTS),
+              "\nInvalid Input Parameter", return NULL);
+
+  /* libxml2 sets up its globals on first use, which must not happen on two
+   * threads at once */
+  xmlInitParser();
+
+  engine = g_new0(BookmarkEngine, 1);
+  engine->ref_count = 1;
+  engine->file_name = g_strdup(file_name);
+  engine->flags = flags;
+  engine->dict = xmlDictCreate();
+  engine->removed =
+      g_ptr_array_new_with_free_func((GDestroyNotify)bookmark_item_free);
+  engine->sort_order = BM_ASC;
+  engine->visits = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         engine_visit_free);
+  g_rw_lock_init(&engine->lock);
+  g_mutex_init(&engine->visits_lock);
+  engine->save_landed = g_string_new(NULL);
+  engine->doc_landed = g_string_new(NULL);
+  g_mutex_init(&engine->save_lock);
+  g_cond_init(&engine->save_cond);
+
+  return engine;
+}
+
+static void
+complete_saves(GSList *tasks, gboolean rv, const gchar *file_name)
+{
+  GSList *l;
+
+  for (l = tasks; l; l = l->next)
+  {
+    GTask *task = l->data;
+
+    if (rv)
+      g_task_return_boolean(task, TRUE);
+    else
+    {
+      g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                              "Could not write %s", file_name);
+    }
+
+    g_object_unref(task);
+  }
+
+  g_slist_free(tasks);
+}
+
+/* Takes the data handed to the save thread and not written yet over, with
+ * the write lock held, and waits for the write in progress. The caller
+ * writes doc, which has all of that data, and completes the tasks returned
+ * with that write. Waiting for the data instead would wait for the save
+ * thread, which may be waiting for the write lock held by the caller. */
+static GSList *
+engine_wait_saves(BookmarkEngine *engine)
+{
+  GSList *tasks;
+
+  g_mutex_lock(&engine->save_lock);
+
+  if (engine->save_data)
+  {
+    xmlFree(engine->save_data);
+    engine->save_data = NULL;
+    g_string_truncate(engine->save_landed, 0);
+  }
+
+  tasks = g_slist_reverse(engine->save_tasks);
+  engine->save_tasks = NULL;
+
+  while (engine->writing)
+    g_cond_wait(&engine->save_cond, &engine->save_lock);
+
+  g_mutex_unlock(&engine->save_lock);
+
+  return tasks;
+}
+
+/* Waits until the save thread is gone, without the write lock held */
+static void
+engine_stop_saves(BookmarkEngine *engine)
+{
+  g_mutex_lock(&engine->save_lock);
+
+  while (engine->saving)
+    g_cond_wait(&engine->save_cond, &engine->save_lock);
+
+  g_mutex_unlock(&engine->save_lock);
+}
+
+static void
+engine_close_doc(BookmarkEngine *engine)
+{
+  if (engine->doc)
+  {
+    bookmark_item_unbind_document(engine->root);
+    bm_doc_free(engine->doc);
+    engine->doc = NULL;
+  }
+
+  /* a document opened again has what the writes so far put in the file */
+  g_mutex_lock(&engine->save_lock);
+  g_string_truncate(engine->doc_landed, 0);
+  engine->doc_journal_emptied = FALSE;
+  g_mutex_unlock(&engine->save_lock);
+}
+
+/* Applies what the save thread folded into the file since doc was serialized
+ * to doc, with the write lock held */
+static void
+engine_doc_landed(BookmarkEngine *engine)
+{
+  g_mutex_lock(&engine->save_lock);
+
+  if (engine->doc && engine->doc_journal_emptied)
+  {
+    bm_journal_apply(engine->doc, engine->doc_landed->str,
+                     engine->doc_landed->len, 0);
+    bm_doc_forget_journal(engine->doc);
+  }
+
+  g_string_truncate(engine->doc_landed, 0);
+  engine->doc_journal_emptied = FALSE;
+  g_mutex_unlock(&engine->save_lock);
+}
+
+static BookmarkEngine *
+engine_ref(BookmarkEngine *engine)
+{
+  g_atomic_int_inc(&engine->ref_count);
+
+  return engine;
+}
+
+/* Frees what bookmark_engine_free() left for the visits timeout */
+static void
+engine_unref(gpointer data)
+{
+  BookmarkEngine *engine = data;
+
+  if (!g_atomic_int_dec_and_test(&engine->ref_count))
+    return;
+
+  g_mutex_clear(&engine->visits_lock);
+  g_mutex_clear(&engine->save_lock);
+  g_cond_clear(&engine->save_cond);
+  g_rw_lock_clear(&engine->lock);
+  g_free(engine);
+}
+
+void
+bookmark_engine_free(BookmarkEngine *engine)
+{
+  if (!engine)
+    return;
+
+  g_mutex_lock(&engine->visits_lock);
+  engine->visits_cancelled = TRUE;
+
+  if (engine->visits_source)
+  {
+    g_source_remove(engine->visits_source);
+    engine->visits_source = 0;
+  }
+
+  g_mutex_unlock(&engine->visits_lock);
+
+  /* including a flush a timeout already asked it for */
+  engine_stop_saves(engine);
+
+  /* the buffer is flushed at shutdown, whatever its bounds */
+  bookmark_engine_flush_visits(engine);
+  engine_close_doc(engine);
+  bookmark_journal_close(engine->journal);
+
+  if (engine->root)
+    bookmark_item_free(engine->root);
+
+  g_ptr_array_free(engine->removed, TRUE);
+  xmlDictFree(engine->dict);
+  g_string_free(engine->save_landed, TRUE);
+  g_string_free(engine->doc_landed, TRUE);
+  g_hash_table_destroy(engine->visits);
+  g_free(engine->file_name);
+
+  /* a timeout being dispatched on another thread still looks at it */
+  engine_unref(engine);
+}
+
+static BookmarkVisitResult
+build_folder_caches(BookmarkItem *bm_item, guint depth, gpointer user_data)
+{
+  if (bm_item->isFolder)
+  {
+    bm_child_names_build(bm_item);
+    bm_child_array_build(bm_item);
+  }
+
+  return BM_VISIT_CONTINUE;
+}
+
+/* Builds what readers would build on their first lookup, at the same time */
+static void
+engine_index(BookmarkItem *root)
+{
+  if (!root->url_index)
+    bm_url_index_build(root);
+
+  bm_search_index_build(root);
+  bm_url_trie_build(root);
+  bookmark_item_walk(root, BM_WALK_DEPTH_FIRST, build_folder_caches, NULL,
+                     NULL);
+}
+
+/* Drops the buffered visits of bm_item and everything below it, with
+ * visits_lock held */
+static void
+forget_visits(GHashTable *visits, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  g_hash_table_remove(visits, bm_item);
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    forget_visits(visits, child);
+}
+
+/* Drops the buffered visits of an item that is about to be freed */
+static void
+engine_forget_visits(BookmarkEngine *engine, BookmarkItem *bm_item)
+{
+  g_mutex_lock(&engine->visits_lock);
+  forget_visits(engine->visits, bm_item);
+  g_mutex_unlock(&engine->visits_lock);
+}
+
+static void
+item_reloaded(BookmarkItem *bm_item, BookmarkChangeType change,
+              gpointer user_data)
+{
+  if (change == BOOKMARK_CHANGE_REMOVED)
+    engine_forget_visits(user_data, bm_item);
+}
+
+/* TRUE if bm_item is in the tree of engine, with the write lock held */
+static gboolean
+engine_has_item(BookmarkEngine *engine, BookmarkItem *bm_item)
+{
+  while (bm_item->parent)
+    bm_item = bm_item->parent;
+
+  return bm_item == engine->root;
+}
+
+/* TRUE if the tree has to be read again, with the read or the write lock
+ * held. Not while the document is open, the tree is ahead of the file
+ * then. */
+static gboolean
+engine_stale(BookmarkEngine *engine)
+{
+  BmFilesKey key;
+  guint key_serial;
+  gboolean stale;
+
+  if (engine->doc)
+    return FALSE;
+
+  g_mutex_lock(&engine->save_lock);
+  key = engine->key;
+  key_serial = engine->key_serial;
+  stale = engine->tree_stale;
+  g_mutex_unlock(&engine->save_lock);
+
+  if (stale || bm_files_key_changed(engine->file_name, &key))
+    return TRUE;
+
+  /* the next check need not hash the file again, unless the key was
+   * replaced meanwhile */
+  g_mutex_lock(&engine->save_lock);
+
+  if (engine->key_serial == key_serial)
+    engine->key = key;
+
+  g_mutex_unlock(&engine->save_lock);
+
+  return FALSE;
+}
+
+/* Loads the tree, or reads it again if others changed the files since, with
+ * the write lock held */
+static gboolean
+engine_load(BookmarkEngine *engine)
+{
+  BookmarkItem *root = NULL;
+  BmFilesKey key;
+
+  if (engine->root && !engine_stale(engine))
+    return TRUE;
+
+  /* taken first, whatever changes during the load shows on the next check */
+  bm_files_key_get(engine->file_name, &key);
+
+  if (!get_root_bookmark_absolute_path_full(&root, engine->file_name,
+                                            engine->flags))
+  {
+    return engine->root != NULL;
+  }
+
+  if (!engine->root)
+    engine->root = root;
+  else
+  {
+    /* matched items keep their address, the indexes are built anew below.
+     * Engine trees have no BookmarkTree whose strings the patch would free
+     * the wrong way. */
+    bm_url_index_free(engine->root->url_index);
+    engine->root->url_index = NULL;
+    bm_search_index_free(engine->root->search_index);
+    engine->root->search_index = NULL;
+    bm_url_trie_free(engine->root->url_trie);
+    engine->root->url_trie = NULL;
+
+    bm_tree_patch(engine->root, root, item_reloaded, engine, engine->removed);
+  }
+
+  engine_index(engine->root);
+
+  g_mutex_lock(&engine->save_lock);
+  engine->key = key;
+  engine->key_serial++;
+  engine->tree_stale = FALSE;
+  g_mutex_unlock(&engine->save_lock);
+
+  return TRUE;
+}
+
+BookmarkItem *
+bookmark_engine_read_lock(BookmarkEngine *engine)
+{
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return NULL);
+
+  g_rw_lock_reader_lock(&engine->lock);
+
+  if (engine->root && !engine_stale(engine))
+    return engine->root;
+
+  /* only the first reader, or the first after others saved, gets here */
+  g_rw_lock_reader_unlock(&engine->lock);
+  g_rw_lock_writer_lock(&engine->lock);
+  engine_load(engine);
+  g_rw_lock_writer_unlock(&engine->lock);
+  g_rw_lock_reader_lock(&engine->lock);
+
+  return engine->root;
+}
+
+void
+bookmark_engine_read_unlock(BookmarkEngine *engine)
+{
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return);
+
+  g_rw_lock_reader_unlock(&engine->lock);
+}
+
+/* Makes sure the document is open, with the write lock held, returns its root
+ * element */
+static xmlNode *
+engine_open(BookmarkEngine *engine)
+{
+  BookmarkLock *lock;
+
+  if (engine->doc)
+    return xmlDocGetRootElement(engine->doc);
+
+  /* nobody saves between reading the tree again and opening the document,
+   * the changes start from the file the tree has */
+  if (!bm_lock_files(BM_LOCK_SHARED, &lock))
+    return NULL;
+
+  if (engine_load(engine))
+  {
+    engine->doc = bm_doc_open_dict(engine->file_name,
+                                   XML_PARSE_SAX1 | XML_PARSE_RECOVER,
+                                   engine->dict);
+  }
+
+  bookmark_lock_release(lock);
+
+  if (!engine->doc)
+    return NULL;
+
+  /* if the tree could not be read again the items are looked up one by one
+   * instead */
+  bookmark_item_bind_document(engine->root, engine->doc);
+
+  return xmlDocGetRootElement(engine->doc);
+}
+
+/* Takes the write lock and opens the document, returns its root element. The
+ * lock is held even if NULL is returned. */
+static xmlNode *
+engine_begin(BookmarkEngine *engine)
+{
+  g_rw_lock_writer_lock(&engine->lock);
+  engine->doc_serial++;
+
+  return engine_open(engine);
+}
+
+static inline void
+engine_end(BookmarkEngine *engine)
+{
+  /* the readers must not rebuild it */
+  if (engine->root)
+    bm_search_index_settle(engine->root);
+
+  g_rw_lock_writer_unlock(&engine->lock);
+}
+
+static inline gboolean
+engine_has_visits(BookmarkEngine *engine)
+{
+  gboolean rv;
+
+  g_mutex_lock(&engine->visits_lock);
+  rv = g_hash_table_size(engine->visits) > 0;
+  g_mutex_unlock(&engine->visits_lock);
+
+  return rv;
+}
+
+/* Moves the buffered visits into the document and the tree, with the write
+ * lock held */
+static void
+engine_apply_visits(BookmarkEngine *engine, xmlNode *root_element)
+{
+  GHashTableIter iter;
+  gpointer bm_item;
+  gpointer value;
+
+  g_mutex_lock(&engine->visits_lock);
+
+  if (g_hash_table_size(engine->visits))
+  {
+    engine->visits_serial++;
+    engine->doc_serial++;
+  }
+
+  g_hash_table_iter_init(&iter, engine->visits);
+
+  while (g_hash_table_iter_next(&iter, &bm_item, &value))
+  {
+    EngineVisit *visit = value;
+
+    /* taken out of the tree since the visit was recorded */
+    if (!engine_has_item(engine, bm_item))
+      continue;
+
+    if (visit->visit_count)
+    {
+      bookmark_set_visit_count(bm_item, visit->visit_count,
+                               engine->file_name, engine->doc, root_element);
+    }
+
+    if (visit->time_visited)
+    {
+      bookmark_set_time_last_visited(bm_item, visit->time_visited,
+                                     engine->file_name, engine->doc,
+                                     root_element);
+    }
+  }
+
+  g_hash_table_remove_all(engine->visits);
+  g_mutex_unlock(&engine->visits_lock);
+}
+
+/* Puts the visit of an item back into the buffer after the journal could not
+ * take it, keeping what was recorded for the item meanwhile, with
+ * visits_lock held */
+static void
+engine_keep_visit(BookmarkEngine *engine, BookmarkItem *bm_item,
+                  EngineVisit *visit)
+{
+  EngineVisit *newer = g_hash_table_lookup(engine->visits, bm_item);
+
+  if (!newer)
+  {
+    g_hash_table_insert(engine->visits, bm_item, visit);
+    return;
+  }
+
+  if (!newer->visit_count)
+  {
+    newer->visit_count = visit->visit_count;
+    visit->visit_count = NULL;
+  }
+
+  if (!newer->time_visited)
+  {
+    newer->time_visited = visit->time_visited;
+    visit->time_visited = NULL;
+  }
+
+  engine_visit_free(visit);
+}
+
+/* Puts a journaled visit into the tree */
+static void
+tree_visit(BookmarkItem *bm_item, EngineVisit *visit)
+{
+  guint visit_count = bm_item->visit_count;
+  GTime time_visited = bm_item->time_last_visited;
+
+  if (visit->visit_count)
+    visit_count = atoi(visit->visit_count);
+
+  if (visit->time_visited)
+    time_visited = atoi(visit->time_visited);
+
+  if (visit_count != bm_item->visit_count ||
+      time_visited != bm_item->time_last_visited)
+  {
+    bookmark_item_set_visited(bm_item, visit_count, time_visited);
+  }
+}
+
+/* Appends lines to the journal. The tree has them, so unless others changed
+ * the files since the tree was read, it still has all of them. */
+static gboolean
+engine_journal_append(BookmarkEngine *engine, const GString *lines)
+{
+  BookmarkLock *lock;
+  BmFilesKey key;
+  gboolean current;
+  gboolean rv;
+
+  /* nobody writes between the check and the append */
+  if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &lock))
+    return FALSE;
+
+  g_mutex_lock(&engine->save_lock);
+  key = engine->key;
+  g_mutex_unlock(&engine->save_lock);
+
+  current = !bm_files_key_changed(engine->file_name, &key);
+  rv = bm_journal_append(engine->journal, lines);
+
+  if (rv && current)
+  {
+    bm_files_key_get(engine->file_name, &key);
+    g_mutex_lock(&engine->save_lock);
+    engine->key = key;
+    engine->key_serial++;
+    g_mutex_unlock(&engine->save_lock);
+  }
+
+  bookmark_lock_release(lock);
+
+  return rv;
+}
+
+/* Appends the buffered visits of items with an id to the journal and puts
+ * them into the tree, with the write lock held. The others, and all of them
+ * if the append fails, stay in the buffer for the document. The buffer is
+ * taken over first, so that visits recorded during the sync do not wait for
+ * it. */
+static void
+engine_journal_visits(BookmarkEngine *engine)
+{
+  GHashTable *visits;
+  GHashTableIter iter;
+  gpointer bm_item;
+  gpointer value;
+  GString *lines;
+  gboolean rv;
+
+  if (!engine_has_visits(engine))
+    return;
+
+  if (!engine->journal)
+    engine->journal = bookmark_journal_open(engine->file_name);
+
+  if (!engine->journal)
+    return;
+
+  g_mutex_lock(&engine->visits_lock);
+  visits = engine->visits;
+  engine->visits = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         engine_visit_free);
+  g_mutex_unlock(&engine->visits_lock);
+
+  lines = g_string_new(NULL);
+  g_hash_table_iter_init(&iter, visits);
+
+  while (g_hash_table_iter_next(&iter, &bm_item, &value))
+  {
+    EngineVisit *visit = value;
+
+    if (!((BookmarkItem *)bm_item)->id || !engine_has_item(engine, bm_item))
+      continue;
+
+    if (visit->visit_count)
+    {
+      bm_journal_line(lines, BM_JOURNAL_VISIT_COUNT, bm_item,
+                      visit->visit_count);
+    }
+
+    if (visit->time_visited)
+    {
+      bm_journal_line(lines, BM_JOURNAL_TIME_VISITED, bm_item,
+                      visit->time_visited);
+    }
+  }
+
+  rv = lines->len && engine_journal_append(engine, lines);
+  g_string_free(lines, TRUE);
+
+  g_mutex_lock(&engine->visits_lock);
+  g_hash_table_iter_init(&iter, visits);
+
+  while (g_hash_table_iter_next(&iter, &bm_item, &value))
+  {
+    /* taken out of the tree, the visit goes with the table */
+    if (!engine_has_item(engine, bm_item))
+      continue;
+
+    if (rv && ((BookmarkItem *)bm_item)->id)
+    {
+      tree_visit(bm_item, value);
+      continue;
+    }
+
+    g_hash_table_iter_steal(&iter);
+    engine_keep_visit(engine, bm_item, value);
+  }
+
+  g_mutex_unlock(&engine->visits_lock);
+  g_hash_table_destroy(visits);
+}
+
+/* TRUE if doc has visits no write succeeded with yet, with the write lock
+ * held */
+static gboolean
+engine_visits_unsaved(BookmarkEngine *engine)
+{
+  gboolean rv;
+
+  g_mutex_lock(&engine->save_lock);
+  rv = engine->visits_serial != engine->visits_saved;
+  g_mutex_unlock(&engine->save_lock);
+
+  return rv;
+}
+
+/* Gets the document ready to be written, with the buffered visits in it.
+ * FALSE if there are visits and the document could not be opened. */
+static gboolean
+engine_prepare_save(BookmarkEngine *engine)
+{
+  xmlNode *root_element;
+
+  if (!engine_has_visits(engine))
+    return TRUE;
+
+  root_element = engine_open(engine);
+
+  if (!root_element)
+    return FALSE;
+
+  engine_apply_visits(engine, root_element);
+
+  return TRUE;
+}
+
+/* Writes doc, or data if doc is NULL, see bm_doc_save_data(), unless the
+ * file is no longer the one the tree was read from. Sets conflict if others
+ * saved it, and tree_stale if the write put changes others journaled into
+ * the file. */
+static gboolean
+engine_write(BookmarkEngine *engine, xmlDoc *doc, const xmlChar *data,
+             gsize len, const BmJournalPos *journal_pos, GString *landed,
+             GString *folded)
+{
+  BookmarkLock *lock;
+  BmFilesKey key;
+  gboolean journaled;
+  gboolean changed;
+  gboolean rv;
+
+  /* nobody writes between the check and the save */
+  if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &lock))
+    return FALSE;
+
+  g_mutex_lock(&engine->save_lock);
+  key = engine->key;
+  g_mutex_unlock(&engine->save_lock);
+
+  /* the journal of this engine is in the key, anything else in it is not in
+   * the tree */
+  journaled = bm_files_key_changed(engine->file_name, &key);
+
+  if (doc)
+    rv = bm_doc_save_key(doc, engine->file_name, &key, &changed);
+  else
+  {
+    rv = bm_doc_save_data(data, len, journal_pos, landed, folded,
+                          engine->file_name, &key, &changed);
+  }
+
+  g_mutex_lock(&engine->save_lock);
+
+  if (rv)
+  {
+    engine->key = key;
+    engine->key_serial++;
+    engine->tree_stale |= journaled;
+  }
+  else if (changed)
+    engine->conflict = TRUE;
+
+  g_mutex_unlock(&engine->save_lock);
+  bookmark_lock_release(lock);
+
+  return rv;
+}
+
+/* Drops the document after a write found the file saved by others since it
+ * was opened, with the write lock held. The changes and visits it had that
+ * were not written are lost, as are the saves still waiting, and the tree
+ * is read again. */
+static void
+engine_resolve_conflict(BookmarkEngine *engine)
+{
+  GSList *tasks;
+  gboolean conflict;
+
+  g_mutex_lock(&engine->save_lock);
+  conflict = engine->conflict;
+  engine->conflict = FALSE;
+  g_mutex_unlock(&engine->save_lock);
+
+  if (!conflict)
+    return;
+
+  tasks = engine_wait_saves(engine);
+  engine_close_doc(engine);
+
+  g_mutex_lock(&engine->save_lock);
+  engine->visits_saved = engine->visits_serial;
+  engine->tree_stale = TRUE;
+  g_mutex_unlock(&engine->save_lock);
+
+  engine_load(engine);
+  complete_saves(tasks, FALSE, engine->file_name);
+}
+
+/* Writes the document with the buffered visits, with the write lock held */
+static gboolean
+engine_save(BookmarkEngine *engine)
+{
+  gboolean rv = TRUE;
+  GSList *tasks;
+
+  if (!engine_prepare_save(engine))
+    return FALSE;
+
+  /* an older state must not be written after this one */
+  tasks = engine_wait_saves(engine);
+
+  if (engine->doc)
+  {
+    engine_doc_landed(engine);
+    rv = engine_write(engine, engine->doc, NULL, 0, NULL, NULL, NULL);
+
+    /* a failed write keeps the document, its changes and visits are written
+     * by the next one */
+    if (rv)
+    {
+      g_mutex_lock(&engine->save_lock);
+      engine->visits_saved = engine->visits_serial;
+      g_mutex_unlock(&engine->save_lock);
+
+      /* the next change starts from what is on disk */
+      engine_close_doc(engine);
+    }
+  }
+
+  complete_saves(tasks, rv, engine->file_name);
+  engine_resolve_conflict(engine);
+
+  return rv;
+}
+
+/* Serializes the document with the buffered visits into save_data for the
+ * save thread, which completes task once it is written, with the write lock
+ * held. task may be NULL. FALSE if there was nothing to hand over, task is
+ * completed then. */
+static gboolean
+engine_hand_over(BookmarkEngine *engine, GTask *task)
+{
+  xmlChar *data = NULL;
+  int len = 0;
+
+  if (!engine_prepare_save(engine))
+  {
+    if (task)
+      complete_saves(g_slist_prepend(NULL, task), FALSE, engine->file_name);
+
+    return FALSE;
+  }
+
+  /* the document stays open, it is ahead of the file until the write */
+  if (engine->doc)
+  {
+    engine_doc_landed(engine);
+    xmlDocDumpFormatMemory(engine->doc, &data, &len, 1);
+  }
+
+  if (!data)
+  {
+    /* nothing to write, or it could not be serialized */
+    if (task)
+    {
+      complete_saves(g_slist_prepend(NULL, task), !engine->doc,
+                     engine->file_name);
+    }
+
+    return FALSE;
+  }
+
+  g_mutex_lock(&engine->save_lock);
+
+  /* not written yet, this one has all of it */
+  if (engine->save_data)
+    xmlFree(engine->save_data);
+
+  engine->save_data = data;
+  engine->save_len = len;
+
+  if (bm_doc_journal_pos(engine->doc))
+    engine->save_journal_pos = *bm_doc_journal_pos(engine->doc);
+  else
+    memset(&engine->save_journal_pos, 0, sizeof(engine->save_journal_pos));
+
+  g_string_truncate(engine->save_landed, 0);
+  engine->save_visits_serial = engine->visits_serial;
+  engine->save_doc_serial = engine->doc_serial;
+
+  if (task)
+    engine->save_tasks = g_slist_prepend(engine->save_tasks, task);
+
+  g_mutex_unlock(&engine->save_lock);
+
+  return TRUE;
+}
+
+/* Closes the document once what was written is all there is to it, with the
+ * write lock held */
+static void
+engine_close_written(BookmarkEngine *engine, guint doc_serial)
+{
+  gboolean unchanged;
+
+  g_mutex_lock(&engine->save_lock);
+  unchanged = engine->doc && engine->doc_serial == doc_serial &&
+      !engine->save_data && !engine->writing;
+  g_mutex_unlock(&engine->save_lock);
+
+  if (unchanged)
+    engine_close_doc(engine);
+}
+
+static void
+save_thread(GTask *worker, gpointer source_object, gpointer task_data,
+            GCancellable *cancellable)
+{
+  BookmarkEngine *engine = task_data;
+
+  g_mutex_lock(&engine->save_lock);
+
+  while (engine->save_data || engine->visits_due)
+  {
+    xmlChar *data = engine->save_data;
+    gsize len = engine->save_len;
+    BmJournalPos journal_pos = engine->save_journal_pos;
+    guint visits_serial = engine->save_visits_serial;
+    guint doc_serial = engine->save_doc_serial;
+    gboolean conflict;
+    gboolean written;
+    GString *landed;
+    GString *folded;
+    GSList *tasks;
+    gboolean rv;
+
+    if (!data)
+    {
+      /* the visits timeout left the whole flush to this thread, waiting for
+       * the readers here keeps the main loop going */
+      engine->visits_due = FALSE;
+      g_mutex_unlock(&engine->save_lock);
+
+      g_rw_lock_writer_lock(&engine->lock);
+      engine_journal_visits(engine);
+
+      if (engine_visits_unsaved(engine) || engine_has_visits(engine))
+        engine_hand_over(engine, NULL);
+
+      engine_end(engine);
+
+      g_mutex_lock(&engine->save_lock);
+      continue;
+    }
+
+    landed = engine->save_landed;
+    folded = g_string_new(NULL);
+    tasks = g_slist_reverse(engine->save_tasks);
+    engine->save_data = NULL;
+    engine->save_landed = g_string_new(NULL);
+    engine->save_tasks = NULL;
+    engine->writing = TRUE;
+    g_mutex_unlock(&engine->save_lock);
+
+    rv = engine_write(engine, NULL, data, len, &journal_pos, landed, folded);
+    xmlFree(data);
+
+    g_mutex_lock(&engine->save_lock);
+
+    if (rv)
+    {
+      /* the journal was emptied, data not written yet and doc lack what was
+       * taken from it */
+      g_string_append_len(engine->save_landed, folded->str, folded->len);
+      memset(&engine->save_journal_pos, 0, sizeof(engine->save_journal_pos));
+      g_string_append_len(engine->doc_landed, folded->str, folded->len);
+      engine->doc_journal_emptied = TRUE;
+      engine->visits_saved = visits_serial;
+    }
+
+    /* nothing newer waits to be written over it */
+    written = rv && !engine->save_data;
+    conflict = engine->conflict;
+    engine->writing = FALSE;
+    g_cond_broadcast(&engine->save_cond);
+    g_mutex_unlock(&engine->save_lock);
+
+    g_string_free(landed, TRUE);
+    g_string_free(folded, TRUE);
+    complete_saves(tasks, rv, engine->file_name);
+
+    /* saves of other processes since would be undone by the next write of
+     * the document. Nobody holding the write lock waits for this thread with
+     * no data handed over. */
+    if (written || conflict)
+    {
+      g_rw_lock_writer_lock(&engine->lock);
+
+      if (written)
+        engine_close_written(engine, doc_serial);
+
+      engine_resolve_conflict(engine);
+      engine_end(engine);
+    }
+
+    g_mutex_lock(&engine->save_lock);
+  }
+
+  engine->saving = FALSE;
+  g_cond_broadcast(&engine->save_cond);
+  g_mutex_unlock(&engine->save_lock);
+}
+
+/* Starts the save thread unless it runs, with save_lock held */
+static void
+engine_start_saving(BookmarkEngine *engine)
+{
+  GTask *worker;
+
+  if (engine->saving)
+    return;
+
+  worker = g_task_new(NULL, NULL, NULL, NULL);
+  engine->saving = TRUE;
+  g_task_set_task_data(worker, engine, NULL);
+  g_task_run_in_thread(worker, save_thread);
+  g_object_unref(worker);
+}
+
+/* Hands the document to the save thread, which completes task once it is
+ * written, with the write lock held */
+static void
+engine_queue_save(BookmarkEngine *engine, GTask *task)
+{
+  if (engine_hand_over(engine, task))
+  {
+    g_mutex_lock(&engine->save_lock);
+    engine_start_saving(engine);
+    g_mutex_unlock(&engine->save_lock);
+  }
+}
+
+/* Leaves the flush of the visits to the save thread, with visits_lock held,
+ * so that bookmark_engine_free() waits for the thread it starts */
+static void
+engine_visits_due(BookmarkEngine *engine)
+{
+  g_mutex_lock(&engine->save_lock);
+  engine->visits_due = TRUE;
+  engine_start_saving(engine);
+  g_mutex_unlock(&engine->save_lock);
+}
+
+static gboolean
+visits_timeout(gpointer data)
+{
+  BookmarkEngine *engine = data;
+
+  g_mutex_lock(&engine->visits_lock);
+
+  /* bookmark_engine_free() removed it while it was being dispatched, the
+   * reference of the timeout keeps the engine around until it returns */
+  if (engine->visits_cancelled)
+  {
+    g_mutex_unlock(&engine->visits_lock);
+    return G_SOURCE_REMOVE;
+  }
+
+  engine->visits_source = 0;
+  engine_visits_due(engine);
+  g_mutex_unlock(&engine->visits_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Records a visit if the buffer is on, FALSE if the change has to go to the
+ * document right away */
+static gboolean
+engine_buffer_visit(BookmarkEngine *engine, BookmarkItem *bm_item,
+                    const gchar *visit_count, const gchar *time_visited)
+{
+  EngineVisit *visit;
+  gboolean full;
+
+  g_mutex_lock(&engine->visits_lock);
+
+  if (!engine->visits_max_pending)
+  {
+    g_mutex_unlock(&engine->visits_lock);
+    return FALSE;
+  }
+
+  visit = g_hash_table_lookup(engine->visits, bm_item);
+
+  if (!visit)
+  {
+    visit = g_new0(EngineVisit, 1);
+    g_hash_table_insert(engine->visits, bm_item, visit);
+  }
+
+  /* only the last value of a field is written */
+  if (visit_count)
+  {
+    g_free(visit->visit_count);
+    visit->visit_count = g_strdup(visit_count);
+  }
+
+  if (time_visited)
+  {
+    g_free(visit->time_visited);
+    visit->time_visited = g_strdup(time_visited);
+  }
+
+  full = g_hash_table_size(engine->visits) >= engine->visits_max_pending;
+
+  /* the caller is not kept waiting for the write either */
+  if (full && !engine->visits_cancelled)
+    engine_visits_due(engine);
+  else if (engine->visits_max_delay && !engine->visits_source &&
+           !engine->visits_cancelled)
+  {
+    engine->visits_source =
+        g_timeout_add_seconds_full(G_PRIORITY_DEFAULT,
+                                   engine->visits_max_delay, visits_timeout,
+                                   engine_ref(engine), engine_unref);
+  }
+
+  g_mutex_unlock(&engine->visits_lock);
+
+  return TRUE;
+}
+
+void
+bookmark_engine_set_visit_buffer(BookmarkEngine *engine, guint max_pending,
+                                 guint max_delay)
+{
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return);
+
+  g_mutex_lock(&engine->visits_lock);
+  engine->visits_max_pending = max_pending;
+  engine->visits_max_delay = max_delay;
+  g_mutex_unlock(&engine->visits_lock);
+
+  /* what is buffered may be over the new bounds */
+  bookmark_engine_flush_visits(engine);
+}
+
+gboolean
+bookmark_engine_flush_visits(BookmarkEngine *engine)
+{
+  gboolean rv = TRUE;
+
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return FALSE);
+
+  g_rw_lock_writer_lock(&engine->lock);
+  engine_journal_visits(engine);
+
+  if (engine_visits_unsaved(engine) || engine_has_visits(engine))
+    rv = engine_save(engine);
+
+  engine_end(engine);
+
+  return rv;
+}
+
+typedef gboolean (*EngineSetter)(BookmarkItem *bm_item, const gchar *val,
+                                 xmlDocPtr doc, xmlNode *root_element);
+
+static gboolean
+engine_set(BookmarkEngine *engine, EngineSetter setter, BookmarkItem *bm_item,
+           const gchar *val)
+{
+  xmlNode *root_element;
+  gboolean rv = FALSE;
+
+  CHECK_PARAM(!engine || !bm_item || !val, "\nInvalid Input Parameter",
+              return FALSE);
+
+  root_element = engine_begin(engine);
+
+  if (root_element && engine_has_item(engine, bm_item))
+    rv = setter(bm_item, val, engine->doc, root_element);
+
+  engine_end(engine);
+
+  return rv;
+}
+
+gboolean
+bookmark_engine_set_name(BookmarkEngine *engine, BookmarkItem *bm_item,
+                         const gchar *val)
+{
+  return engine_set(engine, bookmark_set_name, bm_item, val);
+}
+
+gboolean
+bookmark_engine_set_url(BookmarkEngine *engine, BookmarkItem *bm_item,
+                        const gchar *val)
+{
+  return engine_set(engine, bookmark_set_url, bm_item, val);
+}
+
+gboolean
+bookmark_engine_set_thumbnail(BookmarkEngine *engine, BookmarkItem *bm_item,
+                              const gchar *val)
+{
+  return engine_set(engine, bookmark_set_thumbnail, bm_item, val);
+}
+
+gboolean
+bookmark_engine_set_visit_count(BookmarkEngine *engine, BookmarkItem *bm_item,
+                                const gchar *val)
+{
+  xmlNode *root_element;
+  gboolean rv = FALSE;
+
+  CHECK_PARAM(!engine || !bm_item || !val, "\nInvalid Input Parameter",
+              return FALSE);
+
+  if (engine_buffer_visit(engine, bm_item, val, NULL))
+    return TRUE;
+
+  root_element = engine_begin(engine);
+
+  if (root_element && engine_has_item(engine, bm_item))
+  {
+    rv = bookmark_set_visit_count(bm_item, val, engine->file_name,
+                                  engine->doc, root_element);
+  }
+
+  engine_end(engine);
+
+  return rv;
+}
+
+gboolean
+bookmark_engine_set_time_last_visited(BookmarkEngine *engine,
+                                      BookmarkItem *bm_item, const gchar *val)
+{
+  xmlNode *root_element;
+  gboolean rv = FALSE;
+
+  CHECK_PARAM(!engine || !bm_item || !val, "\nInvalid Input Parameter",
+              return FALSE);
+
+  if (engine_buffer_visit(engine, bm_item, NULL, val))
+    return TRUE;
+
+  root_element = engine_begin(engine);
+
+  if (root_element && engine_has_item(engine, bm_item))
+  {
+    rv = bookmark_set_time_last_visited(bm_item, val, engine->file_name,
+                                        engine->doc, root_element);
+  }
+
+  engine_end(engine);
+
+  return rv;
+}
+
+gboolean
+bookmark_engine_remove(BookmarkEngine *engine, BookmarkItem *bm_item)
+{
+  xmlNode *root_element;
+  gboolean rv = FALSE;
+
+  CHECK_PARAM(!engine || !bm_item, "\nInvalid Input Parameter", return FALSE);
+
+  root_element = engine_begin(engine);
+
+  /* the root has no element of its own to remove */
+  if (root_element && bm_item->parent && engine_has_item(engine, bm_item))
+  {
+    /* visits recorded before the removal find their elements */
+    engine_apply_visits(engine, root_element);
+
+    if (bm_item->isOperatorBookmark)
+    {
+      rv = bookmark_set_operator_bookmark_as_deleted(bm_item,
+                                                     engine->file_name,
+                                                     engine->doc,
+                                                     root_element);
+    }
+    else if (opened_bookmark_remove(bm_item, root_element))
+    {
+      engine_forget_visits(engine, bm_item);
+      bookmark_item_unlink(bm_item);
+      g_ptr_array_add(engine->removed, bm_item);
+      rv = TRUE;
+    }
+  }
+
+  engine_end(engine);
+
+  return rv;
+}
+
+/* Puts bm_item, which was added to the document in front of before or last
+ * if NULL, into the tree, with the write lock held */
+static void
+engine_link(BookmarkItem *parent, BookmarkItem *bm_item, BookmarkItem *before)
+{
+  gint position = before ? g_slist_index(parent->list, before) : -1;
+
+  bm_item_insert_child(parent, bm_item, before);
+  parent->list = g_slist_insert(parent->list, bm_item, position);
+
+  /* what readers of the tree expect to be there already */
+  bookmark_item_walk(bm_item, BM_WALK_DEPTH_FIRST, build_folder_caches, NULL,
+                     NULL);
+}
+
+BMError
+bookmark_engine_add_child_at_sorted_position(BookmarkEngine *engine,
+                                             BookmarkItem *parent,
+                                             BookmarkItem *bm_item,
+                                             SortType presentSortType)
+{
+  xmlNode *root_element;
+  BookmarkItem *before;
+  BMError rv = BM_INVALID_FILE;
+
+  CHECK_PARAM(!engine || !parent || !bm_item || !parent->isFolder ||
+              bm_item->parent, "\nInvalid Input Parameter",
+              return BM_INVALID_PARAMETER);
+
+  root_element = engine_begin(engine);
+
+  if (root_element && !engine_has_item(engine, parent))
+    rv = BM_INVALID_PARAMETER;
+  else if (root_element)
+  {
+    if (bm_add_child_at_sorted_position(parent, bm_item, presentSortType,
+                                        engine->doc, root_element,
+                                        &engine->sort_order, &before))
+    {
+      engine_link(parent, bm_item, before);
+      rv = BM_OK;
+    }
+  }
+
+  engine_end(engine);
+
+  return rv;
+}
+
+gboolean
+bookmark_engine_import(BookmarkEngine *engine, BookmarkItem *parent,
+                       const gchar *path, gchar *importFolderName,
+                       BookmarkItem **import_folder)
+{
+  xmlNode *root_element;
+  BookmarkItem *folder;
+  gboolean rv = FALSE;
+
+  CHECK_PARAM(!engine || !path || (parent && !parent->isFolder),
+              "\nInvalid Input Parameter", return FALSE);
+
+  /* the file is read before the write lock is taken */
+  if (!bookmark_import(path, importFolderName, &folder))
+    return FALSE;
+
+  while (folder->parent)
+    folder = folder->parent;
+
+  root_element = engine_begin(engine);
+
+  if (root_element)
+  {
+    if (!parent)
+      parent = engine->root;
+
+    if (engine_has_item(engine, parent) &&
+        bm_doc_append_child(parent, folder, root_element))
+    {
+      engine_link(parent, folder, NULL);
+      rv = TRUE;
+    }
+  }
+
+  engine_end(engine);
+
+  if (!rv)
+    bookmark_item_free(folder);
+  else if (import_folder)
+    *import_folder = folder;
+
+  return rv;
+}
+
+SortOrder
+bookmark_engine_get_sorting_order(BookmarkEngine *engine)
+{
+  SortOrder order;
+
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return BM_ASC);
+
+  g_rw_lock_reader_lock(&engine->lock);
+  order = engine->sort_order;
+  g_rw_lock_reader_unlock(&engine->lock);
+
+  return order;
+}
+
+gboolean
+bookmark_engine_save(BookmarkEngine *engine)
+{
+  gboolean rv;
+
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return FALSE);
+
+  g_rw_lock_writer_lock(&engine->lock);
+  rv = engine_save(engine);
+  engine_end(engine);
+
+  return rv;
+}
+
+void
+bookmark_engine_save_async(BookmarkEngine *engine, GCancellable *cancellable,
+                           GAsyncReadyCallback callback, gpointer user_data)
+{
+  GTask *task;
+
+  CHECK_PARAM(!engine, "\nInvalid Input Parameter", return);
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_source_tag(task, bookmark_engine_save_async);
+
+  if (g_task_return_error_if_cancelled(task))
+  {
+    g_object_unref(task);
+    return;
+  }
+
+  /* once the data is handed over it is written, merged saves share it */
+  g_task_set_check_cancellable(task, FALSE);
+
+  g_rw_lock_writer_lock(&engine->lock);
+  engine_queue_save(engine, task);
+  engine_end(engine);
+}
+
+gboolean
+bookmark_engine_save_finish(BookmarkEngine *engine, GAsyncResult *result,
+                            GError **error)
+{
+  CHECK_PARAM(!engine || !g_task_is_valid(result, NULL),
+              "\nInvalid Input Parameter", return FALSE);
+
+  return g_task_propagate_boolean(G_TASK(result), error);
+}
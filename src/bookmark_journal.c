@@ -0,0 +1,753 @@
+#include "bookmark_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Small changes written to <file>.journal instead of rewriting the file. The
+ * journal is a line per change, "<op> <id> <value>\n", the value escaped with
+ * g_strescape(). Every change names the item by its XBEL id and sets a field
+ * or removes the item, so applying a change twice does no harm: the journal
+ * is replayed on top of the file on every load, and a save that wrote the
+ * file but did not get to empty the journal loses nothing. A line without
+ * its newline was cut off by a crash and is ignored, the next append cuts it
+ * off the journal so that it does not complete it.
+ *
+ * Documents opened with bm_doc_open() have the journal applied, and remember
+ * how much of it. Every save of the file under the exclusive lock applies
+ * what was journaled since and empties the journal, otherwise replaying it
+ * on the next load would bring back values older than the file. An emptied
+ * journal starts with a "generation <n>" line, n one more than before, which
+ * is no change and skipped as such. A document that remembers an offset into
+ * another generation, or into a journal that was replaced, has none of what
+ * is in the journal now.
+ */
+
+/* Journals larger than this are folded into the file */
+#define BM_JOURNAL_COMPACT_SIZE (64 * 1024)
+
+#define JOURNAL_HEADER "generation "
+/* Longest header line */
+#define JOURNAL_HEADER_MAX (sizeof(JOURNAL_HEADER) + 21)
+
+struct _BookmarkJournal
+{
+  gchar *file_name;
+  gchar *journal_name;
+  int fd;
+  gsize size;
+  GMutex lock;
+};
+
+static const gchar *const field_ops[] =
+{
+  [BM_JOURNAL_NAME] = "name",
+  [BM_JOURNAL_URL] = "url",
+  [BM_JOURNAL_THUMBNAIL] = "thumbnail",
+  [BM_JOURNAL_VISIT_COUNT] = "visit_count",
+  [BM_JOURNAL_TIME_VISITED] = "time_visited",
+  [BM_JOURNAL_TIME_ADDED] = "time_added"
+};
+
+#define OP_REMOVE G_N_ELEMENTS(field_ops)
+
+typedef struct
+{
+  guint op;
+  const gchar *id;
+  gchar *val;
+} JournalEntry;
+
+static inline gchar *
+journal_name_for(const gchar *file_name)
+{
+  return g_strconcat(file_name, ".journal", NULL);
+}
+
+/* Generation of the journal starting with contents, 0 for one that was
+ * never emptied. contents is NUL terminated. */
+static guint64
+journal_generation(const gchar *contents)
+{
+  if (strncmp(contents, JOURNAL_HEADER, strlen(JOURNAL_HEADER)))
+    return 0;
+
+  return g_ascii_strtoull(contents + strlen(JOURNAL_HEADER), NULL, 10);
+}
+
+/* Length of the header line of contents, 0 if there is none */
+static gsize
+journal_header_len(const gchar *contents, gsize len)
+{
+  const gchar *eol;
+
+  if (len < strlen(JOURNAL_HEADER) ||
+      strncmp(contents, JOURNAL_HEADER, strlen(JOURNAL_HEADER)))
+  {
+    return 0;
+  }
+
+  eol = memchr(contents, '\n', len);
+
+  return eol ? (gsize)(eol + 1 - contents) : len;
+}
+
+/* Splits the next complete line of p into entry, NULL at the end */
+static gchar *
+next_entry(gchar *p, gchar *end, JournalEntry *entry)
+{
+  while (p < end)
+  {
+    gchar *eol = memchr(p, '\n', end - p);
+    gchar *id;
+    gchar *val;
+    guint op;
+
+    if (!eol)
+      return NULL;
+
+    *eol = '\0';
+    id = strchr(p, ' ');
+    val = id ? strchr(id + 1, ' ') : NULL;
+
+    if (id)
+    {
+      *id++ = '\0';
+
+      if (val)
+        *val++ = '\0';
+
+      for (op = 0; op < OP_REMOVE; op++)
+      {
+        if (!strcmp(p, field_ops[op]))
+          break;
+      }
+
+      if (op == OP_REMOVE && strcmp(p, "remove"))
+        op++;
+
+      /* every op but remove has a value */
+      if (op <= OP_REMOVE && *id && (op == OP_REMOVE) == !val)
+      {
+        entry->op = op;
+        entry->id = id;
+        entry->val = val ? g_strcompress(val) : NULL;
+
+        return eol + 1;
+      }
+    }
+
+    p = eol + 1;
+  }
+
+  return NULL;
+}
+
+gboolean
+bm_journal_pending(const gchar *file_name)
+{
+  gchar *journal_name;
+  struct stat st;
+  gboolean rv;
+
+  if (!file_name)
+    return FALSE;
+
+  journal_name = journal_name_for(file_name);
+  rv = !stat(journal_name, &st) && st.st_size > 0;
+  g_free(journal_name);
+
+  /* emptied ones still have their header */
+  if (rv && (gsize)st.st_size <= JOURNAL_HEADER_MAX)
+  {
+    gchar *contents;
+    gsize len;
+
+    contents = bm_journal_read(file_name, &len, NULL);
+    rv = contents && journal_header_len(contents, len) < len;
+    g_free(contents);
+  }
+
+  return rv;
+}
+
+static void
+detach_item(BookmarkItem *bm_item)
+{
+  BookmarkItem *parent = bm_item->parent;
+  BookmarkItem *prev = NULL;
+  BookmarkItem *child;
+  GSList **l;
+
+  for (child = parent->first_child; child != bm_item;
+       child = child->next_sibling)
+  {
+    prev = child;
+  }
+
+  if (prev)
+    prev->next_sibling = bm_item->next_sibling;
+  else
+    parent->first_child = bm_item->next_sibling;
+
+  if (parent->last_child == bm_item)
+    parent->last_child = prev;
+
+  /* the list nodes of arena trees are not freed one by one */
+  for (l = &parent->list; *l; l = &(*l)->next)
+  {
+    if ((*l)->data == bm_item)
+    {
+      GSList *node = *l;
+
+      *l = node->next;
+
+      if (!parent->tree || !parent->tree->arena)
+        g_slist_free_1(node);
+
+      break;
+    }
+  }
+
+  bm_item->parent = NULL;
+  bm_item->next_sibling = NULL;
+}
+
+static void
+set_item_string(BookmarkItem *bm_item, gchar **s, const gchar *val)
+{
+  bm_tree_strfree(bm_item->tree, *s);
+  *s = bm_tree_strdup(bm_item->tree, val);
+}
+
+static BookmarkVisitResult
+add_item_id(BookmarkItem *bm_item, guint depth, gpointer user_data)
+{
+  if (bm_item->id)
+    g_hash_table_insert(user_data, bm_item->id, bm_item);
+
+  return BM_VISIT_CONTINUE;
+}
+
+static BookmarkVisitResult
+remove_item_id(BookmarkItem *bm_item, guint depth, gpointer user_data)
+{
+  if (bm_item->id && g_hash_table_lookup(user_data, bm_item->id) == bm_item)
+    g_hash_table_remove(user_data, bm_item->id);
+
+  return BM_VISIT_CONTINUE;
+}
+
+static void
+replay_entry(GHashTable *items, const JournalEntry *entry,
+             BookmarkFieldMask fields)
+{
+  BookmarkItem *bm_item = g_hash_table_lookup(items, entry->id);
+
+  if (!bm_item || !bm_item->parent)
+    return;
+
+  switch (entry->op)
+  {
+    case BM_JOURNAL_NAME:
+      if (fields & BM_FIELD_NAMES)
+        set_item_string(bm_item, &bm_item->name, entry->val);
+      break;
+    case BM_JOURNAL_URL:
+      if (fields & BM_FIELD_URLS)
+        set_item_string(bm_item, &bm_item->url, entry->val);
+      break;
+    case BM_JOURNAL_THUMBNAIL:
+      if (fields & BM_FIELD_ASSETS)
+        set_item_string(bm_item, &bm_item->thumbnail_file, entry->val);
+      break;
+    case BM_JOURNAL_VISIT_COUNT:
+      if (fields & BM_FIELD_METADATA)
+        bm_item->visit_count = atoi(entry->val);
+      break;
+    case BM_JOURNAL_TIME_VISITED:
+      if (fields & BM_FIELD_METADATA)
+        bm_item->time_last_visited = atoi(entry->val);
+      break;
+    case BM_JOURNAL_TIME_ADDED:
+      if (fields & BM_FIELD_METADATA)
+        bm_item->time_added = atoi(entry->val);
+      break;
+    default:
+      /* the ids below bm_item go away with it */
+      bookmark_item_walk(bm_item, BM_WALK_DEPTH_FIRST, remove_item_id, NULL,
+                         items);
+      detach_item(bm_item);
+      free_bookmark_item(bm_item);
+      break;
+  }
+}
+
+gchar *
+bm_journal_read(const gchar *file_name, gsize *len, BmJournalPos *pos)
+{
+  gchar *journal_name = journal_name_for(file_name);
+  gchar *contents;
+  struct stat st;
+
+  if (!g_file_get_contents(journal_name, &contents, len, NULL))
+    contents = NULL;
+
+  /* the lock held keeps it from being emptied in between */
+  if (pos)
+  {
+    memset(pos, 0, sizeof(*pos));
+
+    if (contents && !stat(journal_name, &st))
+    {
+      pos->ino = st.st_ino;
+      pos->generation = journal_generation(contents);
+      pos->offset = journal_header_len(contents, *len);
+    }
+  }
+
+  g_free(journal_name);
+
+  return contents;
+}
+
+void
+bm_journal_truncate(const gchar *file_name)
+{
+  gchar *journal_name = journal_name_for(file_name);
+  gchar header[JOURNAL_HEADER_MAX + 1];
+  gssize n;
+  int fd;
+
+  /* the file stays, journals open for appending keep writing to it */
+  fd = open(journal_name, O_RDWR | O_CLOEXEC);
+
+  if (fd == -1)
+  {
+    if (errno != ENOENT)
+      g_warning("Could not empty %s: %s", journal_name, g_strerror(errno));
+
+    g_free(journal_name);
+    return;
+  }
+
+  n = pread(fd, header, sizeof(header) - 1, 0);
+  header[MAX(n, 0)] = '\0';
+  n = g_snprintf(header, sizeof(header), JOURNAL_HEADER "%" G_GUINT64_FORMAT
+                 "\n", journal_generation(header) + 1);
+
+  if (ftruncate(fd, 0) || pwrite(fd, header, n, 0) != n)
+    g_warning("Could not empty %s: %s", journal_name, g_strerror(errno));
+
+  close(fd);
+  g_free(journal_name);
+}
+
+void
+bm_journal_replay(const gchar *file_name, BookmarkItem *bookmark_root,
+                  BookmarkFieldMask fields)
+{
+  JournalEntry entry;
+  GHashTable *items;
+  gchar *contents;
+  gsize len;
+  gchar *p;
+
+  contents = bm_journal_read(file_name, &len, NULL);
+
+  if (!contents)
+    return;
+
+  /* the walk builds all folders of lazy trees */
+  items = g_hash_table_new(g_str_hash, g_str_equal);
+  bookmark_item_walk(bookmark_root, BM_WALK_DEPTH_FIRST, add_item_id, NULL,
+                     items);
+
+  for (p = contents; (p = next_entry(p, contents + len, &entry)); )
+  {
+    replay_entry(items, &entry, fields);
+    g_free(entry.val);
+  }
+
+  g_hash_table_destroy(items);
+  g_free(contents);
+}
+
+/* First element child of node called name */
+static xmlNode *
+child_element(xmlNode *node, const char *name)
+{
+  for (node = node->children; node; node = node->next)
+  {
+    if (node->type == XML_ELEMENT_NODE &&
+        !xmlStrcmp(node->name, BAD_CAST name))
+    {
+      return node;
+    }
+  }
+
+  return NULL;
+}
+
+static xmlNode *
+ensure_child_element(xmlNode *node, const char *name)
+{
+  xmlNode *child = child_element(node, name);
+
+  return child ? child : xmlNewChild(node, NULL, BAD_CAST name, NULL);
+}
+
+/* Same as replay_entry(), on the element of the item in doc */
+static void
+apply_entry(xmlDoc *doc, const JournalEntry *entry)
+{
+  xmlNode *node = bm_doc_find_id(doc, entry->id);
+  xmlNode *n;
+
+  if (!node)
+    return;
+
+  switch (entry->op)
+  {
+    case BM_JOURNAL_NAME:
+    {
+      gsize len = strlen(entry->val);
+      gchar *title;
+      xmlChar *enc;
+
+      /* names of bookmarks end in ".bm", titles do not */
+      if (!xmlStrcmp(node->name, BAD_CAST "bookmark") &&
+          g_str_has_suffix(entry->val, ".bm"))
+      {
+        len -= 3;
+      }
+
+      title = g_strndup(entry->val, len);
+      enc = xmlEncodeEntitiesReentrant(doc, BAD_CAST title);
+      xmlNodeSetContent(ensure_child_element(node, "title"), enc);
+      xmlFree(enc);
+      g_free(title);
+      break;
+    }
+    case BM_JOURNAL_URL:
+      xmlSetProp(node, BAD_CAST "href", BAD_CAST entry->val);
+      break;
+    case BM_JOURNAL_THUMBNAIL:
+      xmlSetProp(node, BAD_CAST "thumbnail", BAD_CAST entry->val);
+      break;
+    case BM_JOURNAL_VISIT_COUNT:
+    case BM_JOURNAL_TIME_VISITED:
+    case BM_JOURNAL_TIME_ADDED:
+      n = get_node_by_tag(node->children, field_ops[entry->op]);
+
+      /* items saved without metadata get it from their first change */
+      if (!n)
+      {
+        n = ensure_child_element(ensure_child_element(node, "info"),
+                                 "metadata");
+        n = xmlNewChild(n, NULL, BAD_CAST field_ops[entry->op], NULL);
+      }
+
+      xmlNodeSetContent(n, BAD_CAST entry->val);
+      break;
+    default:
+      xmlUnlinkNode(node);
+      bm_bind_forget(node);
+      xmlFreeNodeList(node);
+      break;
+  }
+}
+
+gsize
+bm_journal_apply(xmlDoc *doc, gchar *contents, gsize len, gsize offset)
+{
+  JournalEntry entry;
+  gchar *end = contents + len;
+  gchar *p;
+
+  /* a torn last line may still be completed, it is not counted */
+  while (end > contents && end[-1] != '\n')
+    end--;
+
+  /* not an offset into this journal */
+  if (offset > len)
+    offset = 0;
+
+  for (p = contents + offset; p < end && (p = next_entry(p, end, &entry)); )
+  {
+    apply_entry(doc, &entry);
+    g_free(entry.val);
+  }
+
+  return MAX((gsize)(end - contents), offset);
+}
+
+BookmarkJournal *
+bookmark_journal_open(const gchar *file_name)
+{
+  BookmarkJournal *journal;
+  struct stat st;
+  int fd;
+
+  CHECK_PARAM(!file_name, "\nInvalid Input Parameter", return NULL);
+
+  journal = g_new0(BookmarkJournal, 1);
+  journal->file_name = g_strdup(file_name);
+  journal->journal_name = journal_name_for(file_name);
+
+  /* read to find a line cut off by a crash at its end */
+  fd = open(journal->journal_name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+            0644);
+
+  if (fd == -1 || fstat(fd, &st))
+  {
+    if (fd != -1)
+      close(fd);
+
+    g_free(journal->journal_name);
+    g_free(journal->file_name);
+    g_free(journal);
+
+    return NULL;
+  }
+
+  journal->fd = fd;
+  journal->size = st.st_size;
+  g_mutex_init(&journal->lock);
+
+  return journal;
+}
+
+void
+bookmark_journal_close(BookmarkJournal *journal)
+{
+  if (!journal)
+    return;
+
+  close(journal->fd);
+  g_mutex_clear(&journal->lock);
+  g_free(journal->journal_name);
+  g_free(journal->file_name);
+  g_free(journal);
+}
+
+/* Called with the lock held */
+static gboolean
+journal_compact(BookmarkJournal *journal)
+{
+  BookmarkLock *lock;
+  xmlDoc *doc;
+  gboolean rv;
+
+  /* appended to by other journals of the file too */
+  if (!bm_journal_pending(journal->file_name))
+  {
+    journal->size = 0;
+    return TRUE;
+  }
+
+  /* appends to the journal from other processes wait for it to be emptied,
+   * the file is read and written under the same lock */
+  if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &lock))
+    return FALSE;
+
+  /* opened with the journal applied, the save empties it */
+  doc = bm_doc_open(journal->file_name, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
+  rv = doc && bm_doc_save(doc, journal->file_name);
+
+  if (rv)
+    journal->size = 0;
+
+  bookmark_lock_release(lock);
+
+  if (doc)
+    bm_doc_free(doc);
+
+  return rv;
+}
+
+/* TRUE if the journal ends in a line cut off by a crash */
+static gboolean
+journal_torn(BookmarkJournal *journal)
+{
+  struct stat st;
+  gchar last;
+
+  return !fstat(journal->fd, &st) && st.st_size > 0 &&
+      pread(journal->fd, &last, 1, st.st_size - 1) == 1 && last != '\n';
+}
+
+/* Cuts the journal after its last complete line, with the lock held
+ * exclusively, as appends under the shared lock go after the cut */
+static void
+journal_cut_torn(BookmarkJournal *journal)
+{
+  gchar *contents;
+  gsize len;
+
+  contents = bm_journal_read(journal->file_name, &len, NULL);
+
+  if (!contents)
+    return;
+
+  while (len && contents[len - 1] != '\n')
+    len--;
+
+  if (ftruncate(journal->fd, len))
+    g_warning("Could not cut %s: %s", journal->journal_name, g_strerror(errno));
+
+  g_free(contents);
+}
+
+/* Appends the line of a change to lines, FALSE if bm_item has no id */
+static gboolean
+journal_line(GString *lines, guint op, const BookmarkItem *bm_item,
+             const gchar *val)
+{
+  /* without an id the item can not be found again */
+  if (!bm_item->id || !bm_item->parent)
+    return FALSE;
+
+  g_string_append(lines, op == OP_REMOVE ? "remove" : field_ops[op]);
+  g_string_append_c(lines, ' ');
+  g_string_append(lines, bm_item->id);
+
+  if (val)
+  {
+    gchar *escaped = g_strescape(val, NULL);
+
+    g_string_append_c(lines, ' ');
+    g_string_append(lines, escaped);
+    g_free(escaped);
+  }
+
+  g_string_append_c(lines, '\n');
+
+  return TRUE;
+}
+
+gboolean
+bm_journal_line(GString *lines, BookmarkJournalField field,
+                const BookmarkItem *bm_item, const gchar *val)
+{
+  return journal_line(lines, field, bm_item, val);
+}
+
+gboolean
+bm_journal_append(BookmarkJournal *journal, const GString *lines)
+{
+  BookmarkLock *lock;
+  gsize done = 0;
+  gboolean rv;
+  struct stat st;
+
+  g_mutex_lock(&journal->lock);
+
+  /* not while a compaction reads and empties the journal */
+  if (!bm_lock_files(BM_LOCK_SHARED, &lock))
+  {
+    g_mutex_unlock(&journal->lock);
+    return FALSE;
+  }
+
+  if (journal_torn(journal))
+  {
+    bookmark_lock_release(lock);
+
+    if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &lock))
+    {
+      g_mutex_unlock(&journal->lock);
+      return FALSE;
+    }
+
+    /* looked at again, someone else may have cut it in between */
+    if (journal_torn(journal))
+      journal_cut_torn(journal);
+  }
+
+  /* emptied by saves of the file since, size counts from there */
+  rv = !fstat(journal->fd, &st);
+
+  while (rv && done < lines->len)
+  {
+    gssize n = write(journal->fd, lines->str + done, lines->len - done);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      rv = FALSE;
+      break;
+    }
+
+    done += n;
+  }
+
+  if (rv)
+  {
+    journal->size = st.st_size + done;
+    rv = !fdatasync(journal->fd);
+  }
+
+  /* the compaction takes the lock exclusively */
+  bookmark_lock_release(lock);
+
+  if (rv && journal->size > BM_JOURNAL_COMPACT_SIZE)
+    journal_compact(journal);
+
+  g_mutex_unlock(&journal->lock);
+
+  return rv;
+}
+
+static gboolean
+journal_append(BookmarkJournal *journal, guint op, const BookmarkItem *bm_item,
+               const gchar *val)
+{
+  GString *line = g_string_new(NULL);
+  gboolean rv;
+
+  rv = journal_line(line, op, bm_item, val) &&
+      bm_journal_append(journal, line);
+  g_string_free(line, TRUE);
+
+  return rv;
+}
+
+gboolean
+bookmark_journal_set(BookmarkJournal *journal, BookmarkItem *bm_item,
+                     BookmarkJournalField field, const gchar *val)
+{
+  CHECK_PARAM(!journal || !bm_item || !val || field >= OP_REMOVE,
+              "\nInvalid Input Parameter", return FALSE);
+
+  return journal_append(journal, field, bm_item, val);
+}
+
+gboolean
+bookmark_journal_remove(BookmarkJournal *journal, BookmarkItem *bm_item)
+{
+  CHECK_PARAM(!journal || !bm_item, "\nInvalid Input Parameter",
+              return FALSE);
+
+  return journal_append(journal, OP_REMOVE, bm_item, NULL);
+}
+
+gboolean
+bookmark_journal_compact(BookmarkJournal *journal)
+{
+  gboolean rv;
+
+  CHECK_PARAM(!journal, "\nInvalid Input Parameter", return FALSE);
+
+  g_mutex_lock(&journal->lock);
+  rv = journal_compact(journal);
+  g_mutex_unlock(&journal->lock);
+
+  return rv;
+}
@@ -0,0 +1,610 @@
+#include "bookmark_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  /* NULL unless the items come from an arena */
+  BookmarkTree *tree;
+  BookmarkLoadFlags flags;
+  BookmarkFieldMask fields;
+} BmLoader;
+
+/* Which field the text of the element being read belongs to */
+typedef enum
+{
+  TEXT_NONE,
+  TEXT_TITLE,
+  TEXT_TIME_VISITED,
+  TEXT_TIME_ADDED,
+  TEXT_OPERATOR_BOOKMARK,
+  TEXT_DELETED,
+  TEXT_VISIT_COUNT
+} TextTarget;
+
+static inline gboolean
+reader_name_is(xmlTextReaderPtr reader, const char *name)
+{
+  return !xmlStrcmp(xmlTextReaderConstLocalName(reader), BAD_CAST name);
+}
+
+static gchar *
+reader_get_attribute(xmlTextReaderPtr reader, BookmarkTree *tree,
+                     const char *attr)
+{
+  xmlChar *xs = xmlTextReaderGetAttribute(reader, BAD_CAST attr);
+  gchar *rv = NULL;
+
+  if (xs)
+  {
+    rv = bm_tree_strdup(tree, (const gchar *)xs);
+    xmlFree(xs);
+  }
+
+  return rv;
+}
+
+static TextTarget
+metadata_target(xmlTextReaderPtr reader)
+{
+  if (reader_name_is(reader, "time_visited"))
+    return TEXT_TIME_VISITED;
+  else if (reader_name_is(reader, "time_added"))
+    return TEXT_TIME_ADDED;
+  else if (reader_name_is(reader, "operator_bookmark"))
+    return TEXT_OPERATOR_BOOKMARK;
+  else if (reader_name_is(reader, "deleted"))
+    return TEXT_DELETED;
+  else if (reader_name_is(reader, "visit_count"))
+    return TEXT_VISIT_COUNT;
+
+  return TEXT_NONE;
+}
+
+static void
+assign_metadata(BookmarkItem *bm_item, TextTarget target, const char *s)
+{
+  long int val = s ? strtol(s, NULL, 10) : 0;
+
+  switch (target)
+  {
+    case TEXT_TIME_VISITED:
+      bm_item->time_last_visited = val;
+      break;
+    case TEXT_TIME_ADDED:
+      bm_item->time_added = val;
+      break;
+    case TEXT_OPERATOR_BOOKMARK:
+      bm_item->isOperatorBookmark = val;
+      break;
+    case TEXT_DELETED:
+      bm_item->isDeleted = val;
+      break;
+    case TEXT_VISIT_COUNT:
+      bm_item->visit_count = val;
+      break;
+    default:
+      break;
+  }
+}
+
+static void
+add_bookmark_suffix(BmLoader *loader, BookmarkItem *bm_bookmark)
+{
+  gchar *name = bm_bookmark->name;
+
+  if (!(loader->fields & BM_FIELD_NAMES))
+    return;
+
+  bm_bookmark->name = bm_tree_strconcat(loader->tree, name ? name : "(null)",
+                                        ".bm");
+  bm_tree_strfree(loader->tree, name);
+}
+
+static void
+append_title(BookmarkTree *tree, BookmarkItem *bm_item, const char *s)
+{
+  gchar *name = bm_item->name;
+
+  if (!s)
+    return;
+
+  if (name && *name)
+    bm_item->name = bm_tree_strconcat(tree, name, s);
+  else
+    bm_item->name = bm_tree_strdup(tree, s);
+
+  bm_tree_strfree(tree, name);
+}
+
+/*
+ * Reads the children of the <xbel>, <folder> or <bookmark> element the reader
+ * is positioned on into bm_item and leaves the reader on its end tag. Only
+ * direct children are looked at, the same way the former DOM walk did:
+ * <title>, the first <metadata> of every <info>, and nested <bookmark> and
+ * <folder> elements.
+ *
+ * Returns the last xmlTextReaderRead() result, 1 if the element was read
+ * completely.
+ */
+static int
+read_bookmark_item(xmlTextReaderPtr reader, BmLoader *loader,
+                   BookmarkItem *bm_item, int depth)
+{
+  BookmarkTree *tree = loader->tree;
+  BookmarkFieldMask fields = loader->fields;
+  gboolean want_list = !(loader->flags & BM_LOAD_NO_CHILD_LISTS);
+  TextTarget target = TEXT_NONE;
+  int text_depth = 0;
+  gboolean in_info = FALSE;
+  gboolean in_metadata = FALSE;
+  gboolean seen_metadata = FALSE;
+  GSList *children = NULL;
+  int ret = 1;
+
+  if (fields & BM_FIELD_IDS)
+    bm_item->id = reader_get_attribute(reader, tree, "id");
+
+  if (xmlTextReaderIsEmptyElement(reader))
+    return ret;
+
+  while ((ret = xmlTextReaderRead(reader)) == 1)
+  {
+    int type = xmlTextReaderNodeType(reader);
+    int d = xmlTextReaderDepth(reader);
+
+    if (type == XML_READER_TYPE_END_ELEMENT)
+    {
+      if (d == depth)
+        break;
+
+      if (d <= text_depth)
+        target = TEXT_NONE;
+
+      continue;
+    }
+
+    if (type == XML_READER_TYPE_TEXT ||
+        type == XML_READER_TYPE_CDATA ||
+        type == XML_READER_TYPE_WHITESPACE ||
+        type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE)
+    {
+      if (target == TEXT_NONE || d <= text_depth)
+        continue;
+
+      if (target == TEXT_TITLE)
+        append_title(tree, bm_item,
+                     (const char *)xmlTextReaderConstValue(reader));
+      else
+      {
+        assign_metadata(bm_item, target,
+                        (const char *)xmlTextReaderConstValue(reader));
+        target = TEXT_NONE;
+      }
+
+      continue;
+    }
+
+    if (type != XML_READER_TYPE_ELEMENT)
+      continue;
+
+    if (target != TEXT_NONE && d > text_depth)
+      continue;
+
+    target = TEXT_NONE;
+
+    if (d == depth + 1)
+    {
+      in_info = FALSE;
+      in_metadata = FALSE;
+
+      if (reader_name_is(reader, "title"))
+      {
+        if (!(fields & BM_FIELD_NAMES))
+          continue;
+
+        bm_tree_strfree(tree, bm_item->name);
+        bm_item->name = bm_tree_strdup(tree, "");
+        target = TEXT_TITLE;
+        text_depth = d;
+      }
+      else if (reader_name_is(reader, "info"))
+      {
+        in_info = fields & BM_FIELD_METADATA;
+        seen_metadata = FALSE;
+      }
+      else if (reader_name_is(reader, "bookmark"))
+      {
+        BookmarkItem *bm_bookmark = bm_tree_new_item(tree);
+
+        if (fields & BM_FIELD_URLS)
+          bm_bookmark->url = reader_get_attribute(reader, tree, "href");
+
+        if (fields & BM_FIELD_ASSETS)
+        {
+          bm_bookmark->thumbnail_file =
+              reader_get_attribute(reader, tree, "thumbnail");
+          bm_bookmark->favicon_file =
+              reader_get_attribute(reader, tree, "favicon");
+        }
+
+        ret = read_bookmark_item(reader, loader, bm_bookmark, d);
+
+        bm_item_link_child(bm_item, bm_bookmark);
+
+        if (want_list)
+          children = bm_tree_slist_prepend(tree, children, bm_bookmark);
+
+        /* Folders show the highest visit count of the bookmarks they hold
+         * directly */
+        if (bm_item->visit_count < bm_bookmark->visit_count)
+          bm_item->visit_count = bm_bookmark->visit_count;
+
+        add_bookmark_suffix(loader, bm_bookmark);
+
+        if (ret != 1)
+          break;
+      }
+      else if (reader_name_is(reader, "folder"))
+      {
+        BookmarkItem *bm_folder = bm_tree_new_item(tree);
+
+        ret = read_bookmark_item(reader, loader, bm_folder, d);
+
+        bm_folder->isFolder = TRUE;
+        bm_item_link_child(bm_item, bm_folder);
+
+        if (want_list)
+          children = bm_tree_slist_prepend(tree, children, bm_folder);
+
+        if (ret != 1)
+          break;
+      }
+    }
+    else if (d == depth + 2 && in_info)
+    {
+      if (reader_name_is(reader, "metadata"))
+      {
+        in_metadata = !seen_metadata;
+        seen_metadata = TRUE;
+      }
+      else
+        in_metadata = FALSE;
+    }
+    else if (d == depth + 3 && in_metadata)
+    {
+      target = metadata_target(reader);
+      text_depth = d;
+
+      /* an element without text still counts, as strtol("") */
+      assign_metadata(bm_item, target, NULL);
+    }
+  }
+
+  bm_item->list = g_slist_reverse(children);
+
+  return ret;
+}
+
+BookmarkItem *
+bm_loader_read_reader(xmlTextReaderPtr reader, BookmarkTree *tree,
+                      BookmarkLoadFlags flags, BookmarkFieldMask fields)
+{
+  BmLoader loader = {tree, flags, fields};
+  BookmarkItem *bm_item = NULL;
+
+  while (xmlTextReaderRead(reader) == 1)
+  {
+    if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT)
+    {
+      bm_item = bm_tree_new_item(tree);
+      read_bookmark_item(reader, &loader, bm_item,
+                         xmlTextReaderDepth(reader));
+      break;
+    }
+  }
+
+  return bm_item;
+}
+
+BookmarkItem *
+bm_loader_read_file(const gchar *file_name, BookmarkLoadFlags flags,
+                    BookmarkFieldMask fields)
+{
+  xmlTextReaderPtr reader;
+  BookmarkTree *tree = NULL;
+  BookmarkItem *bm_item;
+
+  reader = xmlReaderForFile(file_name, NULL, XML_PARSE_RECOVER);
+
+  if (!reader)
+    return NULL;
+
+  if (flags & (BM_LOAD_ARENA | BM_LOAD_NO_CHILD_LISTS))
+    tree = bm_tree_new(flags);
+
+  bm_item = bm_loader_read_reader(reader, tree, flags, fields);
+
+  xmlFreeTextReader(reader);
+
+  if (tree)
+  {
+    if (bm_item)
+      tree->root = bm_item;
+    else
+      bm_tree_free(tree);
+  }
+
+  return bm_item;
+}
+
+/* What read_bookmark_node() builds of an element */
+typedef enum
+{
+  /* title and info of the element itself, and the visit count its direct
+   * bookmarks give it */
+  NODE_HEADER = 1 << 0,
+  /* items for the child elements */
+  NODE_CHILDREN = 1 << 1
+} NodeParts;
+
+static inline gboolean
+node_name_is(const xmlNode *node, const char *name)
+{
+  return !xmlStrcmp(node->name, BAD_CAST name);
+}
+
+static gchar *
+node_get_attribute(xmlNode *node, BookmarkTree *tree, const char *attr)
+{
+  xmlChar *xs = xmlGetProp(node, BAD_CAST attr);
+  gchar *rv = NULL;
+
+  if (xs)
+  {
+    rv = bm_tree_strdup(tree, (const gchar *)xs);
+    xmlFree(xs);
+  }
+
+  return rv;
+}
+
+static void
+node_read_metadata(BookmarkItem *bm_item, xmlNode *info)
+{
+  xmlNode *n;
+
+  for (n = info->children; n; n = n->next)
+  {
+    if (n->type == XML_ELEMENT_NODE && node_name_is(n, "metadata"))
+      break;
+  }
+
+  if (!n)
+    return;
+
+  for (n = n->children; n; n = n->next)
+  {
+    TextTarget target = TEXT_NONE;
+    xmlChar *xs;
+
+    if (n->type != XML_ELEMENT_NODE)
+      continue;
+
+    if (node_name_is(n, "time_visited"))
+      target = TEXT_TIME_VISITED;
+    else if (node_name_is(n, "time_added"))
+      target = TEXT_TIME_ADDED;
+    else if (node_name_is(n, "operator_bookmark"))
+      target = TEXT_OPERATOR_BOOKMARK;
+    else if (node_name_is(n, "deleted"))
+      target = TEXT_DELETED;
+    else if (node_name_is(n, "visit_count"))
+      target = TEXT_VISIT_COUNT;
+    else
+      continue;
+
+    xs = xmlNodeGetContent(n);
+    assign_metadata(bm_item, target, (const char *)xs);
+    xmlFree(xs);
+  }
+}
+
+/* Visit count of a <bookmark> element, without building an item for it */
+static guint
+node_visit_count(xmlNode *node)
+{
+  BookmarkItem bm_item;
+
+  memset(&bm_item, 0, sizeof(bm_item));
+
+  for (node = node->children; node; node = node->next)
+  {
+    if (node->type == XML_ELEMENT_NODE && node_name_is(node, "info"))
+      node_read_metadata(&bm_item, node);
+  }
+
+  return bm_item.visit_count;
+}
+
+/*
+ * DOM counterpart of read_bookmark_item(). With BM_LOAD_LAZY folders below
+ * node only get their header, the element they come from is remembered in
+ * the tree until bm_loader_expand() builds their children.
+ */
+static void
+read_bookmark_node(BmLoader *loader, xmlNode *node, BookmarkItem *bm_item,
+                   NodeParts parts)
+{
+  BookmarkTree *tree = loader->tree;
+  BookmarkFieldMask fields = loader->fields;
+  gboolean lazy = loader->flags & BM_LOAD_LAZY;
+  gboolean want_list = !(loader->flags & BM_LOAD_NO_CHILD_LISTS);
+  GSList *children = NULL;
+
+  if ((parts & NODE_HEADER) && (fields & BM_FIELD_IDS))
+    bm_item->id = node_get_attribute(node, tree, "id");
+
+  for (node = node->children; node; node = node->next)
+  {
+    if (node->type != XML_ELEMENT_NODE)
+      continue;
+
+    if (node_name_is(node, "title"))
+    {
+      if ((parts & NODE_HEADER) && (fields & BM_FIELD_NAMES))
+      {
+        xmlChar *xs = xmlNodeGetContent(node);
+
+        bm_tree_strfree(tree, bm_item->name);
+        bm_item->name = bm_tree_strdup(tree, (const gchar *)xs);
+        xmlFree(xs);
+      }
+    }
+    else if (node_name_is(node, "info"))
+    {
+      if ((parts & NODE_HEADER) && (fields & BM_FIELD_METADATA))
+        node_read_metadata(bm_item, node);
+    }
+    else if (node_name_is(node, "bookmark"))
+    {
+      BookmarkItem *bm_bookmark;
+
+      if (!(parts & NODE_CHILDREN))
+      {
+        guint visit_count;
+
+        if (!(fields & BM_FIELD_METADATA))
+          continue;
+
+        visit_count = node_visit_count(node);
+
+        if (bm_item->visit_count < visit_count)
+          bm_item->visit_count = visit_count;
+
+        continue;
+      }
+
+      bm_bookmark = bm_tree_new_item(tree);
+
+      if (fields & BM_FIELD_URLS)
+        bm_bookmark->url = node_get_attribute(node, tree, "href");
+
+      if (fields & BM_FIELD_ASSETS)
+      {
+        bm_bookmark->thumbnail_file =
+            node_get_attribute(node, tree, "thumbnail");
+        bm_bookmark->favicon_file = node_get_attribute(node, tree, "favicon");
+      }
+
+      read_bookmark_node(loader, node, bm_bookmark,
+                         NODE_HEADER | NODE_CHILDREN);
+
+      bm_item_link_child(bm_item, bm_bookmark);
+
+      if (want_list)
+        children = bm_tree_slist_prepend(tree, children, bm_bookmark);
+
+      if ((parts & NODE_HEADER) &&
+          bm_item->visit_count < bm_bookmark->visit_count)
+      {
+        bm_item->visit_count = bm_bookmark->visit_count;
+      }
+
+      add_bookmark_suffix(loader, bm_bookmark);
+    }
+    else if (node_name_is(node, "folder"))
+    {
+      BookmarkItem *bm_folder;
+
+      if (!(parts & NODE_CHILDREN))
+        continue;
+
+      bm_folder = bm_tree_new_item(tree);
+
+      if (lazy)
+      {
+        read_bookmark_node(loader, node, bm_folder, NODE_HEADER);
+        g_hash_table_insert(tree->lazy_nodes, bm_folder, node);
+      }
+      else
+        read_bookmark_node(loader, node, bm_folder,
+                           NODE_HEADER | NODE_CHILDREN);
+
+      bm_folder->isFolder = TRUE;
+      bm_item_link_child(bm_item, bm_folder);
+
+      if (want_list)
+        children = bm_tree_slist_prepend(tree, children, bm_folder);
+    }
+  }
+
+  if (parts & NODE_CHILDREN)
+    bm_item->list = g_slist_reverse(children);
+}
+
+BookmarkItem *
+bm_loader_read_file_lazy(const gchar *file_name, BookmarkLoadFlags flags,
+                         BookmarkFieldMask fields)
+{
+  BmLoader loader = {NULL, flags | BM_LOAD_LAZY, fields};
+  BookmarkItem *bm_item;
+  xmlDoc *doc;
+  xmlNode *node;
+
+  doc = xmlReadFile(file_name, NULL, XML_PARSE_RECOVER | XML_PARSE_COMPACT);
+
+  if (!doc)
+    return NULL;
+
+  node = xmlDocGetRootElement(doc);
+
+  if (!node)
+  {
+    xmlFreeDoc(doc);
+    return NULL;
+  }
+
+  loader.tree = bm_tree_new(loader.flags);
+  loader.tree->fields = fields;
+  loader.tree->doc = doc;
+  loader.tree->lazy_nodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  bm_item = bm_tree_new_item(loader.tree);
+  read_bookmark_node(&loader, node, bm_item, NODE_HEADER | NODE_CHILDREN);
+  loader.tree->root = bm_item;
+
+  bm_tree_lazy_done(loader.tree);
+
+  return bm_item;
+}
+
+gboolean
+bm_loader_expand(BookmarkItem *folder)
+{
+  BookmarkTree *tree = folder->tree;
+  BmLoader loader;
+  xmlNode *node;
+
+  if (!tree || !tree->lazy_nodes)
+    return FALSE;
+
+  node = g_hash_table_lookup(tree->lazy_nodes, folder);
+
+  if (!node)
+    return FALSE;
+
+  g_hash_table_remove(tree->lazy_nodes, folder);
+
+  loader.tree = tree;
+  loader.flags = tree->flags;
+  loader.fields = tree->fields;
+  read_bookmark_node(&loader, node, folder, NODE_CHILDREN);
+  bm_stats_refresh(folder);
+  bm_item_index_add(folder);
+
+  bm_tree_lazy_done(tree);
+
+  return TRUE;
+}
@@ -0,0 +1,305 @@
+#include "bookmark_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+/*
+ * Locks on a lock file in ~/.bookmarks, flock()ed so they are held by open
+ * file and not by process: every lock opens the file itself, so threads of
+ * one process exclude each other just as processes do, and a process that
+ * dies lets go of its locks. Readers share the lock, writers hold it alone.
+ * The files are replaced by rename(), so readers never see a partly written
+ * file anyway, the lock keeps a file and its journal together and writers
+ * from overwriting each other.
+ */
+
+struct _BookmarkLock
+{
+  gchar *path;
+  int fd;
+  /* thread holding it exclusively, NULL for a shared lock */
+  GThread *owner;
+  /* times the thread holding it exclusively took it again */
+  guint depth;
+};
+
+/* The locks held exclusively by the current thread, by path. flock() can not
+ * be taken twice through different files, so that thread gets such a lock
+ * back instead, for any mode. */
+static GPrivate exclusive_locks =
+    G_PRIVATE_INIT((GDestroyNotify)g_hash_table_unref);
+
+static BookmarkLockStats lock_stats[2];
+static GMutex lock_stats_lock;
+
+/* Microseconds to sleep between tries, doubled up to the maximum */
+#define LOCK_POLL_MIN 1000
+#define LOCK_POLL_MAX 50000
+
+static void
+record_stats(BookmarkLockMode mode, gboolean taken, gint64 wait)
+{
+  BookmarkLockStats *stats = &lock_stats[mode];
+
+  g_mutex_lock(&lock_stats_lock);
+
+  if (taken)
+    stats->acquired++;
+  else
+    stats->timeouts++;
+
+  if (wait >= 0)
+  {
+    stats->contended++;
+    stats->wait_usec += wait;
+
+    if ((guint64)wait > stats->max_wait_usec)
+      stats->max_wait_usec = wait;
+  }
+
+  g_mutex_unlock(&lock_stats_lock);
+}
+
+static gboolean
+flock_retry(int fd, int operation)
+{
+  while (flock(fd, operation))
+  {
+    if (errno != EINTR)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Waits up to timeout ms for the lock on fd, forever if negative */
+static gboolean
+flock_wait(int fd, int operation, gint timeout)
+{
+  gint64 deadline;
+  gulong poll = LOCK_POLL_MIN;
+
+  if (timeout < 0)
+    return flock_retry(fd, operation);
+
+  deadline = g_get_monotonic_time() + (gint64)timeout * 1000;
+
+  while (TRUE)
+  {
+    gint64 left = deadline - g_get_monotonic_time();
+
+    if (left <= 0)
+      return FALSE;
+
+    g_usleep(MIN((gint64)poll, left));
+    poll = MIN(poll * 2, LOCK_POLL_MAX);
+
+    if (flock_retry(fd, operation | LOCK_NB))
+      return TRUE;
+
+    if (errno != EWOULDBLOCK)
+      return FALSE;
+  }
+}
+
+/* NULL if the lock was not free in time, *no_file set if there is no lock
+ * file to take at all */
+static BookmarkLock *
+lock_acquire(const gchar *path, BookmarkLockMode mode, gint timeout,
+             gboolean *no_file)
+{
+  int operation = mode == BM_LOCK_EXCLUSIVE ? LOCK_EX : LOCK_SH;
+  GHashTable *held = g_private_get(&exclusive_locks);
+  BookmarkLock *lock = held ? g_hash_table_lookup(held, path) : NULL;
+  gint64 start;
+  gboolean taken;
+  int fd;
+
+  *no_file = FALSE;
+
+  if (lock)
+  {
+    lock->depth++;
+    return lock;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  if (fd == -1)
+  {
+    *no_file = TRUE;
+    return NULL;
+  }
+
+  if (flock_retry(fd, operation | LOCK_NB))
+  {
+    record_stats(mode, TRUE, -1);
+  }
+  else if (errno != EWOULDBLOCK)
+  {
+    close(fd);
+    *no_file = TRUE;
+    return NULL;
+  }
+  else
+  {
+    start = g_get_monotonic_time();
+    taken = timeout && flock_wait(fd, operation, timeout);
+    record_stats(mode, taken, g_get_monotonic_time() - start);
+
+    if (!taken)
+    {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  lock = g_new0(BookmarkLock, 1);
+  lock->path = g_strdup(path);
+  lock->fd = fd;
+
+  if (mode == BM_LOCK_EXCLUSIVE)
+  {
+    if (!held)
+    {
+      held = g_hash_table_new(g_str_hash, g_str_equal);
+      g_private_set(&exclusive_locks, held);
+    }
+
+    lock->owner = g_thread_self();
+    g_hash_table_insert(held, lock->path, lock);
+  }
+
+  return lock;
+}
+
+BookmarkLock *
+bookmark_lock_acquire(const gchar *lock_file_name, BookmarkLockMode mode,
+                      gint timeout)
+{
+  BookmarkLock *lock;
+  gboolean no_file;
+  gchar *path;
+
+  CHECK_PARAM(!lock_file_name || mode > BM_LOCK_EXCLUSIVE,
+              "\nInvalid Input Parameter", return NULL);
+
+  path = file_path_with_home_dir(lock_file_name);
+  lock = lock_acquire(path, mode, timeout, &no_file);
+  g_free(path);
+
+  return lock;
+}
+
+void
+bookmark_lock_release(BookmarkLock *lock)
+{
+  if (!lock)
+    return;
+
+  /* it is in the table of that thread */
+  CHECK_PARAM(lock->owner && lock->owner != g_thread_self(),
+              "\nLock held by another thread", return);
+
+  if (lock->depth)
+  {
+    lock->depth--;
+    return;
+  }
+
+  if (lock->owner)
+    g_hash_table_remove(g_private_get(&exclusive_locks), lock->path);
+
+  /* closing the file drops the lock */
+  close(lock->fd);
+  g_free(lock->path);
+  g_free(lock);
+}
+
+gboolean
+bm_lock_files_timeout(BookmarkLockMode mode, gint timeout,
+                      BookmarkLock **lock)
+{
+  gboolean no_file;
+  gchar *path;
+
+  path = file_path_with_home_dir(BOOKMARK_FLOCK_PATH);
+  *lock = lock_acquire(path, mode, timeout, &no_file);
+  g_free(path);
+
+  return *lock || no_file;
+}
+
+gboolean
+bm_lock_files(BookmarkLockMode mode, BookmarkLock **lock)
+{
+  return bm_lock_files_timeout(mode, BM_LOCK_TIMEOUT, lock);
+}
+
+void
+bookmark_lock_get_stats(BookmarkLockMode mode, BookmarkLockStats *stats)
+{
+  CHECK_PARAM(!stats || mode > BM_LOCK_EXCLUSIVE, "\nInvalid Input Parameter",
+              return);
+
+  g_mutex_lock(&lock_stats_lock);
+  *stats = lock_stats[mode];
+  g_mutex_unlock(&lock_stats_lock);
+}
+
+void
+bookmark_lock_reset_stats(void)
+{
+  g_mutex_lock(&lock_stats_lock);
+  memset(lock_stats, 0, sizeof(lock_stats));
+  g_mutex_unlock(&lock_stats_lock);
+}
+
+/* The old lock: a file that exists while a writer holds it. Nothing waits
+ * for it or is kept out by it, so the bookmark functions lock
+ * BOOKMARK_FLOCK_PATH instead. */
+gboolean
+set_lock(gchar *lock_file_name)
+{
+  gchar *path;
+  FILE *fp;
+
+  CHECK_PARAM(!lock_file_name, "\nInvalid Input Parameter", return FALSE);
+
+  path = file_path_with_home_dir(lock_file_name);
+  fp = fopen(path, "w");
+  g_free(path);
+
+  if (fp)
+  {
+    fclose(fp);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+gboolean
+del_lock(gchar *lock_file_name)
+{
+  gchar *path;
+
+  CHECK_PARAM(!lock_file_name, "\nInvalid Input Parameter", return FALSE);
+
+  path = file_path_with_home_dir(lock_file_name);
+
+  if (access(path, R_OK))
+  {
+    g_free(path);
+    return FALSE;
+  }
+
+  unlink(path);
+  g_free(path);
+
+  return TRUE;
+}
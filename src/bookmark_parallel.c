@@ -0,0 +1,458 @@
+#include "bookmark_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Parallel loading of large files. The file is read into memory and every
+ * top level <folder> element is cut out of it and parsed on a thread pool,
+ * each one by its own xmlTextReader into its own arena. Meanwhile the rest of
+ * the document, with an empty <folder/> in place of every cut out one, is
+ * parsed on the calling thread. The folders are spliced into the root in
+ * document order at the end.
+ *
+ * Anything the cut could change the meaning of - other encodings, an
+ * internal DTD subset, namespace prefixes, parse errors - makes the load fall
+ * back to bm_loader_read_file().
+ */
+
+/* Files smaller than this are not worth the threads */
+#define PARALLEL_MIN_SIZE (256 * 1024)
+
+typedef struct
+{
+  const gchar *buf;
+  gsize start;
+  gsize end;
+  BookmarkLoadFlags flags;
+  BookmarkFieldMask fields;
+  /* tree the items end up in, NULL for heap items */
+  BookmarkTree *owner;
+  /* arena of this job until it is merged into owner */
+  BookmarkTree *tree;
+  BookmarkItem *bm_item;
+  gboolean failed;
+} ParseJob;
+
+static const gchar *
+skip_past(const gchar *p, const gchar *end, const gchar *s)
+{
+  p = g_strstr_len(p, end - p, s);
+
+  return p ? p + strlen(s) : NULL;
+}
+
+/* Returns the '>' closing the tag starting at p, skipping quoted values */
+static const gchar *
+tag_end(const gchar *p, const gchar *end)
+{
+  gchar quote = 0;
+
+  for (; p < end; p++)
+  {
+    if (quote)
+    {
+      if (*p == quote)
+        quote = 0;
+    }
+    else if (*p == '"' || *p == '\'')
+      quote = *p;
+    else if (*p == '>')
+      return p;
+  }
+
+  return NULL;
+}
+
+static gboolean
+utf8_declaration(const gchar *p, const gchar *decl_end)
+{
+  const gchar *enc = g_strstr_len(p, decl_end - p, "encoding");
+
+  if (!enc)
+    return TRUE;
+
+  enc = strpbrk(enc, "\"'");
+
+  return enc && enc < decl_end &&
+      (!g_ascii_strncasecmp(enc + 1, "utf-8", 5) ||
+       !g_ascii_strncasecmp(enc + 1, "utf8", 4));
+}
+
+static void
+add_job(GArray *jobs, const gchar *buf, const gchar *start, const gchar *end)
+{
+  ParseJob job;
+
+  memset(&job, 0, sizeof(job));
+  job.buf = buf;
+  job.start = start - buf;
+  job.end = end - buf;
+  g_array_append_val(jobs, job);
+}
+
+/* Finds the top level <folder> elements of the document in buf */
+static gboolean
+scan_folders(const gchar *buf, gsize len, GArray *jobs)
+{
+  const gchar *p = buf;
+  const gchar *end = buf + len;
+  const gchar *folder = NULL;
+  int depth = 0;
+
+  if (len >= 2 && ((guchar)buf[0] == 0xfe || (guchar)buf[0] == 0xff))
+    return FALSE;
+
+  while ((p = memchr(p, '<', end - p)))
+  {
+    const gchar *name = p + 1;
+    const gchar *q;
+
+    if (name >= end)
+      return FALSE;
+
+    if (*name == '?')
+    {
+      q = skip_past(p, end, "?>");
+
+      if (!q || (!strncmp(name, "?xml ", 5) && !utf8_declaration(p, q)))
+        return FALSE;
+    }
+    else if (!strncmp(name, "!--", 3))
+      q = skip_past(p, end, "-->");
+    else if (!strncmp(name, "![CDATA[", 8))
+      q = skip_past(p, end, "]]>");
+    else if (*name == '!')
+    {
+      /* DOCTYPE, entities declared in it would not reach the folders */
+      q = tag_end(p, end);
+
+      if (!q || depth || memchr(p, '[', q - p))
+        return FALSE;
+
+      q++;
+    }
+    else if (*name == '/')
+    {
+      q = tag_end(p, end);
+
+      if (!q || --depth < 0)
+        return FALSE;
+
+      q++;
+
+      if (depth == 1 && folder)
+      {
+        add_job(jobs, buf, folder, q);
+        folder = NULL;
+      }
+    }
+    else
+    {
+      gsize name_len = strcspn(name, " \t\r\n/>");
+      gboolean empty;
+
+      q = tag_end(p, end);
+
+      if (!q)
+        return FALSE;
+
+      empty = q[-1] == '/';
+
+      if (!depth && g_strstr_len(p, q - p, "xmlns:"))
+        return FALSE;
+
+      if (depth == 1 && name_len == 6 && !strncmp(name, "folder", 6))
+      {
+        if (empty)
+          add_job(jobs, buf, p, q + 1);
+        else
+          folder = p;
+      }
+      else if (depth == 1 && memchr(name, ':', name_len))
+        return FALSE;
+
+      if (!empty)
+        depth++;
+
+      q++;
+    }
+
+    if (!q)
+      return FALSE;
+
+    p = q;
+  }
+
+  return !depth && jobs->len > 1;
+}
+
+static void
+count_errors(void *arg, const char *msg, xmlParserSeverities severity,
+             xmlTextReaderLocatorPtr locator)
+{
+  if (severity == XML_PARSER_SEVERITY_ERROR ||
+      severity == XML_PARSER_SEVERITY_VALIDITY_ERROR)
+  {
+    (*(int *)arg)++;
+  }
+}
+
+/* Parses buf with the reader loader, NULL if it was not well formed */
+static BookmarkItem *
+read_memory(const gchar *buf, gsize len, const gchar *url, BookmarkTree *tree,
+            BookmarkLoadFlags flags, BookmarkFieldMask fields)
+{
+  xmlTextReaderPtr reader;
+  BookmarkItem *bm_item;
+  int errors = 0;
+
+  reader = xmlReaderForMemory(buf, len, url, NULL, XML_PARSE_RECOVER);
+
+  if (!reader)
+    return NULL;
+
+  xmlTextReaderSetErrorHandler(reader, count_errors, &errors);
+  bm_item = bm_loader_read_reader(reader, tree, flags, fields);
+
+  /* errors behind the element count too */
+  while (xmlTextReaderRead(reader) == 1)
+    ;
+
+  xmlFreeTextReader(reader);
+
+  /* the items of an arena tree go with it */
+  if (errors && bm_item && (!tree || !tree->arena))
+  {
+    free_bookmark_item(bm_item);
+    bm_item = NULL;
+  }
+
+  return errors ? NULL : bm_item;
+}
+
+static void
+set_tree(BookmarkItem *bm_item, BookmarkTree *tree)
+{
+  BookmarkItem *child;
+
+  bm_item->tree = tree;
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    set_tree(child, tree);
+}
+
+static void
+parse_job(gpointer data, gpointer user_data)
+{
+  ParseJob *job = data;
+
+  if (job->owner && job->owner->arena)
+    job->tree = bm_tree_new(job->flags);
+
+  job->bm_item = read_memory(job->buf + job->start, job->end - job->start,
+                             NULL, job->tree, job->flags, job->fields);
+
+  if (!job->bm_item)
+  {
+    job->failed = TRUE;
+    return;
+  }
+
+  job->bm_item->isFolder = TRUE;
+
+  if (job->owner)
+    set_tree(job->bm_item, job->owner);
+}
+
+static int
+job_size_cmp(const void *a, const void *b)
+{
+  const ParseJob *ja = *(ParseJob * const *)a;
+  const ParseJob *jb = *(ParseJob * const *)b;
+  gsize la = ja->end - ja->start;
+  gsize lb = jb->end - jb->start;
+
+  return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+/* Puts the parsed folders in place of the empty ones in the skeleton */
+static gboolean
+splice_folders(BookmarkItem *root, GArray *jobs)
+{
+  BookmarkItem *prev = NULL;
+  BookmarkItem *child;
+  GSList *l = root->list;
+  guint i = 0;
+
+  for (child = root->first_child; child; child = child->next_sibling)
+  {
+    if (child->isFolder)
+    {
+      BookmarkItem *bm_folder;
+
+      if (i == jobs->len)
+        return FALSE;
+
+      bm_folder = g_array_index(jobs, ParseJob, i).bm_item;
+      g_array_index(jobs, ParseJob, i++).bm_item = NULL;
+
+      bm_folder->parent = root;
+      bm_folder->next_sibling = child->next_sibling;
+
+      if (prev)
+        prev->next_sibling = bm_folder;
+      else
+        root->first_child = bm_folder;
+
+      if (root->last_child == child)
+        root->last_child = bm_folder;
+
+      if (l)
+        l->data = bm_folder;
+
+      if (!root->tree || !root->tree->arena)
+        free_bookmark_item(child);
+
+      child = bm_folder;
+    }
+
+    prev = child;
+
+    if (l)
+      l = l->next;
+  }
+
+  return i == jobs->len;
+}
+
+static BookmarkItem *
+read_parallel(const gchar *file_name, const gchar *buf, gsize len,
+              BookmarkLoadFlags flags, BookmarkFieldMask fields)
+{
+  GArray *jobs = g_array_new(FALSE, FALSE, sizeof(ParseJob));
+  BookmarkTree *tree = NULL;
+  BookmarkItem *bm_item = NULL;
+  ParseJob **order;
+  GThreadPool *pool;
+  GString *skeleton;
+  gsize pos = 0;
+  gboolean ok;
+  guint i;
+
+  if (!scan_folders(buf, len, jobs))
+  {
+    g_array_free(jobs, TRUE);
+    return NULL;
+  }
+
+  if (flags & (BM_LOAD_ARENA | BM_LOAD_NO_CHILD_LISTS))
+    tree = bm_tree_new(flags);
+
+  /* biggest folders first, so that no thread is left with one at the end */
+  order = g_new(ParseJob *, jobs->len);
+
+  for (i = 0; i < jobs->len; i++)
+  {
+    ParseJob *job = &g_array_index(jobs, ParseJob, i);
+
+    job->flags = flags;
+    job->fields = fields;
+    job->owner = tree;
+    order[i] = job;
+  }
+
+  qsort(order, jobs->len, sizeof(*order), job_size_cmp);
+
+  /* the workers must not be the first to use libxml2 */
+  xmlInitParser();
+
+  pool = g_thread_pool_new(parse_job, NULL,
+                           MIN(g_get_num_processors(), jobs->len), FALSE,
+                           NULL);
+
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push(pool, order[i], NULL);
+
+  skeleton = g_string_sized_new(len / 16);
+
+  for (i = 0; i < jobs->len; i++)
+  {
+    ParseJob *job = &g_array_index(jobs, ParseJob, i);
+
+    g_string_append_len(skeleton, buf + pos, job->start - pos);
+    g_string_append(skeleton, "<folder/>");
+    pos = job->end;
+  }
+
+  g_string_append_len(skeleton, buf + pos, len - pos);
+
+  bm_item = read_memory(skeleton->str, skeleton->len, file_name, tree, flags,
+                        fields);
+  g_string_free(skeleton, TRUE);
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_free(order);
+
+  ok = bm_item != NULL;
+
+  for (i = 0; i < jobs->len; i++)
+    ok = ok && !g_array_index(jobs, ParseJob, i).failed;
+
+  if (ok)
+    ok = splice_folders(bm_item, jobs);
+
+  for (i = 0; i < jobs->len; i++)
+  {
+    ParseJob *job = &g_array_index(jobs, ParseJob, i);
+
+    if (job->tree)
+    {
+      if (ok)
+        bm_arena_steal(tree->arena, job->tree->arena);
+
+      bm_tree_free(job->tree);
+    }
+    else if (job->bm_item)
+      free_bookmark_item(job->bm_item);
+  }
+
+  g_array_free(jobs, TRUE);
+
+  if (ok && tree)
+    tree->root = bm_item;
+  else if (!ok)
+  {
+    /* the items of an arena tree go with it */
+    if (bm_item && (!tree || !tree->arena))
+      free_bookmark_item(bm_item);
+
+    bm_tree_free(tree);
+  }
+
+  return ok ? bm_item : NULL;
+}
+
+BookmarkItem *
+bm_loader_read_file_parallel(const gchar *file_name, BookmarkLoadFlags flags,
+                             BookmarkFieldMask fields)
+{
+  BookmarkItem *bm_item = NULL;
+  struct stat st;
+  gchar *buf;
+  gsize len;
+
+  if (g_get_num_processors() > 1 &&
+      !stat(file_name, &st) && st.st_size >= PARALLEL_MIN_SIZE &&
+      g_file_get_contents(file_name, &buf, &len, NULL))
+  {
+    bm_item = read_parallel(file_name, buf, len, flags, fields);
+    g_free(buf);
+  }
+
+  if (!bm_item)
+    bm_item = bm_loader_read_file(file_name, flags, fields);
+
+  return bm_item;
+}
@@ -1,4 +1,5 @@
 #include "osso_bookmark_parser.h"
+#include "bookmark_private.h"
 
 #include <gio/gio.h>
 #include <glib/gprintf.h>
@@ -18,8 +19,9 @@
 #define TEST(fun) fun
 #endif
 
+/* Left by the last bookmark_gslist_find*() call, see BookmarkEngine for a
+ * per-caller one */
 SortOrder sort_order;
-guint nodeptriter = 0;
 
 SortOrder bookmark_get_sorting_order(void)
 {
@@ -50,7 +52,7 @@ static const char *bookmark_template =
  "</info>"
 "</xbel>";
 
-static gchar *
+gchar *
 file_path_with_home_dir(const gchar *file_name)
 {
   const gchar *home_dir;
@@ -93,80 +95,17 @@ get_attribute_pointer(xmlNode *node, const char *attribute)
   return node;
 }
 
-static void
-free_bookmark_item(BookmarkItem *bm_item)
-{
-  if (!bm_item)
-    return;
-
-  if (bm_item->name)
-  {
-    g_free(bm_item->name);
-    bm_item->name = NULL;
-  }
-
-  if (bm_item->url)
-  {
-    g_free(bm_item->url);
-    bm_item->url = NULL;
-  }
-
-  if (bm_item->favicon_file)
-  {
-    g_free(bm_item->favicon_file);
-    bm_item->favicon_file = NULL;
-  }
-
-  if (bm_item->thumbnail_file)
-  {
-    g_free(bm_item->thumbnail_file);
-    bm_item->thumbnail_file = NULL;
-  }
-
-  if (bm_item->list)
-  {
-    g_slist_foreach(bm_item->list, (GFunc)free_bookmark_item, NULL);
-    g_slist_free(bm_item->list);
-    bm_item->list = NULL;
-  }
-
-  g_free(bm_item);
-}
-
-static const gchar *
-bookmark_string_strcasestr(const gchar *s1, const gchar *s2)
-{
-  gchar *s1_dup;
-  gchar *s1_down;
-  gchar *s2_dup;
-  gchar *s2_down;
-  gchar *p;
-
-  s1_dup = g_strdup(s1);
-  s2_dup = g_strdup(s2);
-
-  if (s1_dup)
-    s1_down = g_utf8_strdown(s1_dup, -1);
-  else
-    s1_down = NULL;
-
-  if ( s2_dup )
-    s2_down = g_utf8_strdown(s2_dup, -1);
-  else
-    s2_down = NULL;
-
-  p = g_strrstr(s1_down, s2_down);
-
-  g_free(s1_dup);
-  g_free(s2_dup);
-  g_free(s1_down);
-  g_free(s2_down);
-
-  if (p)
-    return &s1[p - s1_down];
-
-  return NULL;
-}
+/* Markers of the Netscape bookmark format */
+static const BmNeedle a_href_needle = BM_NEEDLE("<A HREF=");
+static const BmNeedle a_end_needle = BM_NEEDLE("</A>");
+static const BmNeedle shortcuturl_needle = BM_NEEDLE("SHORTCUTURL=");
+static const BmNeedle dt_h3_needle = BM_NEEDLE("<DT><H3");
+static const BmNeedle h3_end_needle = BM_NEEDLE("</H3>");
+static const BmNeedle dl_end_needle = BM_NEEDLE("</DL>");
+static const BmNeedle hr_needle = BM_NEEDLE("<HR>");
+static const BmNeedle dd_needle = BM_NEEDLE("<DD>");
+static const BmNeedle add_date_needle = BM_NEEDLE("ADD_DATE=");
+static const BmNeedle last_visit_needle = BM_NEEDLE("LAST_VISIT=");
 
 /* fmg: TODO: Optimize me !!! */
 static gchar *
@@ -195,187 +134,143 @@ bookmark_read_line_from_html_file(GInputStream *in)
   return NULL;
 }
 
-static void
-assign_node_text_contents(gchar **s, xmlNode *node)
-{
-  xmlChar *xs = xmlNodeGetContent(node);
-
-  if (xs)
-  {
-    *s = g_strdup((gchar *)xs);
-    xmlFree(xs);
-  }
-  else
-    *s = NULL;
-}
-
-static void
-assign_text_attribute(gchar **s, xmlNode *node, const char* attr)
-{
-  xmlChar *xs = xmlGetProp(node, BAD_CAST attr);
-
-  if (xs)
-  {
-    *s = g_strdup((gchar *)xs);
-    xmlFree(xs);
-  }
-  else
-    *s = NULL;
-}
-
-static long int
-get_node_int_contents(xmlNode *node)
-{
-  xmlChar *xs;
-  long int rv;
-
-  xs = xmlNodeGetContent(node);
-  rv = strtol((const char *)xs, NULL, 10);
-  xmlFree(xs);
+gboolean
+get_root_bookmark_absolute_path_fields(BookmarkItem **bookmark_root,
+                                       const gchar *file_name,
+                                       BookmarkLoadFlags flags,
+                                       BookmarkFieldMask fields)
+{
+  BookmarkItem *bm_item = NULL;
+  BookmarkLock *lock;
+  BmSnapshotKey key;
+  GString *snapshot = NULL;
+  gboolean have_key = FALSE;
+  gboolean journal;
+
+  if (!bookmark_root)
+    return FALSE;
 
-  return rv;
-}
+  /* the file and its journal as one writer left them */
+  if (!bm_lock_files(BM_LOCK_SHARED, &lock))
+    return FALSE;
 
-static inline gboolean
-node_name_is(const xmlNode *node, const char *name)
-{
-  return !xmlStrcmp(node->name, BAD_CAST name);
-}
+  /* the journal finds its items by id */
+  journal = bm_journal_pending(file_name);
 
-static void
-assign_node_metadata(BookmarkItem *bm_item, const xmlNode *node)
-{
-  xmlNode *n = get_attribute_pointer(node->children, "metadata");
+  if (journal)
+    fields |= BM_FIELD_IDS;
 
-  for (n = n->children; n; n = n->next)
+  if (flags & BM_LOAD_SNAPSHOT)
   {
-    while (n && n->type != XML_ELEMENT_NODE)
-      n = n->next;
-
-    if (!n)
-      break;
+    have_key = bm_snapshot_key_for_file(file_name, &key);
 
-    if (node_name_is(n, "time_visited"))
-      bm_item->time_last_visited = get_node_int_contents(n);
-    else if (node_name_is(n, "time_added"))
-      bm_item->time_added = get_node_int_contents(n);
-    else if (node_name_is(n, "operator_bookmark"))
-      bm_item->isOperatorBookmark = get_node_int_contents(n);
-    else if (node_name_is(n, "deleted"))
-      bm_item->isDeleted = get_node_int_contents(n);
-    else if (node_name_is(n, "visit_count"))
-      bm_item->visit_count = get_node_int_contents(n);
+    if (have_key)
+      bm_item = bm_snapshot_read(file_name, &key, flags, fields, &snapshot);
   }
-}
-
-static BookmarkItem *
-print_root_names(xmlNode *node)
-{
-  BookmarkItem *bm_item;
-
-  if (!node)
-    return NULL;
 
-  bm_item = create_bookmark_new();
-
-  for (node = node->children; node; node = node->next)
+  if (!bm_item && (flags & BM_LOAD_LAZY))
   {
-    if (!xmlStrcmp(node->name, BAD_CAST "title"))
-    {
-      assign_node_text_contents(&bm_item->name, node);
-    }
-    else if (node_name_is(node,"info"))
-    {
-      assign_node_metadata(bm_item, node);
-    }
-    else if (node_name_is(node, "bookmark"))
-    {
-      BookmarkItem *bm_bookmark = print_root_names(node);
-      BookmarkItem *bm_parent;
-      gchar *name;
-
-      assign_text_attribute(&bm_bookmark->url, node, "href");
-      assign_text_attribute(&bm_bookmark->thumbnail_file, node, "thumbnail");
-      assign_text_attribute(&bm_bookmark->favicon_file, node, "favicon");
-      bm_bookmark->parent = bm_item;
+    /* a partial tree must not end up in the snapshot */
+    bm_item = bm_loader_read_file_lazy(file_name, flags, fields);
 
-      bm_item->list = g_slist_append(bm_item->list, bm_bookmark);
-
-      for (bm_parent = bm_item; bm_parent; bm_parent = bm_parent->parent)
-      {
-        if (bm_parent->visit_count < bm_bookmark->visit_count)
-          bm_parent->visit_count = bm_bookmark->visit_count;
-      }
-
-      name = bm_bookmark->name;
-      bm_bookmark->name = g_strdup_printf("%s.%s", name, "bm");
-      g_free(name);
-    }
-    else if (node_name_is(node, "folder"))
+    if (!bm_item)
     {
-      BookmarkItem *bm_folder = print_root_names(node);
-
-      bm_folder->isFolder = TRUE;
-      bm_folder->parent = bm_item;
-      bm_item->list = g_slist_append(bm_item->list, bm_folder);
+      bookmark_lock_release(lock);
+      return FALSE;
     }
   }
+  else if (!bm_item)
+  {
+    if (flags & BM_LOAD_PARALLEL)
+      bm_item = bm_loader_read_file_parallel(file_name, flags, fields);
+    else
+      bm_item = bm_loader_read_file(file_name, flags, fields);
 
-  return bm_item;
-}
+    if (!bm_item)
+    {
+      bookmark_lock_release(lock);
+      return FALSE;
+    }
 
-gboolean
-TEST(get_root_bookmark_absolute_path)(BookmarkItem **bookmark_root,
-                                      gchar *file_name)
-{
-  xmlDoc *doc;
-  xmlNode *node;
-  BookmarkItem *bm_item;
+    if (have_key && fields == BM_FIELD_ALL)
+      snapshot = bm_snapshot_encode(&key, bm_item);
+  }
 
-  doc = xmlReadFile(file_name, 0, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
+  free_bookmark_item(*bookmark_root);
+  bm_item->isFolder = 1;
 
-  if (!doc)
-    return FALSE;
+  /* on top of the file, the snapshot has to stay the file as it is */
+  if (journal)
+    bm_journal_replay(file_name, bm_item, fields);
 
-  node = xmlDocGetRootElement(doc);
+  bookmark_lock_release(lock);
 
-  if (!node || !bookmark_root)
+  /* the shared lock must be gone before the exclusive one is taken */
+  if (snapshot)
   {
-    xmlFreeDoc(doc);
-    return FALSE;
+    bm_snapshot_write(file_name, &key, snapshot);
+    g_string_free(snapshot, TRUE);
   }
 
-  free_bookmark_item(*bookmark_root);
-  *bookmark_root = NULL;
+  /* lazy trees add up their folders as they are built, and index their
+   * urls on the first lookup */
+  if (bm_item->tree && bm_item->tree->lazy_nodes)
+    bm_stats_refresh(bm_item);
+  else
+  {
+    bm_stats_compute(bm_item);
+
+    if (fields & BM_FIELD_URLS)
+      bm_url_index_build(bm_item);
+  }
 
-  bm_item = print_root_names(node);
   *bookmark_root = bm_item;
 
-  xmlFreeDoc(doc);
+  return TRUE;
+}
 
-  if (bm_item)
-  {
-    bm_item->isFolder = 1;
-    return TRUE;
-  }
+gboolean
+get_root_bookmark_absolute_path_full(BookmarkItem **bookmark_root,
+                                     const gchar *file_name,
+                                     BookmarkLoadFlags flags)
+{
+  return get_root_bookmark_absolute_path_fields(bookmark_root, file_name,
+                                                flags, BM_FIELD_ALL);
+}
 
-  return FALSE;
+gboolean
+TEST(get_root_bookmark_absolute_path)(BookmarkItem **bookmark_root,
+                                      gchar *file_name)
+{
+  return get_root_bookmark_absolute_path_full(bookmark_root, file_name,
+                                              BM_LOAD_DEFAULT);
 }
 
 static gboolean
-_get_root_bookmark(BookmarkItem **bookmark_root, gchar *file_name)
+_get_root_bookmark_fields(BookmarkItem **bookmark_root, gchar *file_name,
+                          BookmarkLoadFlags flags, BookmarkFieldMask fields)
 {
   gboolean rv;
 
   gchar *bm_file = file_path_with_home_dir(file_name);
 
-  rv = TEST(get_root_bookmark_absolute_path)(bookmark_root, bm_file);
+  rv = get_root_bookmark_absolute_path_fields(bookmark_root, bm_file, flags,
+                                              fields);
 
   g_free(bm_file);
 
   return rv;
 }
 
+static gboolean
+_get_root_bookmark(BookmarkItem **bookmark_root, gchar *file_name)
+{
+  /* the files in ~/.bookmarks are ours, and this is the load that every
+   * application starts with */
+  return _get_root_bookmark_fields(bookmark_root, file_name, BM_LOAD_SNAPSHOT,
+                                   BM_FIELD_ALL);
+}
+
 gboolean
 TEST(get_root_bookmark) (BookmarkItem **bookmark_root,
                          gchar *file_name)
@@ -385,6 +280,13 @@ TEST(get_root_bookmark) (BookmarkItem **bookmark_root,
   return _get_root_bookmark(bookmark_root, MYBOOKMARKS);
 }
 
+gboolean
+get_root_bookmark_full(BookmarkItem **bookmark_root, BookmarkLoadFlags flags)
+{
+  return _get_root_bookmark_fields(bookmark_root, MYBOOKMARKS, flags,
+                                   BM_FIELD_ALL);
+}
+
 gboolean
 create_bookmarks_backup(const gchar *file_name)
 {
@@ -544,14 +446,14 @@ bookmarks_new_bookmark(gboolean isFolder, const gchar *name, const gchar *url,
 }
 
 static GTime
-ns_get_bookmark_date(const char *line, const char *search)
+ns_get_bookmark_date(const char *line, const BmNeedle *search)
 {
-  const char *found = bookmark_string_strcasestr(line, search);
+  const char *found = bm_needle_rfind(line, search);
 
   if (!found)
     return 0;
 
-  return strtol(found + strlen(search) + 1, NULL, 10);
+  return strtol(found + search->len + 1, NULL, 10);
 }
 
 /**
@@ -731,7 +633,7 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
     if (!line)
       break;
 
-    if ((found = bookmark_string_strcasestr(line, "<A HREF=")))
+    if ((found = bm_needle_rfind(line, &a_href_needle)))
     {
       g_string_assign(url, found + 9);
       g_string_truncate(url, strchr(url->str, '"') - url->str);
@@ -740,8 +642,8 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
       {
         g_string_assign(name, found + 2);
         g_string_truncate(
-              name, bookmark_string_strcasestr(name->str, "</A>") - name->str);
-        found = bookmark_string_strcasestr(line, "SHORTCUTURL=");
+              name, bm_needle_rfind(name->str, &a_end_needle) - name->str);
+        found = bm_needle_rfind(line, &shortcuturl_needle);
 
         if (found)
         {
@@ -752,8 +654,8 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
           g_string_assign(nick, "");
 
         /* fmg: why is the result ignored? */
-        ns_get_bookmark_date(line, "ADD_DATE=");
-        ns_get_bookmark_date(line, "LAST_VISIT=");
+        ns_get_bookmark_date(line, &add_date_needle);
+        ns_get_bookmark_date(line, &last_visit_needle);
 
         unescaped = ns_parse_bookmark_item(name);
         converted = convert_iso_string_to_utf8(unescaped);
@@ -762,22 +664,21 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
         bm = bookmarks_new_bookmark(TRUE, converted, url->str, FALSE);
         g_free(converted);
 
-        bm->parent = bm_item;
         bm->isFolder = FALSE;
 
         if (bm_item)
-          bm_item->list = g_slist_append(bm_item->list, bm);
+          bm_item_link_child(bm_item, bm);
       }
     }
-    else if ((found = bookmark_string_strcasestr(line, "<DT><H3")))
+    else if ((found = bm_needle_rfind(line, &dt_h3_needle)))
     {
       if ((found = strchr(found + 7, '>')))
       {
         g_string_assign(name, found + 1);
         g_string_truncate(
               name,
-              bookmark_string_strcasestr(name->str, "</H3>") - name->str);
-        ns_get_bookmark_date(line, "ADD_DATE=");
+              bm_needle_rfind(name->str, &h3_end_needle) - name->str);
+        ns_get_bookmark_date(line, &add_date_needle);
 
         unescaped = ns_parse_bookmark_item(name);
         converted = convert_iso_string_to_utf8(unescaped);
@@ -786,20 +687,19 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
         bm = bookmarks_new_bookmark(0, converted, 0, 0);
         g_free(converted);
 
-        bm_item->list = g_slist_append(bm_item->list, bm);
+        bm_item_link_child(bm_item, bm);
         bm->isFolder = TRUE;
-        bm->parent = bm_item;
         bm_item = bm;
       }
     }
-    else if (bookmark_string_strcasestr(line, "</DL>"))
+    else if (bm_needle_rfind(line, &dl_end_needle))
     {
       if (bm_item->parent)
         bm_item = bm_item->parent;
     }
-    else if (bookmark_string_strcasestr(line, "<HR>"))
+    else if (bm_needle_rfind(line, &hr_needle))
     {
-      found = bookmark_string_strcasestr(line, "<DD>");
+      found = bm_needle_rfind(line, &dd_needle);
 
       if (found)
         g_string_assign(name, found + 4);
@@ -817,6 +717,12 @@ netscape_import_bookmarks(const gchar *path, gboolean use_locale,
   g_string_free(url, 1);
   g_string_free(nick, 1);
 
+  for (bm = bm_item; bm->parent; bm = bm->parent)
+    ;
+
+  bm_item_build_lists(bm);
+  bm_stats_compute(bm);
+
   return bm_item;
 }
 
@@ -868,44 +774,6 @@ TEST(bookmark_import)(const gchar *path, gchar *importFolderName,
   return FALSE;
 }
 
-gboolean
-set_lock(gchar *lock_file_name)
-{
-  gchar *path;
-  FILE *fp;
-
-  path = file_path_with_home_dir(lock_file_name);
-  fp = fopen(path, "w");
-  g_free(path);
-
-  if (fp)
-  {
-    fclose(fp);
-    return TRUE;
-  }
-
-  return FALSE;
-}
-
-gboolean
-del_lock(gchar *lock_file_name)
-{
-  gchar *path;
-
-  path = file_path_with_home_dir(lock_file_name);
-
-  if (access(path, R_OK))
-  {
-    g_free(path);
-    return FALSE;
-  }
-
-  unlink(path);
-  g_free(path);
-
-  return TRUE;
-}
-
 gchar *
 get_base_url_name(const gchar *url)
 {
@@ -992,26 +860,19 @@ set_bookmark_files_path(void)
 static void
 osso_bookmark_get_dir_node(const BookmarkItem *bm_item, GSList **folders)
 {
-  GSList *next;
+  const BookmarkItem *bm;
+  GSList *dirs = NULL;
 
   if (!bm_item)
     return;
 
-  for (next = bm_item->list; next; next = next->next)
+  for (bm = bm_item->first_child; bm; bm = bm->next_sibling)
   {
-    const BookmarkItem *bm;
-
-    while (!((const BookmarkItem *)next->data)->isFolder)
-    {
-      next = next->next;
-
-      if (!next)
-        return;
-    }
-
-    bm = (const BookmarkItem *)next->data;
-    *folders =  g_slist_append(*folders, g_strdup_printf("USER:%s", bm->name));
+    if (bm->isFolder)
+      dirs = g_slist_prepend(dirs, g_strdup_printf("USER:%s", bm->name));
   }
+
+  *folders = g_slist_concat(*folders, g_slist_reverse(dirs));
 }
 
 GSList *
@@ -1022,7 +883,10 @@ TEST(osso_bookmark_get_folders_list)(void)
 
   set_bookmark_files_path();
   bm_item = create_bookmark_new();
-  _get_root_bookmark(&bm_item, "/.bookmarks/MyBookmarks.xml");
+  /* only the names of the top level folders are needed */
+  _get_root_bookmark_fields(&bm_item, "/.bookmarks/MyBookmarks.xml",
+                            BM_LOAD_ARENA | BM_LOAD_NO_CHILD_LISTS,
+                            BM_FIELD_NAMES);
   folders = g_slist_append(NULL,
                            g_strdup_printf("MY:%s",
                                            dgettext("osso-browser-ui",
@@ -1170,7 +1034,7 @@ netscape_export_bookmarks_item(GOutputStream *out, BookmarkItem *bm_item,
 
     bm_gio_write_string(out, "</H3>\n<DL><p>\n");
 
-    for (list = bm_item->list; list; list = list->next)
+    for (list = bookmark_item_get_list(bm_item); list; list = list->next)
     {
       while (g_main_context_iteration(0, 0));
       netscape_export_bookmarks_item(out, (BookmarkItem *)list->data, 0);
@@ -1229,34 +1093,12 @@ TEST(netscape_export_bookmarks)(const gchar *filename, GSList *root,
   return TRUE;
 }
 
-static gboolean
-dump_xml_doc_and_fsync(xmlDoc *doc, const char *file_path)
-{
-  FILE *fp;
-  gboolean rv;
-
-  g_return_val_if_fail(doc, FALSE);
-  g_return_val_if_fail(file_path, FALSE);
-
-  fp = fopen(file_path, "w");
-  g_return_val_if_fail(fp, FALSE);
-
-  if (!xmlDocFormatDump(fp, doc, 1) == -1)
-  {
-    fsync(fileno(fp));
-    rv = TRUE;
-  }
-  else
-    rv = FALSE;
-
-  fclose(fp);
-
-  return rv;
-}
-
-static xmlNode *
+xmlNode *
 get_node_by_tag(xmlNode *node, const char *tag)
 {
+  if (!node)
+    return NULL;
+
   if (xmlStrcmp(node->name, BAD_CAST tag))
   {
     while (xmlStrcmp(node->name, BAD_CAST "info"))
@@ -1269,6 +1111,9 @@ get_node_by_tag(xmlNode *node, const char *tag)
 
     node = node->children;
 
+    if (!node)
+      return NULL;
+
     if (xmlStrcmp(node->name, BAD_CAST tag))
     {
       while (xmlStrcmp(node->name, BAD_CAST "metadata"))
@@ -1281,6 +1126,9 @@ get_node_by_tag(xmlNode *node, const char *tag)
 
       node = node->children;
 
+      if (!node)
+        return NULL;
+
       while (node->type != XML_ELEMENT_NODE)
       {
         node = node->next;
@@ -1333,6 +1181,7 @@ create_new_xmlnode(xmlNode *parent_node, BookmarkItem *bm_item)
   if (bm_item->isFolder)
   {
     node = xmlNewChild(parent_node, NULL, BAD_CAST "folder", NULL);
+    bm_doc_set_new_id(node, bm_item);
     xmlSetProp(node, BAD_CAST "folded", BAD_CAST "no");
     xmlAddChild(node, xmlNewText(BAD_CAST "\n"));
     xmlNewTextChild(node, NULL, BAD_CAST "title", BAD_CAST bm_item->name);
@@ -1342,6 +1191,7 @@ create_new_xmlnode(xmlNode *parent_node, BookmarkItem *bm_item)
     gchar *s;
 
     node = xmlNewChild(parent_node, NULL, BAD_CAST "bookmark", NULL);
+    bm_doc_set_new_id(node, bm_item);
     xmlSetProp(node, BAD_CAST "href", BAD_CAST bm_item->url);
     xmlSetProp(node, BAD_CAST "favicon", BAD_CAST bm_item->favicon_file);
     xmlSetProp(node, BAD_CAST "thumbnail", BAD_CAST bm_item->thumbnail_file);
@@ -1410,8 +1260,9 @@ add_xmlnode_to_parent(BookmarkItem *parent_item, xmlNode *parent_node)
   }
 }
 
+/* Creates the element of bm_item in doc, not linked into it yet */
 static xmlNode *
-add_bookmark_item(const BookmarkItem *bm_item)
+add_bookmark_item(xmlDoc *doc, BookmarkItem *bm_item)
 {
   xmlNode *item;
   xmlNode *metadata;
@@ -1429,7 +1280,8 @@ add_bookmark_item(const BookmarkItem *bm_item)
   {
     xmlNode *info;
 
-    item = xmlNewNode(NULL, BAD_CAST "folder");
+    item = xmlNewDocNode(doc, NULL, BAD_CAST "folder", NULL);
+    bm_doc_set_new_id(item, bm_item);
     xmlAddChild(item, xmlNewText(BAD_CAST "\n"));
     xmlSetProp(item, BAD_CAST "folded", BAD_CAST "no");
     xmlNewTextChild(item, NULL, BAD_CAST "title",
@@ -1444,7 +1296,8 @@ add_bookmark_item(const BookmarkItem *bm_item)
   {
     gchar *s;
 
-    item = xmlNewNode(NULL, BAD_CAST "bookmark");
+    item = xmlNewDocNode(doc, NULL, BAD_CAST "bookmark", NULL);
+    bm_doc_set_new_id(item, bm_item);
     xmlAddChild(item, xmlNewText(BAD_CAST "\n"));
     xmlSetProp(item, BAD_CAST "href", BAD_CAST bm_item->url);
     xmlSetProp(item, BAD_CAST "favicon",
@@ -1494,8 +1347,10 @@ add_bookmark_item(const BookmarkItem *bm_item)
   return item;
 }
 
+/* iter is the position in items_list the search has got to */
 static xmlNode *
-get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
+get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len,
+                   guint *iter)
 {
   xmlNode *n;
   gboolean found = FALSE;
@@ -1525,9 +1380,9 @@ get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
         xmlChar *title =
             xmlNodeGetContent(get_attribute_pointer(n->children, "title"));
 
-        if (nodeptriter)
+        if (*iter)
         {
-          gchar *data = g_strdup(g_slist_nth_data(items_list, nodeptriter));
+          gchar *data = g_strdup(g_slist_nth_data(items_list, *iter));
 
           if (data)
           {
@@ -1552,7 +1407,7 @@ get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
     }
     else
     {
-      const gchar *data = g_slist_nth_data(items_list, nodeptriter);
+      const gchar *data = g_slist_nth_data(items_list, *iter);
       xmlChar *title =
           xmlNodeGetContent(get_attribute_pointer(n->children, "title"));
 
@@ -1560,7 +1415,7 @@ get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
       {
         xmlNode *next;
 
-        if (list_len == ++nodeptriter)
+        if (list_len == ++(*iter))
           found = TRUE;
 
         xmlFree(title);
@@ -1569,7 +1424,7 @@ get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
         if (found)
           return n;
 
-        next = get_parent_nodeptr(items_list, n, list_len);
+        next = get_parent_nodeptr(items_list, n, list_len, iter);
 
         if (next)
           return next;
@@ -1583,85 +1438,262 @@ get_parent_nodeptr(GSList *items_list, xmlNode *node, guint list_len)
   return n;
 }
 
-gboolean
-bm_engine_add_duplicate_item(BookmarkItem *parent, BookmarkItem *bm_item)
+/*
+ * Returns the element of bm_item in the document of root_element, or the
+ * <title> of root_element for the root item, as get_parent_nodeptr() does.
+ * Items bound to the document have it at hand, items read with an id are
+ * looked up by it and NULL if no element has it, only the others are found
+ * by matching the titles along their path.
+ */
+static xmlNode *
+find_item_node(BookmarkItem *bm_item, xmlNode *root_element)
 {
-  gchar *bm_file;
-  xmlDoc *doc;
   GSList *list;
-  int len;
-  gboolean rv;
-
-  bm_file = file_path_with_home_dir("/.bookmarks/MyBookmarks.xml");
-  doc = xmlParseFile(bm_file);
+  xmlNode *node;
+  guint iter = 1;
 
-  if (!doc)
-  {
-    g_free(bm_file);
-    return FALSE;
-  }
+  if (!bm_item || !root_element)
+    return NULL;
 
-  list = g_slist_reverse(get_complete_path(parent));
-  len = g_slist_length(list);
-  nodeptriter = 1;
-  xmlAddNextSibling(get_parent_nodeptr(list, xmlDocGetRootElement(doc), len),
-                    add_bookmark_item(bm_item));
+  /* NULL if the element was removed, whatever else has the same title */
+  if (bm_bind_is_bound(bm_item, root_element))
+    return bm_bind_lookup(bm_item, root_element, BM_NODE_ELEMENT);
 
-  set_lock("/.bookmarks/.lock");
+  /* an item with an id is that element or gone, an item with the same
+   * title is another one */
+  if (bm_item->parent && bm_item->id)
+    return bm_doc_find_id(root_element->doc, bm_item->id);
 
+  list = g_slist_reverse(get_complete_path(bm_item));
+  node = get_parent_nodeptr(list, root_element, g_slist_length(list), &iter);
   g_slist_free(list);
-  rv = dump_xml_doc_and_fsync(doc, bm_file);
-  g_free(bm_file);
-  xmlFreeDoc(doc);
 
-  del_lock("/.bookmarks/.lock");
+  return node;
+}
+
+xmlNodePtr
+bookmark_item_resolve_path_node(BookmarkItem *folder, const gchar *path,
+                                xmlNode *root_element)
+{
+  CHECK_PARAM(!root_element, "\nInvalid Input Parameter", return NULL);
 
-  return rv;
+  return find_item_node(bookmark_item_resolve_path(folder, path),
+                        root_element);
 }
 
-gboolean
-bookmark_set_operator_bookmark_as_deleted(BookmarkItem *bm_item,
-                                          gchar *file_name, xmlDocPtr doc,
-                                          xmlNode *root_element)
+/*
+ * The functions below that change MyBookmarks.xml on their own open it, make
+ * their change and save it again. Between bm_engine_begin() and
+ * bm_engine_commit() they all work on the one document of the transaction
+ * instead, which is saved once at the end. The transaction belongs to the
+ * thread that began it, the functions wait for it on other threads.
+ */
+static GRecMutex transaction_lock;
+static xmlDoc *transaction_doc;
+static guint transaction_depth;
+/* keeps other writers off the file from the read to the save */
+static BookmarkLock *transaction_files_lock;
+
+/* Takes the transaction lock, given back by transaction_close_doc() */
+static xmlDoc *
+transaction_open_doc(const gchar *bm_file, int options)
 {
-  GSList *list;
-  xmlNode *node;
+  xmlDoc *doc;
 
-  (void)file_name;
+  g_rec_mutex_lock(&transaction_lock);
 
-  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return FALSE);
+  if (transaction_depth)
+    return transaction_doc;
 
-  CHECK_PARAM(!bm_item->isOperatorBookmark, "\nBM Not Operator BM",
-              return FALSE);
+  doc = bm_doc_open(bm_file, options);
 
   if (!doc)
-    return FALSE;
+    g_rec_mutex_unlock(&transaction_lock);
 
-  list = g_slist_reverse(get_complete_path(bm_item));
+  return doc;
+}
 
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+/* Saves doc if asked to, unless that is up to the transaction */
+static gboolean
+transaction_close_doc(xmlDoc *doc, const gchar *bm_file, gboolean save)
+{
+  gboolean rv = save;
 
-  if (node && (node = get_node_by_tag(node->children, "deleted")))
+  if (doc != transaction_doc)
   {
-    xmlNodeSetContent(node, BAD_CAST "1");
-    g_slist_free(list);
-    return TRUE;
+    if (save)
+    {
+      rv = bm_doc_save(doc, bm_file);
+    }
+
+    bm_doc_free(doc);
   }
 
-  g_slist_free(list);
+  g_rec_mutex_unlock(&transaction_lock);
 
-  return FALSE;
+  return rv;
 }
 
-static GConfClient *
-osso_bookmark_gconf_init_default_client()
+xmlNodePtr
+bm_engine_begin(void)
 {
-  return gconf_client_get_default();
-}
+  g_rec_mutex_lock(&transaction_lock);
 
-SortType osso_bookmark_gconf_get_int(gchar * key)
-{
+  if (!transaction_depth)
+  {
+    gchar *bm_file;
+
+    /* the locks bm_doc_open() and bm_doc_save() take are this one again,
+     * the lock table of the thread hands it back to them */
+    if (!bm_lock_files(BM_LOCK_EXCLUSIVE, &transaction_files_lock))
+    {
+      g_rec_mutex_unlock(&transaction_lock);
+      return NULL;
+    }
+
+    bm_file = file_path_with_home_dir(MYBOOKMARKS);
+    transaction_doc = bm_doc_open(bm_file, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
+    g_free(bm_file);
+
+    if (!transaction_doc)
+    {
+      bookmark_lock_release(transaction_files_lock);
+      transaction_files_lock = NULL;
+      g_rec_mutex_unlock(&transaction_lock);
+      return NULL;
+    }
+  }
+
+  transaction_depth++;
+
+  return xmlDocGetRootElement(transaction_doc);
+}
+
+static gboolean
+transaction_end(gboolean save)
+{
+  gboolean rv = TRUE;
+
+  g_rec_mutex_lock(&transaction_lock);
+
+  CHECK_PARAM(!transaction_depth, "\nNo transaction to end",
+              g_rec_mutex_unlock(&transaction_lock); return FALSE);
+
+  /* a nested transaction is part of the outer one */
+  if (!--transaction_depth)
+  {
+    if (save)
+    {
+      gchar *bm_file = file_path_with_home_dir(MYBOOKMARKS);
+
+      rv = bm_doc_save(transaction_doc, bm_file);
+      g_free(bm_file);
+    }
+
+    bm_doc_free(transaction_doc);
+    transaction_doc = NULL;
+    bookmark_lock_release(transaction_files_lock);
+    transaction_files_lock = NULL;
+  }
+
+  /* once for this call and once for bm_engine_begin() */
+  g_rec_mutex_unlock(&transaction_lock);
+  g_rec_mutex_unlock(&transaction_lock);
+
+  return rv;
+}
+
+gboolean
+bm_engine_commit(void)
+{
+  return transaction_end(TRUE);
+}
+
+void
+bm_engine_abort(void)
+{
+  transaction_end(FALSE);
+}
+
+gboolean
+bm_engine_add_duplicate_item(BookmarkItem *parent, BookmarkItem *bm_item)
+{
+  gchar *bm_file;
+  xmlDoc *doc;
+  xmlNode *node;
+  gboolean rv;
+
+  bm_file = file_path_with_home_dir("/.bookmarks/MyBookmarks.xml");
+  doc = transaction_open_doc(bm_file, 0);
+
+  if (!doc)
+  {
+    g_free(bm_file);
+    return FALSE;
+  }
+
+  node = find_item_node(parent, xmlDocGetRootElement(doc));
+
+  if (node)
+    xmlAddNextSibling(node, add_bookmark_item(doc, bm_item));
+
+  rv = transaction_close_doc(doc, bm_file, TRUE);
+  g_free(bm_file);
+
+  return rv;
+}
+
+/* The item follows what is written to the file, so that the indexes of its
+ * tree stay right. Arena trees are read only. */
+static inline gboolean
+item_is_writable(BookmarkItem *bm_item)
+{
+  return !(bm_item->tree && bm_item->tree->arena);
+}
+
+gboolean
+bookmark_set_operator_bookmark_as_deleted(BookmarkItem *bm_item,
+                                          gchar *file_name, xmlDocPtr doc,
+                                          xmlNode *root_element)
+{
+  xmlNode *node;
+
+  (void)file_name;
+
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return FALSE);
+
+  CHECK_PARAM(!bm_item->isOperatorBookmark, "\nBM Not Operator BM",
+              return FALSE);
+
+  if (!doc)
+    return FALSE;
+
+  node = bm_bind_lookup(bm_item, root_element, BM_NODE_DELETED);
+
+  if (!node && (node = find_item_node(bm_item, root_element)))
+    node = get_node_by_tag(node->children, "deleted");
+
+  if (node)
+  {
+    xmlNodeSetContent(node, BAD_CAST "1");
+
+    if (item_is_writable(bm_item))
+      bm_item->isDeleted = TRUE;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static GConfClient *
+osso_bookmark_gconf_init_default_client()
+{
+  return gconf_client_get_default();
+}
+
+SortType osso_bookmark_gconf_get_int(gchar * key)
+{
   GConfClient *client;
   GError *err = NULL;
 
@@ -1695,39 +1727,41 @@ osso_bookmark_gconf_set_int(gchar *key, gint val)
 gboolean
 opened_bookmark_remove(BookmarkItem *node, xmlNodePtr root_element)
 {
-  GSList *list;
+  xmlNode *n;
 
   if (!node)
     return FALSE;
 
-  list = g_slist_reverse(get_complete_path(node));
-  nodeptriter = 1;
+  n = find_item_node(node, root_element);
 
-  if (root_element)
+  if (n)
   {
-    xmlNode *n = get_parent_nodeptr(list, root_element, g_slist_length(list));
-
-    if (n)
-    {
-      g_slist_free(list);
-      xmlUnlinkNode(n);
-      xmlFreeNodeList(n);
-      return TRUE;
-    }
+    xmlUnlinkNode(n);
+    bm_bind_forget(n);
+    xmlFreeNodeList(n);
+    return TRUE;
   }
 
-  g_slist_free(list);
-
   return FALSE;
 }
 
-gboolean
-bookmark_set_visit_count(BookmarkItem *bm_item, const gchar *val,
-                         const gchar *file_name, xmlDocPtr doc,
-                         xmlNode *root_element)
+/* Puts an item added to the file into the children and the indexes of
+ * parent as well. list is the caller's to insert it into. */
+static void
+link_added_child(BookmarkItem *parent, BookmarkItem *bm_item,
+                 BookmarkItem *before)
 {
-  GSList *list;
-  int list_len;
+  if (item_is_writable(parent) && !bm_item->parent)
+    bm_item_insert_child(parent, bm_item, before);
+}
+
+/* bookmark_set_visit_count() writing doc only */
+static gboolean
+bm_doc_set_visit_count(BookmarkItem *bm_item, const gchar *val,
+                       const gchar *file_name, xmlDocPtr doc,
+                       xmlNode *root_element)
+{
+  xmlNode *item_node;
   xmlNode *node;
 
   CHECK_PARAM(!bm_item || !val, "\nInvalid Input Parameter", return FALSE);
@@ -1737,57 +1771,77 @@ bookmark_set_visit_count(BookmarkItem *bm_item, const gchar *val,
   if (!doc)
     return FALSE;
 
-  list = g_slist_reverse(get_complete_path(bm_item));
-  list_len = g_slist_length(list);
-  nodeptriter = 1;
+  node = bm_bind_lookup(bm_item, root_element, BM_NODE_VISIT_COUNT);
+
+  if (node)
+  {
+    xmlNodeSetContent(node, BAD_CAST val);
+    return TRUE;
+  }
 
-  node = get_parent_nodeptr(list, root_element, list_len);
+  item_node = find_item_node(bm_item, root_element);
 
-  if (!node)
-    goto err;
+  if (!item_node)
+    return FALSE;
 
-  node = get_node_by_tag(node->children, "visit_count");
+  node = get_node_by_tag(item_node->children, "visit_count");
   if (node)
   {
     xmlNodeSetContent(node, BAD_CAST val);
-    g_slist_free(list);
     return TRUE;
   }
 
-  node = get_node_by_tag(node->children, "metadata");
+  node = bm_bind_lookup(bm_item, root_element, BM_NODE_METADATA);
+
+  if (!node)
+    node = get_node_by_tag(item_node->children, "metadata");
 
   if (!node)
-    goto err;
+    return FALSE;
 
   node = xmlNewChild(node, NULL, BAD_CAST "visit_count", BAD_CAST val);
-  g_slist_free(list);
+  bm_bind_update(bm_item, root_element, BM_NODE_VISIT_COUNT, node);
 
   return !!node;
+}
 
-err:
-  g_slist_free(list);
+gboolean
+bookmark_set_visit_count(BookmarkItem *bm_item, const gchar *val,
+                         const gchar *file_name, xmlDocPtr doc,
+                         xmlNode *root_element)
+{
+  if (!bm_doc_set_visit_count(bm_item, val, file_name, doc, root_element))
+    return FALSE;
 
-  return FALSE;
+  if (item_is_writable(bm_item) && bm_item->visit_count != (guint)atoi(val))
+  {
+    bookmark_item_set_visited(bm_item, atoi(val),
+                              bm_item->time_last_visited);
+  }
+
+  return TRUE;
 }
 
-gboolean
-bookmark_set_name(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
-                  xmlNode *root_element)
+/* bookmark_set_name() writing doc only */
+static gboolean
+bm_doc_set_name(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
+                xmlNode *root_element)
 {
   gboolean rv = FALSE;
-  GSList *list;
   xmlNode *node;
   xmlNode *children;
 
   if (!val || !bm_item)
     return FALSE;
 
-  list = g_slist_reverse(get_complete_path(bm_item));
+  children = bm_bind_lookup(bm_item, root_element, BM_NODE_TITLE);
 
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  if (children)
+    node = children->parent;
+  else
+    node = find_item_node(bm_item, root_element);
 
-  if (node && (children = node->children) != 0)
+  if (node && (children || (children = node->children) != 0))
   {
     xmlChar *val_enc;
 
@@ -1817,17 +1871,28 @@ bookmark_set_name(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
   }
 
 out:
-  g_slist_free(list);
-
   return rv;
 }
 
 gboolean
-bookmark_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
-                 xmlNode *root_element)
+bookmark_set_name(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
+                  xmlNode *root_element)
+{
+  if (!bm_doc_set_name(bm_item, val, doc, root_element))
+    return FALSE;
+
+  if (item_is_writable(bm_item) && g_strcmp0(bm_item->name, val))
+    bookmark_item_set_name(bm_item, val);
+
+  return TRUE;
+}
+
+/* bookmark_set_url() writing doc only */
+static gboolean
+bm_doc_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
+               xmlNode *root_element)
 {
   gboolean rv = FALSE;
-  GSList *list;
   xmlNode *node;
 
   (void)doc;
@@ -1838,9 +1903,7 @@ bookmark_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
   CHECK_PARAM(bm_item->isFolder, "\nThe BookmarkItem is a Folder",
               return FALSE);
 
-  list = g_slist_reverse(get_complete_path(bm_item));
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  node = find_item_node(bm_item, root_element);
 
   while (node && xmlStrcmp(node->name, BAD_CAST "bookmark"))
     node = node->next;
@@ -1856,7 +1919,7 @@ bookmark_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
     old_url = get_base_url_name((const gchar *)old_href);
     new_url = get_base_url_name((const gchar *)new_href);
 
-    if (strcmp(old_url, new_url))
+    if (g_strcmp0(old_url, new_url))
     {
       xmlSetProp(node, BAD_CAST "favicon", BAD_CAST "");
       xmlSetProp(node, BAD_CAST "thumbnail", BAD_CAST "");
@@ -1870,16 +1933,28 @@ bookmark_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
     rv = TRUE;
   }
 
-  g_slist_free(list);
-
   return rv;
 }
 
+gboolean
+bookmark_set_url(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
+                 xmlNode *root_element)
+{
+  if (!bm_doc_set_url(bm_item, val, doc, root_element))
+    return FALSE;
+
+  if (item_is_writable(bm_item) && g_strcmp0(bm_item->url, val))
+    bookmark_item_set_url(bm_item, val);
+
+  return TRUE;
+}
+
 BMError
 bookmark_add_child(BookmarkItem *parent, BookmarkItem *bm_item, gint position,
                    xmlNode *root_element)
 {
-  GSList *list;
+  BookmarkItem *before = NULL;
+  xmlNode *added = NULL;
 
   CHECK_PARAM(!bm_item || !parent || !parent->isFolder,
               "\nInvalid Input Parameter", return BM_INVALID_PARAMETER);
@@ -1891,33 +1966,24 @@ bookmark_add_child(BookmarkItem *parent, BookmarkItem *bm_item, gint position,
     if (position == -1)
       position = g_slist_length(parent->list) - 1;
 
-    list = g_slist_reverse(
-             get_complete_path(g_slist_nth(parent->list, position)->data));
-    nodeptriter = 1;
-    node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+    before = g_slist_nth_data(parent->list, position);
+    node = find_item_node(before, root_element);
 
     if (node)
-      xmlAddPrevSibling(node, add_bookmark_item(bm_item));
+      added = xmlAddPrevSibling(node, add_bookmark_item(node->doc, bm_item));
   }
   else
   {
-    guint list_len;
-    xmlNode *node, *new_node;
-
-    list = g_slist_reverse(get_complete_path(parent));
-    nodeptriter = 1;
-    list_len = g_slist_length(list);
-    node = get_parent_nodeptr(list, root_element, list_len);
-    new_node = add_bookmark_item(bm_item);
-
-    if (list_len == 1)
-      xmlAddSibling(node, new_node);
-    else
-      xmlAddChild(node, new_node);
+    xmlNode *node = find_item_node(parent, root_element);
 
+    if (node && !parent->parent)
+      added = xmlAddSibling(node, add_bookmark_item(node->doc, bm_item));
+    else if (node)
+      added = xmlAddChild(node, add_bookmark_item(node->doc, bm_item));
   }
 
-  g_slist_free(list);
+  if (added)
+    link_added_child(parent, bm_item, before);
 
   return BM_OK;
 }
@@ -1934,15 +2000,12 @@ bm_engine_add_folder(BookmarkItem *parent, BookmarkItem *bm_item,
   (void)file_name;
 
   bm_file = file_path_with_home_dir(MYBOOKMARKS);
-  doc = xmlParseFile(bm_file);
+  doc = transaction_open_doc(bm_file, 0);
 
   if (doc)
   {
-    xmlAddChild(xmlDocGetRootElement(doc), add_bookmark_item(bm_item));
-    set_lock("/.bookmarks/.lock");
-    rv = dump_xml_doc_and_fsync(doc, bm_file);
-    del_lock("/.bookmarks/.lock");
-    xmlFreeDoc(doc);
+    xmlAddChild(xmlDocGetRootElement(doc), add_bookmark_item(doc, bm_item));
+    rv = transaction_close_doc(doc, bm_file, TRUE);
   }
 
   g_free(bm_file);
@@ -1963,32 +2026,23 @@ bookmark_remove(BookmarkItem *bm_item, gchar *file_name)
     return FALSE;
 
   bm_file = file_path_with_home_dir("/.bookmarks/MyBookmarks.xml");
-  doc = xmlReadFile(bm_file, 0, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
+  doc = transaction_open_doc(bm_file, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
 
   if (doc)
   {
     xmlNode *node = xmlDocGetRootElement(doc);
-    GSList *list = g_slist_reverse(get_complete_path(bm_item));
 
-    nodeptriter = 1;
+    if (node)
+      node = find_item_node(bm_item, node);
 
     if (node)
     {
-      node = get_parent_nodeptr(list, node, g_slist_length(list));
-
-      if (node)
-      {
-        xmlUnlinkNode(node);
-        xmlFreeNodeList(node);
-
-        set_lock("/.bookmarks/.lock");
-        rv = dump_xml_doc_and_fsync(doc, bm_file);
-        del_lock("/.bookmarks/.lock");
-      }
+      xmlUnlinkNode(node);
+      bm_bind_forget(node);
+      xmlFreeNodeList(node);
     }
 
-    g_slist_free(list);
-    xmlFreeDoc(doc);
+    rv = transaction_close_doc(doc, bm_file, node != NULL);
   }
 
   g_free(bm_file);
@@ -2007,7 +2061,7 @@ bookmark_remove_list(GSList *item_list)
   g_return_val_if_fail("item_list", FALSE);
 
   bm_file = file_path_with_home_dir("/.bookmarks/MyBookmarks.xml");
-  doc = xmlReadFile(bm_file, 0, 513);
+  doc = transaction_open_doc(bm_file, XML_PARSE_SAX1 | XML_PARSE_RECOVER);
 
   if (!doc)
   {
@@ -2030,15 +2084,12 @@ bookmark_remove_list(GSList *item_list)
     }
     else
     {
-      GSList *list = g_slist_reverse(get_complete_path(item_list->data));
-
-      nodeptriter = 1;
-      n = get_parent_nodeptr(list, node, g_slist_length(list));
-      g_slist_free(list);
+      n = find_item_node(item_list->data, node);
 
       if (n)
       {
         xmlUnlinkNode(n);
+        bm_bind_forget(n);
         xmlFreeNodeList(n);
       }
     }
@@ -2046,24 +2097,20 @@ bookmark_remove_list(GSList *item_list)
     item_list = item_list->next;
   }
 
-  set_lock("/.bookmarks/.lock");
-  rv = dump_xml_doc_and_fsync(doc, bm_file);
-  del_lock("/.bookmarks/.lock");
-
 out:
-  xmlFreeDoc(doc);
+  rv = transaction_close_doc(doc, bm_file, node != NULL);
   g_free(bm_file);
 
   return rv;
 }
 
-gboolean
-bookmark_set_time_last_visited(BookmarkItem *bm_item, const gchar *val,
-                               const gchar *file_name, xmlDocPtr doc,
-                               xmlNode *root_element)
+/* bookmark_set_time_last_visited() writing doc only */
+static gboolean
+bm_doc_set_time_last_visited(BookmarkItem *bm_item, const gchar *val,
+                             const gchar *file_name, xmlDocPtr doc,
+                             xmlNode *root_element)
 {
   gboolean rv = FALSE;
-  GSList *list;
   xmlNode *node;
 
   (void)file_name;
@@ -2073,32 +2120,42 @@ bookmark_set_time_last_visited(BookmarkItem *bm_item, const gchar *val,
   if (!doc)
     return FALSE;
 
-  list = g_slist_reverse(get_complete_path(bm_item));
-
-  nodeptriter = 1;
+  node = bm_bind_lookup(bm_item, root_element, BM_NODE_TIME_VISITED);
 
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  if (!node && (node = find_item_node(bm_item, root_element)))
+    node = get_node_by_tag(node->children, "time_visited");
 
   if (node)
   {
-    node = get_node_by_tag(node->children, "time_visited");
-
-    if (node)
-    {
-      xmlNodeSetContent(node, BAD_CAST val);
-      rv = TRUE;
-    }
+    xmlNodeSetContent(node, BAD_CAST val);
+    rv = TRUE;
   }
 
   return rv;
 }
 
+gboolean
+bookmark_set_time_last_visited(BookmarkItem *bm_item, const gchar *val,
+                               const gchar *file_name, xmlDocPtr doc,
+                               xmlNode *root_element)
+{
+  if (!bm_doc_set_time_last_visited(bm_item, val, file_name, doc,
+                                    root_element))
+  {
+    return FALSE;
+  }
+
+  if (item_is_writable(bm_item) && bm_item->time_last_visited != atoi(val))
+    bookmark_item_set_visited(bm_item, bm_item->visit_count, atoi(val));
+
+  return TRUE;
+}
+
 gboolean
 bookmark_set_thumbnail(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
                        xmlNode *root_element)
 {
   gboolean rv = FALSE;
-  GSList *list;
   xmlNode *node;
 
   (void)doc;
@@ -2106,36 +2163,39 @@ bookmark_set_thumbnail(BookmarkItem *bm_item, const gchar *val, xmlDocPtr doc,
   if (!bm_item || !val || bm_item->isFolder )
     return FALSE;
 
-  list = g_slist_reverse(get_complete_path(bm_item));
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  node = find_item_node(bm_item, root_element);
 
   if (node)
   {
     xmlSetProp(node, BAD_CAST "thumbnail", BAD_CAST val);
+
+    if (item_is_writable(bm_item) && g_strcmp0(bm_item->thumbnail_file, val))
+    {
+      bm_tree_strfree(bm_item->tree, bm_item->thumbnail_file);
+      bm_item->thumbnail_file = bm_tree_strdup(bm_item->tree, val);
+    }
+
     rv = TRUE;
   }
 
-  g_slist_free(list);
-
   return rv;
 }
 
-BMError
-opened_bm_engine_insert_node_at_sorted_position(BookmarkItem *parent,
-                                                BookmarkItem *bm_item,
-                                                SortOrder sort_order,
-                                                xmlNode *root_element)
+/* Adds bm_item next to the element of parent, returns the new element or NULL
+ * if parent has none */
+static xmlNode *
+insert_node_at_sorted_position(BookmarkItem *parent, BookmarkItem *bm_item,
+                               SortOrder sort_order, xmlNode *root_element)
 {
   xmlNode *bm_node;
-  GSList *list;
   xmlNode *node;
 
-  bm_node = add_bookmark_item(bm_item);
+  node = find_item_node(parent, root_element);
+
+  if (!node)
+    return NULL;
 
-  list = g_slist_reverse(get_complete_path(parent));
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  bm_node = add_bookmark_item(node->doc, bm_item);
 
   switch (sort_order)
   {
@@ -2147,80 +2207,118 @@ opened_bm_engine_insert_node_at_sorted_position(BookmarkItem *parent,
       break;
   }
 
-  g_slist_free(list);
-
-  return BM_OK;
+  return bm_node;
 }
 
 BMError
-bm_engine_insert_node_at_sorted_position(BookmarkItem *parent,
-                                         BookmarkItem *bm_item,
-                                         SortOrder sort_order, xmlDocPtr doc,
-                                         xmlNode *root_element)
-{
-  xmlNode *bm_node;
-  GSList *list;
-  xmlNode *node;
+opened_bm_engine_insert_node_at_sorted_position(BookmarkItem *parent,
+                                                BookmarkItem *bm_item,
+                                                SortOrder sort_order,
+                                                xmlNode *root_element)
+{
+  insert_node_at_sorted_position(parent, bm_item, sort_order, root_element);
+
+  return BM_OK;
+}
 
+BMError
+bm_engine_insert_node_at_sorted_position(BookmarkItem *parent,
+                                         BookmarkItem *bm_item,
+                                         SortOrder sort_order, xmlDocPtr doc,
+                                         xmlNode *root_element)
+{
   (void)doc;
 
-  bm_node = add_bookmark_item(bm_item);
-  list = g_slist_reverse(get_complete_path(parent));
-  nodeptriter = 1;
-  node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+  insert_node_at_sorted_position(parent, bm_item, sort_order, root_element);
 
-  switch (sort_order)
-  {
-    case BM_DSC:
-      xmlAddNextSibling(node, bm_node);
-      break;
-    case BM_ASC:
-      xmlAddPrevSibling(node, bm_node);
-      break;
-  }
+  return BM_OK;
+}
 
-  g_slist_free(list);
+xmlNode *
+bm_doc_append_child(BookmarkItem *parent, BookmarkItem *bm_item,
+                    xmlNode *root_element)
+{
+  xmlNode *node = find_item_node(parent, root_element);
 
-  return BM_OK;
+  if (!node)
+    return NULL;
+
+  /* the children of the root follow its <title> */
+  if (!parent->parent)
+    return xmlAddSibling(node, add_bookmark_item(node->doc, bm_item));
+
+  return xmlAddChild(node, add_bookmark_item(node->doc, bm_item));
 }
 
-BMError
-bookmark_add_child_at_sorted_position(BookmarkItem *parent,
-                                      BookmarkItem *bm_item,
-                                      SortType presentSortType, xmlDocPtr doc,
-                                      xmlNode *root_element)
+xmlNode *
+bm_add_child_at_sorted_position(BookmarkItem *parent, BookmarkItem *bm_item,
+                                SortType presentSortType, xmlDocPtr doc,
+                                xmlNode *root_element, SortOrder *order,
+                                BookmarkItem **before)
 {
   BookmarkItem *parent_item = NULL;
+  xmlNode *node;
+
+  (void)doc;
+
+  *before = NULL;
+
+  /* nothing to sort in among */
+  if (!parent->list)
+    return bm_doc_append_child(parent, bm_item, root_element);
 
   switch (presentSortType)
   {
     case SORT_BY_NAME_ASC:
     case SORT_BY_NAME_DSC:
-      parent_item = bookmark_gslist_find(parent->list, bm_item,
-                                         presentSortType);
+      parent_item = bm_gslist_find(parent->list, bm_item, presentSortType,
+                                   order);
       break;
     case SORT_BY_LASTVISIT_ASC:
     case SORT_BY_LASTVISIT_DSC:
-      parent_item = bookmark_gslist_find_by_addeddate(parent->list, bm_item,
-                                                      INSERT_BY_VISIT_TIME,
-                                                      presentSortType);
+      parent_item = bm_gslist_find_by_addeddate(parent->list, bm_item,
+                                                INSERT_BY_VISIT_TIME,
+                                                presentSortType, order);
       break;
     case SORT_BY_VISITCOUNT_ASC:
       parent_item = g_slist_last(parent->list)->data;
       break;
   }
 
-  return
-      bm_engine_insert_node_at_sorted_position(parent_item, bm_item,
-                                               sort_order, doc, root_element);
+  node = insert_node_at_sorted_position(parent_item, bm_item, *order,
+                                        root_element);
+
+  if (node && parent_item)
+    *before = *order == BM_ASC ? parent_item : parent_item->next_sibling;
+
+  return node;
+}
+
+BMError
+bookmark_add_child_at_sorted_position(BookmarkItem *parent,
+                                      BookmarkItem *bm_item,
+                                      SortType presentSortType, xmlDocPtr doc,
+                                      xmlNode *root_element)
+{
+  BookmarkItem *before;
+
+  /* where it sorts in is up to the list of the caller */
+  if (bm_add_child_at_sorted_position(parent, bm_item, presentSortType, doc,
+                                      root_element, &sort_order, &before))
+  {
+    link_added_child(parent, bm_item, before);
+  }
+
+  return BM_OK;
 }
 
 BMError
 opened_bookmark_add_child(BookmarkItem *parent, BookmarkItem *bm_item,
                           gint position, xmlNode *root_element)
 {
+  BookmarkItem *before = NULL;
+  xmlNode *added = NULL;
   xmlNode *node;
-  GSList *list;
 
   CHECK_PARAM(!bm_item || !parent || !parent->isFolder,
               "\nInvalid Input Parameter", return BM_INVALID_PARAMETER);
@@ -2230,33 +2328,25 @@ opened_bookmark_add_child(BookmarkItem *parent, BookmarkItem *bm_item,
     if (position == -1)
       position = g_slist_length(parent->list) - 1;
 
-    list = g_slist_reverse(get_complete_path(g_slist_nth(parent->list,
-                                                         position)->data));
-    nodeptriter = 1;
-    node = get_parent_nodeptr(list, root_element, g_slist_length(list));
+    before = g_slist_nth_data(parent->list, position);
+    node = find_item_node(before, root_element);
 
     if (node)
-      xmlAddPrevSibling(node, add_bookmark_item(bm_item));
-
-    g_slist_free(list);
+      added = xmlAddPrevSibling(node, add_bookmark_item(node->doc, bm_item));
   }
   else
   {
-    guint len;
-
-    list = g_slist_reverse(get_complete_path(parent));
-    len = g_slist_length(list);
-    nodeptriter = 1;
-    node = get_parent_nodeptr(list, root_element, len);
-
-    if (len == 1)
-      xmlAddSibling(node, add_bookmark_item(bm_item));
-    else
-      xmlAddChild(node, add_bookmark_item(bm_item));
+    node = find_item_node(parent, root_element);
 
-    g_slist_free(list);
+    if (node && !parent->parent)
+      added = xmlAddSibling(node, add_bookmark_item(node->doc, bm_item));
+    else if (node)
+      added = xmlAddChild(node, add_bookmark_item(node->doc, bm_item));
   }
 
+  if (added)
+    link_added_child(parent, bm_item, before);
+
   return BM_OK;
 }
 
@@ -2276,8 +2366,8 @@ sort_bookmark_by_time(BookmarkItem *a, BookmarkItem *b)
 }
 
 BookmarkItem *
-bookmark_gslist_find(GSList *parent_list, BookmarkItem *newItem,
-                     SortType presentSortType)
+bm_gslist_find(GSList *parent_list, BookmarkItem *newItem,
+               SortType presentSortType, SortOrder *order)
 {
   GSList *l;
   BookmarkItem *data;
@@ -2316,7 +2406,7 @@ bookmark_gslist_find(GSList *parent_list, BookmarkItem *newItem,
           {
             if (strcasecmp(data->name, newItem->name) >= 0)
             {
-              sort_order = BM_ASC;
+              *order = BM_ASC;
               g_slist_free(list);
               return data;
             }
@@ -2331,14 +2421,14 @@ bookmark_gslist_find(GSList *parent_list, BookmarkItem *newItem,
             if (presentSortType == SORT_BY_NAME_DSC &&
                 strcasecmp(data->name, newItem->name) <= 0)
             {
-              sort_order = BM_ASC;
+              *order = BM_ASC;
               g_slist_free(list);
               return data;
             }
           }
           else if (strcasecmp(data->name, newItem->name) >= 0)
           {
-            sort_order = BM_ASC;
+            *order = BM_ASC;
             g_slist_free(list);
             return data;
           }
@@ -2358,7 +2448,8 @@ out:
 
     tmp_data = list->data;
     g_slist_free(list);
-    sort_order = BM_ASC;
+    /* sorts after every item of its kind */
+    *order = BM_DSC;
 
     if (newItem->isFolder)
       data = tmp1;
@@ -2367,6 +2458,7 @@ out:
 
     if (!data)
     {
+      *order = BM_ASC;
       data = tmp_data;
       return data;
     }
@@ -2375,7 +2467,7 @@ out:
   {
     /* what ?!? Isn;t that a recipe for a SEGFAULT */
     data = l->data;
-    sort_order = BM_ASC;
+    *order = BM_ASC;
     g_slist_free(l);
   }
 
@@ -2383,9 +2475,16 @@ out:
 }
 
 BookmarkItem *
-bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
-                                  insertParam ins_param,
-                                  SortType presentSortType)
+bookmark_gslist_find(GSList *parent_list, BookmarkItem *newItem,
+                     SortType presentSortType)
+{
+  return bm_gslist_find(parent_list, newItem, presentSortType, &sort_order);
+}
+
+BookmarkItem *
+bm_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
+                            insertParam ins_param, SortType presentSortType,
+                            SortOrder *order)
 {
   GSList *l;
   GSList *sorted;
@@ -2404,7 +2503,7 @@ bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
   if (!g_slist_length(l))
   {
     old_item = l->data;
-    sort_order = BM_ASC;
+    *order = BM_ASC;
     g_slist_free(l);
     return old_item;
   }
@@ -2445,7 +2544,7 @@ bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
         {
           if (strcasecmp(old_item->name, newItem->name) >= 0)
           {
-            sort_order = BM_ASC;
+            *order = BM_ASC;
             g_slist_free(list);
             return old_item;
           }
@@ -2459,7 +2558,7 @@ bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
         {
           if (cur_time > new_time)
           {
-            sort_order = BM_ASC;
+            *order = BM_ASC;
             g_slist_free(list);
             return old_item;
           }
@@ -2467,7 +2566,7 @@ bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
         else if (presentSortType == SORT_BY_LASTVISIT_DSC &&
                  cur_time < new_time)
         {
-          sort_order = BM_ASC;
+          *order = BM_ASC;
           g_slist_free(list);
           return old_item;
         }
@@ -2488,7 +2587,7 @@ bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
 out:
   tmp_data = list->data;
   g_slist_free(list);
-  sort_order = BM_DSC;
+  *order = BM_DSC;
 
   if (newItem->isFolder)
     old_item = tmp1;
@@ -2501,11 +2600,23 @@ out:
   return old_item;
 }
 
+BookmarkItem *
+bookmark_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
+                                  insertParam ins_param,
+                                  SortType presentSortType)
+{
+  return bm_gslist_find_by_addeddate(parent_list, newItem, ins_param,
+                                     presentSortType, &sort_order);
+}
+
 #ifdef BOOKMARK_PARSER_TEST
 
+#include <assert.h>
+#include <signal.h>
+#include <sys/resource.h>
+
 #ifdef MAEMO5
 #include <libgnomevfs/gnome-vfs.h>
-#include <assert.h>
 
 static void
 compare(BookmarkItem *bm1, BookmarkItem *bm2, gboolean compare_times)
@@ -2568,8 +2679,1059 @@ compare(BookmarkItem *bm1, BookmarkItem *bm2, gboolean compare_times)
 }
 #endif
 
+#define JOURNAL_TEST_FILE "/tmp/bookmark-journal-test.xml"
+#define JOURNAL_TEST_JOURNAL JOURNAL_TEST_FILE ".journal"
+
+static const char *journal_test_xml =
+"<?xml version=\"1.0\"?>"
+"<xbel version=\"1.0\">"
+ "<title>My bookmarks</title>"
+ "<folder id=\"f1\" folded=\"no\">"
+  "<title>Folder</title>"
+  "<bookmark id=\"b1\" href=\"http://a.example/\">"
+   "<title>A</title>"
+   "<info><metadata><visit_count>1</visit_count></metadata></info>"
+  "</bookmark>"
+  "<bookmark id=\"b2\" href=\"http://b.example/\"><title>B</title></bookmark>"
+ "</folder>"
+"</xbel>";
+
+static BookmarkItem *
+journal_test_find(BookmarkItem *bm_item, const gchar *id)
+{
+  BookmarkItem *child;
+
+  if (!g_strcmp0(bm_item->id, id))
+    return bm_item;
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+  {
+    BookmarkItem *found = journal_test_find(child, id);
+
+    if (found)
+      return found;
+  }
+
+  return NULL;
+}
+
+static BookmarkItem *
+journal_test_load(void)
+{
+  BookmarkItem *root = NULL;
+
+  assert(get_root_bookmark_absolute_path_full(&root, JOURNAL_TEST_FILE,
+                                              BM_LOAD_DEFAULT));
+
+  return root;
+}
+
+static gchar *
+journal_test_contents(const gchar *file_name)
+{
+  gchar *contents = NULL;
+
+  g_file_get_contents(file_name, &contents, NULL, NULL);
+
+  return contents ? contents : g_strdup("");
+}
+
+static void
+journal_test_append(const gchar *s)
+{
+  FILE *fp = fopen(JOURNAL_TEST_JOURNAL, "a");
+
+  assert(fp);
+  fputs(s, fp);
+  fclose(fp);
+}
+
+static void
+test_journal(void)
+{
+  BookmarkJournal *journal;
+  BookmarkEngine *engine;
+  BookmarkItem *root;
+  BookmarkItem *b1;
+  gchar *contents;
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  assert(g_file_set_contents(JOURNAL_TEST_FILE, journal_test_xml, -1, NULL));
+
+  /* one line per change, values escaped */
+  root = journal_test_load();
+  journal = bookmark_journal_open(JOURNAL_TEST_FILE);
+  assert(journal);
+  b1 = journal_test_find(root, "b1");
+  assert(bookmark_journal_set(journal, b1, BM_JOURNAL_NAME, "Re\"named.bm"));
+  assert(bookmark_journal_set(journal, b1, BM_JOURNAL_VISIT_COUNT, "5"));
+  assert(bookmark_journal_remove(journal, journal_test_find(root, "b2")));
+  bookmark_item_free(root);
+
+  contents = journal_test_contents(JOURNAL_TEST_JOURNAL);
+  assert(!strcmp(contents, "name b1 Re\\\"named.bm\n"
+                           "visit_count b1 5\n"
+                           "remove b2\n"));
+  g_free(contents);
+
+  /* replayed on load, the file itself is left alone */
+  root = journal_test_load();
+  b1 = journal_test_find(root, "b1");
+  assert(!strcmp(b1->name, "Re\"named.bm") && b1->visit_count == 5);
+  assert(!journal_test_find(root, "b2"));
+  bookmark_item_free(root);
+
+  contents = journal_test_contents(JOURNAL_TEST_FILE);
+  assert(strstr(contents, "<title>A</title>"));
+  g_free(contents);
+
+  /* a torn last line is ignored, the next change starts a line of its own */
+  journal_test_append("name b1 Torn.bm");
+  root = journal_test_load();
+  b1 = journal_test_find(root, "b1");
+  assert(!strcmp(b1->name, "Re\"named.bm"));
+  assert(bookmark_journal_set(journal, b1, BM_JOURNAL_TIME_ADDED, "77"));
+  bookmark_item_free(root);
+
+  root = journal_test_load();
+  b1 = journal_test_find(root, "b1");
+  assert(!strcmp(b1->name, "Re\"named.bm") && b1->time_added == 77);
+  bookmark_item_free(root);
+
+  /* a full save has the journal in it and empties it, so that its older
+   * values do not come back on the next load */
+  engine = bookmark_engine_new(JOURNAL_TEST_FILE, BM_LOAD_DEFAULT);
+  b1 = journal_test_find(bookmark_engine_read_lock(engine), "b1");
+  bookmark_engine_read_unlock(engine);
+  assert(bookmark_engine_set_name(engine, b1, "Newer.bm"));
+  assert(bookmark_engine_save(engine));
+  bookmark_engine_free(engine);
+
+  contents = journal_test_contents(JOURNAL_TEST_JOURNAL);
+  assert(!strcmp(contents, "generation 1\n"));
+  g_free(contents);
+
+  root = journal_test_load();
+  b1 = journal_test_find(root, "b1");
+  assert(!strcmp(b1->name, "Newer.bm"));
+  assert(b1->visit_count == 5 && b1->time_added == 77);
+  assert(!journal_test_find(root, "b2"));
+
+  /* compaction folds the journal into the file, ".bm" is only cut off
+   * names that have it */
+  assert(bookmark_journal_set(journal, b1, BM_JOURNAL_NAME, "NoSuffix"));
+  assert(bookmark_journal_set(journal, journal_test_find(root, "f1"),
+                              BM_JOURNAL_NAME, "Folder.bm"));
+  assert(bookmark_journal_compact(journal));
+  bookmark_item_free(root);
+
+  contents = journal_test_contents(JOURNAL_TEST_JOURNAL);
+  assert(!strcmp(contents, "generation 2\n"));
+  g_free(contents);
+
+  contents = journal_test_contents(JOURNAL_TEST_FILE);
+  assert(strstr(contents, "<title>NoSuffix</title>"));
+  assert(strstr(contents, "<title>Folder.bm</title>"));
+  g_free(contents);
+
+  bookmark_journal_close(journal);
+  unlink(JOURNAL_TEST_JOURNAL);
+  unlink(JOURNAL_TEST_FILE);
+}
+
+static void
+test_journal_generation(void)
+{
+  BookmarkJournal *journal;
+  BookmarkEngine *engine;
+  BookmarkItem *root;
+  BookmarkItem *b1;
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  assert(g_file_set_contents(JOURNAL_TEST_FILE, journal_test_xml, -1, NULL));
+
+  root = journal_test_load();
+  journal = bookmark_journal_open(JOURNAL_TEST_FILE);
+  assert(journal);
+  assert(bookmark_journal_set(journal, journal_test_find(root, "b1"),
+                              BM_JOURNAL_VISIT_COUNT, "5"));
+
+  /* the engine document has the journal up to its end */
+  engine = bookmark_engine_new(JOURNAL_TEST_FILE, BM_LOAD_DEFAULT);
+  b1 = journal_test_find(bookmark_engine_read_lock(engine), "b1");
+  bookmark_engine_read_unlock(engine);
+  assert(bookmark_engine_set_name(engine, b1, "Open.bm"));
+
+  /* emptied by someone else, then grown past that end again: all of it is
+   * newer than the document */
+  assert(bookmark_journal_compact(journal));
+  assert(bookmark_journal_set(journal, journal_test_find(root, "b1"),
+                              BM_JOURNAL_TIME_ADDED, "77"));
+  assert(bookmark_journal_set(journal, journal_test_find(root, "b2"),
+                              BM_JOURNAL_URL, "http://c.example/"));
+  bookmark_item_free(root);
+
+  assert(bookmark_engine_save(engine));
+  bookmark_engine_free(engine);
+  assert(!bm_journal_pending(JOURNAL_TEST_FILE));
+
+  root = journal_test_load();
+  b1 = journal_test_find(root, "b1");
+  assert(!strcmp(b1->name, "Open.bm"));
+  assert(b1->visit_count == 5 && b1->time_added == 77);
+  assert(!strcmp(journal_test_find(root, "b2")->url, "http://c.example/"));
+  bookmark_item_free(root);
+
+  bookmark_journal_close(journal);
+  unlink(JOURNAL_TEST_JOURNAL);
+  unlink(JOURNAL_TEST_FILE);
+}
+
+#define SNAPSHOT_TEST_FILE "/tmp/bookmark-snapshot-test.xml"
+#define SNAPSHOT_TEST_SNAPSHOT SNAPSHOT_TEST_FILE ".snapshot"
+
+/* The test document with the title of b1 set to title, same size */
+static gchar *
+snapshot_test_xml(gchar title)
+{
+  gchar *xml = g_strdup(journal_test_xml);
+
+  strstr(xml, "<title>A</title>")[strlen("<title>")] = title;
+
+  return xml;
+}
+
+static const gchar *
+snapshot_test_b1_name(void)
+{
+  static gchar name[16];
+  BookmarkItem *root = NULL;
+
+  assert(get_root_bookmark_absolute_path_full(&root, SNAPSHOT_TEST_FILE,
+                                              BM_LOAD_SNAPSHOT));
+  g_strlcpy(name, journal_test_find(root, "b1")->name, sizeof(name));
+  bookmark_item_free(root);
+
+  return name;
+}
+
+/* TRUE if the snapshot would be used for the file as it is now */
+static gboolean
+snapshot_test_valid(void)
+{
+  BookmarkItem *root;
+  BmSnapshotKey key;
+  GString *update = NULL;
+
+  assert(bm_snapshot_key_for_file(SNAPSHOT_TEST_FILE, &key));
+  root = bm_snapshot_read(SNAPSHOT_TEST_FILE, &key, BM_LOAD_SNAPSHOT,
+                          BM_FIELD_ALL, &update);
+
+  if (update)
+    g_string_free(update, TRUE);
+
+  if (root)
+    bookmark_item_free(root);
+
+  return root != NULL;
+}
+
+static void
+test_snapshot(void)
+{
+  struct timespec times[2];
+  struct stat st;
+  gchar *xml;
+  FILE *fp;
+
+  unlink(SNAPSHOT_TEST_SNAPSHOT);
+  xml = snapshot_test_xml('A');
+  assert(g_file_set_contents(SNAPSHOT_TEST_FILE, xml, -1, NULL));
+  g_free(xml);
+
+  /* written by the first load, used by the next */
+  assert(!strcmp(snapshot_test_b1_name(), "A.bm"));
+  assert(g_file_test(SNAPSHOT_TEST_SNAPSHOT, G_FILE_TEST_EXISTS));
+  assert(snapshot_test_valid());
+  assert(!strcmp(snapshot_test_b1_name(), "A.bm"));
+
+  /* rewritten in place within the racy window with the same size and mtime,
+   * only the contents tell */
+  assert(!stat(SNAPSHOT_TEST_FILE, &st));
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  xml = snapshot_test_xml('Z');
+  fp = fopen(SNAPSHOT_TEST_FILE, "r+");
+  assert(fp);
+  fputs(xml, fp);
+  fflush(fp);
+  assert(!futimens(fileno(fp), times));
+  fclose(fp);
+  g_free(xml);
+
+  assert(!snapshot_test_valid());
+  assert(!strcmp(snapshot_test_b1_name(), "Z.bm"));
+
+  /* replaced by another file */
+  xml = snapshot_test_xml('Y');
+  assert(g_file_set_contents(SNAPSHOT_TEST_FILE, xml, -1, NULL));
+  g_free(xml);
+
+  assert(!snapshot_test_valid());
+  assert(!strcmp(snapshot_test_b1_name(), "Y.bm"));
+
+  unlink(SNAPSHOT_TEST_SNAPSHOT);
+  unlink(SNAPSHOT_TEST_FILE);
+}
+
+/* What the Netscape import used before bm_needle_rfind() */
+static const gchar *
+needle_test_strcasestr(const gchar *s1, const gchar *s2)
+{
+  gchar *s1_down = g_utf8_strdown(s1, -1);
+  gchar *s2_down = g_utf8_strdown(s2, -1);
+  gchar *p = g_strrstr(s1_down, s2_down);
+  const gchar *found = p ? &s1[p - s1_down] : NULL;
+
+  g_free(s1_down);
+  g_free(s2_down);
+
+  return found;
+}
+
+static void
+test_needle_rfind(void)
+{
+  static const gchar *const cases[][2] =
+  {
+    { "<DT><A HREF=\"http://a/\" ADD_DATE=\"1\">A</A>", "<A HREF=" },
+    { "<dt><a href=\"http://a/\">a</a>", "<A HREF=" },
+    { "</a> and </A> and </a", "</A>" },
+    { "<DT><H3 ADD_DATE=\"1\" LAST_VISIT=\"2\">F</H3>", "ADD_DATE=" },
+    { "<DT><H3>F</H3>", "</h3>" },
+    { "aaaa", "aa" },
+    { "AbAbAb", "bab" },
+    { "<HR>", "<HR><HR>" },
+    { "no tags here", "</DL>" },
+    { "", "<DD>" },
+    { "\303\204rger und \303\204RGER", "\303\244rger" },
+    { "\303\204RGER", "\303\204" }
+  };
+  BmNeedle needle;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(cases); i++)
+  {
+    needle.str = cases[i][1];
+    needle.len = strlen(cases[i][1]);
+    assert(bm_needle_rfind(cases[i][0], &needle) ==
+           needle_test_strcasestr(cases[i][0], cases[i][1]));
+  }
+
+  assert(!bm_needle_rfind(NULL, &needle));
+}
+
+static void
+watch_test_changed(BookmarkItem *bm_item, BookmarkChangeType change,
+                   gpointer user_data)
+{
+  if (change == BOOKMARK_CHANGE_MODIFIED)
+    (*(guint *)user_data)++;
+}
+
+static void
+test_watch_journal(void)
+{
+  BookmarkWatch *watch;
+  BookmarkItem *root = NULL;
+  guint modified = 0;
+  gint64 deadline;
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  assert(g_file_set_contents(JOURNAL_TEST_FILE, journal_test_xml, -1, NULL));
+
+  watch = bookmark_watch_new(&root, JOURNAL_TEST_FILE, watch_test_changed,
+                             &modified);
+  assert(watch && root);
+
+  /* a change that only went to the journal reaches the tree too */
+  journal_test_append("visit_count b1 9\n");
+  deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+  while (!modified && g_get_monotonic_time() < deadline)
+  {
+    if (!g_main_context_iteration(NULL, FALSE))
+      g_usleep(10000);
+  }
+
+  assert(modified);
+  assert(journal_test_find(root, "b1")->visit_count == 9);
+
+  bookmark_watch_free(watch);
+  free_bookmark_item(root);
+  unlink(JOURNAL_TEST_JOURNAL);
+  unlink(JOURNAL_TEST_FILE);
+}
+
+/* The journal test document with a bookmark without id, whose visits go to
+ * the document instead of the journal */
+static const char *engine_test_xml =
+"<?xml version=\"1.0\"?>"
+"<xbel version=\"1.0\">"
+ "<title>My bookmarks</title>"
+ "<folder id=\"f1\" folded=\"no\">"
+  "<title>Folder</title>"
+  "<bookmark id=\"b1\" href=\"http://a.example/\">"
+   "<title>A</title>"
+   "<info><metadata><visit_count>1</visit_count></metadata></info>"
+  "</bookmark>"
+  "<bookmark id=\"b2\" href=\"http://b.example/\"><title>B</title></bookmark>"
+  "<bookmark href=\"http://c.example/\"><title>C</title></bookmark>"
+ "</folder>"
+"</xbel>";
+
+static BookmarkEngine *
+engine_test_new(BookmarkItem **b1, BookmarkItem **b2, BookmarkItem **c)
+{
+  BookmarkEngine *engine;
+  BookmarkItem *root;
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  assert(g_file_set_contents(JOURNAL_TEST_FILE, engine_test_xml, -1, NULL));
+
+  engine = bookmark_engine_new(JOURNAL_TEST_FILE, BM_LOAD_DEFAULT);
+  root = bookmark_engine_read_lock(engine);
+  assert(root);
+  *b1 = journal_test_find(root, "b1");
+  *b2 = journal_test_find(root, "b2");
+  *c = bookmark_item_lookup_url(root, "http://c.example/");
+  bookmark_engine_read_unlock(engine);
+
+  return engine;
+}
+
+/* Runs the main loop until the journal has line, FALSE if it never does */
+static gboolean
+engine_test_wait_journal(const gchar *line)
+{
+  gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+  while (g_get_monotonic_time() < deadline)
+  {
+    gchar *contents = journal_test_contents(JOURNAL_TEST_JOURNAL);
+    gboolean found = strstr(contents, line) != NULL;
+
+    g_free(contents);
+
+    if (found)
+      return TRUE;
+
+    if (!g_main_context_iteration(NULL, FALSE))
+      g_usleep(10000);
+  }
+
+  return FALSE;
+}
+
+static guint
+engine_test_visit_count(BookmarkEngine *engine, BookmarkItem *bm_item)
+{
+  guint visit_count;
+
+  bookmark_engine_read_lock(engine);
+  visit_count = bm_item->visit_count;
+  bookmark_engine_read_unlock(engine);
+
+  return visit_count;
+}
+
+static void
+test_engine_visits(void)
+{
+  BookmarkEngine *engine;
+  BookmarkItem *root;
+  BookmarkItem *b1;
+  BookmarkItem *b2;
+  BookmarkItem *c;
+  struct rlimit limit;
+  struct rlimit no_writes;
+
+  /* a full buffer wakes the save thread, the tree gets the visits then */
+  engine = engine_test_new(&b1, &b2, &c);
+  bookmark_engine_set_visit_buffer(engine, 2, 0);
+  assert(bookmark_engine_set_visit_count(engine, b1, "3"));
+  assert(engine_test_visit_count(engine, b1) == 1);
+
+  assert(bookmark_engine_set_visit_count(engine, b2, "4"));
+  assert(engine_test_wait_journal("visit_count b1 3\n"));
+  assert(engine_test_wait_journal("visit_count b2 4\n"));
+  assert(engine_test_visit_count(engine, b1) == 3);
+  assert(engine_test_visit_count(engine, b2) == 4);
+  bookmark_engine_free(engine);
+
+  /* so does the delay, from the main loop */
+  engine = engine_test_new(&b1, &b2, &c);
+  bookmark_engine_set_visit_buffer(engine, 10, 1);
+  assert(bookmark_engine_set_visit_count(engine, b1, "6"));
+  assert(engine_test_wait_journal("visit_count b1 6\n"));
+  assert(engine_test_visit_count(engine, b1) == 6);
+  bookmark_engine_free(engine);
+
+  /* freeing the engine writes both kinds */
+  engine = engine_test_new(&b1, &b2, &c);
+  bookmark_engine_set_visit_buffer(engine, 10, 0);
+  assert(bookmark_engine_set_time_last_visited(engine, b2, "1234"));
+  assert(bookmark_engine_set_visit_count(engine, c, "7"));
+  bookmark_engine_free(engine);
+
+  root = journal_test_load();
+  assert(journal_test_find(root, "b2")->time_last_visited == 1234);
+  assert(bookmark_item_lookup_url(root, "http://c.example/")->visit_count == 7);
+  bookmark_item_free(root);
+
+  /* nothing can be written, neither the journal nor the file take the
+   * visits, which are written by the next flush */
+  engine = engine_test_new(&b1, &b2, &c);
+  bookmark_engine_set_visit_buffer(engine, 10, 0);
+  assert(bookmark_engine_set_visit_count(engine, b1, "8"));
+  assert(bookmark_engine_set_visit_count(engine, c, "9"));
+
+  signal(SIGXFSZ, SIG_IGN);
+  assert(!getrlimit(RLIMIT_FSIZE, &limit));
+  no_writes = limit;
+  no_writes.rlim_cur = 0;
+  assert(!setrlimit(RLIMIT_FSIZE, &no_writes));
+  assert(!bookmark_engine_flush_visits(engine));
+  assert(!setrlimit(RLIMIT_FSIZE, &limit));
+  signal(SIGXFSZ, SIG_DFL);
+
+  root = journal_test_load();
+  assert(journal_test_find(root, "b1")->visit_count == 1);
+  assert(bookmark_item_lookup_url(root, "http://c.example/")->visit_count == 0);
+  bookmark_item_free(root);
+
+  assert(bookmark_engine_flush_visits(engine));
+  bookmark_engine_free(engine);
+
+  root = journal_test_load();
+  assert(journal_test_find(root, "b1")->visit_count == 8);
+  assert(bookmark_item_lookup_url(root, "http://c.example/")->visit_count == 9);
+  bookmark_item_free(root);
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  unlink(JOURNAL_TEST_FILE);
+}
+
+typedef struct
+{
+  BookmarkEngine *engine;
+  guint done;
+  guint succeeded;
+} EngineTestSaves;
+
+static void
+engine_test_saved(GObject *source_object, GAsyncResult *result,
+                  gpointer user_data)
+{
+  EngineTestSaves *saves = user_data;
+
+  if (bookmark_engine_save_finish(saves->engine, result, NULL))
+    saves->succeeded++;
+
+  saves->done++;
+}
+
+/* Generation of the journal, bumped by every write of the file */
+static guint
+engine_test_generation(void)
+{
+  gchar *contents = journal_test_contents(JOURNAL_TEST_JOURNAL);
+  guint generation = 0;
+
+  sscanf(contents, "generation %u", &generation);
+  g_free(contents);
+
+  return generation;
+}
+
+static void
+test_engine_save_async(void)
+{
+  static const gchar *const names[] = { "One.bm", "Two.bm", "Three.bm" };
+  EngineTestSaves saves = { NULL, 0, 0 };
+  BookmarkEngine *engine;
+  BookmarkLock *lock;
+  BookmarkItem *root;
+  BookmarkItem *b1;
+  BookmarkItem *b2;
+  BookmarkItem *c;
+  gchar *lock_dir;
+  gint64 deadline;
+  guint generation;
+  guint i;
+
+  engine = engine_test_new(&b1, &b2, &c);
+  saves.engine = engine;
+
+  /* every write empties the journal with a new generation */
+  journal_test_append("");
+  generation = engine_test_generation();
+
+  /* the first write waits for the lock, the saves asked for meanwhile are
+   * all written by the next one */
+  lock_dir = g_build_filename(g_get_home_dir(), ".bookmarks", NULL);
+  g_mkdir_with_parents(lock_dir, 0755);
+  g_free(lock_dir);
+  lock = bookmark_lock_acquire(BOOKMARK_FLOCK_PATH, BM_LOCK_EXCLUSIVE, 0);
+  assert(lock);
+
+  for (i = 0; i < G_N_ELEMENTS(names); i++)
+  {
+    assert(bookmark_engine_set_name(engine, b1, names[i]));
+    bookmark_engine_save_async(engine, NULL, engine_test_saved, &saves);
+  }
+
+  bookmark_lock_release(lock);
+  deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+  while (saves.done < G_N_ELEMENTS(names) &&
+         g_get_monotonic_time() < deadline)
+  {
+    if (!g_main_context_iteration(NULL, FALSE))
+      g_usleep(10000);
+  }
+
+  assert(saves.done == G_N_ELEMENTS(names));
+  assert(saves.succeeded == G_N_ELEMENTS(names));
+  assert(engine_test_generation() > generation);
+  assert(engine_test_generation() <= generation + 2);
+  bookmark_engine_free(engine);
+
+  root = journal_test_load();
+  assert(!strcmp(journal_test_find(root, "b1")->name, "Three.bm"));
+  bookmark_item_free(root);
+
+  unlink(JOURNAL_TEST_JOURNAL);
+  unlink(JOURNAL_TEST_FILE);
+}
+
+#define INDEX_TEST_FILE "/tmp/bookmark-index-test.xml"
+
+#define INDEX_TEST_BOOKMARK(title, url, visit_count, time_visited) \
+  "<bookmark href=\"" url "\"><title>" title "</title>" \
+   "<info><metadata><visit_count>" visit_count "</visit_count>" \
+    "<time_visited>" time_visited "</time_visited></metadata></info>" \
+  "</bookmark>"
+
+static const char *index_test_xml =
+"<?xml version=\"1.0\"?>"
+"<xbel version=\"1.0\">"
+ "<title>My bookmarks</title>"
+ "<folder folded=\"no\">"
+  "<title>Work</title>"
+  INDEX_TEST_BOOKMARK("Wiki", "http://wiki.example/", "5", "100")
+  INDEX_TEST_BOOKMARK("Mail", "http://mail.example/", "2", "300")
+  "<folder folded=\"no\">"
+   "<title>Projects</title>"
+   INDEX_TEST_BOOKMARK("Tracker", "http://tracker.example/", "9", "900")
+   INDEX_TEST_BOOKMARK("Docs", "http://docs.example/", "3", "200")
+  "</folder>"
+ "</folder>"
+ INDEX_TEST_BOOKMARK("News", "http://news.example/", "4", "400")
+ INDEX_TEST_BOOKMARK("Wiki mirror", "http://wiki.example/", "1", "50")
+"</xbel>";
+
+static gint
+index_test_name_cmp(gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+/* Appends the names of items sorted, ties in the ranking may come in any
+ * order, and frees the list */
+static void
+index_test_append_items(GString *out, GSList *items)
+{
+  GPtrArray *names = g_ptr_array_new();
+  GSList *l;
+  guint i;
+
+  for (l = items; l; l = l->next)
+    g_ptr_array_add(names, ((BookmarkItem *)l->data)->name);
+
+  g_ptr_array_sort(names, index_test_name_cmp);
+
+  for (i = 0; i < names->len; i++)
+    g_string_append_printf(out, " %s", (gchar *)g_ptr_array_index(names, i));
+
+  g_string_append_c(out, '\n');
+  g_ptr_array_free(names, TRUE);
+  g_slist_free(items);
+}
+
+/* Writes what every index of the tree answers about bm_item and the items
+ * below it to out. Paths are checked against the child links right away. */
+static void
+index_test_dump(BookmarkItem *root, BookmarkItem *bm_item, const gchar *path,
+                GString *out)
+{
+  BookmarkItem *child;
+  guint n;
+  guint i;
+
+  g_string_append_printf(out, "%s\n", bm_item->name);
+
+  if (!bm_item->isFolder)
+  {
+    gchar *title = g_strndup(bm_item->name, strlen(bm_item->name) - 3);
+
+    g_string_append(out, "url");
+    index_test_append_items(out,
+                            bookmark_item_lookup_url_all(root, bm_item->url));
+    g_string_append(out, "complete");
+    index_test_append_items(out,
+                            bookmark_item_complete_url(root, bm_item->url, 0));
+    g_string_append(out, "search");
+    index_test_append_items(out, bookmark_item_search(root, title, 0));
+    g_free(title);
+
+    return;
+  }
+
+  g_string_append_printf(out, "stats %u %u %u %d\n", bm_item->stats.n_items,
+                         bm_item->stats.n_folders,
+                         bm_item->stats.max_visit_count,
+                         (gint)bm_item->stats.latest_visit);
+
+  n = bookmark_item_get_n_children(bm_item);
+  child = bm_item->first_child;
+
+  for (i = 0; i < n; i++, child = child->next_sibling)
+  {
+    BookmarkItem *window[1];
+    gchar *child_path;
+
+    assert(child);
+    assert(bookmark_item_get_nth_child(bm_item, i) == child);
+    assert(bookmark_item_get_children(bm_item, i, 1, window) == 1);
+    assert(window[0] == child);
+    assert(g_slist_nth_data(bm_item->list, i) == child);
+
+    if (child->isFolder)
+      child_path = g_strconcat(path, "/", child->name, NULL);
+    else
+    {
+      child_path = g_strdup_printf("%s/%.*s", path,
+                                   (int)strlen(child->name) - 3, child->name);
+    }
+
+    assert(bookmark_item_resolve_path(root, child_path) == child);
+    index_test_dump(root, child, child_path, out);
+    g_free(child_path);
+  }
+
+  assert(!child);
+}
+
+static BookmarkVisitResult
+index_test_rebuild_folder(BookmarkItem *bm_item, guint depth,
+                          gpointer user_data)
+{
+  if (bm_item->isFolder)
+  {
+    bm_child_names_free(bm_item);
+    bm_child_names_build(bm_item);
+    bm_child_array_free(bm_item);
+    bm_child_array_build(bm_item);
+  }
+
+  return BM_VISIT_CONTINUE;
+}
+
+static void
+test_tree_indexes(void)
+{
+  BookmarkItem *root = NULL;
+  BookmarkItem *calendar;
+  BookmarkItem *bm_item;
+  GString *kept;
+  GString *built;
+
+  assert(g_file_set_contents(INDEX_TEST_FILE, index_test_xml, -1, NULL));
+  assert(get_root_bookmark_absolute_path_full(&root, INDEX_TEST_FILE,
+                                              BM_LOAD_DEFAULT));
+
+  /* every index exists before the changes, so they have to follow them */
+  kept = g_string_new(NULL);
+  index_test_dump(root, root, "", kept);
+
+  bookmark_item_set_url(bookmark_item_resolve_path(root, "Work/Projects/Docs"),
+                        "http://docs.example.org/");
+  bookmark_item_set_name(bookmark_item_resolve_path(root, "Work/Mail"),
+                         "Inbox.bm");
+  bookmark_item_set_visited(bookmark_item_resolve_path(root, "News"), 7, 700);
+
+  calendar = create_bookmark_new();
+  bookmark_item_set_name(calendar, "Calendar.bm");
+  bookmark_item_set_url(calendar, "http://calendar.example/");
+  bookmark_item_set_visited(calendar, 6, 600);
+  bookmark_item_append_child(bookmark_item_resolve_path(root,
+                                                        "Work/Projects"),
+                             calendar);
+
+  bookmark_item_append_child(root, bookmark_item_resolve_path(root,
+                                                              "Work/Wiki"));
+
+  /* the most visited and latest item, the folders above it look again */
+  bm_item = bookmark_item_resolve_path(root, "Work/Projects/Tracker");
+  bookmark_item_unlink(bm_item);
+  bookmark_item_free(bm_item);
+
+  assert(root->stats.n_items == 6 && root->stats.n_folders == 2);
+  assert(root->stats.max_visit_count == 7 && root->stats.latest_visit == 700);
+  bm_item = bookmark_item_resolve_path(root, "Work");
+  assert(bm_item->stats.max_visit_count == 6);
+  assert(bm_item->stats.latest_visit == 600);
+
+  g_string_truncate(kept, 0);
+  index_test_dump(root, root, "", kept);
+
+  bm_url_index_build(root);
+  bm_search_index_build(root);
+  bm_url_trie_build(root);
+  bookmark_item_walk(root, BM_WALK_DEPTH_FIRST, index_test_rebuild_folder,
+                     NULL, NULL);
+  bm_stats_compute(root);
+
+  built = g_string_new(NULL);
+  index_test_dump(root, root, "", built);
+  assert(!strcmp(kept->str, built->str));
+
+  g_string_free(kept, TRUE);
+  g_string_free(built, TRUE);
+  bookmark_item_free(root);
+  unlink(INDEX_TEST_FILE);
+}
+
+#define LOADER_TEST_FILE "/tmp/bookmark-loader-test.xml"
+/* PARALLEL_MIN_SIZE of bookmark_parallel.c, below it the file is read
+ * serially anyway */
+#define LOADER_TEST_MIN_SIZE (256 * 1024)
+
+static void
+loader_test_bookmark(GString *xml, guint i)
+{
+  if (i % 9)
+    g_string_append_printf(xml, "<bookmark id=\"b%u\"", i);
+  else
+    g_string_append(xml, "<bookmark");
+
+  g_string_append_printf(xml, " href=\"http://host%u.example/?a=1&amp;b=%u\"",
+                         i % 97, i);
+
+  if (i % 4)
+  {
+    g_string_append_printf(xml, " thumbnail=\"thumb%u.png\""
+                           " favicon=\"icon%u.ico\"", i, i % 31);
+  }
+
+  g_string_append_printf(xml, ">\n <title>Page %u &amp; more</title>\n"
+                         " <info><metadata>"
+                         "<visit_count>%u</visit_count>"
+                         "<time_added>%u</time_added>", i, (i * 7) % 13,
+                         1000 + i);
+
+  if (i % 5)
+    g_string_append_printf(xml, "<time_visited>%u</time_visited>", 2000 + i);
+
+  if (!(i % 11))
+  {
+    g_string_append_printf(xml, "<operator_bookmark>1</operator_bookmark>"
+                           "<deleted>%u</deleted>", !(i % 22));
+  }
+
+  g_string_append(xml, "</metadata></info>\n</bookmark>\n");
+}
+
+/* Top level folders with folders in them and bookmarks in between, all
+ * fields set on some of them */
+static void
+loader_test_write(void)
+{
+  GString *xml = g_string_new("<?xml version=\"1.0\"?>\n"
+                              "<xbel version=\"1.0\">\n"
+                              "<title>My bookmarks</title>\n");
+  guint i = 0;
+  guint f;
+  guint s;
+  guint b;
+
+  for (f = 0; f < 12; f++)
+  {
+    g_string_append_printf(xml, "<folder id=\"f%u\" folded=\"no\">\n"
+                           "<title>Folder %u</title>\n", f, f);
+
+    for (s = 0; s < 3; s++)
+    {
+      g_string_append_printf(xml, "<folder id=\"f%u.%u\" folded=\"yes\">\n"
+                             "<title>Sub %u</title>\n", f, s, s);
+
+      for (b = 0; b < 50; b++)
+        loader_test_bookmark(xml, i++);
+
+      g_string_append(xml, "</folder>\n");
+    }
+
+    loader_test_bookmark(xml, i++);
+    g_string_append(xml, "<folder><title>Empty</title></folder>\n"
+                         "</folder>\n");
+    loader_test_bookmark(xml, i++);
+  }
+
+  g_string_append(xml, "</xbel>\n");
+  assert(xml->len > LOADER_TEST_MIN_SIZE);
+  assert(g_file_set_contents(LOADER_TEST_FILE, xml->str, xml->len, NULL));
+  g_string_free(xml, TRUE);
+}
+
+static void
+loader_test_str(const gchar *s, const gchar *expected, gboolean loaded)
+{
+  if (!loaded)
+    assert(!s);
+  else
+    assert(!g_strcmp0(s, expected));
+}
+
+/* Compares the tree bm_item was loaded into with the serially loaded one
+ * with every field, fields not in the mask have to be left out */
+static void
+loader_test_compare(BookmarkItem *bm_item, BookmarkItem *expected,
+                    BookmarkFieldMask fields, gboolean lists)
+{
+  gboolean metadata = (fields & BM_FIELD_METADATA) != 0;
+  BookmarkItem *child;
+  BookmarkItem *other;
+  GSList *l;
+
+  assert(bm_item->isFolder == expected->isFolder);
+  loader_test_str(bm_item->url, expected->url, fields & BM_FIELD_URLS);
+  loader_test_str(bm_item->favicon_file, expected->favicon_file,
+                  fields & BM_FIELD_ASSETS);
+  loader_test_str(bm_item->thumbnail_file, expected->thumbnail_file,
+                  fields & BM_FIELD_ASSETS);
+  loader_test_str(bm_item->id, expected->id, fields & BM_FIELD_IDS);
+
+  if (fields & BM_FIELD_NAMES)
+    assert(!g_strcmp0(bm_item->name, expected->name));
+  else
+    assert(!bm_item->name);
+
+  assert(bm_item->visit_count == (metadata ? expected->visit_count : 0));
+  assert(bm_item->time_added == (metadata ? expected->time_added : 0));
+  assert(bm_item->time_last_visited ==
+         (metadata ? expected->time_last_visited : 0));
+  assert(bm_item->isOperatorBookmark ==
+         (metadata ? expected->isOperatorBookmark : FALSE));
+  assert(bm_item->isDeleted == (metadata ? expected->isDeleted : FALSE));
+
+  l = bm_item->list;
+  child = bm_item->first_child;
+
+  for (other = expected->first_child; other; other = other->next_sibling)
+  {
+    assert(child && child->parent == bm_item);
+    loader_test_compare(child, other, fields, lists);
+
+    if (lists)
+    {
+      assert(l && l->data == child);
+      l = l->next;
+    }
+
+    if (!child->next_sibling)
+      assert(bm_item->last_child == child);
+
+    child = child->next_sibling;
+  }
+
+  assert(!child && !l);
+
+  if (!lists)
+    assert(!bm_item->list);
+}
+
+static void
+test_loader_equivalence(void)
+{
+  static const BookmarkFieldMask masks[] =
+  {
+    BM_FIELD_ALL,
+    BM_FIELD_NAMES,
+    BM_FIELD_URLS,
+    BM_FIELD_ASSETS,
+    BM_FIELD_METADATA,
+    BM_FIELD_IDS,
+    BM_FIELD_NAMES | BM_FIELD_URLS
+  };
+  BookmarkItem *expected;
+  BookmarkItem *root;
+  guint i;
+
+  loader_test_write();
+  expected = bm_loader_read_file(LOADER_TEST_FILE, BM_LOAD_DEFAULT,
+                                 BM_FIELD_ALL);
+  assert(expected && expected->first_child);
+
+  for (i = 0; i < G_N_ELEMENTS(masks); i++)
+  {
+    root = bm_loader_read_file(LOADER_TEST_FILE, BM_LOAD_DEFAULT, masks[i]);
+    loader_test_compare(root, expected, masks[i], TRUE);
+    bookmark_item_free(root);
+
+    root = bm_loader_read_file_parallel(LOADER_TEST_FILE, BM_LOAD_DEFAULT,
+                                        masks[i]);
+    loader_test_compare(root, expected, masks[i], TRUE);
+    bookmark_item_free(root);
+
+    root = bm_loader_read_file_parallel(LOADER_TEST_FILE, BM_LOAD_ARENA,
+                                        masks[i]);
+    loader_test_compare(root, expected, masks[i], TRUE);
+    bookmark_item_free(root);
+
+    root = bm_loader_read_file_lazy(LOADER_TEST_FILE, BM_LOAD_LAZY,
+                                    masks[i]);
+    bm_item_expand_all(root);
+    loader_test_compare(root, expected, masks[i], TRUE);
+    bookmark_item_free(root);
+  }
+
+  root = bm_loader_read_file(LOADER_TEST_FILE, BM_LOAD_ARENA, BM_FIELD_ALL);
+  loader_test_compare(root, expected, BM_FIELD_ALL, TRUE);
+  bookmark_item_free(root);
+
+  root = bm_loader_read_file_parallel(LOADER_TEST_FILE,
+                                      BM_LOAD_ARENA | BM_LOAD_NO_CHILD_LISTS,
+                                      BM_FIELD_ALL);
+  loader_test_compare(root, expected, BM_FIELD_ALL, FALSE);
+  bookmark_item_free(root);
+
+  bookmark_item_free(expected);
+  unlink(LOADER_TEST_FILE);
+}
+
 int main()
 {
+  test_loader_equivalence();
+  test_tree_indexes();
+  test_journal();
+  test_journal_generation();
+  test_watch_journal();
+  test_engine_visits();
+  test_engine_save_async();
+  test_snapshot();
+  test_needle_rfind();
+
 #ifdef MAEMO5
   BookmarkItem *bm1 = NULL, *bm2 = NULL;
 
@@ -0,0 +1,180 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Every folder a path went through keeps a map from the title of a child to
+ * the first child with it, the title being the name without the ".bm" of
+ * bookmarks. Built on the first lookup in the folder, so resolving a path
+ * costs one hash lookup per component. Linking, unlinking and renaming a
+ * child change the map in place; bookmark_item_relink_children() drops it.
+ * The maps of arena trees are freed together with the tree, their items are
+ * not freed one by one.
+ */
+
+/* Length of the title in the name of bm_item */
+static gsize
+title_len(const BookmarkItem *bm_item)
+{
+  gsize len = strlen(bm_item->name);
+
+  if (!bm_item->isFolder && len >= 3 && !strcmp(bm_item->name + len - 3, ".bm"))
+    len -= 3;
+
+  return len;
+}
+
+static inline gchar *
+title_dup(const BookmarkItem *bm_item)
+{
+  return g_strndup(bm_item->name, title_len(bm_item));
+}
+
+static GHashTable *
+child_names(BookmarkItem *folder)
+{
+  BookmarkItem *child;
+
+  if (folder->child_names)
+    return folder->child_names;
+
+  bm_loader_expand(folder);
+
+  folder->child_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              NULL);
+
+  for (child = folder->first_child; child; child = child->next_sibling)
+  {
+    gchar *title;
+
+    if (!child->name)
+      continue;
+
+    title = title_dup(child);
+
+    if (g_hash_table_contains(folder->child_names, title))
+      g_free(title);
+    else
+      g_hash_table_insert(folder->child_names, title, child);
+  }
+
+  if (folder->tree && folder->tree->arena)
+  {
+    folder->tree->child_names =
+        g_slist_prepend(folder->tree->child_names, folder->child_names);
+  }
+
+  return folder->child_names;
+}
+
+void
+bm_child_names_build(BookmarkItem *folder)
+{
+  child_names(folder);
+}
+
+void
+bm_child_names_free(BookmarkItem *folder)
+{
+  if (folder->child_names)
+  {
+    g_hash_table_destroy(folder->child_names);
+    folder->child_names = NULL;
+  }
+}
+
+void
+bm_child_names_add(BookmarkItem *parent, BookmarkItem *child)
+{
+  BookmarkItem *other;
+  gchar *title;
+
+  if (!parent->child_names || !child->name)
+    return;
+
+  title = title_dup(child);
+  other = g_hash_table_lookup(parent->child_names, title);
+
+  if (other)
+  {
+    BookmarkItem *next;
+
+    /* the first of children with the same title keeps it */
+    for (next = child->next_sibling; next && next != other;
+         next = next->next_sibling)
+      ;
+
+    if (!next)
+    {
+      g_free(title);
+      return;
+    }
+  }
+
+  g_hash_table_insert(parent->child_names, title, child);
+}
+
+void
+bm_child_names_remove(BookmarkItem *parent, BookmarkItem *child)
+{
+  BookmarkItem *other;
+  gchar *title;
+
+  if (!parent->child_names || !child->name)
+    return;
+
+  title = title_dup(child);
+
+  if (g_hash_table_lookup(parent->child_names, title) == child)
+  {
+    g_hash_table_remove(parent->child_names, title);
+
+    /* the next child with the title takes it over */
+    for (other = parent->first_child; other; other = other->next_sibling)
+    {
+      if (other != child && other->name &&
+          title_len(other) == strlen(title) &&
+          !strncmp(other->name, title, strlen(title)))
+      {
+        g_hash_table_insert(parent->child_names, g_strdup(title), other);
+        break;
+      }
+    }
+  }
+
+  g_free(title);
+}
+
+BookmarkItem *
+bookmark_item_resolve_path(BookmarkItem *folder, const gchar *path)
+{
+  gchar *components;
+  gchar *next;
+
+  CHECK_PARAM(!folder || !path, "\nInvalid Input Parameter", return NULL);
+
+  components = g_strdup(path);
+  next = components;
+
+  while (next && folder)
+  {
+    gchar *c = next;
+
+    next = strchr(next, '/');
+
+    if (next)
+      *next++ = '\0';
+
+    if (!*c)
+      continue;
+
+    if (!folder->isFolder)
+      folder = NULL;
+    else
+      folder = g_hash_table_lookup(child_names(folder), c);
+  }
+
+  g_free(components);
+
+  return folder;
+}
@@ -0,0 +1,546 @@
+/**
+  * Copyright (C) 2005 Nokia Corporation.
+  *
+  * This library is free software; you can redistribute it and/or
+  * modify it under the terms of the GNU Lesser General Public License
+  * as published by the Free Software Foundation; either version 2.1 of
+  * the License, or (at your option) any later version.
+  *
+  * This library is distributed in the hope that it will be useful, but
+  * WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  * Lesser General Public License for more details.
+  *
+  * You should have received a copy of the GNU Lesser General Public
+  * License along with this library; if not, write to the Free Software
+  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+  * 02110-1301 USA
+  *
+  */
+
+/* Declarations shared between the library's translation units. Not
+ * installed. */
+
+#ifndef __BOOKMARK_PRIVATE_H__
+#define __BOOKMARK_PRIVATE_H__
+
+#include "osso_bookmark_parser.h"
+
+G_BEGIN_DECLS
+
+/* Bump allocator behind BM_LOAD_ARENA trees */
+typedef struct _BmArena BmArena;
+
+struct _BookmarkTree
+{
+  /* root item, freeing it frees the tree */
+  BookmarkItem *root;
+  BookmarkLoadFlags flags;
+  BookmarkFieldMask fields;
+  /* NULL unless loaded with BM_LOAD_ARENA */
+  BmArena *arena;
+  /* snapshot the strings of an arena tree point into, if any */
+  GMappedFile *mapped_file;
+  /* BM_LOAD_LAZY: the parsed file and the element of every folder whose
+   * children are not built yet, both dropped once all folders are built */
+  xmlDoc *doc;
+  GHashTable *lazy_nodes;
+  /* BM_LOAD_ARENA: child_names and child_array of the items, their items are
+   * not freed one by one */
+  GSList *child_names;
+  GSList *child_arrays;
+  /* BM_LOAD_ARENA: an item was bound to a document, whose elements point
+   * back into the arena */
+  gboolean bound;
+};
+
+G_GNUC_INTERNAL BmArena *bm_arena_new(void);
+G_GNUC_INTERNAL void bm_arena_free(BmArena *arena);
+G_GNUC_INTERNAL gpointer bm_arena_alloc(BmArena *arena, gsize size);
+G_GNUC_INTERNAL gpointer bm_arena_alloc0(BmArena *arena, gsize size);
+G_GNUC_INTERNAL gchar *bm_arena_strndup(BmArena *arena, const gchar *s,
+                                        gsize len);
+G_GNUC_INTERNAL gchar *bm_arena_strconcat(BmArena *arena, const gchar *s1,
+                                          const gchar *s2);
+/* Moves all memory of from into arena, from is left empty */
+G_GNUC_INTERNAL void bm_arena_steal(BmArena *arena, BmArena *from);
+
+G_GNUC_INTERNAL BookmarkTree *bm_tree_new(BookmarkLoadFlags flags);
+G_GNUC_INTERNAL void bm_tree_free(BookmarkTree *tree);
+
+/* Allocation helpers for loaders, tree may be NULL for plain heap items */
+G_GNUC_INTERNAL BookmarkItem *bm_tree_new_item(BookmarkTree *tree);
+G_GNUC_INTERNAL gchar *bm_tree_strdup(BookmarkTree *tree, const gchar *s);
+G_GNUC_INTERNAL gchar *bm_tree_strconcat(BookmarkTree *tree, const gchar *s1,
+                                         const gchar *s2);
+G_GNUC_INTERNAL void bm_tree_strfree(BookmarkTree *tree, gchar *s);
+G_GNUC_INTERNAL GSList *bm_tree_slist_prepend(BookmarkTree *tree,
+                                              GSList *list, gpointer data);
+
+G_GNUC_INTERNAL void free_bookmark_item(BookmarkItem *bm_item);
+
+/* Frees the parsed file of a lazy tree once no folder needs it */
+G_GNUC_INTERNAL void bm_tree_lazy_done(BookmarkTree *tree);
+/* Builds everything below bm_item and takes it out of its lazy tree */
+G_GNUC_INTERNAL void bm_tree_detach(BookmarkItem *bm_item);
+
+/* Appends child through the intrusive links only, list is left alone */
+G_GNUC_INTERNAL void bm_item_link_child(BookmarkItem *parent,
+                                        BookmarkItem *child);
+/* Links child into the children of parent before before, last if that is
+ * NULL or no child of parent, and into the caches and indexes of the tree.
+ * list is left alone. */
+G_GNUC_INTERNAL void bm_item_insert_child(BookmarkItem *parent,
+                                          BookmarkItem *child,
+                                          BookmarkItem *before);
+/* Fills in list of bm_item and all folders below it from the links */
+G_GNUC_INTERNAL void bm_item_build_lists(BookmarkItem *bm_item);
+/* The root item of the tree bm_item is linked into */
+G_GNUC_INTERNAL BookmarkItem *bm_item_root(BookmarkItem *bm_item);
+/* Builds every folder below bm_item of a lazy tree */
+G_GNUC_INTERNAL void bm_item_expand_all(BookmarkItem *bm_item);
+/* Add bm_item and everything below it to the indexes of the tree it is
+ * linked into, or remove them */
+G_GNUC_INTERNAL void bm_item_index_add(BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_item_index_remove(BookmarkItem *bm_item);
+
+/* Makes the tree of old_root what new_root holds, the way a BookmarkWatch
+ * does on a reload: matched items are updated in place, the others added or
+ * taken out, and func, if not NULL, is told about each. The items taken out
+ * are added to removed, or freed if it is NULL. new_root is freed. Items
+ * whose name or url changed are not moved in the indexes of old_root, the
+ * caller drops or rebuilds those. */
+G_GNUC_INTERNAL void bm_tree_patch(BookmarkItem *old_root,
+                                   BookmarkItem *new_root,
+                                   BookmarkWatchFunc func, gpointer user_data,
+                                   GPtrArray *removed);
+
+/* The functions of the same name without bm_, with the sort order in order
+ * instead of a global */
+G_GNUC_INTERNAL BookmarkItem *bm_gslist_find(GSList *parent_list,
+                                             BookmarkItem *newItem,
+                                             SortType presentSortType,
+                                             SortOrder *order);
+G_GNUC_INTERNAL BookmarkItem *
+bm_gslist_find_by_addeddate(GSList *parent_list, BookmarkItem *newItem,
+                            insertParam ins_param, SortType presentSortType,
+                            SortOrder *order);
+/* Adds bm_item to doc next to the child of parent it sorts after or before,
+ * returns its new element or NULL if nothing was added. before is set to the
+ * child of parent bm_item went in front of, NULL if it went last. */
+G_GNUC_INTERNAL xmlNode *
+bm_add_child_at_sorted_position(BookmarkItem *parent, BookmarkItem *bm_item,
+                                SortType presentSortType, xmlDocPtr doc,
+                                xmlNode *root_element, SortOrder *order,
+                                BookmarkItem **before);
+/* Adds bm_item and everything below it to doc as the last child of parent,
+ * returns its new element or NULL if parent has none */
+G_GNUC_INTERNAL xmlNode *bm_doc_append_child(BookmarkItem *parent,
+                                             BookmarkItem *bm_item,
+                                             xmlNode *root_element);
+
+/* Elements a BookmarkNodeRef points to */
+typedef enum
+{
+  /* the <folder> or <bookmark> */
+  BM_NODE_ELEMENT,
+  /* its first <title> */
+  BM_NODE_TITLE,
+  /* the rest as get_node_by_tag() finds them below the element */
+  BM_NODE_METADATA,
+  BM_NODE_VISIT_COUNT,
+  BM_NODE_TIME_VISITED,
+  BM_NODE_DELETED,
+  BM_NODE_N_PARTS
+} BmNodePart;
+
+/* Returns the element of bm_item bound to the document of root_element, NULL
+ * if bm_item is not bound to it or has no such element */
+G_GNUC_INTERNAL xmlNode *bm_bind_lookup(const BookmarkItem *bm_item,
+                                        const xmlNode *root_element,
+                                        BmNodePart part);
+/* Remembers an element that was added for bm_item */
+G_GNUC_INTERNAL void bm_bind_update(BookmarkItem *bm_item,
+                                    const xmlNode *root_element,
+                                    BmNodePart part, xmlNode *node);
+/* TRUE if bm_item is bound to the document of root_element, even if its
+ * element was removed since */
+G_GNUC_INTERNAL gboolean bm_bind_is_bound(const BookmarkItem *bm_item,
+                                          const xmlNode *root_element);
+/* To be called before node and its siblings are freed: the items bound to
+ * them or to anything below them lose their elements */
+G_GNUC_INTERNAL void bm_bind_forget(xmlNode *node);
+/* Unbinds bm_item alone, which is about to be freed, so that its element
+ * does not point back to it any more */
+G_GNUC_INTERNAL void bm_bind_release(BookmarkItem *bm_item);
+
+/* A string to look for with bm_needle_rfind(), BM_NEEDLE() makes one of a
+ * literal at compile time */
+typedef struct
+{
+  const gchar *str;
+  gsize len;
+} BmNeedle;
+
+#define BM_NEEDLE(s) { (s), sizeof(s) - 1 }
+
+/* Last occurrence of needle in haystack, ignoring case, without allocating.
+ * NULL if there is none or haystack is NULL. */
+G_GNUC_INTERNAL const gchar *bm_needle_rfind(const gchar *haystack,
+                                             const BmNeedle *needle);
+
+/* Finds tag in the first <metadata> of the first <info> below node */
+G_GNUC_INTERNAL xmlNode *get_node_by_tag(xmlNode *node, const char *tag);
+
+/* Computes the stats of bm_item and everything below it, post-order */
+G_GNUC_INTERNAL void bm_stats_compute(BookmarkItem *bm_item);
+/* Update the stats of parent and the folders above it after child was
+ * linked to or unlinked from parent */
+G_GNUC_INTERNAL void bm_stats_child_added(BookmarkItem *parent,
+                                          BookmarkItem *child);
+G_GNUC_INTERNAL void bm_stats_child_removed(BookmarkItem *parent,
+                                            BookmarkItem *child);
+/* Same after the children of folder were replaced */
+G_GNUC_INTERNAL void bm_stats_refresh(BookmarkItem *folder);
+
+G_GNUC_INTERNAL void bm_url_index_free(BookmarkUrlIndex *url_index);
+/* Add or remove bm_item and every bookmark below it, url_index may be NULL */
+G_GNUC_INTERNAL void bm_url_index_add(BookmarkUrlIndex *url_index,
+                                      BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_url_index_remove(BookmarkUrlIndex *url_index,
+                                         BookmarkItem *bm_item);
+/* (Re)builds the index of the tree below bookmark_root */
+G_GNUC_INTERNAL void bm_url_index_build(BookmarkItem *bookmark_root);
+
+/* Same as the bm_url_index_* functions, for every item below the root */
+G_GNUC_INTERNAL void bm_search_index_free(BookmarkSearchIndex *search_index);
+G_GNUC_INTERNAL void bm_search_index_add(BookmarkSearchIndex *search_index,
+                                         BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_search_index_remove(BookmarkSearchIndex *search_index,
+                                            BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_search_index_build(BookmarkItem *bookmark_root);
+/* Builds the index if there is none, or again once most of it are holes
+ * left by removed items. bookmark_item_search() does it on every call. */
+G_GNUC_INTERNAL void bm_search_index_settle(BookmarkItem *bookmark_root);
+
+/* Keep child_names of parent, if it has one, up to date after child was
+ * linked to it or before it is unlinked or renamed */
+G_GNUC_INTERNAL void bm_child_names_add(BookmarkItem *parent,
+                                        BookmarkItem *child);
+G_GNUC_INTERNAL void bm_child_names_remove(BookmarkItem *parent,
+                                           BookmarkItem *child);
+G_GNUC_INTERNAL void bm_child_names_free(BookmarkItem *folder);
+/* Builds child_names of folder now instead of on the first lookup */
+G_GNUC_INTERNAL void bm_child_names_build(BookmarkItem *folder);
+
+/* TRUE if the journal of file_name has changes in it */
+G_GNUC_INTERNAL gboolean bm_journal_pending(const gchar *file_name);
+/* Applies the changes in the journal of file_name to the tree just loaded
+ * from it, of the fields that were loaded */
+G_GNUC_INTERNAL void bm_journal_replay(const gchar *file_name,
+                                       BookmarkItem *bookmark_root,
+                                       BookmarkFieldMask fields);
+/* How far into a journal a document has its changes. Emptying the journal
+ * starts a new generation, so an offset only counts in the journal it was
+ * taken from. All zero stands for a document with none of any journal. */
+typedef struct
+{
+  guint64 ino;
+  guint64 generation;
+  gsize offset;
+} BmJournalPos;
+
+/* TRUE if pos was taken in the journal that now is at now */
+#define bm_journal_pos_same(pos, now) \
+  ((pos)->ino == (now)->ino && (pos)->generation == (now)->generation)
+
+/* Contents of the journal of file_name, NULL if there is none. Which journal
+ * it is goes to pos, if not NULL, with the offset of its first change. */
+G_GNUC_INTERNAL gchar *bm_journal_read(const gchar *file_name, gsize *len,
+                                       BmJournalPos *pos);
+/* Applies the complete lines of contents from offset on to the elements of
+ * doc, returns the offset after them */
+G_GNUC_INTERNAL gsize bm_journal_apply(xmlDoc *doc, gchar *contents,
+                                       gsize len, gsize offset);
+/* Empties the journal of file_name, once its changes are in the file, and
+ * starts its next generation */
+G_GNUC_INTERNAL void bm_journal_truncate(const gchar *file_name);
+/* Appends the line bookmark_journal_set() would write to lines, FALSE if
+ * bm_item has no id */
+G_GNUC_INTERNAL gboolean bm_journal_line(GString *lines,
+                                         BookmarkJournalField field,
+                                         const BookmarkItem *bm_item,
+                                         const gchar *val);
+/* Writes the lines built with bm_journal_line() to journal, with one sync
+ * for all of them */
+G_GNUC_INTERNAL gboolean bm_journal_append(BookmarkJournal *journal,
+                                           const GString *lines);
+
+/* Same for child_array of parent, child goes in before before, last if that
+ * is NULL */
+G_GNUC_INTERNAL void bm_child_array_insert(BookmarkItem *parent,
+                                           BookmarkItem *child,
+                                           BookmarkItem *before);
+G_GNUC_INTERNAL void bm_child_array_remove(BookmarkItem *parent,
+                                           BookmarkItem *child);
+G_GNUC_INTERNAL void bm_child_array_free(BookmarkItem *folder);
+G_GNUC_INTERNAL void bm_child_array_build(BookmarkItem *folder);
+
+/* Same again for the url trie, which ranks by visit_count: a bookmark has to
+ * be removed before its visit_count changes and added again after */
+G_GNUC_INTERNAL void bm_url_trie_free(BookmarkUrlTrie *url_trie);
+G_GNUC_INTERNAL void bm_url_trie_add(BookmarkUrlTrie *url_trie,
+                                     BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_url_trie_remove(BookmarkUrlTrie *url_trie,
+                                        BookmarkItem *bm_item);
+G_GNUC_INTERNAL void bm_url_trie_build(BookmarkItem *bookmark_root);
+
+/**
+ * bm_loader_read_file:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param flags: Load options
+ * @param fields: Fields to fill in
+ * @return Root bookmark item, NULL if the file could not be read
+ *
+ * Builds the BookmarkItem tree straight from an xmlTextReader stream,
+ * without building a libxml2 document first.
+ */
+G_GNUC_INTERNAL BookmarkItem *bm_loader_read_file(const gchar *file_name,
+                                                  BookmarkLoadFlags flags,
+                                                  BookmarkFieldMask fields);
+
+/* Reads the first element of reader and everything below it */
+G_GNUC_INTERNAL BookmarkItem *bm_loader_read_reader(xmlTextReaderPtr reader,
+                                                    BookmarkTree *tree,
+                                                    BookmarkLoadFlags flags,
+                                                    BookmarkFieldMask fields);
+
+/**
+ * bm_loader_read_file_parallel:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param flags: Load options
+ * @return Root bookmark item, NULL if the file could not be read
+ *
+ * Same result as bm_loader_read_file(), with the top level folders of large
+ * files parsed on a thread pool.
+ */
+G_GNUC_INTERNAL BookmarkItem *
+bm_loader_read_file_parallel(const gchar *file_name, BookmarkLoadFlags flags,
+                             BookmarkFieldMask fields);
+
+/**
+ * bm_loader_read_file_lazy:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param flags: Load options
+ * @return Root bookmark item, NULL if the file could not be read
+ *
+ * Parses the file into a document and builds the root folder and its direct
+ * children only. The folders below keep a pointer to their element and are
+ * built by bm_loader_expand().
+ */
+G_GNUC_INTERNAL BookmarkItem *bm_loader_read_file_lazy(const gchar *file_name,
+                                                       BookmarkLoadFlags flags,
+                                                       BookmarkFieldMask fields);
+
+/**
+ * bm_loader_expand:
+ * @param folder: Bookmark folder
+ * @return TRUE if the children of folder were built by this call
+ */
+G_GNUC_INTERNAL gboolean bm_loader_expand(BookmarkItem *folder);
+
+/* Identifies the contents of a bookmark XML file. hash is only set if
+ * hashed, for files whose mtime is too recent to tell changes apart. */
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  gint64 mtime;
+  gint64 mtime_nsec;
+  guint64 hash;
+  gboolean hashed;
+} BmSnapshotKey;
+
+G_GNUC_INTERNAL gboolean bm_snapshot_key_for_file(const gchar *file_name,
+                                                  BmSnapshotKey *key);
+
+/* TRUE if key, taken of file_name, says its contents are still the ones old
+ * was taken of. Hashes file_name into key if old had to be hashed. */
+G_GNUC_INTERNAL gboolean bm_snapshot_key_matches(const gchar *file_name,
+                                                 BmSnapshotKey *key,
+                                                 const BmSnapshotKey *old);
+
+/* What a bookmark file and its journal held when last read or written */
+typedef struct
+{
+  BmSnapshotKey file;
+  /* size and mtime of the journal, all zero if there is none */
+  guint64 journal_size;
+  gint64 journal_mtime;
+  gint64 journal_mtime_nsec;
+} BmFilesKey;
+
+G_GNUC_INTERNAL gboolean bm_files_key_get(const gchar *file_name,
+                                          BmFilesKey *key);
+/* TRUE if file_name or its journal are not what key was taken of. The
+ * journal is only appended to or emptied, its size and mtime tell. A key
+ * whose file had to be hashed is replaced by one that does not need that
+ * any more, once the file is old enough. */
+G_GNUC_INTERNAL gboolean bm_files_key_changed(const gchar *file_name,
+                                              BmFilesKey *key);
+
+/**
+ * bm_snapshot_read:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param key: Current key of file_name
+ * @param flags: Load options
+ * @param fields: Fields to fill in
+ * @param update: Set to the contents the snapshot should be replaced with
+ * through bm_snapshot_write(), NULL if it is fine as it is
+ * @return Root bookmark item, NULL if there is no valid snapshot for key
+ */
+G_GNUC_INTERNAL BookmarkItem *bm_snapshot_read(const gchar *file_name,
+                                               BmSnapshotKey *key,
+                                               BookmarkLoadFlags flags,
+                                               BookmarkFieldMask fields,
+                                               GString **update);
+
+/**
+ * bm_snapshot_encode:
+ * @param key: Key of the file root was parsed from, taken before parsing
+ * @param root: Root bookmark item
+ * @return Contents of the snapshot of root, for bm_snapshot_write()
+ */
+G_GNUC_INTERNAL GString *bm_snapshot_encode(const BmSnapshotKey *key,
+                                            const BookmarkItem *root);
+
+/**
+ * bm_snapshot_write:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param key: Key data was encoded with
+ * @param data: Contents of the snapshot
+ * @return TRUE on success
+ *
+ * Replaces the snapshot through a temporary file, under the exclusive lock.
+ * The caller must not hold the lock shared. Nothing is written if another
+ * thread or process holds the lock, or if file_name no longer matches key.
+ */
+G_GNUC_INTERNAL gboolean bm_snapshot_write(const gchar *file_name,
+                                           const BmSnapshotKey *key,
+                                           const GString *data);
+
+/**
+ * bm_doc_open:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param options: xmlParserOption flags, XML_PARSE_COMPACT and
+ * XML_PARSE_NOBLANKS are always added
+ * @return The parsed document, NULL on error
+ *
+ * Parses the memory mapped file under the shared lock of the bookmark
+ * files. Every document gets a dictionary of its own for its names. The ids
+ * of the document are indexed with bm_doc_index_ids(), then the journal of
+ * the file, read under the same lock, is applied to it.
+ */
+G_GNUC_INTERNAL xmlDoc *bm_doc_open(const gchar *file_name, int options);
+
+/* Same with the names in dict, which the caller keeps other threads away
+ * from for as long as the document lives. NULL gives the document its own. */
+G_GNUC_INTERNAL xmlDoc *bm_doc_open_dict(const gchar *file_name, int options,
+                                         xmlDictPtr dict);
+
+/**
+ * bm_doc_index_ids:
+ * @param doc: Document
+ *
+ * Registers the id attribute of every <folder> and <bookmark> of doc as an
+ * ID, so that xmlGetID() finds the element. Elements without an id, and all
+ * elements that share one, get a new id.
+ */
+G_GNUC_INTERNAL void bm_doc_index_ids(xmlDoc *doc);
+
+/**
+ * bm_doc_find_id:
+ * @param doc: Document
+ * @param id: Value of the id attribute
+ * @return The <folder> or <bookmark> element with that id, NULL if none
+ *
+ * Looks the id up among the registered ones first. Documents not indexed
+ * with bm_doc_index_ids(), such as those of the caller, are searched
+ * without registering anything in them or copying any attribute, and so is
+ * an indexed one that does not have the id.
+ */
+G_GNUC_INTERNAL xmlNode *bm_doc_find_id(xmlDoc *doc, const gchar *id);
+
+/* Gives node, which is not linked into its document yet, the id of bm_item,
+ * or a new one stored in bm_item too if it has none or another element of
+ * the document has it. The id is registered in the document of node. */
+G_GNUC_INTERNAL void bm_doc_set_new_id(xmlNode *node, BookmarkItem *bm_item);
+
+/**
+ * bm_doc_save:
+ * @param doc: Document
+ * @param file_name: Absolute path to bookmark XML file
+ * @return TRUE if the document was written and synced
+ *
+ * Writes doc to a temporary file next to file_name and renames it over
+ * file_name, so that readers never see a partly written file. The exclusive
+ * lock of the bookmark files is held for the write, FALSE is returned if it
+ * could not be taken. Changes journaled since doc was opened are applied to
+ * it first, and the journal is emptied once the file is written.
+ */
+G_GNUC_INTERNAL gboolean bm_doc_save(xmlDoc *doc, const gchar *file_name);
+
+/* Same as bm_doc_save(), but nothing is written if file_name is no longer
+ * the file key was taken of, *changed is set then. Changes journaled by
+ * others are not a conflict, they are applied to doc as usual. Once doc is
+ * written key becomes that of the new file and its emptied journal. */
+G_GNUC_INTERNAL gboolean bm_doc_save_key(xmlDoc *doc, const gchar *file_name,
+                                         BmFilesKey *key, gboolean *changed);
+
+/* Where in the journal doc has the journaled changes up to, NULL if it has
+ * none of them */
+#define bm_doc_journal_pos(doc) ((const BmJournalPos *)(doc)->_private)
+
+/* Forgets where doc is in the journal, once it has none of what is in it */
+G_GNUC_INTERNAL void bm_doc_forget_journal(xmlDoc *doc);
+
+/* Frees a document opened with bm_doc_open() */
+G_GNUC_INTERNAL void bm_doc_free(xmlDoc *doc);
+
+/* Same as bm_doc_save_key() with a document already serialized into data,
+ * which has the journal up to journal_pos, NULL if none of it. The journal
+ * lines in landed, if any, were folded into the file since data was
+ * serialized and go into it first. Once the file is written the lines taken
+ * from the journal are appended to folded, if not NULL, for the documents
+ * still open that lack them. key may be NULL to write unchecked. */
+G_GNUC_INTERNAL gboolean bm_doc_save_data(const xmlChar *data, gsize len,
+                                          const BmJournalPos *journal_pos,
+                                          GString *landed, GString *folded,
+                                          const gchar *file_name,
+                                          BmFilesKey *key, gboolean *changed);
+
+/**
+ * bm_lock_files:
+ * @param mode: Shared to read the bookmark files, exclusive to write them
+ * @param lock: Returns the lock to give to bookmark_lock_release()
+ * @return FALSE if the lock was held elsewhere for BM_LOCK_TIMEOUT
+ *
+ * Takes the lock of BOOKMARK_FLOCK_PATH. If the lock file can not be opened,
+ * as when ~/.bookmarks does not exist, *lock is NULL and the files are used
+ * without a lock, the way they were before there was one.
+ */
+G_GNUC_INTERNAL gboolean bm_lock_files(BookmarkLockMode mode,
+                                       BookmarkLock **lock);
+
+/* bm_lock_files() giving up after timeout milliseconds, 0 to only try */
+G_GNUC_INTERNAL gboolean bm_lock_files_timeout(BookmarkLockMode mode,
+                                               gint timeout,
+                                               BookmarkLock **lock);
+
+/* file_name under $HOME */
+G_GNUC_INTERNAL gchar *file_path_with_home_dir(const gchar *file_name);
+
+G_END_DECLS
+
+#endif /* __BOOKMARK_PRIVATE_H__ */
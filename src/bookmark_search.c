@@ -0,0 +1,510 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Trigram index over the titles and urls of a tree, kept on the root item.
+ * Built on the first search, from then on an item goes in and out together
+ * with the url index, also when only its name changes. Every indexed item
+ * gets an id and its title and url case folded with g_utf8_casefold(). Every
+ * byte, pair and triple of bytes of those gets the ascending list of ids that
+ * have it. A search intersects the lists of the trigrams of the folded query,
+ * or looks up the one list of a shorter query, and checks the few items
+ * left. Removed items only leave a hole in items, the lists are cleaned up by
+ * rebuilding the index once most of it is holes.
+ */
+
+struct _BookmarkSearchIndex
+{
+  /* indexed items by id, NULL once removed */
+  GPtrArray *items;
+  /* folded title and url of the items by id, one after the other */
+  GPtrArray *folded;
+  /* BookmarkItem -> id + 1 */
+  GHashTable *ids;
+  /* gram() -> GArray of guint32 ids */
+  GHashTable *postings;
+  guint n_removed;
+};
+
+typedef struct
+{
+  guint score;
+  guint visit_count;
+  guint32 id;
+} SearchHit;
+
+/* The n bytes at p, 1 to 3 of them, below the length so that grams of
+ * different lengths do not meet */
+static inline guint32
+gram(const gchar *p, guint n)
+{
+  guint32 rv = n;
+  guint i;
+
+  for (i = 0; i < n; i++)
+    rv = rv << 8 | (guchar)p[i];
+
+  return rv;
+}
+
+/* Case folded copy of s. Broken UTF-8 only has its ASCII folded, as
+ * g_utf8_casefold() would read past it. */
+static gchar *
+fold_string(const gchar *s, gssize len)
+{
+  if (!g_utf8_validate(s, len, NULL))
+    return g_ascii_strdown(s, len);
+
+  return g_utf8_casefold(s, len);
+}
+
+/* The name without the ".bm" the loader gives bookmarks */
+static const gchar *
+item_title(const BookmarkItem *bm_item, gsize *len)
+{
+  if (!bm_item->name)
+  {
+    *len = 0;
+    return NULL;
+  }
+
+  *len = strlen(bm_item->name);
+
+  if (!bm_item->isFolder && *len >= 3 &&
+      !strcmp(bm_item->name + *len - 3, ".bm"))
+  {
+    *len -= 3;
+  }
+
+  return bm_item->name;
+}
+
+static void
+free_posting(gpointer posting)
+{
+  g_array_free(posting, TRUE);
+}
+
+static BookmarkSearchIndex *
+search_index_new(void)
+{
+  BookmarkSearchIndex *search_index = g_new0(BookmarkSearchIndex, 1);
+
+  search_index->items = g_ptr_array_new();
+  search_index->folded = g_ptr_array_new_with_free_func(g_free);
+  search_index->ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+  search_index->postings = g_hash_table_new_full(g_direct_hash,
+                                                 g_direct_equal, NULL,
+                                                 free_posting);
+
+  return search_index;
+}
+
+void
+bm_search_index_free(BookmarkSearchIndex *search_index)
+{
+  if (search_index)
+  {
+    g_ptr_array_free(search_index->items, TRUE);
+    g_ptr_array_free(search_index->folded, TRUE);
+    g_hash_table_destroy(search_index->ids);
+    g_hash_table_destroy(search_index->postings);
+    g_free(search_index);
+  }
+}
+
+static void
+index_string(BookmarkSearchIndex *search_index, guint32 id, const gchar *s,
+             gsize len)
+{
+  gsize i;
+  guint n;
+
+  for (i = 0; i < len; i++)
+  {
+    for (n = 1; n <= 3 && i + n <= len; n++)
+    {
+      gpointer key = GUINT_TO_POINTER(gram(s + i, n));
+      GArray *posting = g_hash_table_lookup(search_index->postings, key);
+
+      if (!posting)
+      {
+        posting = g_array_new(FALSE, FALSE, sizeof(guint32));
+        g_hash_table_insert(search_index->postings, key, posting);
+      }
+
+      /* ids only ever grow, a gram seen twice in an item is at the end */
+      if (!posting->len ||
+          g_array_index(posting, guint32, posting->len - 1) != id)
+      {
+        g_array_append_val(posting, id);
+      }
+    }
+  }
+}
+
+void
+bm_search_index_add(BookmarkSearchIndex *search_index, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!search_index)
+    return;
+
+  /* the root of the tree is not searched for */
+  if (bm_item->parent &&
+      !g_hash_table_contains(search_index->ids, bm_item))
+  {
+    guint32 id = search_index->items->len;
+    const gchar *title;
+    gchar *folded_title;
+    gchar *folded_url;
+    gchar *folded;
+    gsize title_len;
+    gsize url_len;
+    gsize len;
+
+    g_ptr_array_add(search_index->items, bm_item);
+    g_hash_table_insert(search_index->ids, bm_item,
+                        GUINT_TO_POINTER(id + 1));
+
+    title = item_title(bm_item, &len);
+    folded_title = title ? fold_string(title, len) : g_strdup("");
+    folded_url = !bm_item->isFolder && bm_item->url ?
+        fold_string(bm_item->url, -1) : g_strdup("");
+
+    title_len = strlen(folded_title);
+    url_len = strlen(folded_url);
+
+    /* the title, its nul, the url and its nul */
+    folded = g_malloc(title_len + url_len + 2);
+    memcpy(folded, folded_title, title_len + 1);
+    memcpy(folded + title_len + 1, folded_url, url_len + 1);
+    g_ptr_array_add(search_index->folded, folded);
+
+    index_string(search_index, id, folded_title, title_len);
+    index_string(search_index, id, folded_url, url_len);
+
+    g_free(folded_title);
+    g_free(folded_url);
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_search_index_add(search_index, child);
+}
+
+void
+bm_search_index_remove(BookmarkSearchIndex *search_index,
+                       BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+  gpointer id;
+
+  if (!search_index)
+    return;
+
+  id = g_hash_table_lookup(search_index->ids, bm_item);
+
+  if (id)
+  {
+    g_ptr_array_index(search_index->items, GPOINTER_TO_UINT(id) - 1) = NULL;
+    g_free(g_ptr_array_index(search_index->folded, GPOINTER_TO_UINT(id) - 1));
+    g_ptr_array_index(search_index->folded, GPOINTER_TO_UINT(id) - 1) = NULL;
+    g_hash_table_remove(search_index->ids, bm_item);
+    search_index->n_removed++;
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_search_index_remove(search_index, child);
+}
+
+void
+bm_search_index_build(BookmarkItem *bookmark_root)
+{
+  bm_search_index_free(bookmark_root->search_index);
+  bookmark_root->search_index = search_index_new();
+  bm_search_index_add(bookmark_root->search_index, bookmark_root);
+}
+
+void
+bm_search_index_settle(BookmarkItem *bookmark_root)
+{
+  BookmarkSearchIndex *search_index = bookmark_root->search_index;
+
+  if (!search_index ||
+      search_index->n_removed > search_index->items->len / 2)
+  {
+    bm_search_index_build(bookmark_root);
+  }
+}
+
+/* 3 for a match at start, 2 at the start of a word, 1 anywhere else. Both
+ * s and query are folded. */
+static guint
+match_score(const gchar *s, gsize start, const gchar *query)
+{
+  const gchar *p = strstr(s, query);
+
+  if (!p)
+    return 0;
+
+  if ((gsize)(p - s) == start)
+    return 3;
+
+  if (p == s || !g_unichar_isalnum(g_utf8_get_char(g_utf8_prev_char(p))))
+    return 2;
+
+  return 1;
+}
+
+/* Where the host of url starts, after the scheme and a "www." */
+static gsize
+url_host_start(const gchar *url)
+{
+  const gchar *p = strstr(url, "://");
+
+  p = p ? p + 3 : url;
+
+  if (!g_ascii_strncasecmp(p, "www.", 4))
+    p += 4;
+
+  return p - url;
+}
+
+/* Title matches rank above url matches, folded is as the index keeps it */
+static guint
+item_score(const gchar *folded, const gchar *query)
+{
+  const gchar *url;
+  guint score;
+
+  score = match_score(folded, 0, query);
+
+  if (score)
+    return score + 3;
+
+  url = folded + strlen(folded) + 1;
+
+  if (!*url)
+    return 0;
+
+  return match_score(url, url_host_start(url), query);
+}
+
+static gint
+compare_postings(gconstpointer a, gconstpointer b)
+{
+  const GArray *pa = *(const GArray **)a;
+  const GArray *pb = *(const GArray **)b;
+
+  return (pa->len > pb->len) - (pa->len < pb->len);
+}
+
+/* Keeps the ids of candidates that are in posting too */
+static void
+intersect(GArray *candidates, const GArray *posting)
+{
+  const guint32 *ids = (const guint32 *)posting->data;
+  guint lo = 0;
+  guint i;
+  guint n = 0;
+
+  for (i = 0; i < candidates->len && lo < posting->len; i++)
+  {
+    guint32 id = g_array_index(candidates, guint32, i);
+    guint step = 1;
+    guint hi;
+
+    /* both are ascending, so the search starts where the last one ended and
+     * gallops ahead, which is a merge for lists of about the same length */
+    while (lo + step < posting->len && ids[lo + step] < id)
+    {
+      lo += step;
+      step *= 2;
+    }
+
+    hi = MIN(lo + step, posting->len);
+
+    while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (ids[mid] < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    if (lo < posting->len && ids[lo] == id)
+      g_array_index(candidates, guint32, n++) = id;
+  }
+
+  g_array_set_size(candidates, n);
+}
+
+/* Ids of the items that have every trigram of query, or the bytes of a
+ * shorter one, NULL if there is none */
+static GArray *
+find_candidates(BookmarkSearchIndex *search_index, const gchar *query,
+                gsize query_len)
+{
+  GPtrArray *postings = g_ptr_array_new();
+  GArray *candidates = NULL;
+  guint n = MIN(query_len, 3);
+  gsize i;
+
+  for (i = 0; i + n <= query_len; i++)
+  {
+    GArray *posting =
+        g_hash_table_lookup(search_index->postings,
+                            GUINT_TO_POINTER(gram(query + i, n)));
+
+    if (!posting)
+      goto out;
+
+    g_ptr_array_add(postings, posting);
+  }
+
+  /* the rarest trigram first keeps the candidates few from the start */
+  g_ptr_array_sort(postings, compare_postings);
+
+  candidates = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+                                 ((GArray *)postings->pdata[0])->len);
+  g_array_append_vals(candidates, ((GArray *)postings->pdata[0])->data,
+                      ((GArray *)postings->pdata[0])->len);
+
+  for (i = 1; i < postings->len && candidates->len; i++)
+  {
+    if (postings->pdata[i] != postings->pdata[i - 1])
+      intersect(candidates, postings->pdata[i]);
+  }
+
+out:
+  g_ptr_array_free(postings, TRUE);
+
+  return candidates;
+}
+
+static gint
+compare_hits(gconstpointer a, gconstpointer b)
+{
+  const SearchHit *ha = a;
+  const SearchHit *hb = b;
+
+  if (ha->score != hb->score)
+    return ha->score > hb->score ? -1 : 1;
+
+  if (ha->visit_count != hb->visit_count)
+    return ha->visit_count > hb->visit_count ? -1 : 1;
+
+  return (ha->id > hb->id) - (ha->id < hb->id);
+}
+
+/* With max_results hits is kept sorted and no longer than that, otherwise it
+ * is sorted at the end */
+static void
+add_hit(BookmarkSearchIndex *search_index, GArray *hits, guint max_results,
+        guint32 id, const gchar *query)
+{
+  const BookmarkItem *bm_item = g_ptr_array_index(search_index->items, id);
+  SearchHit hit;
+  guint lo = 0;
+  guint hi = hits->len;
+
+  if (!bm_item)
+    return;
+
+  /* having the trigrams does not mean having them in a row */
+  hit.score = item_score(g_ptr_array_index(search_index->folded, id), query);
+
+  if (!hit.score)
+    return;
+
+  hit.visit_count = bm_item->visit_count;
+  hit.id = id;
+
+  if (!max_results)
+  {
+    g_array_append_val(hits, hit);
+    return;
+  }
+
+  if (hits->len == max_results &&
+      compare_hits(&hit, &g_array_index(hits, SearchHit, hi - 1)) >= 0)
+  {
+    return;
+  }
+
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (compare_hits(&g_array_index(hits, SearchHit, mid), &hit) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  g_array_insert_val(hits, lo, hit);
+
+  if (hits->len > max_results)
+    g_array_set_size(hits, max_results);
+}
+
+GSList *
+bookmark_item_search(BookmarkItem *bookmark_root, const gchar *query,
+                     guint max_results)
+{
+  BookmarkSearchIndex *search_index;
+  GSList *rv = NULL;
+  GArray *candidates;
+  GArray *hits;
+  gchar *folded;
+  gsize query_len;
+  guint i;
+
+  CHECK_PARAM(!bookmark_root || bookmark_root->parent || !query,
+              "\nInvalid Input Parameter", return NULL);
+
+  if (!*query)
+    return NULL;
+
+  if (bookmark_root->tree && bookmark_root->tree->lazy_nodes)
+    bm_item_expand_all(bookmark_root);
+
+  bm_search_index_settle(bookmark_root);
+  search_index = bookmark_root->search_index;
+
+  folded = fold_string(query, -1);
+  query_len = strlen(folded);
+  hits = g_array_new(FALSE, FALSE, sizeof(SearchHit));
+  candidates = query_len ?
+      find_candidates(search_index, folded, query_len) : NULL;
+
+  if (candidates)
+  {
+    for (i = 0; i < candidates->len; i++)
+    {
+      add_hit(search_index, hits, max_results,
+              g_array_index(candidates, guint32, i), folded);
+    }
+
+    g_array_free(candidates, TRUE);
+  }
+
+  if (!max_results)
+    g_array_sort(hits, compare_hits);
+
+  for (i = hits->len; i > 0; i--)
+  {
+    guint32 id = g_array_index(hits, SearchHit, i - 1).id;
+
+    rv = g_slist_prepend(rv, g_ptr_array_index(search_index->items, id));
+  }
+
+  g_array_free(hits, TRUE);
+  g_free(folded);
+
+  return rv;
+}
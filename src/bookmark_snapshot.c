@@ -0,0 +1,548 @@
+#include "bookmark_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Binary snapshot of a parsed bookmark tree, kept next to the XML file as
+ * <file>.snapshot. Layout, native byte order:
+ *
+ *   SnapshotHeader
+ *   SnapshotItem[n_items]    items in document pre-order
+ *   strings                  NUL terminated strings, strings_size bytes
+ *
+ * String fields hold an offset into the string table plus one, 0 for NULL.
+ * A snapshot is only used if device, inode, size and mtime of the XML file
+ * still match the ones it was written for. Those only tell a change apart
+ * once the mtime is old enough that a write could not have got the same one,
+ * so the contents of a file changed within SNAPSHOT_RACY_SECONDS are hashed
+ * and compared as well.
+ */
+
+#define SNAPSHOT_MAGIC "BMSNAP03"
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+/* mtime granularity of the coarsest file systems */
+#define SNAPSHOT_RACY_SECONDS 2
+
+/* libxml2 does not parse deeper documents without XML_PARSE_HUGE */
+#define SNAPSHOT_MAX_DEPTH 256
+
+typedef struct
+{
+  gchar magic[8];
+  guint32 byte_order;
+  guint32 n_items;
+  guint64 strings_size;
+  guint64 xml_dev;
+  guint64 xml_ino;
+  guint64 xml_size;
+  gint64 xml_mtime;
+  gint64 xml_mtime_nsec;
+  guint64 xml_hash;
+  guint32 xml_hashed;
+} SnapshotHeader;
+
+typedef struct
+{
+  guint32 n_children;
+  guint32 is_folder;
+  gint32 time_added;
+  gint32 time_last_visited;
+  guint32 visit_count;
+  gint32 is_operator_bookmark;
+  gint32 is_deleted;
+  guint32 name;
+  guint32 url;
+  guint32 favicon_file;
+  guint32 thumbnail_file;
+  guint32 id;
+} SnapshotItem;
+
+typedef struct
+{
+  const SnapshotItem *items;
+  guint32 n_items;
+  guint32 pos;
+  const gchar *strings;
+  guint64 strings_size;
+  BookmarkTree *tree;
+  BookmarkLoadFlags flags;
+  BookmarkFieldMask fields;
+  /* strings may point into the mapped snapshot */
+  gboolean zero_copy;
+} SnapshotReader;
+
+static gchar *
+snapshot_file_name(const gchar *file_name)
+{
+  return g_strconcat(file_name, ".snapshot", NULL);
+}
+
+/* 64 bit FNV-1a */
+static guint64
+hash_update(guint64 hash, const guchar *p, gsize len)
+{
+  while (len--)
+  {
+    hash ^= *p++;
+    hash *= G_GUINT64_CONSTANT(0x100000001b3);
+  }
+
+  return hash;
+}
+
+static gboolean
+hash_fd(int fd, guint64 *hash)
+{
+  guchar buf[64 * 1024];
+  ssize_t len;
+
+  *hash = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+
+  while ((len = read(fd, buf, sizeof(buf))) != 0)
+  {
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    *hash = hash_update(*hash, buf, len);
+  }
+
+  return TRUE;
+}
+
+/* A write in the same tick would leave the key of the file as it is */
+static gboolean
+key_is_racy(const BmSnapshotKey *key)
+{
+  return key->mtime >=
+      g_get_real_time() / G_USEC_PER_SEC - SNAPSHOT_RACY_SECONDS;
+}
+
+static void
+key_from_stat(BmSnapshotKey *key, const struct stat *st)
+{
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->size = st->st_size;
+  key->mtime = st->st_mtim.tv_sec;
+  key->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+gboolean
+bm_snapshot_key_for_file(const gchar *file_name, BmSnapshotKey *key)
+{
+  struct stat st;
+  gboolean rv = TRUE;
+  int fd;
+
+  fd = open(file_name, O_RDONLY);
+
+  if (fd == -1)
+    return FALSE;
+
+  if (fstat(fd, &st))
+  {
+    close(fd);
+    return FALSE;
+  }
+
+  key_from_stat(key, &st);
+  key->hash = 0;
+  key->hashed = FALSE;
+
+  if (key_is_racy(key))
+    rv = key->hashed = hash_fd(fd, &key->hash);
+
+  close(fd);
+
+  return rv;
+}
+
+/* Hashes the contents of file_name into key, FALSE if they are not the ones
+ * key was taken of any more */
+static gboolean
+key_hash(const gchar *file_name, BmSnapshotKey *key)
+{
+  BmSnapshotKey now;
+  struct stat st;
+  int fd;
+
+  if (key->hashed)
+    return TRUE;
+
+  fd = open(file_name, O_RDONLY);
+
+  if (fd == -1)
+    return FALSE;
+
+  if (fstat(fd, &st))
+  {
+    close(fd);
+    return FALSE;
+  }
+
+  key_from_stat(&now, &st);
+
+  if (now.dev != key->dev || now.ino != key->ino || now.size != key->size ||
+      now.mtime != key->mtime || now.mtime_nsec != key->mtime_nsec)
+  {
+    close(fd);
+    return FALSE;
+  }
+
+  key->hashed = hash_fd(fd, &key->hash);
+  close(fd);
+
+  return key->hashed;
+}
+
+gboolean
+bm_snapshot_key_matches(const gchar *file_name, BmSnapshotKey *key,
+                        const BmSnapshotKey *old)
+{
+  if (key->dev != old->dev || key->ino != old->ino ||
+      key->size != old->size || key->mtime != old->mtime ||
+      key->mtime_nsec != old->mtime_nsec)
+  {
+    return FALSE;
+  }
+
+  /* old was taken when the file could still change unnoticed */
+  if (old->hashed)
+    return key_hash(file_name, key) && key->hash == old->hash;
+
+  return TRUE;
+}
+
+static gboolean
+snapshot_string(SnapshotReader *reader, BookmarkFieldMask field,
+                guint32 offset, gchar **s)
+{
+  if (!offset || !(reader->fields & field))
+  {
+    *s = NULL;
+    return TRUE;
+  }
+
+  if (offset - 1 >= reader->strings_size)
+    return FALSE;
+
+  if (reader->zero_copy)
+    *s = (gchar *)&reader->strings[offset - 1];
+  else
+    *s = bm_tree_strdup(reader->tree, &reader->strings[offset - 1]);
+
+  return TRUE;
+}
+
+static BookmarkItem *
+snapshot_read_item(SnapshotReader *reader, guint depth)
+{
+  const SnapshotItem *si;
+  BookmarkItem *bm_item;
+  GSList *children = NULL;
+  guint32 i;
+
+  if (reader->pos >= reader->n_items || depth > SNAPSHOT_MAX_DEPTH)
+    return NULL;
+
+  si = &reader->items[reader->pos++];
+
+  if (si->n_children > reader->n_items - reader->pos)
+    return NULL;
+
+  bm_item = bm_tree_new_item(reader->tree);
+  bm_item->isFolder = si->is_folder;
+
+  if (reader->fields & BM_FIELD_METADATA)
+  {
+    bm_item->time_added = si->time_added;
+    bm_item->time_last_visited = si->time_last_visited;
+    bm_item->visit_count = si->visit_count;
+    bm_item->isOperatorBookmark = si->is_operator_bookmark;
+    bm_item->isDeleted = si->is_deleted;
+  }
+
+  if (!snapshot_string(reader, BM_FIELD_NAMES, si->name, &bm_item->name) ||
+      !snapshot_string(reader, BM_FIELD_URLS, si->url, &bm_item->url) ||
+      !snapshot_string(reader, BM_FIELD_ASSETS, si->favicon_file,
+                       &bm_item->favicon_file) ||
+      !snapshot_string(reader, BM_FIELD_ASSETS, si->thumbnail_file,
+                       &bm_item->thumbnail_file) ||
+      !snapshot_string(reader, BM_FIELD_IDS, si->id, &bm_item->id))
+  {
+    goto err;
+  }
+
+  for (i = 0; i < si->n_children; i++)
+  {
+    BookmarkItem *child = snapshot_read_item(reader, depth + 1);
+
+    if (!child)
+      goto err;
+
+    bm_item_link_child(bm_item, child);
+
+    if (!(reader->flags & BM_LOAD_NO_CHILD_LISTS))
+      children = bm_tree_slist_prepend(reader->tree, children, child);
+  }
+
+  bm_item->list = g_slist_reverse(children);
+
+  return bm_item;
+
+err:
+  if (!reader->tree || !reader->tree->arena)
+  {
+    g_slist_free(children);
+    free_bookmark_item(bm_item);
+  }
+
+  return NULL;
+}
+
+/* Copy of the snapshot at data with xml_hashed cleared */
+static GString *
+snapshot_settle(const gchar *data, gsize len)
+{
+  GString *settled = g_string_new_len(data, len);
+
+  ((SnapshotHeader *)settled->str)->xml_hashed = FALSE;
+
+  return settled;
+}
+
+BookmarkItem *
+bm_snapshot_read(const gchar *file_name, BmSnapshotKey *key,
+                 BookmarkLoadFlags flags, BookmarkFieldMask fields,
+                 GString **update)
+{
+  SnapshotReader reader;
+  const SnapshotHeader *hdr;
+  BmSnapshotKey written;
+  GMappedFile *mf;
+  BookmarkItem *bm_item = NULL;
+  gchar *path;
+  gsize len;
+
+  *update = NULL;
+  path = snapshot_file_name(file_name);
+  mf = g_mapped_file_new(path, FALSE, NULL);
+
+  if (!mf)
+  {
+    g_free(path);
+    return NULL;
+  }
+
+  hdr = (const SnapshotHeader *)g_mapped_file_get_contents(mf);
+  len = g_mapped_file_get_length(mf);
+
+  if (len < sizeof(*hdr) ||
+      memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+      hdr->byte_order != SNAPSHOT_BYTE_ORDER)
+  {
+    goto out;
+  }
+
+  written.dev = hdr->xml_dev;
+  written.ino = hdr->xml_ino;
+  written.size = hdr->xml_size;
+  written.mtime = hdr->xml_mtime;
+  written.mtime_nsec = hdr->xml_mtime_nsec;
+  written.hash = hdr->xml_hash;
+  written.hashed = hdr->xml_hashed;
+
+  if (!bm_snapshot_key_matches(file_name, key, &written) ||
+      !hdr->n_items ||
+      hdr->n_items > (len - sizeof(*hdr)) / sizeof(SnapshotItem) ||
+      hdr->strings_size !=
+      len - sizeof(*hdr) - hdr->n_items * sizeof(SnapshotItem))
+  {
+    goto out;
+  }
+
+  reader.items = (const SnapshotItem *)(hdr + 1);
+  reader.n_items = hdr->n_items;
+  reader.pos = 0;
+  reader.strings = (const gchar *)(reader.items + hdr->n_items);
+  reader.strings_size = hdr->strings_size;
+  reader.flags = flags;
+  reader.fields = fields;
+  reader.tree = NULL;
+  reader.zero_copy = FALSE;
+
+  if (reader.strings_size && reader.strings[reader.strings_size - 1])
+    goto out;
+
+  if (flags & BM_LOAD_ARENA)
+  {
+    /* arena trees are read only, let them use the mapping directly */
+    reader.tree = bm_tree_new(flags);
+    reader.tree->mapped_file = g_mapped_file_ref(mf);
+    reader.zero_copy = TRUE;
+  }
+  else if (flags & BM_LOAD_NO_CHILD_LISTS)
+    reader.tree = bm_tree_new(flags);
+
+  bm_item = snapshot_read_item(&reader, 0);
+
+  if (reader.tree)
+  {
+    if (bm_item)
+      reader.tree->root = bm_item;
+    else
+      bm_tree_free(reader.tree);
+  }
+
+  /* the file is old enough now that any change shows in its mtime, later
+   * reads need not hash it */
+  if (bm_item && written.hashed && !key_is_racy(key))
+    *update = snapshot_settle((const gchar *)hdr, len);
+
+out:
+  g_mapped_file_unref(mf);
+  g_free(path);
+
+  return bm_item;
+}
+
+typedef struct
+{
+  GString *items;
+  GString *strings;
+  GHashTable *offsets;
+  guint32 n_items;
+} SnapshotWriter;
+
+static guint32
+snapshot_add_string(SnapshotWriter *writer, const gchar *s)
+{
+  gpointer offset;
+
+  if (!s)
+    return 0;
+
+  offset = g_hash_table_lookup(writer->offsets, s);
+
+  if (!offset)
+  {
+    offset = GUINT_TO_POINTER(writer->strings->len + 1);
+    g_string_append_len(writer->strings, s, strlen(s) + 1);
+    g_hash_table_insert(writer->offsets, (gpointer)s, offset);
+  }
+
+  return GPOINTER_TO_UINT(offset);
+}
+
+static void
+snapshot_write_item(SnapshotWriter *writer, const BookmarkItem *bm_item)
+{
+  SnapshotItem si;
+  const BookmarkItem *child;
+
+  memset(&si, 0, sizeof(si));
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    si.n_children++;
+
+  si.is_folder = bm_item->isFolder;
+  si.time_added = bm_item->time_added;
+  si.time_last_visited = bm_item->time_last_visited;
+  si.visit_count = bm_item->visit_count;
+  si.is_operator_bookmark = bm_item->isOperatorBookmark;
+  si.is_deleted = bm_item->isDeleted;
+  si.name = snapshot_add_string(writer, bm_item->name);
+  si.url = snapshot_add_string(writer, bm_item->url);
+  si.favicon_file = snapshot_add_string(writer, bm_item->favicon_file);
+  si.thumbnail_file = snapshot_add_string(writer, bm_item->thumbnail_file);
+  si.id = snapshot_add_string(writer, bm_item->id);
+
+  g_string_append_len(writer->items, (const gchar *)&si, sizeof(si));
+  writer->n_items++;
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    snapshot_write_item(writer, child);
+}
+
+GString *
+bm_snapshot_encode(const BmSnapshotKey *key, const BookmarkItem *root)
+{
+  SnapshotWriter writer;
+  SnapshotHeader hdr;
+  GString *data;
+
+  writer.items = g_string_new(NULL);
+  writer.strings = g_string_new(NULL);
+  writer.offsets = g_hash_table_new(g_str_hash, g_str_equal);
+  writer.n_items = 0;
+
+  snapshot_write_item(&writer, root);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr.n_items = writer.n_items;
+  hdr.strings_size = writer.strings->len;
+  hdr.xml_dev = key->dev;
+  hdr.xml_ino = key->ino;
+  hdr.xml_size = key->size;
+  hdr.xml_mtime = key->mtime;
+  hdr.xml_mtime_nsec = key->mtime_nsec;
+  hdr.xml_hash = key->hash;
+  hdr.xml_hashed = key->hashed;
+
+  data = g_string_sized_new(sizeof(hdr) + writer.items->len +
+                            writer.strings->len);
+  g_string_append_len(data, (const gchar *)&hdr, sizeof(hdr));
+  g_string_append_len(data, writer.items->str, writer.items->len);
+  g_string_append_len(data, writer.strings->str, writer.strings->len);
+
+  g_hash_table_destroy(writer.offsets);
+  g_string_free(writer.items, TRUE);
+  g_string_free(writer.strings, TRUE);
+
+  return data;
+}
+
+gboolean
+bm_snapshot_write(const gchar *file_name, const BmSnapshotKey *key,
+                  const GString *data)
+{
+  BookmarkLock *lock;
+  struct stat st;
+  gchar *path;
+  gboolean rv = FALSE;
+
+  /* only a cache, not worth waiting for writers */
+  if (!bm_lock_files_timeout(BM_LOCK_EXCLUSIVE, 0, &lock))
+    return FALSE;
+
+  /* the file changed since it was read, the key does not describe it */
+  if (!stat(file_name, &st) &&
+      (guint64)st.st_dev == key->dev &&
+      (guint64)st.st_ino == key->ino &&
+      (guint64)st.st_size == key->size &&
+      st.st_mtim.tv_sec == key->mtime &&
+      st.st_mtim.tv_nsec == key->mtime_nsec)
+  {
+    /* written to a temporary file and renamed over the old one, so that
+     * readers that have it mapped keep seeing a whole snapshot */
+    path = snapshot_file_name(file_name);
+    rv = g_file_set_contents(path, data->str, data->len, NULL);
+    g_free(path);
+  }
+
+  bookmark_lock_release(lock);
+
+  return rv;
+}
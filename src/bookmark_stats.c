@@ -0,0 +1,189 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Folder aggregates. The stats of a folder are the sum of what every child
+ * contributes: the child itself plus its own stats. They are computed in one
+ * post-order pass on load. After that a change to one item is pushed up the
+ * parent chain as the difference between its old and new contribution,
+ * stopping at the first folder that does not change. Only when the item that
+ * held a maximum goes down are the siblings scanned again.
+ */
+
+static void
+item_contribution(const BookmarkItem *bm_item, BookmarkFolderStats *c)
+{
+  *c = bm_item->stats;
+
+  if (bm_item->isFolder)
+    c->n_folders++;
+  else
+    c->n_items++;
+
+  c->max_visit_count = MAX(c->max_visit_count, bm_item->visit_count);
+  c->latest_visit = MAX(c->latest_visit, bm_item->time_last_visited);
+}
+
+static void
+stats_add(BookmarkFolderStats *stats, const BookmarkFolderStats *c)
+{
+  stats->n_items += c->n_items;
+  stats->n_folders += c->n_folders;
+  stats->max_visit_count = MAX(stats->max_visit_count, c->max_visit_count);
+  stats->latest_visit = MAX(stats->latest_visit, c->latest_visit);
+}
+
+static void
+stats_from_children(const BookmarkItem *folder, BookmarkFolderStats *stats)
+{
+  const BookmarkItem *child;
+  BookmarkFolderStats c;
+
+  memset(stats, 0, sizeof(*stats));
+
+  for (child = folder->first_child; child; child = child->next_sibling)
+  {
+    item_contribution(child, &c);
+    stats_add(stats, &c);
+  }
+}
+
+static gboolean
+stats_equal(const BookmarkFolderStats *a, const BookmarkFolderStats *b)
+{
+  return a->n_items == b->n_items && a->n_folders == b->n_folders &&
+      a->max_visit_count == b->max_visit_count &&
+      a->latest_visit == b->latest_visit;
+}
+
+/* A child of folder now contributes new_c instead of old_c */
+static void
+stats_update(BookmarkItem *folder, const BookmarkFolderStats *old_c,
+             const BookmarkFolderStats *new_c)
+{
+  BookmarkFolderStats from = *old_c;
+  BookmarkFolderStats to = *new_c;
+
+  for (; folder; folder = folder->parent)
+  {
+    BookmarkFolderStats *stats = &folder->stats;
+    BookmarkFolderStats old_stats = *stats;
+    BookmarkFolderStats old_fc;
+    gboolean rescan = FALSE;
+
+    item_contribution(folder, &old_fc);
+
+    stats->n_items += to.n_items - from.n_items;
+    stats->n_folders += to.n_folders - from.n_folders;
+
+    if (to.max_visit_count >= stats->max_visit_count)
+      stats->max_visit_count = to.max_visit_count;
+    else if (from.max_visit_count == stats->max_visit_count)
+      rescan = TRUE;
+
+    if (to.latest_visit >= stats->latest_visit)
+      stats->latest_visit = to.latest_visit;
+    else if (from.latest_visit == stats->latest_visit)
+      rescan = TRUE;
+
+    if (rescan)
+    {
+      BookmarkFolderStats s;
+
+      stats_from_children(folder, &s);
+      stats->max_visit_count = s.max_visit_count;
+      stats->latest_visit = s.latest_visit;
+    }
+
+    if (stats_equal(&old_stats, stats))
+      break;
+
+    from = old_fc;
+    item_contribution(folder, &to);
+  }
+}
+
+void
+bm_stats_compute(BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+  BookmarkFolderStats c;
+
+  memset(&bm_item->stats, 0, sizeof(bm_item->stats));
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+  {
+    bm_stats_compute(child);
+    item_contribution(child, &c);
+    stats_add(&bm_item->stats, &c);
+  }
+}
+
+void
+bm_stats_child_added(BookmarkItem *parent, BookmarkItem *child)
+{
+  BookmarkFolderStats old_c;
+  BookmarkFolderStats new_c;
+
+  memset(&old_c, 0, sizeof(old_c));
+  item_contribution(child, &new_c);
+  stats_update(parent, &old_c, &new_c);
+}
+
+void
+bm_stats_child_removed(BookmarkItem *parent, BookmarkItem *child)
+{
+  BookmarkFolderStats old_c;
+  BookmarkFolderStats new_c;
+
+  item_contribution(child, &old_c);
+  memset(&new_c, 0, sizeof(new_c));
+  stats_update(parent, &old_c, &new_c);
+}
+
+void
+bm_stats_refresh(BookmarkItem *folder)
+{
+  BookmarkFolderStats old_c;
+  BookmarkFolderStats new_c;
+
+  item_contribution(folder, &old_c);
+  stats_from_children(folder, &folder->stats);
+  item_contribution(folder, &new_c);
+  stats_update(folder->parent, &old_c, &new_c);
+}
+
+gboolean
+bookmark_item_get_stats(BookmarkItem *folder, BookmarkFolderStats *stats)
+{
+  CHECK_PARAM(!folder || !stats, "\nInvalid Input Parameter", return FALSE);
+
+  if (folder->tree && folder->tree->lazy_nodes)
+    bm_item_expand_all(folder);
+
+  *stats = folder->stats;
+
+  return TRUE;
+}
+
+void
+bookmark_item_set_visited(BookmarkItem *bm_item, guint visit_count,
+                          GTime time_last_visited)
+{
+  BookmarkFolderStats old_c;
+  BookmarkFolderStats new_c;
+  BookmarkUrlTrie *url_trie;
+
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return);
+
+  url_trie = bm_item->isFolder ? NULL : bm_item_root(bm_item)->url_trie;
+
+  item_contribution(bm_item, &old_c);
+  bm_url_trie_remove(url_trie, bm_item);
+  bm_item->visit_count = visit_count;
+  bm_item->time_last_visited = time_last_visited;
+  bm_url_trie_add(url_trie, bm_item);
+  item_contribution(bm_item, &new_c);
+  stats_update(bm_item->parent, &old_c, &new_c);
+}
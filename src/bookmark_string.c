@@ -0,0 +1,146 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Case insensitive search without copying either string. ASCII needles are
+ * compared byte by byte with ASCII case folding, after memchr() found a byte
+ * of the needle that has no case; memchr() is vectorized by the C library,
+ * which makes it the fast path over long lines. Needles with other UTF-8 in
+ * them are compared character by character with g_unichar_tolower().
+ */
+
+static inline guchar
+fold(gchar c)
+{
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (guchar)c;
+}
+
+static inline gboolean
+is_ascii_letter(gchar c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline gboolean
+ascii_match(const gchar *s, const BmNeedle *needle)
+{
+  gsize i;
+
+  for (i = 0; i < needle->len; i++)
+  {
+    if (fold(s[i]) != fold(needle->str[i]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static const gchar *
+ascii_rfind(const gchar *haystack, gsize haystack_len, const BmNeedle *needle)
+{
+  const gchar *last = NULL;
+  const gchar *end = haystack + haystack_len - needle->len + 1;
+  const gchar *p = haystack;
+  gsize anchor;
+
+  /* a byte without case can be looked for with a single memchr() */
+  for (anchor = 0; anchor < needle->len; anchor++)
+  {
+    if (!is_ascii_letter(needle->str[anchor]))
+      break;
+  }
+
+  if (anchor < needle->len)
+  {
+    const gchar *q;
+
+    while (p < end &&
+           (q = memchr(p + anchor, needle->str[anchor], end - p)) != NULL)
+    {
+      p = q - anchor;
+
+      if (ascii_match(p, needle))
+        last = p;
+
+      p++;
+    }
+  }
+  else
+  {
+    gchar lower = fold(needle->str[0]);
+    gchar upper = g_ascii_toupper(lower);
+
+    for (; p < end; p++)
+    {
+      if ((*p == lower || *p == upper) && ascii_match(p, needle))
+        last = p;
+    }
+  }
+
+  return last;
+}
+
+static gboolean
+utf8_match(const gchar *s, const gchar *s_end, const BmNeedle *needle)
+{
+  const gchar *n = needle->str;
+  const gchar *n_end = needle->str + needle->len;
+
+  while (n < n_end)
+  {
+    if (s >= s_end ||
+        g_unichar_tolower(g_utf8_get_char(s)) !=
+        g_unichar_tolower(g_utf8_get_char(n)))
+    {
+      return FALSE;
+    }
+
+    s = g_utf8_next_char(s);
+    n = g_utf8_next_char(n);
+  }
+
+  return TRUE;
+}
+
+static const gchar *
+utf8_rfind(const gchar *haystack, gsize haystack_len, const BmNeedle *needle)
+{
+  const gchar *last = NULL;
+  const gchar *end = haystack + haystack_len;
+  const gchar *p;
+
+  for (p = haystack; p < end; p = g_utf8_next_char(p))
+  {
+    if (utf8_match(p, end, needle))
+      last = p;
+  }
+
+  return last;
+}
+
+const gchar *
+bm_needle_rfind(const gchar *haystack, const BmNeedle *needle)
+{
+  gsize haystack_len;
+  gsize i;
+
+  if (!haystack)
+    return NULL;
+
+  haystack_len = strlen(haystack);
+
+  if (!needle->len)
+    return haystack + haystack_len;
+
+  for (i = 0; i < needle->len; i++)
+  {
+    if ((guchar)needle->str[i] >= 0x80)
+      return utf8_rfind(haystack, haystack_len, needle);
+  }
+
+  if (haystack_len < needle->len)
+    return NULL;
+
+  return ascii_rfind(haystack, haystack_len, needle);
+}
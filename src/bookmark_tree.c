@@ -0,0 +1,581 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+BookmarkTree *
+bm_tree_new(BookmarkLoadFlags flags)
+{
+  BookmarkTree *tree = g_new0(BookmarkTree, 1);
+
+  tree->flags = flags;
+  tree->fields = BM_FIELD_ALL;
+
+  if (flags & BM_LOAD_ARENA)
+    tree->arena = bm_arena_new();
+
+  return tree;
+}
+
+void
+bm_tree_free(BookmarkTree *tree)
+{
+  if (!tree)
+    return;
+
+  bm_arena_free(tree->arena);
+
+  if (tree->mapped_file)
+    g_mapped_file_unref(tree->mapped_file);
+
+  if (tree->lazy_nodes)
+    g_hash_table_destroy(tree->lazy_nodes);
+
+  if (tree->doc)
+    xmlFreeDoc(tree->doc);
+
+  g_slist_free_full(tree->child_names, (GDestroyNotify)g_hash_table_destroy);
+  g_slist_free_full(tree->child_arrays, (GDestroyNotify)g_ptr_array_unref);
+  g_free(tree);
+}
+
+void
+bm_tree_lazy_done(BookmarkTree *tree)
+{
+  if (!tree->lazy_nodes || g_hash_table_size(tree->lazy_nodes))
+    return;
+
+  g_hash_table_destroy(tree->lazy_nodes);
+  tree->lazy_nodes = NULL;
+  xmlFreeDoc(tree->doc);
+  tree->doc = NULL;
+}
+
+/* Fills in list of folder from the child links */
+static void
+build_list(BookmarkItem *folder)
+{
+  GSList *list = NULL;
+  BookmarkItem *child;
+
+  for (child = folder->first_child; child; child = child->next_sibling)
+    list = bm_tree_slist_prepend(folder->tree, list, child);
+
+  folder->list = g_slist_reverse(list);
+}
+
+void
+bm_tree_detach(BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!bm_item->tree || bm_item->tree->arena)
+    return;
+
+  bm_loader_expand(bm_item);
+
+  /* bookmark_item_get_list() only builds lists for trees without them */
+  if ((bm_item->tree->flags & BM_LOAD_NO_CHILD_LISTS) && !bm_item->list)
+    build_list(bm_item);
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_tree_detach(child);
+
+  bm_item->tree = NULL;
+}
+
+BookmarkItem *
+bm_tree_new_item(BookmarkTree *tree)
+{
+  BookmarkItem *bm_item;
+
+  if (!tree || !tree->arena)
+    bm_item = create_bookmark_new();
+  else
+    bm_item = bm_arena_alloc0(tree->arena, sizeof(BookmarkItem));
+
+  bm_item->tree = tree;
+
+  return bm_item;
+}
+
+gchar *
+bm_tree_strdup(BookmarkTree *tree, const gchar *s)
+{
+  if (!tree || !tree->arena)
+    return g_strdup(s);
+
+  return s ? bm_arena_strndup(tree->arena, s, strlen(s)) : NULL;
+}
+
+gchar *
+bm_tree_strconcat(BookmarkTree *tree, const gchar *s1, const gchar *s2)
+{
+  if (!tree || !tree->arena)
+    return g_strconcat(s1, s2, NULL);
+
+  return bm_arena_strconcat(tree->arena, s1, s2);
+}
+
+void
+bm_tree_strfree(BookmarkTree *tree, gchar *s)
+{
+  if (!tree || !tree->arena)
+    g_free(s);
+}
+
+GSList *
+bm_tree_slist_prepend(BookmarkTree *tree, GSList *list, gpointer data)
+{
+  GSList *l;
+
+  if (!tree || !tree->arena)
+    return g_slist_prepend(list, data);
+
+  l = bm_arena_alloc(tree->arena, sizeof(GSList));
+  l->data = data;
+  l->next = list;
+
+  return l;
+}
+
+void
+bm_item_link_child(BookmarkItem *parent, BookmarkItem *child)
+{
+  child->parent = parent;
+  child->next_sibling = NULL;
+
+  if (parent->last_child)
+    parent->last_child->next_sibling = child;
+  else
+    parent->first_child = child;
+
+  parent->last_child = child;
+}
+
+void
+bm_item_build_lists(BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  bm_loader_expand(bm_item);
+
+  if (!bm_item->list)
+    build_list(bm_item);
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+  {
+    if (child->first_child)
+      bm_item_build_lists(child);
+  }
+}
+
+BookmarkItem *
+bm_item_root(BookmarkItem *bm_item)
+{
+  while (bm_item->parent)
+    bm_item = bm_item->parent;
+
+  return bm_item;
+}
+
+void
+bm_item_index_add(BookmarkItem *bm_item)
+{
+  BookmarkItem *root = bm_item_root(bm_item);
+
+  bm_url_index_add(root->url_index, bm_item);
+  bm_search_index_add(root->search_index, bm_item);
+  bm_url_trie_add(root->url_trie, bm_item);
+}
+
+void
+bm_item_index_remove(BookmarkItem *bm_item)
+{
+  BookmarkItem *root = bm_item_root(bm_item);
+
+  bm_url_index_remove(root->url_index, bm_item);
+  bm_search_index_remove(root->search_index, bm_item);
+  bm_url_trie_remove(root->url_trie, bm_item);
+}
+
+void
+bm_item_expand_all(BookmarkItem *bm_item)
+{
+  /* the walk builds every folder it goes into */
+  bookmark_item_walk(bm_item, BM_WALK_DEPTH_FIRST, NULL, NULL, NULL);
+}
+
+GSList *
+bookmark_item_get_list(BookmarkItem *folder)
+{
+  if (!folder)
+    return NULL;
+
+  bm_loader_expand(folder);
+
+  /* only trees loaded without lists lack them, a list emptied by the caller
+   * stays empty */
+  if (!folder->list && folder->tree &&
+      (folder->tree->flags & BM_LOAD_NO_CHILD_LISTS))
+  {
+    build_list(folder);
+  }
+
+  return folder->list;
+}
+
+gboolean
+bookmark_item_expand(BookmarkItem *folder)
+{
+  CHECK_PARAM(!folder, "\nInvalid Input Parameter", return FALSE);
+
+  bm_loader_expand(folder);
+
+  return TRUE;
+}
+
+void
+bm_item_insert_child(BookmarkItem *parent, BookmarkItem *child,
+                     BookmarkItem *before)
+{
+  BookmarkItem *prev = NULL;
+  BookmarkItem *sibling;
+
+  if (before && before->parent == parent)
+  {
+    for (sibling = parent->first_child; sibling && sibling != before;
+         sibling = sibling->next_sibling)
+    {
+      prev = sibling;
+    }
+  }
+  else
+    sibling = NULL;
+
+  if (sibling)
+  {
+    child->parent = parent;
+    child->next_sibling = sibling;
+
+    if (prev)
+      prev->next_sibling = child;
+    else
+      parent->first_child = child;
+  }
+  else
+  {
+    bm_item_link_child(parent, child);
+    before = NULL;
+  }
+
+  bm_child_names_add(parent, child);
+  bm_child_array_insert(parent, child, before);
+  bm_stats_child_added(parent, child);
+
+  /* a root moved into another tree goes into the indexes of that one */
+  bm_url_index_free(child->url_index);
+  child->url_index = NULL;
+  bm_search_index_free(child->search_index);
+  child->search_index = NULL;
+  bm_url_trie_free(child->url_trie);
+  child->url_trie = NULL;
+  bm_item_index_add(child);
+}
+
+void
+bookmark_item_append_child(BookmarkItem *parent, BookmarkItem *child)
+{
+  CHECK_PARAM(!parent || !child, "\nInvalid Input Parameter", return);
+  CHECK_PARAM(parent->tree && parent->tree->arena,
+              "\nArena trees are read only", return);
+
+  /* linked twice the chain of children would run in a circle */
+  if (child->parent)
+    bookmark_item_unlink(child);
+
+  bm_item_insert_child(parent, child, NULL);
+
+  if (parent->list)
+    parent->list = g_slist_append(parent->list, child);
+}
+
+/* Takes bm_item out of the children and the indexes of parent, but not out of
+ * parent->list */
+static void
+unlink_item(BookmarkItem *parent, BookmarkItem *bm_item)
+{
+  BookmarkItem *prev = NULL;
+  BookmarkItem *child;
+
+  bm_item_index_remove(bm_item);
+
+  for (child = parent->first_child; child && child != bm_item;
+       child = child->next_sibling)
+  {
+    prev = child;
+  }
+
+  if (child)
+  {
+    if (prev)
+      prev->next_sibling = bm_item->next_sibling;
+    else
+      parent->first_child = bm_item->next_sibling;
+
+    if (parent->last_child == bm_item)
+      parent->last_child = prev;
+  }
+
+  bm_child_names_remove(parent, bm_item);
+  bm_child_array_remove(parent, bm_item);
+  bm_item->parent = NULL;
+  bm_item->next_sibling = NULL;
+
+  if (child)
+    bm_stats_child_removed(parent, bm_item);
+}
+
+void
+bookmark_item_unlink(BookmarkItem *bm_item)
+{
+  BookmarkItem *parent;
+
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return);
+
+  parent = bm_item->parent;
+
+  if (!parent)
+    return;
+
+  CHECK_PARAM(parent->tree && parent->tree->arena,
+              "\nArena trees are read only", return);
+
+  parent->list = g_slist_remove(parent->list, bm_item);
+  unlink_item(parent, bm_item);
+
+  /* must not outlive the lazy tree it came from */
+  if (bm_item->tree && bm_item->tree->root != bm_item)
+    bm_tree_detach(bm_item);
+}
+
+void
+bookmark_item_relink_children(BookmarkItem *folder)
+{
+  BookmarkItem *root;
+  GHashTable *old_children = NULL;
+  BookmarkItem *child;
+  GSList *l;
+
+  CHECK_PARAM(!folder, "\nInvalid Input Parameter", return);
+  CHECK_PARAM(folder->tree && folder->tree->arena,
+              "\nArena trees are read only", return);
+
+  root = bm_item_root(folder);
+
+  if (root->url_index || root->search_index || root->url_trie)
+  {
+    old_children = g_hash_table_new(NULL, NULL);
+
+    for (child = folder->first_child; child; child = child->next_sibling)
+      g_hash_table_add(old_children, child);
+  }
+
+  folder->first_child = NULL;
+  folder->last_child = NULL;
+
+  for (l = folder->list; l; l = l->next)
+    bm_item_link_child(folder, l->data);
+
+  /* built again on the next lookup */
+  bm_child_names_free(folder);
+  bm_child_array_free(folder);
+  bm_stats_refresh(folder);
+
+  if (old_children)
+  {
+    GHashTableIter iter;
+
+    /* what is left in old_children was taken out of the folder */
+    for (child = folder->first_child; child; child = child->next_sibling)
+    {
+      if (!g_hash_table_remove(old_children, child))
+        bm_item_index_add(child);
+    }
+
+    g_hash_table_iter_init(&iter, old_children);
+
+    /* still linked to folder through their parent */
+    while (g_hash_table_iter_next(&iter, (gpointer *)&child, NULL))
+      bm_item_index_remove(child);
+
+    g_hash_table_destroy(old_children);
+  }
+}
+
+void
+bookmark_item_set_name(BookmarkItem *bm_item, const gchar *name)
+{
+  gchar *old;
+
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return);
+  CHECK_PARAM(bm_item->tree && bm_item->tree->arena,
+              "\nArena trees are read only", return);
+
+  bm_item_index_remove(bm_item);
+
+  if (bm_item->parent)
+    bm_child_names_remove(bm_item->parent, bm_item);
+
+  /* name may be, or point into, the old one */
+  old = bm_item->name;
+  bm_item->name = bm_tree_strdup(bm_item->tree, name);
+  bm_tree_strfree(bm_item->tree, old);
+
+  if (bm_item->parent)
+    bm_child_names_add(bm_item->parent, bm_item);
+
+  bm_item_index_add(bm_item);
+}
+
+void
+bookmark_item_set_url(BookmarkItem *bm_item, const gchar *url)
+{
+  gchar *old;
+
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return);
+  CHECK_PARAM(bm_item->tree && bm_item->tree->arena,
+              "\nArena trees are read only", return);
+
+  bm_item_index_remove(bm_item);
+  old = bm_item->url;
+  bm_item->url = bm_tree_strdup(bm_item->tree, url);
+  bm_tree_strfree(bm_item->tree, old);
+  bm_item_index_add(bm_item);
+}
+
+static void
+free_item(BookmarkItem *bm_item)
+{
+  bm_url_index_free(bm_item->url_index);
+  bm_item->url_index = NULL;
+  bm_search_index_free(bm_item->search_index);
+  bm_item->search_index = NULL;
+  bm_url_trie_free(bm_item->url_trie);
+  bm_item->url_trie = NULL;
+
+  if (bm_item->tree && bm_item->tree->arena)
+  {
+    /* arena items go away all at once, together with their root. Their
+     * bindings are in the arena too. */
+    if (bm_item->tree->root == bm_item)
+    {
+      if (bm_item->tree->bound)
+        bookmark_item_unbind_document(bm_item);
+
+      bm_tree_free(bm_item->tree);
+    }
+
+    return;
+  }
+
+  if (bm_item->tree && bm_item->tree->lazy_nodes)
+  {
+    g_hash_table_remove(bm_item->tree->lazy_nodes, bm_item);
+    bm_tree_lazy_done(bm_item->tree);
+  }
+
+  if (bm_item->name)
+  {
+    g_free(bm_item->name);
+    bm_item->name = NULL;
+  }
+
+  if (bm_item->url)
+  {
+    g_free(bm_item->url);
+    bm_item->url = NULL;
+  }
+
+  if (bm_item->favicon_file)
+  {
+    g_free(bm_item->favicon_file);
+    bm_item->favicon_file = NULL;
+  }
+
+  if (bm_item->thumbnail_file)
+  {
+    g_free(bm_item->thumbnail_file);
+    bm_item->thumbnail_file = NULL;
+  }
+
+  if (bm_item->id)
+  {
+    g_free(bm_item->id);
+    bm_item->id = NULL;
+  }
+
+  bm_bind_release(bm_item);
+  bm_child_names_free(bm_item);
+  bm_child_array_free(bm_item);
+
+  /* children added by the library are linked in first_child before the
+   * caller puts them into list, and the caller may have built list by
+   * hand. Both go, each once: the ones in list are told apart by their
+   * parent being cleared first. */
+  if (bm_item->list)
+  {
+    GSList *l;
+
+    for (l = bm_item->list; l; l = l->next)
+      ((BookmarkItem *)l->data)->parent = NULL;
+  }
+
+  {
+    BookmarkItem *child = bm_item->first_child;
+
+    while (child)
+    {
+      BookmarkItem *next = child->next_sibling;
+
+      if (child->parent)
+        free_item(child);
+
+      child = next;
+    }
+
+    bm_item->first_child = NULL;
+    bm_item->last_child = NULL;
+  }
+
+  if (bm_item->list)
+  {
+    g_slist_foreach(bm_item->list, (GFunc)free_item, NULL);
+    g_slist_free(bm_item->list);
+    bm_item->list = NULL;
+  }
+
+  if (bm_item->tree && bm_item->tree->root == bm_item)
+    bm_tree_free(bm_item->tree);
+
+  g_free(bm_item);
+}
+
+void
+free_bookmark_item(BookmarkItem *bm_item)
+{
+  if (!bm_item)
+    return;
+
+  /* removed from a list by the caller, the tree and its indexes must not keep
+   * it. The list belongs to the caller, who may be walking it. */
+  if (bm_item->parent && !(bm_item->tree && bm_item->tree->arena))
+    unlink_item(bm_item->parent, bm_item);
+
+  free_item(bm_item);
+}
+
+void
+bookmark_item_free(BookmarkItem *bm_item)
+{
+  free_bookmark_item(bm_item);
+}
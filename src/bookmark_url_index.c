@@ -0,0 +1,249 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * The bookmarks of a tree by url, kept on the root item. Built on load, then
+ * changed through bm_item_index_add() and bm_item_index_remove() whenever an
+ * item is linked, unlinked, relinked, freed or renamed. Urls are normalized
+ * first, so that the same page written a little differently is found too.
+ * Every url maps to the list of bookmarks that have it, almost always one.
+ */
+
+struct _BookmarkUrlIndex
+{
+  /* normalized url -> GSList of BookmarkItem */
+  GHashTable *urls;
+};
+
+static inline gboolean
+is_default_port(const gchar *scheme, gsize scheme_len, const gchar *port,
+                gsize port_len)
+{
+  if (port_len == 2 && !strncmp(port, "80", 2))
+    return scheme_len == 4 && !g_ascii_strncasecmp(scheme, "http", 4);
+
+  if (port_len == 3 && !strncmp(port, "443", 3))
+    return scheme_len == 5 && !g_ascii_strncasecmp(scheme, "https", 5);
+
+  return FALSE;
+}
+
+/* Lowercases scheme and host, drops a default port and the fragment and
+ * gives an empty path a "/" */
+static gchar *
+normalize_url(const gchar *url)
+{
+  const gchar *scheme_end;
+  const gchar *host;
+  const gchar *host_end;
+  const gchar *port = NULL;
+  const gchar *end;
+  const gchar *p;
+  GString *s;
+
+  while (g_ascii_isspace(*url))
+    url++;
+
+  end = url + strcspn(url, "#");
+
+  while (end > url && g_ascii_isspace(end[-1]))
+    end--;
+
+  scheme_end = strstr(url, "://");
+
+  if (!scheme_end || scheme_end > end)
+    return g_strndup(url, end - url);
+
+  host = scheme_end + 3;
+  host_end = host + strcspn(host, "/?#");
+
+  if (host_end > end)
+    host_end = end;
+
+  /* user info is left as it is */
+  for (p = host; p < host_end; p++)
+  {
+    if (*p == '@')
+      host = p + 1;
+  }
+
+  for (p = host_end; p > host && g_ascii_isdigit(p[-1]); p--)
+    ;
+
+  if (p > host && p[-1] == ':')
+    port = p;
+
+  s = g_string_sized_new(end - url + 1);
+
+  for (p = url; p < scheme_end; p++)
+    g_string_append_c(s, g_ascii_tolower(*p));
+
+  g_string_append_len(s, scheme_end, host - scheme_end);
+
+  if (port && is_default_port(url, scheme_end - url, port, host_end - port))
+    p = port - 1;
+  else
+    p = host_end;
+
+  for (; host < p; host++)
+    g_string_append_c(s, g_ascii_tolower(*host));
+
+  if (host_end == end || *host_end != '/')
+    g_string_append_c(s, '/');
+
+  g_string_append_len(s, host_end, end - host_end);
+
+  return g_string_free(s, FALSE);
+}
+
+static void
+free_items(gpointer items)
+{
+  g_slist_free(items);
+}
+
+static BookmarkUrlIndex *
+url_index_new(void)
+{
+  BookmarkUrlIndex *url_index = g_new(BookmarkUrlIndex, 1);
+
+  url_index->urls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          free_items);
+
+  return url_index;
+}
+
+void
+bm_url_index_free(BookmarkUrlIndex *url_index)
+{
+  if (url_index)
+  {
+    g_hash_table_destroy(url_index->urls);
+    g_free(url_index);
+  }
+}
+
+void
+bm_url_index_add(BookmarkUrlIndex *url_index, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!url_index)
+    return;
+
+  if (!bm_item->isFolder)
+  {
+    gchar *url;
+    GSList *items;
+
+    if (!bm_item->url)
+      return;
+
+    url = normalize_url(bm_item->url);
+    items = g_hash_table_lookup(url_index->urls, url);
+
+    if (items)
+    {
+      /* the list stays where it is, only the new item is linked in */
+      items->next = g_slist_prepend(items->next, bm_item);
+      g_free(url);
+    }
+    else
+      g_hash_table_insert(url_index->urls, url, g_slist_prepend(NULL, bm_item));
+
+    return;
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_url_index_add(url_index, child);
+}
+
+void
+bm_url_index_remove(BookmarkUrlIndex *url_index, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!url_index)
+    return;
+
+  if (!bm_item->isFolder)
+  {
+    gpointer key;
+    gpointer items;
+    gchar *url;
+
+    if (!bm_item->url)
+      return;
+
+    url = normalize_url(bm_item->url);
+
+    if (g_hash_table_lookup_extended(url_index->urls, url, &key, &items))
+    {
+      g_hash_table_steal(url_index->urls, key);
+      items = g_slist_remove(items, bm_item);
+
+      if (items)
+        g_hash_table_insert(url_index->urls, key, items);
+      else
+        g_free(key);
+    }
+
+    g_free(url);
+
+    return;
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_url_index_remove(url_index, child);
+}
+
+void
+bm_url_index_build(BookmarkItem *bookmark_root)
+{
+  bm_url_index_free(bookmark_root->url_index);
+  bookmark_root->url_index = url_index_new();
+  bm_url_index_add(bookmark_root->url_index, bookmark_root);
+}
+
+static GSList *
+lookup(BookmarkItem *bookmark_root, const gchar *url)
+{
+  GSList *items;
+  gchar *key;
+
+  /* lazy trees only have what was built so far */
+  if (bookmark_root->tree && bookmark_root->tree->lazy_nodes)
+    bm_item_expand_all(bookmark_root);
+
+  if (!bookmark_root->url_index)
+    bm_url_index_build(bookmark_root);
+
+  key = normalize_url(url);
+  items = g_hash_table_lookup(bookmark_root->url_index->urls, key);
+  g_free(key);
+
+  return items;
+}
+
+BookmarkItem *
+bookmark_item_lookup_url(BookmarkItem *bookmark_root, const gchar *url)
+{
+  GSList *items;
+
+  CHECK_PARAM(!bookmark_root || bookmark_root->parent || !url,
+              "\nInvalid Input Parameter", return NULL);
+
+  items = lookup(bookmark_root, url);
+
+  return items ? items->data : NULL;
+}
+
+GSList *
+bookmark_item_lookup_url_all(BookmarkItem *bookmark_root, const gchar *url)
+{
+  CHECK_PARAM(!bookmark_root || bookmark_root->parent || !url,
+              "\nInvalid Input Parameter", return NULL);
+
+  return g_slist_copy(lookup(bookmark_root, url));
+}
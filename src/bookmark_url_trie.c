@@ -0,0 +1,573 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Compressed prefix trie over the urls of a tree, for completing a url as it
+ * is typed. Kept on the root item and built on the first completion. From then
+ * on it changes together with the url index, and bookmark_item_set_visited()
+ * takes a bookmark out and in again around its new visit_count. Urls go in
+ * without their scheme and "www.", ASCII case folded, so "Example.com/a",
+ * "http://www.example.com/a" and "https://example.com/a" complete alike.
+ * Every node keeps the URL_TRIE_BEST most visited bookmarks below it, so the
+ * usual completion only walks down the typed prefix.
+ */
+
+#define URL_TRIE_BEST 16
+
+typedef struct
+{
+  BookmarkItem *bm_item;
+  gchar *key;
+  /* order of insertion, for ties */
+  guint64 seq;
+} TrieEntry;
+
+typedef struct _TrieNode TrieNode;
+
+struct _TrieNode
+{
+  /* edge from the parent, not NUL terminated */
+  gchar *label;
+  gsize label_len;
+  /* TrieNode, ordered by the first byte of their label, NULL if none */
+  GPtrArray *children;
+  /* TrieEntry whose key ends here, NULL if none */
+  GPtrArray *entries;
+  /* the most visited entries at and below this node, best first */
+  TrieEntry **best;
+  guint n_best;
+};
+
+struct _BookmarkUrlTrie
+{
+  TrieNode *root;
+  /* BookmarkItem -> TrieEntry */
+  GHashTable *entries;
+  guint64 seq;
+};
+
+static inline guchar
+fold(gchar c)
+{
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (guchar)c;
+}
+
+/* Drops the scheme the way netscape_export_bookmarks_item() tells urls with
+ * one from those without, then "www." */
+static gchar *
+url_key(const gchar *url)
+{
+  const gchar *p = url;
+  gchar *key;
+  gsize i;
+
+  while (g_ascii_isalnum(*p))
+    p++;
+
+  if (*p == ':')
+  {
+    for (p++; *p == '/'; p++)
+      ;
+  }
+  else
+    p = url;
+
+  if (!g_ascii_strncasecmp(p, "www.", 4))
+    p += 4;
+
+  key = g_strdup(p);
+
+  for (i = 0; key[i]; i++)
+    key[i] = fold(key[i]);
+
+  return key;
+}
+
+static gboolean
+ranks_before(const TrieEntry *a, const TrieEntry *b)
+{
+  if (a->bm_item->visit_count != b->bm_item->visit_count)
+    return a->bm_item->visit_count > b->bm_item->visit_count;
+
+  return a->seq < b->seq;
+}
+
+static gint
+compare_entries(gconstpointer a, gconstpointer b)
+{
+  const TrieEntry *ea = *(const TrieEntry **)a;
+  const TrieEntry *eb = *(const TrieEntry **)b;
+
+  return ranks_before(ea, eb) ? -1 : ranks_before(eb, ea) ? 1 : 0;
+}
+
+static void
+free_entry(gpointer entry)
+{
+  g_free(((TrieEntry *)entry)->key);
+  g_free(entry);
+}
+
+static TrieNode *
+node_new(const gchar *label, gsize label_len)
+{
+  TrieNode *node = g_new0(TrieNode, 1);
+
+  node->label = g_strndup(label, label_len);
+  node->label_len = label_len;
+
+  return node;
+}
+
+static void
+node_free(TrieNode *node)
+{
+  if (node->children)
+  {
+    guint i;
+
+    for (i = 0; i < node->children->len; i++)
+      node_free(g_ptr_array_index(node->children, i));
+
+    g_ptr_array_free(node->children, TRUE);
+  }
+
+  if (node->entries)
+    g_ptr_array_free(node->entries, TRUE);
+
+  g_free(node->best);
+  g_free(node->label);
+  g_free(node);
+}
+
+static TrieNode *
+find_child(const TrieNode *node, gchar c, guint *pos)
+{
+  guint lo = 0;
+  guint hi = node->children ? node->children->len : 0;
+
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+    TrieNode *child = g_ptr_array_index(node->children, mid);
+
+    if ((guchar)child->label[0] < (guchar)c)
+      lo = mid + 1;
+    else if ((guchar)child->label[0] > (guchar)c)
+      hi = mid;
+    else
+    {
+      *pos = mid;
+      return child;
+    }
+  }
+
+  *pos = lo;
+
+  return NULL;
+}
+
+static gsize
+common_prefix(const TrieNode *node, const gchar *s)
+{
+  gsize i;
+
+  for (i = 0; i < node->label_len && s[i] && node->label[i] == s[i]; i++)
+    ;
+
+  return i;
+}
+
+static TrieEntry **
+best_copy(TrieEntry **best, guint n_best)
+{
+  TrieEntry **copy = g_new(TrieEntry *, n_best);
+
+  if (n_best)
+    memcpy(copy, best, n_best * sizeof(TrieEntry *));
+
+  return copy;
+}
+
+static void
+best_insert(TrieNode *node, TrieEntry *entry)
+{
+  guint pos;
+
+  if (node->n_best == URL_TRIE_BEST &&
+      !ranks_before(entry, node->best[URL_TRIE_BEST - 1]))
+  {
+    return;
+  }
+
+  for (pos = node->n_best; pos > 0; pos--)
+  {
+    if (!ranks_before(entry, node->best[pos - 1]))
+      break;
+  }
+
+  if (node->n_best < URL_TRIE_BEST)
+    node->best = g_renew(TrieEntry *, node->best, ++node->n_best);
+
+  memmove(&node->best[pos + 1], &node->best[pos],
+          (node->n_best - pos - 1) * sizeof(TrieEntry *));
+  node->best[pos] = entry;
+}
+
+/* The best of node again, from its own entries and the best of its
+ * children */
+static void
+best_refresh(TrieNode *node)
+{
+  GPtrArray *all = g_ptr_array_new();
+  guint i;
+
+  if (node->entries)
+  {
+    for (i = 0; i < node->entries->len; i++)
+      g_ptr_array_add(all, g_ptr_array_index(node->entries, i));
+  }
+
+  if (node->children)
+  {
+    for (i = 0; i < node->children->len; i++)
+    {
+      TrieNode *child = g_ptr_array_index(node->children, i);
+      guint j;
+
+      for (j = 0; j < child->n_best; j++)
+        g_ptr_array_add(all, child->best[j]);
+    }
+  }
+
+  g_ptr_array_sort(all, compare_entries);
+
+  node->n_best = MIN(all->len, URL_TRIE_BEST);
+  g_free(node->best);
+  node->best = best_copy((TrieEntry **)all->pdata, node->n_best);
+
+  g_ptr_array_free(all, TRUE);
+}
+
+/* Cuts the label of node after len bytes, the rest of node moves to a new
+ * child */
+static void
+node_split(TrieNode *node, gsize len)
+{
+  TrieNode *tail = node_new(node->label + len, node->label_len - len);
+
+  tail->children = node->children;
+  tail->entries = node->entries;
+  tail->best = node->best;
+  tail->n_best = node->n_best;
+
+  node->label_len = len;
+  node->children = g_ptr_array_new();
+  g_ptr_array_add(node->children, tail);
+  node->entries = NULL;
+  node->best = best_copy(tail->best, tail->n_best);
+}
+
+static void
+node_insert(TrieNode *node, const gchar *rest, TrieEntry *entry)
+{
+  TrieNode *child;
+  gsize len;
+  guint pos;
+
+  best_insert(node, entry);
+
+  if (!*rest)
+  {
+    if (!node->entries)
+      node->entries = g_ptr_array_new();
+
+    g_ptr_array_add(node->entries, entry);
+
+    return;
+  }
+
+  child = find_child(node, *rest, &pos);
+
+  if (!child)
+  {
+    child = node_new(rest, strlen(rest));
+
+    if (!node->children)
+      node->children = g_ptr_array_new();
+
+    g_ptr_array_insert(node->children, pos, child);
+    node_insert(child, "", entry);
+
+    return;
+  }
+
+  len = common_prefix(child, rest);
+
+  if (len < child->label_len)
+    node_split(child, len);
+
+  node_insert(child, rest + len, entry);
+}
+
+/* Joins node with its only child */
+static void
+node_merge(TrieNode *node)
+{
+  TrieNode *child = g_ptr_array_index(node->children, 0);
+  gchar *label = g_malloc(node->label_len + child->label_len + 1);
+
+  memcpy(label, node->label, node->label_len);
+  memcpy(label + node->label_len, child->label, child->label_len);
+  label[node->label_len + child->label_len] = '\0';
+
+  g_free(node->label);
+  node->label = label;
+  node->label_len += child->label_len;
+
+  g_ptr_array_free(node->children, TRUE);
+  node->children = child->children;
+  node->entries = child->entries;
+  g_free(node->best);
+  node->best = child->best;
+  node->n_best = child->n_best;
+
+  g_free(child->label);
+  g_free(child);
+}
+
+static void
+node_remove(TrieNode *node, const gchar *rest, TrieEntry *entry)
+{
+  guint i;
+
+  if (!*rest)
+  {
+    g_ptr_array_remove(node->entries, entry);
+
+    if (!node->entries->len)
+    {
+      g_ptr_array_free(node->entries, TRUE);
+      node->entries = NULL;
+    }
+  }
+  else
+  {
+    guint pos;
+    TrieNode *child = find_child(node, *rest, &pos);
+
+    node_remove(child, rest + child->label_len, entry);
+
+    if (!child->entries && !child->children)
+    {
+      g_ptr_array_remove_index(node->children, pos);
+      node_free(child);
+
+      if (!node->children->len)
+      {
+        g_ptr_array_free(node->children, TRUE);
+        node->children = NULL;
+      }
+    }
+    else if (!child->entries && child->children->len == 1)
+      node_merge(child);
+  }
+
+  /* an entry that is not among the best of a node is not among those of the
+   * nodes above it either */
+  for (i = 0; i < node->n_best; i++)
+  {
+    if (node->best[i] == entry)
+    {
+      best_refresh(node);
+      break;
+    }
+  }
+}
+
+static BookmarkUrlTrie *
+url_trie_new(void)
+{
+  BookmarkUrlTrie *url_trie = g_new0(BookmarkUrlTrie, 1);
+
+  url_trie->root = node_new("", 0);
+  url_trie->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, free_entry);
+
+  return url_trie;
+}
+
+void
+bm_url_trie_free(BookmarkUrlTrie *url_trie)
+{
+  if (url_trie)
+  {
+    node_free(url_trie->root);
+    g_hash_table_destroy(url_trie->entries);
+    g_free(url_trie);
+  }
+}
+
+void
+bm_url_trie_add(BookmarkUrlTrie *url_trie, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!url_trie)
+    return;
+
+  if (!bm_item->isFolder)
+  {
+    TrieEntry *entry;
+
+    if (!bm_item->url || g_hash_table_contains(url_trie->entries, bm_item))
+      return;
+
+    entry = g_new(TrieEntry, 1);
+    entry->bm_item = bm_item;
+    entry->key = url_key(bm_item->url);
+    entry->seq = url_trie->seq++;
+    g_hash_table_insert(url_trie->entries, bm_item, entry);
+    node_insert(url_trie->root, entry->key, entry);
+
+    return;
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_url_trie_add(url_trie, child);
+}
+
+void
+bm_url_trie_remove(BookmarkUrlTrie *url_trie, BookmarkItem *bm_item)
+{
+  BookmarkItem *child;
+
+  if (!url_trie)
+    return;
+
+  if (!bm_item->isFolder)
+  {
+    TrieEntry *entry = g_hash_table_lookup(url_trie->entries, bm_item);
+
+    if (entry)
+    {
+      node_remove(url_trie->root, entry->key, entry);
+      g_hash_table_remove(url_trie->entries, bm_item);
+    }
+
+    return;
+  }
+
+  for (child = bm_item->first_child; child; child = child->next_sibling)
+    bm_url_trie_remove(url_trie, child);
+}
+
+void
+bm_url_trie_build(BookmarkItem *bookmark_root)
+{
+  bm_url_trie_free(bookmark_root->url_trie);
+  bookmark_root->url_trie = url_trie_new();
+  bm_url_trie_add(bookmark_root->url_trie, bookmark_root);
+}
+
+/* The node whose subtree has the keys starting with prefix, NULL if none */
+static TrieNode *
+find_prefix(TrieNode *node, const gchar *prefix)
+{
+  while (*prefix)
+  {
+    TrieNode *child;
+    gsize len;
+    guint pos;
+
+    child = find_child(node, *prefix, &pos);
+
+    if (!child)
+      return NULL;
+
+    len = common_prefix(child, prefix);
+
+    if (!prefix[len])
+      return child;
+
+    if (len < child->label_len)
+      return NULL;
+
+    prefix += len;
+    node = child;
+  }
+
+  return node;
+}
+
+static void
+collect_entries(TrieNode *node, GPtrArray *all)
+{
+  guint i;
+
+  if (node->entries)
+  {
+    for (i = 0; i < node->entries->len; i++)
+      g_ptr_array_add(all, g_ptr_array_index(node->entries, i));
+  }
+
+  if (node->children)
+  {
+    for (i = 0; i < node->children->len; i++)
+      collect_entries(g_ptr_array_index(node->children, i), all);
+  }
+}
+
+GSList *
+bookmark_item_complete_url(BookmarkItem *bookmark_root, const gchar *prefix,
+                           guint max_results)
+{
+  TrieNode *node;
+  GSList *rv = NULL;
+  gchar *key;
+  guint i;
+
+  CHECK_PARAM(!bookmark_root || bookmark_root->parent || !prefix,
+              "\nInvalid Input Parameter", return NULL);
+
+  if (bookmark_root->tree && bookmark_root->tree->lazy_nodes)
+    bm_item_expand_all(bookmark_root);
+
+  if (!bookmark_root->url_trie)
+    bm_url_trie_build(bookmark_root);
+
+  key = url_key(prefix);
+  node = find_prefix(bookmark_root->url_trie->root, key);
+  g_free(key);
+
+  if (!node)
+    return NULL;
+
+  if (max_results && max_results <= URL_TRIE_BEST)
+  {
+    for (i = MIN(max_results, node->n_best); i > 0; i--)
+      rv = g_slist_prepend(rv, node->best[i - 1]->bm_item);
+  }
+  else
+  {
+    GPtrArray *all = g_ptr_array_new();
+
+    collect_entries(node, all);
+    g_ptr_array_sort(all, compare_entries);
+
+    if (max_results && all->len > max_results)
+      g_ptr_array_set_size(all, max_results);
+
+    for (i = all->len; i > 0; i--)
+    {
+      rv = g_slist_prepend(rv,
+                           ((TrieEntry *)g_ptr_array_index(all, i - 1))->
+                           bm_item);
+    }
+
+    g_ptr_array_free(all, TRUE);
+  }
+
+  return rv;
+}
@@ -0,0 +1,239 @@
+#include "bookmark_private.h"
+
+#include <string.h>
+
+/*
+ * Traversal over the child links. Depth first needs no memory of its own:
+ * the way back up is the parent links, and the depth is counted along. Breadth
+ * first keeps the folders of the current depth and the next one in an array,
+ * their children are read straight from the links when it is their turn.
+ */
+
+static BookmarkItem *
+next_depth_first(BookmarkIter *iter, BookmarkItem *bm_item, gboolean skip)
+{
+  if (bm_item->isFolder && !skip)
+  {
+    bm_loader_expand(bm_item);
+
+    if (bm_item->first_child)
+    {
+      iter->depth++;
+      return bm_item->first_child;
+    }
+  }
+
+  for (; bm_item != iter->root; bm_item = bm_item->parent, iter->depth--)
+  {
+    if (bm_item->next_sibling)
+      return bm_item->next_sibling;
+  }
+
+  return NULL;
+}
+
+static BookmarkItem *
+next_breadth_first(BookmarkIter *iter, BookmarkItem *bm_item, gboolean skip)
+{
+  if (bm_item->isFolder && !skip)
+  {
+    if (!iter->folders)
+      iter->folders = g_ptr_array_new();
+
+    g_ptr_array_add(iter->folders, bm_item);
+  }
+
+  bm_item = bm_item == iter->root ? NULL : bm_item->next_sibling;
+
+  while (!bm_item)
+  {
+    BookmarkItem *folder;
+
+    if (!iter->folders || iter->head == iter->folders->len)
+      return NULL;
+
+    if (iter->head == iter->depth_end)
+    {
+      /* the folders of the depth before are done with */
+      g_ptr_array_remove_range(iter->folders, 0, iter->head);
+      iter->head = 0;
+      iter->depth_end = iter->folders->len;
+      iter->depth++;
+    }
+
+    folder = g_ptr_array_index(iter->folders, iter->head++);
+    bm_loader_expand(folder);
+    bm_item = folder->first_child;
+  }
+
+  return bm_item;
+}
+
+void
+bookmark_iter_init(BookmarkIter *iter, BookmarkItem *bm_item,
+                   BookmarkWalkOrder order)
+{
+  CHECK_PARAM(!iter, "\nInvalid Input Parameter", return);
+
+  memset(iter, 0, sizeof(*iter));
+  iter->root = bm_item;
+  iter->order = order;
+}
+
+BookmarkItem *
+bookmark_iter_next(BookmarkIter *iter)
+{
+  BookmarkItem *bm_item;
+  gboolean skip;
+
+  CHECK_PARAM(!iter, "\nInvalid Input Parameter", return NULL);
+
+  if (!iter->root)
+    return NULL;
+
+  bm_item = iter->item;
+  skip = iter->skip_children;
+  iter->skip_children = FALSE;
+
+  if (!bm_item)
+    bm_item = iter->root;
+  else if (iter->order == BM_WALK_BREADTH_FIRST)
+    bm_item = next_breadth_first(iter, bm_item, skip);
+  else
+    bm_item = next_depth_first(iter, bm_item, skip);
+
+  if (!bm_item)
+    bookmark_iter_clear(iter);
+
+  iter->item = bm_item;
+
+  return bm_item;
+}
+
+guint
+bookmark_iter_get_depth(const BookmarkIter *iter)
+{
+  CHECK_PARAM(!iter, "\nInvalid Input Parameter", return 0);
+
+  return iter->depth;
+}
+
+void
+bookmark_iter_skip_children(BookmarkIter *iter)
+{
+  CHECK_PARAM(!iter, "\nInvalid Input Parameter", return);
+
+  iter->skip_children = TRUE;
+}
+
+void
+bookmark_iter_clear(BookmarkIter *iter)
+{
+  CHECK_PARAM(!iter, "\nInvalid Input Parameter", return);
+
+  if (iter->folders)
+  {
+    g_ptr_array_free(iter->folders, TRUE);
+    iter->folders = NULL;
+  }
+
+  iter->root = NULL;
+  iter->item = NULL;
+}
+
+/* Same as the iterator, but with a post hook once everything below an item
+ * was visited, on the way back up */
+static BookmarkItem *
+walk_depth_first(BookmarkItem *root, BookmarkVisitFunc pre,
+                 BookmarkVisitFunc post, gpointer user_data)
+{
+  BookmarkItem *bm_item = root;
+  guint depth = 0;
+
+  while (1)
+  {
+    BookmarkVisitResult rv = BM_VISIT_CONTINUE;
+
+    if (pre)
+    {
+      rv = pre(bm_item, depth, user_data);
+
+      if (rv == BM_VISIT_STOP)
+        return bm_item;
+    }
+
+    if (bm_item->isFolder && rv != BM_VISIT_SKIP_CHILDREN)
+    {
+      bm_loader_expand(bm_item);
+
+      if (bm_item->first_child)
+      {
+        bm_item = bm_item->first_child;
+        depth++;
+        continue;
+      }
+    }
+
+    while (1)
+    {
+      if (post && post(bm_item, depth, user_data) == BM_VISIT_STOP)
+        return bm_item;
+
+      if (bm_item == root)
+        return NULL;
+
+      if (bm_item->next_sibling)
+      {
+        bm_item = bm_item->next_sibling;
+        break;
+      }
+
+      bm_item = bm_item->parent;
+      depth--;
+    }
+  }
+}
+
+static BookmarkItem *
+walk_breadth_first(BookmarkItem *root, BookmarkVisitFunc pre,
+                   gpointer user_data)
+{
+  BookmarkIter iter;
+  BookmarkItem *bm_item;
+
+  bookmark_iter_init(&iter, root, BM_WALK_BREADTH_FIRST);
+
+  while ((bm_item = bookmark_iter_next(&iter)))
+  {
+    BookmarkVisitResult rv;
+
+    if (!pre)
+      continue;
+
+    rv = pre(bm_item, iter.depth, user_data);
+
+    if (rv == BM_VISIT_STOP)
+    {
+      bookmark_iter_clear(&iter);
+      return bm_item;
+    }
+
+    if (rv == BM_VISIT_SKIP_CHILDREN)
+      bookmark_iter_skip_children(&iter);
+  }
+
+  return NULL;
+}
+
+BookmarkItem *
+bookmark_item_walk(BookmarkItem *bm_item, BookmarkWalkOrder order,
+                   BookmarkVisitFunc pre, BookmarkVisitFunc post,
+                   gpointer user_data)
+{
+  CHECK_PARAM(!bm_item, "\nInvalid Input Parameter", return NULL);
+
+  if (order == BM_WALK_BREADTH_FIRST)
+    return walk_breadth_first(bm_item, pre, user_data);
+
+  return walk_depth_first(bm_item, pre, post, user_data);
+}
@@ -0,0 +1,406 @@
+#include "bookmark_private.h"
+
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Keeps an in-memory bookmark tree in sync with its file. On every change
+ * the file is parsed into a new tree that is matched against the old one
+ * folder by folder, children by (isFolder, name, url) in document order.
+ * Matched items are updated in place, so pointers held by the caller stay
+ * valid, and only the differences are applied and reported. The journal of
+ * the file is watched as well, as changes written to it alone are part of
+ * the tree too.
+ */
+
+/* A journal is only ever appended to or emptied, so its size and mtime tell
+ * every change apart */
+typedef struct
+{
+  guint64 size;
+  gint64 mtime;
+  gint64 mtime_nsec;
+} JournalKey;
+
+struct _BookmarkWatch
+{
+  gchar *file_name;
+  gchar *journal_name;
+  BookmarkItem **bookmark_root;
+  BookmarkWatchFunc func;
+  gpointer user_data;
+  /* items a patch took out of the tree, left to the caller instead of freed
+   * if set */
+  GPtrArray *removed;
+  GFileMonitor *monitor;
+  gulong handler_id;
+  GFileMonitor *journal_monitor;
+  gulong journal_handler_id;
+  /* contents of the file and the journal the tree was last loaded from */
+  BmSnapshotKey key;
+  JournalKey journal_key;
+  gboolean have_key;
+};
+
+static guint
+item_key_hash(gconstpointer p)
+{
+  const BookmarkItem *bm_item = p;
+  guint hash = bm_item->name ? g_str_hash(bm_item->name) : 0;
+
+  if (bm_item->url)
+    hash = hash * 31 + g_str_hash(bm_item->url);
+
+  return bm_item->isFolder ? ~hash : hash;
+}
+
+static gboolean
+item_key_equal(gconstpointer a, gconstpointer b)
+{
+  const BookmarkItem *bm_a = a;
+  const BookmarkItem *bm_b = b;
+
+  return !bm_a->isFolder == !bm_b->isFolder &&
+      !g_strcmp0(bm_a->name, bm_b->name) &&
+      !g_strcmp0(bm_a->url, bm_b->url);
+}
+
+static inline void
+notify(BookmarkWatch *watch, BookmarkItem *bm_item, BookmarkChangeType change)
+{
+  if (watch->func)
+    watch->func(bm_item, change, watch->user_data);
+}
+
+/* Takes over the string of to if it differs */
+static gboolean
+patch_string(gchar **s, gchar **to)
+{
+  if (!g_strcmp0(*s, *to))
+    return FALSE;
+
+  g_free(*s);
+  *s = *to;
+  *to = NULL;
+
+  return TRUE;
+}
+
+#define PATCH_FIELD(old, new, field) \
+  ((old)->field != (new)->field ? ((old)->field = (new)->field, TRUE) : FALSE)
+
+static void patch_children(BookmarkWatch *watch, BookmarkItem *folder,
+                           BookmarkItem *new_folder);
+
+static void
+patch_item(BookmarkWatch *watch, BookmarkItem *bm_item, BookmarkItem *new_item)
+{
+  gboolean modified = FALSE;
+
+  modified |= patch_string(&bm_item->name, &new_item->name);
+  modified |= patch_string(&bm_item->url, &new_item->url);
+  modified |= patch_string(&bm_item->favicon_file, &new_item->favicon_file);
+  modified |= patch_string(&bm_item->thumbnail_file,
+                           &new_item->thumbnail_file);
+  modified |= PATCH_FIELD(bm_item, new_item, visit_count);
+  modified |= PATCH_FIELD(bm_item, new_item, time_added);
+  modified |= PATCH_FIELD(bm_item, new_item, time_last_visited);
+  modified |= PATCH_FIELD(bm_item, new_item, isOperatorBookmark);
+  modified |= PATCH_FIELD(bm_item, new_item, isDeleted);
+  /* ids showing up on the first save are no change to report */
+  patch_string(&bm_item->id, &new_item->id);
+
+  if (bm_item->isFolder)
+    patch_children(watch, bm_item, new_item);
+
+  if (modified)
+    notify(watch, bm_item, BOOKMARK_CHANGE_MODIFIED);
+}
+
+static void
+free_unmatched(gpointer key, gpointer value, gpointer user_data)
+{
+  g_slist_free(value);
+}
+
+/*
+ * Makes the children of folder those of new_folder. The children of
+ * new_folder are either matched with one of folder and freed, or moved over.
+ * new_folder is left without children.
+ */
+static void
+patch_children(BookmarkWatch *watch, BookmarkItem *folder,
+               BookmarkItem *new_folder)
+{
+  GHashTable *unmatched = g_hash_table_new(item_key_hash, item_key_equal);
+  GHashTable *matched = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GPtrArray *old_children = g_ptr_array_new();
+  GSList *children = NULL;
+  GSList *added = NULL;
+  GSList *l;
+  BookmarkItem *child;
+  BookmarkItem *next;
+  gint i;
+
+  for (child = folder->first_child; child; child = child->next_sibling)
+    g_ptr_array_add(old_children, child);
+
+  /* lists of equal children, in document order */
+  for (i = old_children->len - 1; i >= 0; i--)
+  {
+    child = g_ptr_array_index(old_children, i);
+    l = g_hash_table_lookup(unmatched, child);
+    g_hash_table_insert(unmatched, child, g_slist_prepend(l, child));
+  }
+
+  child = new_folder->first_child;
+  new_folder->first_child = NULL;
+  new_folder->last_child = NULL;
+  g_slist_free(new_folder->list);
+  new_folder->list = NULL;
+
+  for (; child; child = next)
+  {
+    next = child->next_sibling;
+    child->next_sibling = NULL;
+    l = g_hash_table_lookup(unmatched, child);
+
+    if (l)
+    {
+      BookmarkItem *old_child = l->data;
+
+      g_hash_table_insert(unmatched, child, l->next);
+      g_slist_free_1(l);
+      g_hash_table_add(matched, old_child);
+
+      patch_item(watch, old_child, child);
+      free_bookmark_item(child);
+      children = g_slist_prepend(children, old_child);
+    }
+    else
+    {
+      children = g_slist_prepend(children, child);
+      added = g_slist_prepend(added, child);
+    }
+  }
+
+  g_hash_table_foreach(unmatched, free_unmatched, NULL);
+  g_hash_table_destroy(unmatched);
+
+  g_slist_free(folder->list);
+  folder->list = g_slist_reverse(children);
+  bookmark_item_relink_children(folder);
+
+  for (l = added = g_slist_reverse(added); l; l = l->next)
+    notify(watch, l->data, BOOKMARK_CHANGE_ADDED);
+
+  g_slist_free(added);
+
+  for (i = 0; i < (gint)old_children->len; i++)
+  {
+    child = g_ptr_array_index(old_children, i);
+
+    if (!g_hash_table_contains(matched, child))
+    {
+      child->parent = NULL;
+      child->next_sibling = NULL;
+      notify(watch, child, BOOKMARK_CHANGE_REMOVED);
+
+      if (watch->removed)
+        g_ptr_array_add(watch->removed, child);
+      else
+        free_bookmark_item(child);
+    }
+  }
+
+  g_ptr_array_free(old_children, TRUE);
+  g_hash_table_destroy(matched);
+}
+
+void
+bm_tree_patch(BookmarkItem *old_root, BookmarkItem *new_root,
+              BookmarkWatchFunc func, gpointer user_data, GPtrArray *removed)
+{
+  BookmarkWatch watch = { 0 };
+
+  /* patch_item() only reports through it */
+  watch.func = func;
+  watch.user_data = user_data;
+  watch.removed = removed;
+
+  patch_item(&watch, old_root, new_root);
+  free_bookmark_item(new_root);
+  bm_stats_compute(old_root);
+}
+
+/* All zero if there is no journal */
+static void
+journal_key_for_file(const gchar *journal_name, JournalKey *key)
+{
+  struct stat st;
+
+  memset(key, 0, sizeof(*key));
+
+  if (!stat(journal_name, &st))
+  {
+    key->size = st.st_size;
+    key->mtime = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+}
+
+gboolean
+bookmark_watch_reload(BookmarkWatch *watch)
+{
+  BookmarkItem *bm_item = NULL;
+  BookmarkItem *old_root;
+  BmSnapshotKey key;
+  JournalKey journal_key;
+
+  CHECK_PARAM(!watch, "\nInvalid Input Parameter", return FALSE);
+
+  journal_key_for_file(watch->journal_name, &journal_key);
+
+  if (!bm_snapshot_key_for_file(watch->file_name, &key))
+    return FALSE;
+
+  if (watch->have_key &&
+      !memcmp(&journal_key, &watch->journal_key, sizeof(journal_key)) &&
+      bm_snapshot_key_matches(watch->file_name, &key, &watch->key))
+  {
+    return TRUE;
+  }
+
+  if (!get_root_bookmark_absolute_path_full(&bm_item, watch->file_name,
+                                            BM_LOAD_DEFAULT))
+  {
+    return FALSE;
+  }
+
+  watch->key = key;
+  watch->journal_key = journal_key;
+  watch->have_key = TRUE;
+  old_root = *watch->bookmark_root;
+
+  if (!old_root)
+    *watch->bookmark_root = bm_item;
+  else if (old_root->tree)
+  {
+    /* arena, lazy and list-less trees can not be patched, swap them */
+    free_bookmark_item(old_root);
+    *watch->bookmark_root = bm_item;
+    notify(watch, bm_item, BOOKMARK_CHANGE_MODIFIED);
+  }
+  else
+  {
+    /* visit counts change in place, which the trie can not follow */
+    gboolean had_trie = old_root->url_trie != NULL;
+
+    bm_url_trie_free(old_root->url_trie);
+    old_root->url_trie = NULL;
+
+    bm_tree_patch(old_root, bm_item, watch->func, watch->user_data, NULL);
+
+    if (had_trie)
+      bm_url_trie_build(old_root);
+  }
+
+  return TRUE;
+}
+
+static void
+file_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+             GFileMonitorEvent event, gpointer user_data)
+{
+  switch (event)
+  {
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_DELETED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+    case G_FILE_MONITOR_EVENT_RENAMED:
+      bookmark_watch_reload(user_data);
+      break;
+    default:
+      break;
+  }
+}
+
+BookmarkWatch *
+bookmark_watch_new(BookmarkItem **bookmark_root, const gchar *file_name,
+                   BookmarkWatchFunc func, gpointer user_data)
+{
+  BookmarkWatch *watch;
+  GFile *file;
+
+  CHECK_PARAM(!bookmark_root || !file_name, "\nInvalid Input Parameter",
+              return NULL);
+
+  watch = g_new0(BookmarkWatch, 1);
+  watch->file_name = g_strdup(file_name);
+  watch->journal_name = g_strconcat(file_name, ".journal", NULL);
+  watch->bookmark_root = bookmark_root;
+  watch->func = func;
+  watch->user_data = user_data;
+
+  if (*bookmark_root)
+  {
+    /* assume the tree is what the file holds now */
+    journal_key_for_file(watch->journal_name, &watch->journal_key);
+    watch->have_key = bm_snapshot_key_for_file(file_name, &watch->key);
+  }
+  else
+    bookmark_watch_reload(watch);
+
+  file = g_file_new_for_path(file_name);
+  watch->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+  g_object_unref(file);
+
+  if (watch->monitor)
+  {
+    watch->handler_id = g_signal_connect(watch->monitor, "changed",
+                                         G_CALLBACK(file_changed), watch);
+  }
+
+  /* may not exist yet, the monitor reports it once it is created */
+  file = g_file_new_for_path(watch->journal_name);
+  watch->journal_monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+                                               NULL, NULL);
+  g_object_unref(file);
+
+  if (watch->journal_monitor)
+  {
+    watch->journal_handler_id =
+        g_signal_connect(watch->journal_monitor, "changed",
+                         G_CALLBACK(file_changed), watch);
+  }
+
+  return watch;
+}
+
+void
+bookmark_watch_free(BookmarkWatch *watch)
+{
+  if (!watch)
+    return;
+
+  if (watch->monitor)
+  {
+    g_signal_handler_disconnect(watch->monitor, watch->handler_id);
+    g_file_monitor_cancel(watch->monitor);
+    g_object_unref(watch->monitor);
+  }
+
+  if (watch->journal_monitor)
+  {
+    g_signal_handler_disconnect(watch->journal_monitor,
+                                watch->journal_handler_id);
+    g_file_monitor_cancel(watch->journal_monitor);
+    g_object_unref(watch->journal_monitor);
+  }
+
+  g_free(watch->file_name);
+  g_free(watch->journal_name);
+  g_free(watch);
+}
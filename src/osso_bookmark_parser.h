@@ -29,6 +29,7 @@
 #endif
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <time.h>
 #include <libxml/xmlreader.h>
 
@@ -37,6 +38,7 @@ G_BEGIN_DECLS
 #define FAVICONS_PATH		   	"/.bookmarks/favicons"
 #define THUMBNAIL_PATH          "/.bookmarks/thumbnails"
 #define BOOKMARKLOCK_PATH		"/.bookmarks/.lock"
+#define BOOKMARK_FLOCK_PATH		"/.bookmarks/.flock"
 #define HOME_ENV   		        "HOME"
 #define BOOKMARK_GCONF_SORT_PATH        "/apps/osso/bookmark/sort"
 
@@ -65,6 +67,25 @@ typedef enum {
 } BookmarkType;
 
 typedef struct _BookmarkItem BookmarkItem;
+typedef struct _BookmarkTree BookmarkTree;
+typedef struct _BookmarkNodeRef BookmarkNodeRef;
+typedef struct _BookmarkUrlIndex BookmarkUrlIndex;
+typedef struct _BookmarkSearchIndex BookmarkSearchIndex;
+typedef struct _BookmarkUrlTrie BookmarkUrlTrie;
+
+/* Aggregates over everything below a folder, at any depth. The folder itself
+ * is not included. All zero for bookmarks. */
+typedef struct {
+    /* number of bookmarks */
+    guint n_items;
+    /* number of folders */
+    guint n_folders;
+    /* highest visit_count */
+    guint max_visit_count;
+    /* latest time_last_visited */
+    GTime latest_visit;
+} BookmarkFolderStats;
+
 struct _BookmarkItem {
     /* The type of this bookmark */
     gboolean isFolder;
@@ -93,8 +114,132 @@ struct _BookmarkItem {
     gboolean isOperatorBookmark;
     /* Flag for deleted operator bookmarks */
     gboolean isDeleted;
+
+    /* The loaded tree owning this item, NULL for items allocated one by one */
+    BookmarkTree *tree;
+
+    /* The children again, linked through the items themselves. Kept in the
+     * same order as list; appending through these is O(1) and needs no
+     * GSList node. */
+    BookmarkItem *first_child;
+    BookmarkItem *last_child;
+    /* next item in the parent folder */
+    BookmarkItem *next_sibling;
+
+    /* Computed on load. Changes through the bookmark_item_* functions, the
+     * bookmark_set_* functions and freeing an item carry over, fields
+     * assigned directly do not. For BM_LOAD_LAZY trees it only covers the
+     * folders built so far, see bookmark_item_get_stats(). */
+    BookmarkFolderStats stats;
+
+    /* XBEL id of the element the item was read from, NULL if it had none.
+     * Every element gets one the first time the file is written. Updates
+     * use it to find the element instead of matching titles. */
+    gchar *id;
+
+    /* Elements of the document the item is bound to, NULL unless
+     * bookmark_item_bind_document() was called */
+    BookmarkNodeRef *xml;
+
+    /* Bookmarks of the tree by url, on the root item only. See
+     * bookmark_item_lookup_url(). */
+    BookmarkUrlIndex *url_index;
+    /* Titles and urls of the tree, on the root item only. See
+     * bookmark_item_search(). */
+    BookmarkSearchIndex *search_index;
+    /* Urls of the tree by prefix, on the root item only. See
+     * bookmark_item_complete_url(). */
+    BookmarkUrlTrie *url_trie;
+
+    /* Title of a child -> first child with it, NULL until a path was
+     * resolved through the folder. See bookmark_item_resolve_path(). */
+    GHashTable *child_names;
+    /* The children by position, NULL until a child was asked for by
+     * position. See bookmark_item_get_children(). */
+    GPtrArray *child_array;
 };
 
+/* Options for get_root_bookmark_absolute_path_full() */
+typedef enum {
+    BM_LOAD_DEFAULT = 0,
+    /* Place all items, child lists and strings of the tree in a few large
+     * blocks. The whole tree is released at once by freeing its root with
+     * bookmark_item_free(). Such a tree is read only: its strings and lists
+     * must not be freed or reallocated one by one. */
+    BM_LOAD_ARENA = 1 << 0,
+    /* Link children through first_child/next_sibling only and leave list
+     * NULL, use bookmark_item_get_list() where a GSList is needed */
+    BM_LOAD_NO_CHILD_LISTS = 1 << 1,
+    /* Use the binary <file>.snapshot written by an earlier load while the
+     * XML file is unchanged, and write one after parsing it otherwise. The
+     * snapshot is replaced under the exclusive lock, and left as it is if
+     * another writer holds that. With BM_LOAD_ARENA the strings point into
+     * the mapped snapshot. get_root_bookmark() sets it, other loads without
+     * this flag never touch the snapshot. */
+    BM_LOAD_SNAPSHOT = 1 << 2,
+    /* Build only the root folder and its direct children. The children of
+     * other folders are built the first time bookmark_item_get_list() or
+     * bookmark_item_expand() is called on the folder, until then list and
+     * first_child of the folder are NULL. */
+    BM_LOAD_LAZY = 1 << 3,
+    /* Parse the top level folders of large files on several threads */
+    BM_LOAD_PARALLEL = 1 << 4
+} BookmarkLoadFlags;
+
+/* Fields of BookmarkItem filled in by get_root_bookmark_absolute_path_fields(),
+ * the others are left NULL or 0. isFolder and the tree structure are always
+ * there. */
+typedef enum {
+    /* name, without the ".bm" suffix of bookmarks if left out */
+    BM_FIELD_NAMES = 1 << 0,
+    /* url */
+    BM_FIELD_URLS = 1 << 1,
+    /* favicon_file and thumbnail_file */
+    BM_FIELD_ASSETS = 1 << 2,
+    /* visit_count, time_added, time_last_visited, isOperatorBookmark and
+     * isDeleted */
+    BM_FIELD_METADATA = 1 << 3,
+    /* id */
+    BM_FIELD_IDS = 1 << 4,
+    BM_FIELD_ALL = 0x1f
+} BookmarkFieldMask;
+
+/* Order of bookmark_item_walk() and BookmarkIter */
+typedef enum {
+    /* a folder, then everything below it, then its next sibling */
+    BM_WALK_DEPTH_FIRST,
+    /* all items of one depth before those of the next */
+    BM_WALK_BREADTH_FIRST
+} BookmarkWalkOrder;
+
+/* What a BookmarkVisitFunc wants bookmark_item_walk() to do next */
+typedef enum {
+    BM_VISIT_CONTINUE,
+    /* leave out the children of the folder just visited, before them only */
+    BM_VISIT_SKIP_CHILDREN,
+    /* end the walk */
+    BM_VISIT_STOP
+} BookmarkVisitResult;
+
+/* depth is 0 for the item the walk started from */
+typedef BookmarkVisitResult (*BookmarkVisitFunc)(BookmarkItem *bm_item,
+                                                 guint depth,
+                                                 gpointer user_data);
+
+/* Iterator over a folder and everything below it, see bookmark_iter_init().
+ * Lives on the stack of the caller, the fields are private. */
+typedef struct {
+    BookmarkItem *root;
+    BookmarkItem *item;
+    guint depth;
+    BookmarkWalkOrder order;
+    gboolean skip_children;
+    /* breadth first: folders whose children are still to come */
+    GPtrArray *folders;
+    guint head;
+    guint depth_end;
+} BookmarkIter;
+
 /* Sorting order Ascending or Descending*/
 typedef enum {
     BM_ASC = 0,
@@ -137,6 +282,663 @@ typedef enum {
  */
 BookmarkItem *create_bookmark_new(void);
 
+/**
+ * bookmark_item_free:
+ * @param bm_item: Bookmark item to release, may be NULL
+ *
+ * Releases the bookmark item together with all of its children. An item that
+ * still has a parent is taken out of the children and the indexes of its tree
+ * first; the list of the parent is left to the caller. For trees loaded with
+ * BM_LOAD_ARENA only freeing the root item does something, and it releases
+ * the whole tree.
+ */
+void bookmark_item_free(BookmarkItem *bm_item);
+
+/**
+ * bookmark_item_get_list:
+ * @param folder: Bookmark folder
+ * @return The list of children of folder
+ *
+ * Compatibility accessor for folder->list. In trees loaded with
+ * BM_LOAD_NO_CHILD_LISTS the list is built from the child links the first
+ * time and kept in folder->list; everywhere else folder->list is returned as
+ * it is, also when the caller emptied it. The list is owned by folder.
+ */
+GSList *bookmark_item_get_list(BookmarkItem *folder);
+
+/**
+ * bookmark_item_expand:
+ * @param folder: Bookmark folder
+ * @return TRUE if success, FALSE otherwise
+ *
+ * Builds the children of a folder from a tree loaded with BM_LOAD_LAZY, so
+ * that they can be reached through the child links. Does nothing for folders
+ * that are built already.
+ */
+gboolean bookmark_item_expand(BookmarkItem *folder);
+
+/**
+ * bookmark_item_append_child:
+ * @param parent: Bookmark folder
+ * @param child: Bookmark item to add at the end of parent
+ *
+ * Adds child to the in-memory tree only. O(1) on the child links, list gets
+ * appended too if parent has one. A child that has a parent already is
+ * unlinked from it first.
+ */
+void bookmark_item_append_child(BookmarkItem *parent, BookmarkItem *child);
+
+/**
+ * bookmark_item_unlink:
+ * @param bm_item: Bookmark item
+ *
+ * Detaches bm_item from its parent folder in the in-memory tree. The item is
+ * not freed.
+ */
+void bookmark_item_unlink(BookmarkItem *bm_item);
+
+/**
+ * bookmark_item_relink_children:
+ * @param folder: Bookmark folder
+ *
+ * Rebuilds the child links of folder from folder->list. Needed after editing
+ * list directly. Not allowed in trees loaded with BM_LOAD_ARENA.
+ */
+void bookmark_item_relink_children(BookmarkItem *folder);
+
+/**
+ * bookmark_item_get_stats:
+ * @param folder: Bookmark folder
+ * @param stats: Returns the aggregates of folder
+ * @return TRUE if success, FALSE otherwise
+ *
+ * Same as reading folder->stats, but builds the folders below folder first if
+ * it is part of a tree loaded with BM_LOAD_LAZY.
+ */
+gboolean bookmark_item_get_stats(BookmarkItem *folder,
+                                 BookmarkFolderStats *stats);
+
+/**
+ * bookmark_item_set_visited:
+ * @param bm_item: Bookmark item
+ * @param visit_count: New visit_count
+ * @param time_last_visited: New time_last_visited
+ *
+ * Sets the visit fields of bm_item in the in-memory tree and updates the
+ * stats of the folders above it. The file is left alone.
+ */
+void bookmark_item_set_visited(BookmarkItem *bm_item, guint visit_count,
+                               GTime time_last_visited);
+
+/**
+ * bookmark_item_lookup_url:
+ * @param bookmark_root: Root bookmark item
+ * @param url: Url to look for
+ * @return The first bookmark below bookmark_root with url, NULL if there is none
+ *
+ * Looks url up in the url index of the tree, without walking it. Urls are
+ * compared after lowercasing scheme and host and dropping a default port and
+ * the #fragment, and an empty path is taken as "/". Trees loaded with
+ * BM_LOAD_LAZY are built completely on the first call.
+ */
+BookmarkItem *bookmark_item_lookup_url(BookmarkItem *bookmark_root,
+                                       const gchar *url);
+
+/**
+ * bookmark_item_lookup_url_all:
+ * @param bookmark_root: Root bookmark item
+ * @param url: Url to look for
+ * @return Every bookmark below bookmark_root with url, free the list with
+ * g_slist_free()
+ *
+ * Same as bookmark_item_lookup_url(), for urls bookmarked more than once.
+ */
+GSList *bookmark_item_lookup_url_all(BookmarkItem *bookmark_root,
+                                     const gchar *url);
+
+/**
+ * bookmark_item_set_url:
+ * @param bm_item: Bookmark item
+ * @param url: New url
+ *
+ * Sets the url of bm_item in the in-memory tree and updates the indexes of
+ * the tree. The file is left alone, see bookmark_set_url() for that.
+ */
+void bookmark_item_set_url(BookmarkItem *bm_item, const gchar *url);
+
+/**
+ * bookmark_item_set_name:
+ * @param bm_item: Bookmark item
+ * @param name: New name, with the ".bm" of bookmarks
+ *
+ * Same as bookmark_item_set_url(), for the name.
+ */
+void bookmark_item_set_name(BookmarkItem *bm_item, const gchar *name);
+
+/**
+ * bookmark_item_search:
+ * @param bookmark_root: Root bookmark item
+ * @param query: Text to look for
+ * @param max_results: Most items to return, 0 for all of them
+ * @return The items below bookmark_root whose title or url has query in it,
+ * best first, free the list with g_slist_free()
+ *
+ * Matches ignore case, as g_utf8_casefold() folds it. Title matches rank
+ * above url matches, matches at the start of the title or host above those
+ * at the start of a word, and those above the rest; visit_count breaks ties.
+ * The trigram index behind it is built on the first call. Items added, moved, renamed or freed through the
+ * bookmark_item_* functions, bookmark_set_name(), bookmark_set_url() or
+ * bookmark_add_child() are found as they are now; after editing list call
+ * bookmark_item_relink_children(), and a name or url assigned to the item
+ * directly is not seen. Queries shorter than 3 bytes are looked up in the
+ * lists of single bytes and pairs of bytes the index keeps as well.
+ */
+GSList *bookmark_item_search(BookmarkItem *bookmark_root, const gchar *query,
+                             guint max_results);
+
+/**
+ * bookmark_item_complete_url:
+ * @param bookmark_root: Root bookmark item
+ * @param prefix: Start of a url, as typed so far
+ * @param max_results: Most bookmarks to return, 0 for all of them
+ * @return The bookmarks below bookmark_root whose url starts with prefix,
+ * most visited first, free the list with g_slist_free()
+ *
+ * The scheme and a "www." are ignored on both sides and ASCII case does not
+ * matter, so "Exa" completes "http://www.example.com/". Up to 16 results come
+ * straight from the url trie, which is built on the first call. It follows
+ * urls and visit counts changed through bookmark_item_set_url(),
+ * bookmark_item_set_visited() or the bookmark_set_* functions, and bookmarks
+ * added or freed through the bookmark_item_* functions or
+ * bookmark_add_child(). A visit_count assigned directly leaves the ranking
+ * wrong.
+ */
+GSList *bookmark_item_complete_url(BookmarkItem *bookmark_root,
+                                   const gchar *prefix, guint max_results);
+
+/**
+ * bookmark_item_resolve_path:
+ * @param folder: Folder the path starts from, usually the root item
+ * @param path: Titles separated by "/", such as "Work/Projects/Wiki"
+ * @return The item at path, NULL if there is none
+ *
+ * Bookmarks go by their title, the name without the ".bm". Of children with
+ * the same title the first one is taken, empty components are skipped and
+ * titles with a "/" in them can not be resolved. Every folder on the way
+ * finds its child through a map from title to child, built on the first
+ * lookup, so the cost is one hash lookup per component. Children added,
+ * unlinked, renamed or freed through the bookmark_item_* functions,
+ * bookmark_set_name() or bookmark_add_child() update the map; one rebuilt by
+ * bookmark_item_relink_children() after editing list is built again.
+ */
+BookmarkItem *bookmark_item_resolve_path(BookmarkItem *folder,
+                                         const gchar *path);
+
+/**
+ * bookmark_item_resolve_path_node:
+ * @param folder: Folder the path starts from, usually the root item
+ * @param path: Titles separated by "/"
+ * @param root_element: Root element of the document
+ * @return The element of the item at path, NULL if there is none
+ *
+ * Same as bookmark_item_resolve_path(), for the element of the item in the
+ * document. It is found directly if the tree is bound to the document, see
+ * bookmark_item_bind_document().
+ */
+xmlNodePtr bookmark_item_resolve_path_node(BookmarkItem *folder,
+                                           const gchar *path,
+                                           xmlNode *root_element);
+
+/**
+ * bookmark_item_get_n_children:
+ * @param folder: Bookmark folder
+ * @return Number of children of folder
+ */
+guint bookmark_item_get_n_children(BookmarkItem *folder);
+
+/**
+ * bookmark_item_get_nth_child:
+ * @param folder: Bookmark folder
+ * @param n: Position of the child, 0 for the first one
+ * @return The child at n, NULL if folder has no more children
+ */
+BookmarkItem *bookmark_item_get_nth_child(BookmarkItem *folder, guint n);
+
+/**
+ * bookmark_item_get_children:
+ * @param folder: Bookmark folder
+ * @param offset: Position of the first child to return
+ * @param limit: Most children to return
+ * @param children: Returns the children, room for limit items
+ * @return Number of children stored in children
+ *
+ * Returns the children of folder from offset on, for showing a window of a
+ * large folder. folder gets an array of its children on the first call, so
+ * that any position is reached in O(1) and a window costs O(limit). Appending,
+ * unlinking and freeing children through the bookmark_item_* functions and
+ * bookmark_add_child() update the array; after editing list directly call
+ * bookmark_item_relink_children().
+ */
+guint bookmark_item_get_children(BookmarkItem *folder, guint offset,
+                                 guint limit, BookmarkItem **children);
+
+/**
+ * bookmark_item_walk:
+ * @param bm_item: Item to start from, usually the root item
+ * @param order: Depth or breadth first
+ * @param pre: Called for every item before the items below it, may be NULL
+ * @param post: Called for every item after the items below it, may be NULL.
+ * Depth first only.
+ * @param user_data: Passed to pre and post
+ * @return The item pre or post returned BM_VISIT_STOP for, NULL if the walk
+ * went through
+ *
+ * Visits bm_item and everything below it in child order, following the child
+ * links of the items. Nothing is allocated on the way depth first, and a
+ * single array of folders breadth first. Folders of a tree loaded with
+ * BM_LOAD_LAZY are built as the walk gets to them, except those whose
+ * children pre skips. The tree must not be changed during the walk, apart
+ * from the fields of the items.
+ */
+BookmarkItem *bookmark_item_walk(BookmarkItem *bm_item, BookmarkWalkOrder order,
+                                 BookmarkVisitFunc pre, BookmarkVisitFunc post,
+                                 gpointer user_data);
+
+/**
+ * bookmark_iter_init:
+ * @param iter: Iterator to set up
+ * @param bm_item: Item to start from, usually the root item
+ * @param order: Depth or breadth first
+ *
+ * Sets up iter to return bm_item and everything below it, in the same order
+ * as bookmark_item_walk(), one item per bookmark_iter_next().
+ */
+void bookmark_iter_init(BookmarkIter *iter, BookmarkItem *bm_item,
+                        BookmarkWalkOrder order);
+
+/**
+ * bookmark_iter_next:
+ * @param iter: Iterator
+ * @return The next item, NULL at the end
+ *
+ * The tree must not be changed while iterating, apart from the fields of the
+ * items.
+ */
+BookmarkItem *bookmark_iter_next(BookmarkIter *iter);
+
+/**
+ * bookmark_iter_get_depth:
+ * @param iter: Iterator
+ * @return Depth of the item returned last, 0 for the item iter started from
+ */
+guint bookmark_iter_get_depth(const BookmarkIter *iter);
+
+/**
+ * bookmark_iter_skip_children:
+ * @param iter: Iterator
+ *
+ * Leaves out the items below the item returned last.
+ */
+void bookmark_iter_skip_children(BookmarkIter *iter);
+
+/**
+ * bookmark_iter_clear:
+ * @param iter: Iterator
+ *
+ * Releases what iter holds when it is not run to the end. Safe to call again
+ * and on iterators that reached the end.
+ */
+void bookmark_iter_clear(BookmarkIter *iter);
+
+/**
+ * bookmark_item_bind_document:
+ * @param bookmark_root: Root bookmark item
+ * @param doc: Open document of the file bookmark_root was loaded from
+ * @return TRUE if success, FALSE if the tree does not match doc
+ *
+ * Makes every item below bookmark_root remember its element in doc and the
+ * metadata elements in it. bookmark_set_name(), bookmark_set_url(),
+ * bookmark_set_thumbnail(), bookmark_set_visit_count(),
+ * bookmark_set_time_last_visited() and
+ * bookmark_set_operator_bookmark_as_deleted() called with the root element of
+ * doc then go straight to the element instead of searching for it, and
+ * opened_bookmark_remove() forgets the elements it frees. doc must only be
+ * changed through the bookmark functions while the tree is bound, and the
+ * _private field of its elements is used. Call
+ * bookmark_item_unbind_document() before freeing doc. Items freed while
+ * bound are unbound first, their elements stop pointing back to them.
+ */
+gboolean bookmark_item_bind_document(BookmarkItem *bookmark_root,
+                                     xmlDocPtr doc);
+
+/**
+ * bookmark_item_unbind_document:
+ * @param bookmark_root: Root bookmark item
+ *
+ * Drops what bookmark_item_bind_document() stored in the items.
+ */
+void bookmark_item_unbind_document(BookmarkItem *bookmark_root);
+
+/**
+ *  get_root_bookmark_absolute_path_full:
+ *  @param bookmark_root: Returns List of bookmark items
+ *  @param file_name: Absolute path to bookmark XML file
+ *  @param flags: How the tree is built, see BookmarkLoadFlags
+ *  @return Return TRUE if success , FALSE otherwise
+ *
+ *  Same as get_root_bookmark_absolute_path(), with load options.
+ */
+gboolean get_root_bookmark_absolute_path_full(BookmarkItem **bookmark_root,
+                                              const gchar *file_name,
+                                              BookmarkLoadFlags flags);
+
+/**
+ *  get_root_bookmark_absolute_path_fields:
+ *  @param bookmark_root: Returns List of bookmark items
+ *  @param file_name: Absolute path to bookmark XML file
+ *  @param flags: How the tree is built, see BookmarkLoadFlags
+ *  @param fields: Fields to read, see BookmarkFieldMask
+ *  @return Return TRUE if success , FALSE otherwise
+ *
+ *  Same as get_root_bookmark_absolute_path_full(), but only reads the given
+ *  fields. Meant for read only users such as folder pickers, trees loaded
+ *  this way must not be saved back.
+ */
+gboolean get_root_bookmark_absolute_path_fields(BookmarkItem **bookmark_root,
+                                                const gchar *file_name,
+                                                BookmarkLoadFlags flags,
+                                                BookmarkFieldMask fields);
+
+/**
+ *  get_root_bookmark_full:
+ *  @param bookmark_root: Returns List of bookmark items
+ *  @param flags: How the tree is built, see BookmarkLoadFlags
+ *  @return Return TRUE if success , FALSE otherwise
+ *
+ *  Same as get_root_bookmark(), with load options.
+ */
+gboolean get_root_bookmark_full(BookmarkItem **bookmark_root,
+                                BookmarkLoadFlags flags);
+
+/* What happened to an item on a reload by a BookmarkWatch */
+typedef enum {
+    BOOKMARK_CHANGE_ADDED,
+    /* the item is freed when the callback returns */
+    BOOKMARK_CHANGE_REMOVED,
+    BOOKMARK_CHANGE_MODIFIED
+} BookmarkChangeType;
+
+typedef void (*BookmarkWatchFunc)(BookmarkItem *bm_item,
+                                  BookmarkChangeType change,
+                                  gpointer user_data);
+
+typedef struct _BookmarkWatch BookmarkWatch;
+
+/**
+ * bookmark_watch_new:
+ * @param bookmark_root: Tree to keep up to date, loaded if *bookmark_root is
+ * NULL
+ * @param file_name: Absolute path to bookmark XML file
+ * @param func: Called for every change, may be NULL
+ * @param user_data: Passed to func
+ * @return New watch, free with bookmark_watch_free()
+ *
+ * Patches *bookmark_root in place whenever file_name or its journal changes
+ * on disk, which is noticed from the thread default main loop. Items that did not change
+ * keep their address. Children are matched by folder flag, name and url, in
+ * document order. For a removed folder only the folder itself is reported.
+ * Trees loaded with BM_LOAD_ARENA or BM_LOAD_LAZY are replaced as a whole,
+ * with a single change for the new root.
+ */
+BookmarkWatch *bookmark_watch_new(BookmarkItem **bookmark_root,
+                                  const gchar *file_name,
+                                  BookmarkWatchFunc func,
+                                  gpointer user_data);
+
+/**
+ * bookmark_watch_reload:
+ * @param watch: Bookmark watch
+ * @return TRUE if the tree matches the file, FALSE if it could not be read
+ *
+ * Brings the tree up to date right away, does nothing if the file did not
+ * change since the last reload.
+ */
+gboolean bookmark_watch_reload(BookmarkWatch *watch);
+
+/**
+ * bookmark_watch_free:
+ * @param watch: Bookmark watch, may be NULL
+ *
+ * Stops watching. The tree is left to the caller.
+ */
+void bookmark_watch_free(BookmarkWatch *watch);
+
+typedef struct _BookmarkEngine BookmarkEngine;
+
+/**
+ * bookmark_engine_new:
+ * @param file_name: Absolute path to bookmark XML file
+ * @param flags: How the tree is built, BM_LOAD_ARENA, BM_LOAD_LAZY and
+ * BM_LOAD_NO_CHILD_LISTS are not allowed
+ * @return New engine, free with bookmark_engine_free()
+ *
+ * An engine keeps the state the bookmark functions otherwise keep in globals,
+ * together with the tree of file_name and the document changes go to. The
+ * bookmark_engine_*() functions can be called from any thread. Different
+ * engines share nothing. Adding items other than by sorted position or by
+ * importing, and exporting have no engine functions.
+ */
+BookmarkEngine *bookmark_engine_new(const gchar *file_name,
+                                    BookmarkLoadFlags flags);
+
+/**
+ * bookmark_engine_free:
+ * @param engine: Bookmark engine, may be NULL
+ *
+ * Frees the engine and its tree. Changes not saved are lost, unless visits
+ * are still buffered: those are written together with them, see
+ * bookmark_engine_set_visit_buffer().
+ */
+void bookmark_engine_free(BookmarkEngine *engine);
+
+/**
+ * bookmark_engine_read_lock:
+ * @param engine: Bookmark engine
+ * @return Root of the tree of engine, NULL if the file could not be read
+ *
+ * Loads the tree on the first call, with its url index, search index, url
+ * trie and the child name maps and child arrays of every folder, so that
+ * the lookup functions do not build them on first use. The tree belongs to
+ * the engine and may be read from any number of threads until
+ * bookmark_engine_read_unlock(), which has to be called even if NULL is
+ * returned. The functions below change the document of engine and the tree
+ * together, waiting for the readers, so a reader sees every change made
+ * through engine. They must not be called with the read lock held.
+ *
+ * While engine has no changes that were not written, the tree is read again
+ * once the file or its journal were changed by others, here or before the
+ * next change. It is patched in place as a BookmarkWatch does, so items that
+ * did not change keep their address. Items taken out of the tree, by a
+ * change or by reading it again, are freed with engine: the engine
+ * functions refuse them, but they may still be looked at.
+ */
+BookmarkItem *bookmark_engine_read_lock(BookmarkEngine *engine);
+void bookmark_engine_read_unlock(BookmarkEngine *engine);
+
+/**
+ * bookmark_engine_set_name:
+ * @param engine: Bookmark engine
+ * @param bm_item: Item of the tree of engine
+ * @param val: New name
+ * @return TRUE if success, FALSE otherwise
+ *
+ * Same as bookmark_set_name() on the document of engine, which is opened
+ * on the first change and written by bookmark_engine_save(), and on the
+ * tree. FALSE if bm_item is no longer in the tree.
+ * bookmark_engine_set_url(), bookmark_engine_set_thumbnail(),
+ * bookmark_engine_set_visit_count() and
+ * bookmark_engine_set_time_last_visited() work the same way.
+ */
+gboolean bookmark_engine_set_name(BookmarkEngine *engine,
+                                  BookmarkItem *bm_item, const gchar *val);
+gboolean bookmark_engine_set_url(BookmarkEngine *engine, BookmarkItem *bm_item,
+                                 const gchar *val);
+gboolean bookmark_engine_set_thumbnail(BookmarkEngine *engine,
+                                       BookmarkItem *bm_item,
+                                       const gchar *val);
+gboolean bookmark_engine_set_visit_count(BookmarkEngine *engine,
+                                         BookmarkItem *bm_item,
+                                         const gchar *val);
+gboolean bookmark_engine_set_time_last_visited(BookmarkEngine *engine,
+                                               BookmarkItem *bm_item,
+                                               const gchar *val);
+
+/**
+ * bookmark_engine_remove:
+ * @param engine: Bookmark engine
+ * @param bm_item: Item of the tree of engine
+ * @return TRUE if success, FALSE otherwise
+ *
+ * Removes bm_item from the document of engine and the tree, or marks it as
+ * deleted if it is an operator bookmark, as bookmark_remove_list() does.
+ * Buffered visits of the items removed are dropped.
+ */
+gboolean bookmark_engine_remove(BookmarkEngine *engine, BookmarkItem *bm_item);
+
+/**
+ * bookmark_engine_add_child_at_sorted_position:
+ * @param engine: Bookmark engine
+ * @param parent: Folder of the tree of engine
+ * @param bm_item: New item, not linked to a parent
+ * @param presentSortType: Sort order of parent
+ * @return BM_OK if success, otherwise the error
+ *
+ * Same as bookmark_add_child_at_sorted_position() on the document of engine.
+ * bm_item goes into the tree at the same place, and belongs to engine once
+ * BM_OK is returned. Into an empty folder it is added as the only child.
+ * The sort order it used is kept in engine, see
+ * bookmark_engine_get_sorting_order().
+ */
+BMError bookmark_engine_add_child_at_sorted_position(BookmarkEngine *engine,
+                                                     BookmarkItem *parent,
+                                                     BookmarkItem *bm_item,
+                                                     SortType presentSortType);
+
+/**
+ * bookmark_engine_import:
+ * @param engine: Bookmark engine
+ * @param parent: Folder of the tree of engine, NULL for its root
+ * @param path: Path of the Netscape bookmark file to import
+ * @param importFolderName: Name of the folder the bookmarks are put in
+ * @param import_folder: Returns that folder, which belongs to engine, may be
+ * NULL
+ * @return TRUE if the file was imported
+ *
+ * Same as bookmark_import(), with the folder added as the last child of
+ * parent to the document of engine and to the tree. The file is read before
+ * the readers are waited for.
+ */
+gboolean bookmark_engine_import(BookmarkEngine *engine, BookmarkItem *parent,
+                                const gchar *path, gchar *importFolderName,
+                                BookmarkItem **import_folder);
+
+/**
+ * bookmark_engine_get_sorting_order:
+ * @param engine: Bookmark engine
+ * @return Sort order of the last sorted insert done through engine
+ */
+SortOrder bookmark_engine_get_sorting_order(BookmarkEngine *engine);
+
+/**
+ * bookmark_engine_save:
+ * @param engine: Bookmark engine
+ * @return TRUE if the changes were written, or if there were none
+ *
+ * Writes the document of engine back to the file and closes it. Nothing is
+ * written if others saved the file since the tree was read: FALSE is
+ * returned, the changes not written are dropped, and the tree is read
+ * again. Changes others only journaled are kept, and the tree is read again
+ * for them once the document is closed.
+ */
+gboolean bookmark_engine_save(BookmarkEngine *engine);
+
+/**
+ * bookmark_engine_save_async:
+ * @param engine: Bookmark engine
+ * @param cancellable: Checked before the document is serialized, may be
+ * NULL. Once it is handed to the worker thread the save is not cancelled.
+ * @param callback: Called once the changes are on disk, may be NULL
+ * @param user_data: Data for callback
+ *
+ * Same as bookmark_engine_save(), but only the document is serialized on
+ * the calling thread, writing and syncing it is done on a worker thread.
+ * The document stays open for the changes made until the write is done, and
+ * gets the changes journaled by others that the write put into the file.
+ * Once the write is done with no change made since the save was asked for,
+ * the document is closed, as bookmark_engine_save() does. A save asked for
+ * while another is being written replaces the data of the saves still
+ * waiting, so only the newest state is written next and all of them
+ * complete with that write. If others saved the file since the tree was
+ * read, the save fails and the document is dropped as by
+ * bookmark_engine_save(), together with the saves still waiting. callback
+ * is called in the thread-default main context of the caller, with NULL as
+ * source object. bookmark_engine_save()
+ * and bookmark_engine_free() wait for the writes in progress.
+ */
+void bookmark_engine_save_async(BookmarkEngine *engine,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data);
+
+/**
+ * bookmark_engine_save_finish:
+ * @param engine: Bookmark engine
+ * @param result: Result given to the callback
+ * @param error: Returns the error, may be NULL
+ * @return TRUE if the changes were written, or if there were none
+ */
+gboolean bookmark_engine_save_finish(BookmarkEngine *engine,
+                                     GAsyncResult *result, GError **error);
+
+/**
+ * bookmark_engine_set_visit_buffer:
+ * @param engine: Bookmark engine
+ * @param max_pending: Number of items whose visits may be buffered, 0 to
+ * write every visit to the document right away
+ * @param max_delay: Seconds a buffered visit may wait, 0 for no limit
+ *
+ * Makes bookmark_engine_set_visit_count() and
+ * bookmark_engine_set_time_last_visited() keep the latest values per item in
+ * memory instead of changing the document. The buffer is written once
+ * max_pending items are in it, max_delay seconds after the first of them
+ * came in, on bookmark_engine_save() and when the engine is freed. A crash
+ * loses the visits of at most max_pending items from the last max_delay
+ * seconds, and those of the write in progress. The delay is a timeout on the
+ * default main context, so it only fires while the main loop runs. Neither
+ * it nor a full buffer writes anything on the calling thread: they wake the
+ * thread of bookmark_engine_save_async(), which waits for the readers,
+ * appends the visits of items with an XBEL id to the journal of the file
+ * with one sync (see bookmark_journal_open()), puts the others into the
+ * document and writes it, so the timeout may fire while the thread running
+ * the main loop holds the read lock. Visits the journal did not take go into
+ * the document, and visits whose write failed stay in the document for the
+ * next one. Buffered visits only show in the tree once they are flushed.
+ * Off by default.
+ */
+void bookmark_engine_set_visit_buffer(BookmarkEngine *engine,
+                                      guint max_pending, guint max_delay);
+
+/**
+ * bookmark_engine_flush_visits:
+ * @param engine: Bookmark engine
+ * @return TRUE if the visits were written, or if there were none
+ *
+ * Writes the buffered visits at once. Those of items with an XBEL id go to
+ * the journal of the file, the others to the file together with any other
+ * change not saved yet, the same as bookmark_engine_save().
+ */
+gboolean bookmark_engine_flush_visits(BookmarkEngine *engine);
+
 /**
  * bookmark_add_child:
  * @param parent: Parent Bookmark item
@@ -145,7 +947,12 @@ BookmarkItem *create_bookmark_new(void);
  * at the end.
  * @return BM_OK if Succesfull, otherwise return type of error.
  *
- * This function adds the bookmark in XML file under parent item.
+ * This function adds the bookmark in XML file under parent item. bm_item is
+ * linked into the children of parent too, before the item at position, and so
+ * into the indexes of the tree; putting it into parent->list is left to the
+ * caller. If the element of parent, or of the item at position, is not in the
+ * document nothing is added and bm_item is not linked either, BM_OK is still
+ * returned. opened_bookmark_add_child() does the same.
  */
 BMError bookmark_add_child(BookmarkItem * parent, BookmarkItem * bm_item,
 			   gint position, xmlNode * root_element);
@@ -157,7 +964,9 @@ BMError bookmark_add_child(BookmarkItem * parent, BookmarkItem * bm_item,
  * @param doc: XML document tree(Return value of xmlParseFile)
  * @param root_element:  Root element of the XML document 
  *
- * This function sets new name for the bookmark item.
+ * This function sets new name for the bookmark item, in the document and in
+ * node, through bookmark_item_set_name() so that the indexes of the tree
+ * follow.
  */
 gboolean bookmark_set_name(BookmarkItem * node, const gchar * val, xmlDocPtr doc, xmlNode *root_element);
 
@@ -168,7 +977,8 @@ gboolean bookmark_set_name(BookmarkItem * node, const gchar * val, xmlDocPtr doc
  * @param doc: XML document tree(Return value of xmlParseFile)
  * @param root_element:  Root element of the XML document 
  *
- * This function sets new URL  for the bookmark item.
+ * This function sets new URL  for the bookmark item, in the document and in
+ * node, through bookmark_item_set_url().
  */
 gboolean bookmark_set_url(BookmarkItem * node, const gchar * val, xmlDocPtr doc, xmlNode *root_element);
 
@@ -219,7 +1029,7 @@ gboolean netscape_export_bookmarks(const gchar * filename, GSList * root,
  * @param doc: XML document tree(Return value of xmlParseFile)
  * @param root_element:  Root element of the XML document 
  *
- * This function adds the item in the sorted position.
+ * This function adds the item in the sorted position, in the document only.
  * @return Return BM_OK if successful or error
  */
 BMError bm_engine_insert_node_at_sorted_position(BookmarkItem * parent,
@@ -238,6 +1048,183 @@ BMError bm_engine_insert_node_at_sorted_position(BookmarkItem * parent,
 gboolean bm_engine_add_duplicate_item(BookmarkItem * parent,
 				      BookmarkItem * bm_item);
 
+typedef struct _BookmarkJournal BookmarkJournal;
+
+/* Fields bookmark_journal_set() can change */
+typedef enum {
+    /* name, with the ".bm" of bookmarks */
+    BM_JOURNAL_NAME,
+    BM_JOURNAL_URL,
+    BM_JOURNAL_THUMBNAIL,
+    BM_JOURNAL_VISIT_COUNT,
+    BM_JOURNAL_TIME_VISITED,
+    BM_JOURNAL_TIME_ADDED
+} BookmarkJournalField;
+
+/**
+ * bookmark_journal_open:
+ * @param file_name: Absolute path to bookmark XML file
+ * @return The journal of file_name, NULL on error
+ *
+ * Opens <file_name>.journal for appending, creating it if needed. Changes
+ * written to the journal cost a small append and an fdatasync() instead of a
+ * rewrite of file_name. Every load of file_name replays them on top of it.
+ * Once the journal grows past 64 KiB it is folded into file_name and emptied,
+ * and so is it by every other save of file_name.
+ */
+BookmarkJournal *bookmark_journal_open(const gchar *file_name);
+
+/**
+ * bookmark_journal_close:
+ * @param journal: Journal, may be NULL
+ *
+ * Closes the journal. What was written stays in it until the next
+ * compaction or save of the file.
+ */
+void bookmark_journal_close(BookmarkJournal *journal);
+
+/**
+ * bookmark_journal_set:
+ * @param journal: Journal
+ * @param bm_item: Bookmark item of a tree loaded from the file of journal
+ * @param field: Field to change
+ * @param val: New value, numbers as decimal strings
+ * @return TRUE if the change was written and synced, FALSE on error or if
+ * bm_item has no id
+ *
+ * Records a change of bm_item in the journal. bm_item itself is left alone.
+ * Items are found again by their XBEL id, which items read from a file
+ * written by this library always have.
+ */
+gboolean bookmark_journal_set(BookmarkJournal *journal, BookmarkItem *bm_item,
+                              BookmarkJournalField field, const gchar *val);
+
+/**
+ * bookmark_journal_remove:
+ * @param journal: Journal
+ * @param bm_item: Bookmark item of a tree loaded from the file of journal
+ * @return TRUE if the removal was written and synced
+ *
+ * Same as bookmark_journal_set(), for removing bm_item and everything below
+ * it.
+ */
+gboolean bookmark_journal_remove(BookmarkJournal *journal,
+                                 BookmarkItem *bm_item);
+
+/**
+ * bookmark_journal_compact:
+ * @param journal: Journal
+ * @return TRUE if the file was written, or the journal was empty
+ *
+ * Applies the journal to the file, writes the file once and empties the
+ * journal.
+ */
+gboolean bookmark_journal_compact(BookmarkJournal *journal);
+
+/**
+ * bm_engine_begin:
+ * @return Root element of MyBookmarks.xml as opened for the transaction, NULL
+ * if it could not be read
+ *
+ * Starts a transaction on MyBookmarks.xml. Until bm_engine_commit() or
+ * bm_engine_abort(), bookmark_remove(), bookmark_remove_list(),
+ * bm_engine_add_folder() and bm_engine_add_duplicate_item() change the
+ * document of the transaction instead of reading and writing the file each
+ * time. The functions taking a document, such as bookmark_set_name() or
+ * bookmark_add_child(), go into the transaction when given the returned
+ * element. Other threads calling these functions wait for the transaction to
+ * end. Transactions nest, only the outermost one saves. The exclusive lock
+ * of the bookmark files is held from here to the end of the transaction, so
+ * that other processes can not write the file in between. NULL is returned
+ * if it stayed taken for BM_LOCK_TIMEOUT.
+ */
+xmlNodePtr bm_engine_begin(void);
+
+/**
+ * bm_engine_commit:
+ * @return TRUE if the document was written, or if the transaction was nested
+ *
+ * Ends the transaction started by bm_engine_begin() and writes the document
+ * to MyBookmarks.xml, once.
+ */
+gboolean bm_engine_commit(void);
+
+/**
+ * bm_engine_abort:
+ *
+ * Ends the transaction started by bm_engine_begin() without writing the
+ * document. Changes made to trees in memory stay. For a nested transaction
+ * nothing is undone, its changes are saved with the outer one.
+ */
+void bm_engine_abort(void);
+
+typedef struct _BookmarkLock BookmarkLock;
+
+typedef enum {
+    /* for readers, any number of them hold it at once */
+    BM_LOCK_SHARED,
+    /* for writers, held by one and no reader */
+    BM_LOCK_EXCLUSIVE
+} BookmarkLockMode;
+
+/* Milliseconds the bookmark functions wait for the lock of the bookmark
+ * files */
+#define BM_LOCK_TIMEOUT 10000
+
+/* Contention of one mode of the locks taken by this process */
+typedef struct {
+    /* locks taken, the ones a thread took again not counted */
+    guint64 acquired;
+    /* tries that had to wait for another holder */
+    guint64 contended;
+    /* tries given up, including those of the try mode */
+    guint64 timeouts;
+    /* microseconds spent waiting by all contended tries, and the longest */
+    guint64 wait_usec;
+    guint64 max_wait_usec;
+} BookmarkLockStats;
+
+/**
+ * bookmark_lock_acquire:
+ * @param lock_file_name: Lock file relative to the home directory, usually
+ * BOOKMARK_FLOCK_PATH
+ * @param mode: Shared or exclusive
+ * @param timeout: Milliseconds to wait at most, 0 to try only, -1 to wait
+ * for as long as it takes
+ * @return The lock, NULL if it was not free in time or the lock file could
+ * not be opened
+ *
+ * Takes an flock() on the lock file, created if needed. The bookmark
+ * functions read the bookmark files under the shared lock of
+ * BOOKMARK_FLOCK_PATH and write them under the exclusive one, across
+ * processes and threads alike. A thread holding a lock exclusively gets the
+ * same lock back from further calls for the same file, which have to be
+ * released as often. A thread holding the lock shared must not ask for it
+ * exclusively, that only ends with the timeout.
+ */
+BookmarkLock *bookmark_lock_acquire(const gchar *lock_file_name,
+                                    BookmarkLockMode mode, gint timeout);
+
+/**
+ * bookmark_lock_release:
+ * @param lock: Lock, may be NULL
+ *
+ * Releases a lock taken with bookmark_lock_acquire(). An exclusive lock can
+ * only be released by the thread that took it.
+ */
+void bookmark_lock_release(BookmarkLock *lock);
+
+/**
+ * bookmark_lock_get_stats:
+ * @param mode: Mode to get the numbers of
+ * @param stats: Returns the numbers
+ *
+ * Tells how often and how long the locks of this process had to wait, since
+ * it started or since bookmark_lock_reset_stats().
+ */
+void bookmark_lock_get_stats(BookmarkLockMode mode, BookmarkLockStats *stats);
+void bookmark_lock_reset_stats(void);
+
 /**
  * bookmark_import:
  * @param path: Path of the file to be imported
@@ -331,7 +1318,9 @@ SortType osso_bookmark_gconf_get_int(gchar * key);
  * @param doc: XML document tree(Return value of xmlParseFile)
  * @param root_element:  Root element of the XML document 
  *
- * This function adds the item in the sorted position.
+ * This function adds the item in the sorted position. bm_item is appended to
+ * the children of parent too if it was added to the document, see
+ * bookmark_add_child().
  * @return Return BM_OK if successful or error
  */
 BMError bookmark_add_child_at_sorted_position(BookmarkItem * parent,
@@ -343,18 +1332,25 @@ BMError bookmark_add_child_at_sorted_position(BookmarkItem * parent,
  * set_lock:
  * @param lock_file_name: Lock file name.
  *
- * Create the lock file.
+ * Create the lock file. Nothing waits for it or is kept out by it, the
+ * bookmark functions lock BOOKMARK_FLOCK_PATH instead.
  * @return Return TRUE if success , FALSE otherwise
+ *
+ * Deprecated: use bookmark_lock_acquire()
  */
+G_GNUC_DEPRECATED_FOR(bookmark_lock_acquire)
 gboolean set_lock(gchar * lock_file_name);
 
 /**
- * set_lock:
+ * del_lock:
  * @param lock_file_name: Lock file name.
  *
  * Delete the lock file.
  * @return Return TRUE if success , FALSE otherwise
+ *
+ * Deprecated: use bookmark_lock_release()
  */
+G_GNUC_DEPRECATED_FOR(bookmark_lock_release)
 gboolean del_lock(gchar * lock_file_name);
 
 #ifdef BOOKMARK_ENGINE_DISABLE_DEPRECATED
@@ -364,6 +1360,8 @@ gboolean del_lock(gchar * lock_file_name);
  *  @return Return TRUE if success , FALSE otherwise
  *
  *  This function parses XML file and return list of BookmarkItems.
+ *  The tree is read from the snapshot of the file while it is unchanged, see
+ *  BM_LOAD_SNAPSHOT.
  */
 gboolean
 get_root_bookmark (BookmarkItem **bookmark_root);